@@ -0,0 +1,191 @@
+#include "beeper.h"
+#include <string.h> //memset()
+#include <unistd.h> //usleep()
+#ifdef BUILD_SDL
+#include "SDL/SDL.h"
+#endif
+
+// samples per half period of the tone
+#define HALF_PERIOD (AUDIO_SAMPLE_RATE/(AUDIO_TONE_HZ*2))
+
+Beeper::Beeper() :
+   maxQueued(AUDIO_QUEUE_SIZE),
+   phase(0),
+   deviceOpen(false),
+   wav(NULL),
+   wavBytes(0),
+   running(false)
+{
+}
+
+Beeper::~Beeper()
+{
+   close();
+}
+
+bool Beeper::openDevice()
+{
+#ifdef BUILD_SDL
+   SDL_AudioSpec want;
+   memset(&want, 0, sizeof(want));
+   want.freq = AUDIO_SAMPLE_RATE;
+   want.format = AUDIO_S16SYS;
+   want.channels = 1;
+   want.samples = 256; // ~6ms per callback
+   want.callback = audioCallback;
+   want.userdata = this;
+
+   if(SDL_OpenAudio(&want, NULL) < 0)
+   {
+      fprintf(stderr, "Cannot open audio device\n");
+      return false;
+   }
+
+   // a live device must not fall behind the emulation, so keep at most one
+   // frame (timer tick) of samples in flight
+   maxQueued = AUDIO_BLOCK_SIZE;
+   deviceOpen = true;
+   SDL_PauseAudio(0);
+   return true;
+#else
+   return false;
+#endif
+}
+
+bool Beeper::openWav(const char* path)
+{
+   wav = fopen(path, "wb");
+   if(wav == NULL)
+   {
+      fprintf(stderr, "Cannot create %s\n", path);
+      return false;
+   }
+
+   // header is rewritten with the real sizes on close
+   wavBytes = 0;
+   wavHeader(0);
+
+   maxQueued = AUDIO_QUEUE_SIZE;
+   running = true;
+   writer = std::thread(&Beeper::wavWriter, this);
+   return true;
+}
+
+void Beeper::close()
+{
+#ifdef BUILD_SDL
+   if(deviceOpen)
+   {
+      SDL_CloseAudio();
+      deviceOpen = false;
+   }
+#endif
+
+   if(wav != NULL)
+   {
+      // writer drains the queue before it exits
+      running = false;
+      if(writer.joinable())
+         writer.join();
+
+      fseek(wav, 0, SEEK_SET);
+      wavHeader(wavBytes);
+      fclose(wav);
+      wav = NULL;
+   }
+}
+
+void Beeper::generate(bool on)
+{
+   if(!deviceOpen && (wav == NULL))
+      return;
+
+   int16_t block[AUDIO_BLOCK_SIZE];
+   for(int i=0; i<AUDIO_BLOCK_SIZE; i++)
+   {
+      if(on)
+         block[i] = (((phase+i)/HALF_PERIOD)&1) ? -AUDIO_VOLUME : AUDIO_VOLUME;
+      else
+         block[i] = 0;
+   }
+   phase += AUDIO_BLOCK_SIZE;
+
+   // drop what doesn't fit rather than wait for the consumer
+   size_t queued = queue.size();
+   if(queued >= maxQueued)
+      return;
+   size_t count = maxQueued - queued;
+   if(count > AUDIO_BLOCK_SIZE)
+      count = AUDIO_BLOCK_SIZE;
+   queue.push(block, count);
+}
+
+#ifdef BUILD_SDL
+void Beeper::audioCallback(void* userdata, uint8_t* stream, int len)
+{
+   Beeper* beeper = (Beeper*) userdata;
+   int16_t* out = (int16_t*) stream;
+   size_t want = len/sizeof(int16_t);
+
+   // play silence on underrun
+   size_t got = beeper->queue.pop(out, want);
+   if(got < want)
+      memset(&out[got], 0, (want-got)*sizeof(int16_t));
+}
+#endif
+
+void Beeper::wavWriter()
+{
+   int16_t buf[AUDIO_BLOCK_SIZE];
+
+   while(true)
+   {
+      // sample running before draining so the last block is never lost
+      bool more = running;
+      size_t got = queue.pop(buf, AUDIO_BLOCK_SIZE);
+      if(got > 0)
+      {
+         wavBytes += fwrite(buf, sizeof(int16_t), got, wav)*sizeof(int16_t);
+      }
+      else if(!more)
+      {
+         break;
+      }
+      else
+      {
+         usleep(2000);
+      }
+   }
+}
+
+static void put16(uint8_t* p, uint16_t v)
+{
+   p[0] = v & 0xFF;
+   p[1] = (v>>8) & 0xFF;
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+   put16(p, v & 0xFFFF);
+   put16(p+2, (v>>16) & 0xFFFF);
+}
+
+void Beeper::wavHeader(uint32_t dataBytes)
+{
+   // canonical 44 byte RIFF/WAVE header, PCM
+   uint8_t h[44];
+   memcpy(&h[0], "RIFF", 4);
+   put32(&h[4], 36 + dataBytes);
+   memcpy(&h[8], "WAVE", 4);
+   memcpy(&h[12], "fmt ", 4);
+   put32(&h[16], 16);                                  // fmt chunk size
+   put16(&h[20], 1);                                   // PCM
+   put16(&h[22], 1);                                   // channels
+   put32(&h[24], AUDIO_SAMPLE_RATE);                   // sample rate
+   put32(&h[28], AUDIO_SAMPLE_RATE*sizeof(int16_t));   // byte rate
+   put16(&h[32], sizeof(int16_t));                     // block align
+   put16(&h[34], 16);                                  // bits per sample
+   memcpy(&h[36], "data", 4);
+   put32(&h[40], dataBytes);
+   fwrite(h, 1, sizeof(h), wav);
+}
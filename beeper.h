@@ -0,0 +1,88 @@
+#ifndef BEEPER_H
+#define BEEPER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include "ringbuffer.h"
+
+// audio format: 16 bit signed mono
+#define AUDIO_SAMPLE_RATE 44100
+#define AUDIO_TONE_HZ     440
+#define AUDIO_VOLUME      6000
+
+// the sound timer ticks at 60Hz, so one block covers one timer tick
+#define AUDIO_TIMER_HZ    60
+#define AUDIO_BLOCK_SIZE  (AUDIO_SAMPLE_RATE/AUDIO_TIMER_HZ)
+
+// samples the ring can hold, must be a power of two
+#define AUDIO_QUEUE_SIZE  8192
+
+/**
+ * Square wave beeper driven by the sound timer.
+ *
+ * The emulation loop calls generate() once per timer tick, which synthesizes
+ * a fixed block of samples and hands it to the output through a lock-free
+ * queue. The output is either the SDL audio callback or a WAV writer thread,
+ * both of which only ever consume from the queue, so the emulation loop never
+ * waits on audio.
+ */
+class Beeper
+{
+public:
+   Beeper();
+   ~Beeper();
+
+   /**
+    * Opens the audio device. Only available in SDL builds.
+    *
+    * @return true if the device was opened
+    */
+   bool openDevice();
+
+   /**
+    * Starts writing samples to a WAV file on a separate thread.
+    *
+    * @param[in] path: The file to create
+    * @return true if the file was created
+    */
+   bool openWav(const char* path);
+
+   /**
+    * Stops the output and flushes whatever is still queued.
+    */
+   void close();
+
+   /**
+    * Synthesizes one timer tick worth of samples.
+    *
+    * @param[in] on: Flag for the tone being audible during this tick
+    */
+   void generate(bool on);
+
+private:
+#ifdef BUILD_SDL
+   static void audioCallback(void* userdata, uint8_t* stream, int len);
+#endif
+   void wavWriter();
+   void wavHeader(uint32_t dataBytes);
+
+   RingBuffer<int16_t, AUDIO_QUEUE_SIZE> queue;
+
+   // most samples generate() keeps queued, bounds the output latency
+   size_t maxQueued;
+
+   // square wave phase, in samples, carried across blocks
+   uint32_t phase;
+
+   bool deviceOpen;
+
+   // wav output
+   FILE* wav;
+   uint32_t wavBytes;
+   std::thread writer;
+   std::atomic<bool> running;
+};
+
+#endif //BEEPER_H
@@ -3,6 +3,12 @@
 #include <stdlib.h> //rand()
 #include <unistd.h> //sleep()
 #include <time.h> //time() difftime()
+#include <poll.h> //poll()
+#include <sys/ipc.h> //IPC_PRIVATE
+#include <sys/shm.h> //shmget()
+#ifdef BUILD_X11
+#include <X11/XKBlib.h> //XkbSetDetectableAutoRepeat()
+#endif
 
 // font set
 uint8_t chip8_fontset[80] =
@@ -25,12 +31,23 @@ uint8_t chip8_fontset[80] =
   0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-Machine::Machine() :
+Machine::Machine(int scale) :
    I(0),
    drawFlag(false),
+   scale(scale),
+   expandTable(NULL),
+   keyMask(0),
+   keyPresses(0),
+   keyLatch(0),
+   waitingKey(false),
+   waitKeys(0),
    pc(0),
    sp(0),
-   kill(false)
+   kill(false),
+   wavPath(NULL),
+   shmName(NULL),
+   frameCount(0),
+   recordPath(NULL)
 {
    // init memories
    memset(memory, 0, MEMORY_SIZE*sizeof(uint8_t));
@@ -48,10 +65,10 @@ Machine::Machine() :
    // init graphics
    for(int i=0; i<SCREEN_WIDTH*SCREEN_HEIGHT; i++)
          screen[i]=0;
-   
-   // init keys
-   for(int i=0; i<16; i++)
-      keys[i]=0;
+   if(this->scale < 1)
+      this->scale = 1;
+   if(this->scale > MAX_SCALE)
+      this->scale = MAX_SCALE;
    
    // get the graphics started
    initGraphics();
@@ -62,6 +79,22 @@ Machine::Machine() :
 
 Machine::~Machine()
 {
+   free(expandTable);
+}
+
+void Machine::setWavFile(const char* path)
+{
+   wavPath = path;
+}
+
+void Machine::setSharedScreen(const char* name)
+{
+   shmName = name;
+}
+
+void Machine::setRecording(const char* path)
+{
+   recordPath = path;
 }
 
 void Machine::disassemble(uint8_t* program, int length)
@@ -98,6 +131,20 @@ void Machine::execute(uint8_t* program, int length)
    // copy the program into memory
    memcpy(&(memory[pc]), program, length);
    
+   // start the sound output
+   if(wavPath != NULL)
+      beeper.openWav(wavPath);
+   else
+      beeper.openDevice();
+   
+   // start the screen export
+   if(shmName != NULL)
+      publisher.open(shmName);
+   
+   // start the video capture
+   if(recordPath != NULL)
+      recorder.open(recordPath, scale);
+   
    while((!kill) && ((pc+1)<MEMORY_SIZE) && (pc != 0))
    {
       // wait for user input
@@ -116,20 +163,34 @@ void Machine::execute(uint8_t* program, int length)
       decode(opcode, true, false);
       
       // *** update timers ***
-      updateTimers();
+      bool frame = updateTimers();
       
-      // *** update screen ***
-      if(drawFlag)
+      // *** update screen *** at most once per frame
+      if(frame && drawFlag)
       {
          drawGraphics();
          drawFlag = false;
       }
+      
+      // *** export screen ***
+      if(frame)
+      {
+         publisher.publish(screen, ++frameCount);
+         recorder.capture(screen);
+      }
 
-      // *** process inputs ***
-      pollInputs();
+      // *** process inputs *** once per frame, not per instruction
+      if(frame)
+      {
+         pollInputs();
+         keyLatch = keyPresses.exchange(0, std::memory_order_relaxed);
+      }
    } // while
    
    // let's cleanup
+   recorder.close();
+   publisher.close();
+   beeper.close();
    cleanupGraphics();
 }
 
@@ -139,6 +200,10 @@ bool Machine::decode(uint16_t opcode,
 {
    bool valid = true; // assume true for now
    
+   // a bad opcode is part of a listing, but only a diagnostic while emulating,
+   // when stdout may be carrying the video
+   FILE* badOut = decode ? stdout : stderr;
+   
    //printf("opcode 0x%04x\n", opcode);
    
    switch(opcode&0xF000)
@@ -180,7 +245,7 @@ bool Machine::decode(uint16_t opcode,
             break;
                
             default:
-               printf("unknown opcode\n");
+               fprintf(badOut, "unknown opcode\n");
                valid = false;
                break;
          }
@@ -435,7 +500,7 @@ bool Machine::decode(uint16_t opcode,
             break;
                
             default:
-               printf("unknown opcode\n");
+               fprintf(badOut, "unknown opcode\n");
                valid = false;
                break;
          }
@@ -549,7 +614,7 @@ bool Machine::decode(uint16_t opcode,
             {
                if(emulate)
                {
-                  if(keys[v[(opcode>>8)&0xF]] > 0)
+                  if(keysDown() & (1<<(v[(opcode>>8)&0xF]&0xF)))
                      pc+=2;
                }
                if(decode)
@@ -563,7 +628,7 @@ bool Machine::decode(uint16_t opcode,
             {
                if(emulate)
                {
-                  if(keys[v[(opcode>>8)&0xF]] == 0)
+                  if(!(keysDown() & (1<<(v[(opcode>>8)&0xF]&0xF))))
                      pc+=2;
                }
                if(decode)
@@ -574,7 +639,7 @@ bool Machine::decode(uint16_t opcode,
             break;
 
             default:
-               printf("unknown opcode\n");
+               fprintf(badOut, "unknown opcode\n");
                valid = false;
                break;
          }
@@ -604,17 +669,30 @@ bool Machine::decode(uint16_t opcode,
             {
                if(emulate)
                {
-                  int waitKey=0;
-                  for(waitKey=0; waitKey<16; waitKey++)
+                  // like the COSMAC VIP the key counts once it has been
+                  // pressed and released again, so a held key is not
+                  // returned twice by back to back waits
+                  uint16_t held = keysDown();
+                  if(!waitingKey)
                   {
-                     if(keys[waitKey] > 0)
-                     {
-                        v[(opcode>>8)&0xF] = waitKey;
-                        break;
-                     }
+                     waitingKey = true;
+                     waitKeys = 0;
                   }
-                  if(waitKey==16)
+                  waitKeys |= held;
+                  
+                  uint16_t released = waitKeys & ~held;
+                  if(released)
+                  {
+                     int waitKey=0;
+                     while(!(released & (1<<waitKey)))
+                        waitKey++;
+                     v[(opcode>>8)&0xF] = waitKey;
+                     waitingKey = false;
+                  }
+                  else
+                  {
                      pc -= 2; // do not increment the pc reg
+                  }
                }
                if(decode)
                {
@@ -640,7 +718,7 @@ bool Machine::decode(uint16_t opcode,
             {
                if(emulate)
                {
-                  soundTimer = (opcode>>8)&0xF;
+                  soundTimer = v[(opcode>>8)&0xF];
                }
                if(decode)
                {
@@ -720,7 +798,7 @@ bool Machine::decode(uint16_t opcode,
             break;
 
             default:
-               printf("unknown opcode\n");
+               fprintf(badOut, "unknown opcode\n");
                valid = false;
                break;
          }
@@ -729,7 +807,7 @@ bool Machine::decode(uint16_t opcode,
       break;
 
       default:
-         printf("unknown opcode\n");
+         fprintf(badOut, "unknown opcode\n");
          if(emulate)
          {
             pc+=2;
@@ -742,9 +820,10 @@ bool Machine::decode(uint16_t opcode,
    return valid;
 }
 
-void Machine::updateTimers()
+bool Machine::updateTimers()
 {
    static int c = 0;
+   bool tick = false;
 
    // the timers are only updated every 25 instructions. This seems to look ok
    if(++c == 25)
@@ -754,11 +833,16 @@ void Machine::updateTimers()
          --delayTimer;
 
       // *** update sound timer ***
+      // one block of audio per tick, the tone plays while the timer is non zero
+      beeper.generate(soundTimer > 0);
       if(soundTimer > 0)
          --soundTimer;
 
       c = 0;
+      tick = true;
    }
+   
+   return tick;
 }
 
 void Machine::initGraphics()
@@ -778,15 +862,78 @@ void Machine::initGraphics()
                                 RootWindow(d, s),  // parent
                                 0,                 // x
                                 0,                 // y
-                                SCREEN_WIDTH*10,   // width
-                                SCREEN_HEIGHT*10,  // height
+                                SCREEN_WIDTH*scale,   // width
+                                SCREEN_HEIGHT*scale,  // height
                                 1,                 // border width
                                 BlackPixel(d, s),  // border
                                 WhitePixel(d, s)); // background
 
-   XSelectInput(d, window, ExposureMask | KeyPressMask);
+   XSelectInput(d, window, ExposureMask);
    XMapWindow(d, window);
+   
+   // frame image, in shared memory when the server supports it so a frame
+   // upload is one request and no copy through the socket
+   int w = SCREEN_WIDTH*scale;
+   int h = SCREEN_HEIGHT*scale;
+   image = NULL;
+   useShm = false;
+   if(XShmQueryExtension(d))
+   {
+      image = XShmCreateImage(d, DefaultVisual(d, s), DefaultDepth(d, s),
+                              ZPixmap, NULL, &shminfo, w, h);
+      if(image != NULL)
+      {
+         shminfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line*image->height, IPC_CREAT|0600);
+         shminfo.shmaddr = (char*)-1;
+         if(shminfo.shmid >= 0)
+            shminfo.shmaddr = (char*) shmat(shminfo.shmid, NULL, 0);
+         shminfo.readOnly = False;
+         if((shminfo.shmaddr != (char*)-1) && XShmAttach(d, &shminfo))
+         {
+            image->data = shminfo.shmaddr;
+            XSync(d, False);
+            useShm = true;
+         }
+         else
+         {
+            if(shminfo.shmaddr != (char*)-1)
+               shmdt(shminfo.shmaddr);
+            // the data was never ours to free
+            image->data = NULL;
+            XDestroyImage(image);
+            image = NULL;
+         }
+         // segment goes away once both sides detach
+         if(shminfo.shmid >= 0)
+            shmctl(shminfo.shmid, IPC_RMID, NULL);
+      }
+   }
+   if(image == NULL)
+   {
+      char* data = (char*) malloc(w*h*sizeof(uint32_t));
+      image = XCreateImage(d, DefaultVisual(d, s), DefaultDepth(d, s),
+                           ZPixmap, 0, data, w, h, 32, 0);
+   }
+   if((image == NULL) || (image->bits_per_pixel != 32))
+   {
+      fprintf(stderr, "Need a 32 bit visual\n");
+      exit(1);
+   }
+   buildExpandTable(BlackPixel(d, s), WhitePixel(d, s));
    XFlush(d);
+   
+   // keyboard goes through a second connection owned by the input thread so
+   // the two never share Xlib state
+   inputDisplay = XOpenDisplay(NULL);
+   if (inputDisplay == NULL)
+   {
+      fprintf(stderr, "Cannot open display\n");
+      exit(1);
+   }
+   XkbSetDetectableAutoRepeat(inputDisplay, True, NULL); // no fake releases
+   XSelectInput(inputDisplay, window, KeyPressMask | KeyReleaseMask);
+   XFlush(inputDisplay);
+   inputThread = std::thread(&Machine::inputLoop, this);
 #endif
 
 #ifdef BUILD_SDL
@@ -797,62 +944,82 @@ void Machine::initGraphics()
    //Set up screen
    backbuff = NULL;
    screenSurface = NULL;
-   screenSurface = SDL_SetVideoMode( SCREEN_WIDTH*10, SCREEN_HEIGHT*10, 32, SDL_SWSURFACE );
+   screenSurface = SDL_SetVideoMode( SCREEN_WIDTH*scale, SCREEN_HEIGHT*scale, 32, SDL_SWSURFACE );
+   buildExpandTable(SDL_MapRGB(screenSurface->format, 255, 255, 255),
+                    SDL_MapRGB(screenSurface->format, 0, 0, 0));
 #endif
 }
 
-void Machine::drawGraphics()
+void Machine::buildExpandTable(uint32_t on, uint32_t off)
 {
-#ifdef BUILD_X11
-   for(int x=0; x<SCREEN_WIDTH; x++)
+   int width = 8*scale;
+   expandTable = (uint32_t*) malloc(256*width*sizeof(uint32_t));
+   for(int bits=0; bits<256; bits++)
+   {
+      for(int x=0; x<width; x++)
+         expandTable[bits*width + x] = (bits & (0x80 >> (x/scale))) ? on : off;
+   }
+}
+
+void Machine::renderScaled(uint32_t* dst, int pitch)
+{
+   int width = 8*scale;
+   for(int y=0; y<SCREEN_HEIGHT; y++)
    {
-      for(int y=0; y<SCREEN_HEIGHT; y++)
+      const uint8_t* src = &screen[y*SCREEN_WIDTH];
+      uint32_t* row = &dst[y*scale*pitch];
+      for(int x=0; x<SCREEN_WIDTH; x+=8)
       {
-         if(screen[(y*SCREEN_WIDTH)+x] == 1)
-            XFillRectangle(d,               // display
-                           window,          // window
-                           DefaultGC(d, s), // GC ???
-                           x*10,            // x
-                           y*10,            // y
-                           10,              // width
-                           10);             // height
-         else
-            XClearArea(d,      // display
-                       window, // window
-                       x*10,   // x
-                       y*10,   // y
-                       10,     // width
-                       10,     // height
-                       false); //
+         // pack 8 pixels into a byte, leftmost pixel in the msb
+         uint8_t bits = 0;
+         for(int b=0; b<8; b++)
+            bits = (bits<<1) | (src[x+b]&1);
+         memcpy(&row[x*scale], &expandTable[bits*width], width*sizeof(uint32_t));
       }
+      // the other host rows of this logical row are identical
+      for(int i=1; i<scale; i++)
+         memcpy(&row[i*pitch], row, SCREEN_WIDTH*scale*sizeof(uint32_t));
    }
+}
+
+void Machine::drawGraphics()
+{
+#ifdef BUILD_X11
+   renderScaled((uint32_t*) image->data, image->bytes_per_line/sizeof(uint32_t));
+   if(useShm)
+      XShmPutImage(d, window, DefaultGC(d, s), image, 0, 0, 0, 0,
+                   image->width, image->height, False);
+   else
+      XPutImage(d, window, DefaultGC(d, s), image, 0, 0, 0, 0,
+                image->width, image->height);
    XFlush(d);
 #endif
 
 #ifdef BUILD_SDL
-      for(int x=0; x<SCREEN_WIDTH; x++)
-      {
-         for(int y=0; y<SCREEN_HEIGHT; y++)
-         {
-            SDL_Rect rect;
-            rect.x = x*10;
-            rect.y = y*10;
-            rect.w = 10;
-            rect.h = 10;
-            if(screen[(y*SCREEN_WIDTH)+x] == 1)
-               SDL_FillRect(screenSurface, &rect, SDL_MapRGB(screenSurface->format, 255, 255, 255));
-            else
-               SDL_FillRect(screenSurface, &rect, SDL_MapRGB(screenSurface->format, 0, 0, 0));
-         }
-      }
-      SDL_Flip(screenSurface);
+   SDL_LockSurface(screenSurface);
+   renderScaled((uint32_t*) screenSurface->pixels, screenSurface->pitch/sizeof(uint32_t));
+   SDL_UnlockSurface(screenSurface);
+   SDL_Flip(screenSurface);
 #endif
 }
 
 void Machine::cleanupGraphics()
 {
 #ifdef BUILD_X11
+   // input thread notices kill within one poll timeout
+   kill = true;
+   if(inputThread.joinable())
+      inputThread.join();
+   
    // cleanup X11
+   if(useShm)
+   {
+      XShmDetach(d, &shminfo);
+      shmdt(shminfo.shmaddr);
+      image->data = NULL; // not ours to free
+   }
+   XDestroyImage(image);
+   XCloseDisplay(inputDisplay);
    XCloseDisplay(d);
 #endif
 
@@ -862,56 +1029,32 @@ void Machine::cleanupGraphics()
 #endif
 }
 
-void Machine::pollInputs()
+void Machine::setKey(int key, bool pressed)
 {
-#ifdef BUILD_X11
-   for(int i=0; i<16; i++)
+   if(pressed)
    {
-      if(keys[i] > 0)
-         keys[i]-=1;
+      keyMask.fetch_or(1<<key, std::memory_order_relaxed);
+      keyPresses.fetch_or(1<<key, std::memory_order_relaxed);
    }
+   else
+      keyMask.fetch_and(~(1<<key), std::memory_order_relaxed);
+}
+
+uint16_t Machine::keysDown() const
+{
+   return keyMask.load(std::memory_order_relaxed) | keyLatch;
+}
+
+void Machine::pollInputs()
+{
+#ifdef BUILD_X11
+   // keys are handled by inputLoop(), only window events arrive here
    while(XEventsQueued(d,QueuedAlready))
-   //while(XPending(d))
    {
-      uint8_t keystate = 0;
       XNextEvent(d, &e);
-      if(e.type == KeyPress)
-         keystate = 100;
-      else if (e.type == KeyRelease)
-         keystate = 0;
-
-     //printf("KeyPress: keycode %u state %u\n", e.xkey.keycode, e.xkey.state);
-     switch(e.xkey.keycode)
-     {
-        case 10: //"1"
-        case 11: //"2"
-        case 12: //"3"
-        case 13: //"4"
-           keys[e.xkey.keycode-10] = keystate;
-           break;
-        case 24: //"q"
-        case 25: //"w"
-        case 26: //"e"
-        case 27: //"r"
-           keys[e.xkey.keycode-20] = keystate;
-           break;
-        case 38: //"a"
-        case 39: //"s"
-        case 40: //"d"
-        case 41: //"f"
-           keys[e.xkey.keycode-30] = keystate;
-           break;
-        case 52: //"z"
-        case 53: //"x"
-        case 54: //"c"
-        case 55: //"v"
-           keys[e.xkey.keycode-40] = keystate;
-           break;
-        case 9: //"esc"
-           kill=true;
-           break;
-     }
-   } // while(pending)
+      if(e.type == Expose)
+         drawFlag = true;
+   }
 #endif
 
 #ifdef BUILD_SDL
@@ -927,62 +1070,58 @@ void Machine::pollInputs()
       //User presses a key
       else if( (e.type == SDL_KEYDOWN) || (e.type == SDL_KEYUP) )
       {
-         uint8_t action = 0; // key up
-         if(e.type == SDL_KEYDOWN)
-         {
-            action = 1;
-         }
+         bool action = (e.type == SDL_KEYDOWN);
 
          //Select surfaces based on key press
          switch( e.key.keysym.sym )
          {
          case SDLK_1:
-            keys[0] = action;
+            setKey(0, action);
             break;
          case SDLK_2:
-            keys[1] = action;;
+            setKey(1, action);
             break;
          case SDLK_3:
-            keys[2] = action;
+            setKey(2, action);
             break;
          case SDLK_4:
-            keys[3] = action;
+            setKey(3, action);
             break;
          case SDLK_q:
-            keys[4] = action;
+            setKey(4, action);
             break;
          case SDLK_w:
-            keys[5] = action;
+            setKey(5, action);
             break;
          case SDLK_e:
-            keys[6] = action;
+            setKey(6, action);
             break;
          case SDLK_r:
-            keys[7] = action;
+            setKey(7, action);
             break;
          case SDLK_a:
-            keys[8] = action;
+            setKey(8, action);
             break;
          case SDLK_s:
-            keys[9] = action;
+            setKey(9, action);
             break;
          case SDLK_d:
-            keys[10] = action;
+            setKey(10, action);
             break;
          case SDLK_f:
-            keys[11] = action;
+            setKey(11, action);
             break;
          case SDLK_z:
-            keys[12] = action;
+            setKey(12, action);
             break;
          case SDLK_x:
-            keys[13] = action;
+            setKey(13, action);
             break;
          case SDLK_c:
-            keys[14] = action;
+            setKey(14, action);
             break;
          case SDLK_v:
-            keys[15] = action;
+            setKey(15, action);
             break;
          case SDLK_ESCAPE:
             kill = true;
@@ -994,3 +1133,61 @@ void Machine::pollInputs()
    }
 #endif
 }
+
+#ifdef BUILD_X11
+void Machine::inputLoop()
+{
+   XEvent ev;
+   struct pollfd pfd;
+   pfd.fd = ConnectionNumber(inputDisplay);
+   pfd.events = POLLIN;
+
+   while(!kill)
+   {
+      // sleep until the server sends something, wake up now and then to
+      // check for shutdown
+      if(!XPending(inputDisplay))
+      {
+         poll(&pfd, 1, 50);
+         continue;
+      }
+
+      XNextEvent(inputDisplay, &ev);
+      if((ev.type != KeyPress) && (ev.type != KeyRelease))
+         continue;
+      bool keystate = (ev.type == KeyPress);
+
+     //printf("KeyPress: keycode %u state %u\n", ev.xkey.keycode, ev.xkey.state);
+     switch(ev.xkey.keycode)
+     {
+        case 10: //"1"
+        case 11: //"2"
+        case 12: //"3"
+        case 13: //"4"
+           setKey(ev.xkey.keycode-10, keystate);
+           break;
+        case 24: //"q"
+        case 25: //"w"
+        case 26: //"e"
+        case 27: //"r"
+           setKey(ev.xkey.keycode-20, keystate);
+           break;
+        case 38: //"a"
+        case 39: //"s"
+        case 40: //"d"
+        case 41: //"f"
+           setKey(ev.xkey.keycode-30, keystate);
+           break;
+        case 52: //"z"
+        case 53: //"x"
+        case 54: //"c"
+        case 55: //"v"
+           setKey(ev.xkey.keycode-40, keystate);
+           break;
+        case 9: //"esc"
+           kill=true;
+           break;
+     }
+   } // while(!kill)
+}
+#endif
@@ -3,8 +3,15 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <atomic>
+#include <thread>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 #include "SDL/SDL.h"
+#include "beeper.h"
+#include "screenshm.h"
+#include "recorder.h"
 
 /** 
  * Hardware specs were taken from :
@@ -28,10 +35,17 @@
 // starting address of program, emulator occupies memory from 0x0-0x1FF
 #define START_ADDRESS 0x200
 
+// host pixels per logical pixel
+#define DEFAULT_SCALE 10
+#define MAX_SCALE     32
+
 class Machine
 {
 public:
-   Machine();
+   /**
+    * @param[in] scale: Host pixels per logical pixel, in each direction
+    */
+   Machine(int scale = DEFAULT_SCALE);
    ~Machine();
    
    void disassemble(uint8_t *program,
@@ -46,6 +60,30 @@ public:
    void execute(uint8_t *program,
                 int     length);
    
+   /**
+    * Sends the sound output to a WAV file instead of the audio device.
+    * Must be called before execute().
+    *
+    * @param[in] path: The WAV file to create
+    */
+   void setWavFile(const char *path);
+   
+   /**
+    * Publishes every frame into a POSIX shared memory segment for external
+    * viewers, see screenshm.h for the layout. Must be called before execute().
+    *
+    * @param[in] name: The shm_open() name, e.g. "/chip8-1234"
+    */
+   void setSharedScreen(const char *name);
+   
+   /**
+    * Records every changed frame to a Y4M or raw stream, see recorder.h.
+    * Frames are scaled like the window. Must be called before execute().
+    *
+    * @param[in] path: The stream to create, "-" for stdout
+    */
+   void setRecording(const char *path);
+   
    /**
     * decodes an instruction. depending on flags will either decode to readable
     * string or emulate the instruction.
@@ -59,11 +97,18 @@ public:
                bool decode);
    
 private:
-   void updateTimers();
+   bool updateTimers();
    void initGraphics();
    void drawGraphics();
    void cleanupGraphics();
+   void buildExpandTable(uint32_t on, uint32_t off);
+   void renderScaled(uint32_t *dst, int pitch);
    void pollInputs();
+   void setKey(int key, bool pressed);
+   uint16_t keysDown() const;
+#ifdef BUILD_X11
+   void inputLoop();
+#endif
    
    // memory
    uint8_t memory[MEMORY_SIZE];
@@ -81,8 +126,23 @@ private:
    // flag that indicates we need to draw the screen
    bool drawFlag;
    
-   // keys
-   uint8_t keys[16];
+   // window scale and the host pixels for each 8 pixel pattern of a row,
+   // already widened by scale (256 entries of 8*scale pixels)
+   int scale;
+   uint32_t *expandTable;
+   
+   // keys, bit n is set while key n is held down. written by the input
+   // side, read by the cpu without any syscall
+   std::atomic<uint16_t> keyMask;
+   
+   // presses since the last frame, and the ones latched at it, which read
+   // as down for the whole frame so a tap between two polls still counts
+   std::atomic<uint16_t> keyPresses;
+   uint16_t keyLatch;
+   
+   // FX0A state, keys seen down since the wait started
+   bool waitingKey;
+   uint16_t waitKeys;
    
    // program counter
    uint16_t pc;
@@ -91,11 +151,24 @@ private:
    uint8_t sp;
    
    // flag used to kill the execute loop
-   bool kill;
+   std::atomic<bool> kill;
    
    // timer counters
    uint8_t delayTimer;
    uint8_t soundTimer;
+   
+   // sound output
+   Beeper beeper;
+   const char *wavPath;
+   
+   // shared memory screen export
+   ScreenPublisher publisher;
+   const char *shmName;
+   uint32_t frameCount;
+   
+   // video capture
+   Recorder recorder;
+   const char *recordPath;
 
 #ifdef BUILD_X11
    // X11 window stuff
@@ -103,6 +176,15 @@ private:
    Window window;
    XEvent e;
    int s;
+   
+   // the whole window is one image, pushed once per frame
+   XImage *image;
+   XShmSegmentInfo shminfo;
+   bool useShm;
+   
+   // keyboard events arrive on their own connection and thread
+   Display *inputDisplay;
+   std::thread inputThread;
 #endif
 
 #ifdef BUILD_SDL
@@ -2,15 +2,20 @@
 #include <stdint.h> //uint8_t
 #include <stdlib.h> //malloc
 #include <string.h>
+#include <unistd.h> //getpid()
 #include "machine.h"
 
 void printHelp(char* app)
 {
-   printf("Usage: %s [-?hde] FILE\n", app);
+   printf("Usage: %s [-?hdesmv#] FILE [WAV] [VIDEO]\n", app);
    printf(" ?\tDisplay this help menu\n");
    printf(" h\tPerform hex dump\n");
    printf(" d\tPerform disassembly\n");
    printf(" e\tPerform emulation\n");
+   printf(" s\tWrite sound to WAV file (default chip8.wav)\n");
+   printf(" v\tRecord video, .y4m, raw or - for stdout (default chip8.y4m)\n");
+   printf(" m\tExport screen to shared memory /chip8-PID\n");
+   printf(" #\tWindow scale factor, e.g. -e4 (default %i)\n", DEFAULT_SCALE);
    printf("\n");
 }
 
@@ -46,6 +51,10 @@ int main(int argc, char* argv[])
    bool dump=false;
    bool diss=false;
    bool emulate=false;
+   const char* wav=NULL;
+   const char* video=NULL;
+   int scale=DEFAULT_SCALE;
+   char shm[32]="";
    
    if(argc<3)
    {
@@ -70,6 +79,21 @@ int main(int argc, char* argv[])
       
       if( strstr(argv[1], "e") != NULL )
          emulate=true;
+      
+      // optional output names follow FILE in the order WAV, VIDEO
+      int arg = 3;
+      if( strstr(argv[1], "s") != NULL )
+         wav = (argc>arg) ? argv[arg++] : "chip8.wav";
+      
+      if( strstr(argv[1], "v") != NULL )
+         video = (argc>arg) ? argv[arg++] : "chip8.y4m";
+      
+      if( strstr(argv[1], "m") != NULL )
+         snprintf(shm, sizeof(shm), "/chip8-%i", (int) getpid());
+      
+      const char* digits = strpbrk(argv[1], "0123456789");
+      if( digits != NULL )
+         scale = atoi(digits);
    }
    else
    {
@@ -78,6 +102,13 @@ int main(int argc, char* argv[])
       return -1;
    }
    
+   // a video on stdout can't share it with a listing
+   if((video != NULL) && (strcmp(video, "-") == 0) && (dump || diss))
+   {
+      fprintf(stderr, "cannot record to stdout with h or d\n");
+      return -1;
+   }
+   
    FILE* f = (FILE*) fopen(argv[2], "r");
    if(f != NULL) // if pointer is valid
    {
@@ -95,12 +126,21 @@ int main(int argc, char* argv[])
       if(dump)
          hexdump(binary, fsize);
       
-      Machine mach;
+      Machine mach(scale);
       // disassemble
       if(diss)
          mach.disassemble(binary, fsize);
       
       // emulate
+      if(wav != NULL)
+         mach.setWavFile(wav);
+      if(video != NULL)
+         mach.setRecording(video);
+      if(shm[0] != 0)
+      {
+         fprintf(stderr, "screen exported to %s\n", shm);
+         mach.setSharedScreen(shm);
+      }
       if(emulate)
          mach.execute(binary, fsize);
       
@@ -0,0 +1,664 @@
+#include "apu.h"
+#include "log.h"
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+// channels, indices into level[] and weight[]
+enum { PULSE1, PULSE2, TRIANGLE, NOISE, DMC };
+
+// linear approximation of the 2A03 mixer, per output step of each channel
+static const float weight[5] = { 0.00752f, 0.00752f, 0.00851f, 0.00494f, 0.00335f };
+
+#define OUTPUT_GAIN 30000.0f
+#define HIGHPASS    (1.0f / 1024) // ~7Hz, removes the DC offset of the mix
+
+// cpu cycles to output samples, 32.32 fixed point
+#define SAMPLE_STEP (((uint64_t)APU_SAMPLE_RATE << 32) / APU_CLOCK_RATE)
+
+static const uint8_t length_table[32] = {
+  10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+  12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const uint8_t duty_table[4][8] = {
+  { 0, 1, 0, 0, 0, 0, 0, 0 },
+  { 0, 1, 1, 0, 0, 0, 0, 0 },
+  { 0, 1, 1, 1, 1, 0, 0, 0 },
+  { 1, 0, 0, 1, 1, 1, 1, 1 }
+};
+
+static const uint8_t triangle_table[32] = {
+  15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+// NTSC periods in cpu cycles
+static const uint16_t noise_table[16] = {
+  4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+static const uint16_t dmc_table[16] = {
+  428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+// frame counter steps, cpu cycles from the start of the sequence. Step 3
+// clocks the length counters in both modes and ends the sequence.
+static const uint16_t frame_steps[2][4] = {
+  { 7457, 14913, 22371, 29829 },
+  { 7457, 14913, 22371, 37281 }
+};
+static const uint16_t frame_length[2] = { 29830, 37282 };
+
+
+//////////////////////////
+// band-limited steps   //
+//////////////////////////
+
+// Windowed sinc impulses, one per sub-sample phase, each summing to 1 so
+// an integrated step lands exactly on the new level.
+static float kernel[BLIP_PHASES][BLIP_TAPS];
+
+static void build_kernel()
+{
+  const double cutoff = 0.45; // of the sample rate, just under nyquist
+
+  for (int p=0; p<BLIP_PHASES; p++)
+  {
+    double sum = 0;
+    for (int k=0; k<BLIP_TAPS; k++)
+    {
+      double x = k - (BLIP_TAPS/2 - 1) - (double)p / BLIP_PHASES;
+      double sinc = (x == 0) ? 1 : sin(2*M_PI*cutoff*x) / (2*M_PI*cutoff*x);
+      double window = 0.42 + 0.5*cos(2*M_PI*x/BLIP_TAPS) + 0.08*cos(4*M_PI*x/BLIP_TAPS);
+      kernel[p][k] = sinc * window;
+      sum += kernel[p][k];
+    }
+    for (int k=0; k<BLIP_TAPS; k++)
+      kernel[p][k] /= sum;
+  }
+}
+
+static void add_step(struct apu_t* apu, uint64_t cycle, float delta)
+{
+  uint64_t pos = apu->frame_frac + (cycle - apu->frame_start) * SAMPLE_STEP;
+  float* out = &apu->deltas[pos >> 32];
+  const float* k = kernel[((pos & 0xFFFFFFFF) * BLIP_PHASES) >> 32];
+
+  for (int i=0; i<BLIP_TAPS; i++)
+    out[i] += delta * k[i];
+}
+
+static void set_level(struct apu_t* apu, int ch, uint8_t level, uint64_t cycle)
+{
+  if (level != apu->level[ch])
+  {
+    add_step(apu, cycle, (level - apu->level[ch]) * weight[ch]);
+    apu->level[ch] = level;
+  }
+}
+
+// integrates the samples before 'cycle' and moves the time base there
+static void flush(struct apu_t* apu, uint64_t cycle)
+{
+  uint64_t pos = apu->frame_frac + (cycle - apu->frame_start) * SAMPLE_STEP;
+  size_t n = pos >> 32;
+  int16_t samples[BLIP_SIZE];
+
+  for (size_t i=0; i<n; i++)
+  {
+    apu->integrator += apu->deltas[i];
+    apu->highpass += (apu->integrator - apu->highpass) * HIGHPASS;
+    float s = (apu->integrator - apu->highpass) * OUTPUT_GAIN;
+    samples[i] = (s > 32767) ? 32767 : (s < -32768) ? -32768 : (int16_t) s;
+  }
+  apu->dropped += n - ring_push(&apu->ring, samples, n);
+
+  memmove(apu->deltas, &apu->deltas[n], BLIP_TAPS * sizeof(float));
+  memset(&apu->deltas[BLIP_TAPS], 0, n * sizeof(float));
+  apu->frame_start = cycle;
+  apu->frame_frac = pos & 0xFFFFFFFF;
+}
+
+
+//////////////
+// channels //
+//////////////
+
+static uint8_t envelope_volume(const struct envelope_t* env)
+{
+  return env->constant ? env->volume : env->decay;
+}
+
+static void envelope_clock(struct envelope_t* env)
+{
+  if (env->start)
+  {
+    env->start = false;
+    env->decay = 15;
+    env->divider = env->volume;
+  }
+  else if (env->divider == 0)
+  {
+    env->divider = env->volume;
+    if (env->decay > 0)
+      env->decay--;
+    else if (env->loop)
+      env->decay = 15;
+  }
+  else
+  {
+    env->divider--;
+  }
+}
+
+static uint16_t sweep_target(const struct pulse_t* p, int ch)
+{
+  uint16_t change = p->timer >> p->sweep_shift;
+  if (!p->sweep_negate)
+    return p->timer + change;
+  // pulse 1 negates in ones' complement
+  return p->timer - change - (ch == PULSE1);
+}
+
+static bool pulse_muted(const struct pulse_t* p, int ch)
+{
+  return (p->timer < 8) || (!p->sweep_negate && (sweep_target(p, ch) > 0x7FF));
+}
+
+static bool pulse_silent(const struct apu_t* apu, int ch)
+{
+  const struct pulse_t* p = &apu->pulse[ch];
+  return (p->length == 0) || pulse_muted(p, ch) || (envelope_volume(&p->env) == 0);
+}
+
+static uint8_t pulse_level(const struct apu_t* apu, int ch)
+{
+  const struct pulse_t* p = &apu->pulse[ch];
+  if (pulse_silent(apu, ch) || !duty_table[p->duty][p->step])
+    return 0;
+  return envelope_volume(&p->env);
+}
+
+static uint8_t noise_level(const struct apu_t* apu)
+{
+  const struct noise_t* n = &apu->noise;
+  if ((n->length == 0) || (n->lfsr & 1))
+    return 0;
+  return envelope_volume(&n->env);
+}
+
+// Each run_* steps its channel's timer up to and including 'until'. A channel
+// whose output can't change is only fast forwarded.
+
+static void run_pulse(struct apu_t* apu, int ch, uint64_t until)
+{
+  struct pulse_t* p = &apu->pulse[ch];
+  uint32_t period = (p->timer + 1) * 2;
+
+  if (p->next > until)
+    return;
+  if (pulse_silent(apu, ch))
+  {
+    uint64_t steps = (until - p->next) / period + 1;
+    p->step = (p->step + steps) & 7;
+    p->next += steps * period;
+    return;
+  }
+
+  while (p->next <= until)
+  {
+    p->step = (p->step + 1) & 7;
+    set_level(apu, ch, pulse_level(apu, ch), p->next);
+    p->next += period;
+  }
+}
+
+static void run_triangle(struct apu_t* apu, uint64_t until)
+{
+  struct triangle_t* t = &apu->triangle;
+  uint32_t period = t->timer + 1;
+
+  if (t->next > until)
+    return;
+  // the sequencer stops without both counters, ultrasonic periods just
+  // hold the level instead of aliasing
+  if ((t->length == 0) || (t->linear == 0) || (t->timer < 2))
+  {
+    t->next += ((until - t->next) / period + 1) * period;
+    return;
+  }
+
+  while (t->next <= until)
+  {
+    t->step = (t->step + 1) & 31;
+    set_level(apu, TRIANGLE, triangle_table[t->step], t->next);
+    t->next += period;
+  }
+}
+
+static void run_noise(struct apu_t* apu, uint64_t until)
+{
+  struct noise_t* n = &apu->noise;
+
+  if (n->next > until)
+    return;
+  if ((n->length == 0) || (envelope_volume(&n->env) == 0))
+  {
+    n->next += ((until - n->next) / n->period + 1) * n->period;
+    return;
+  }
+
+  while (n->next <= until)
+  {
+    uint16_t feedback = (n->lfsr ^ (n->lfsr >> (n->mode ? 6 : 1))) & 1;
+    n->lfsr = (n->lfsr >> 1) | (feedback << 14);
+    set_level(apu, NOISE, noise_level(apu), n->next);
+    n->next += n->period;
+  }
+}
+
+static void dmc_fetch(struct apu_t* apu)
+{
+  struct dmc_t* d = &apu->dmc;
+
+  if (d->buffer_full || (d->remaining == 0))
+    return;
+
+  d->buffer = bus_read(apu->bus, d->addr);
+  d->buffer_full = true;
+  d->addr = (d->addr == 0xFFFF) ? 0x8000 : d->addr + 1;
+  if (--d->remaining == 0)
+  {
+    if (d->loop)
+    {
+      d->addr = d->start;
+      d->remaining = d->length;
+    }
+    else if (d->irq_enabled)
+    {
+      apu->dmc_irq = true;
+    }
+  }
+}
+
+static void run_dmc(struct apu_t* apu, uint64_t until)
+{
+  struct dmc_t* d = &apu->dmc;
+
+  if (d->next > until)
+    return;
+  if (d->silent && !d->buffer_full && (d->remaining == 0))
+  {
+    d->next += ((until - d->next) / d->period + 1) * d->period;
+    return;
+  }
+
+  while (d->next <= until)
+  {
+    if (!d->silent)
+    {
+      if (d->shift & 1)
+      {
+        if (d->level <= 125)
+          d->level += 2;
+      }
+      else if (d->level >= 2)
+      {
+        d->level -= 2;
+      }
+      d->shift >>= 1;
+      set_level(apu, DMC, d->level, d->next);
+    }
+
+    if (--d->bits == 0)
+    {
+      d->bits = 8;
+      d->silent = !d->buffer_full;
+      d->shift = d->buffer;
+      d->buffer_full = false;
+      dmc_fetch(apu);
+    }
+    d->next += d->period;
+  }
+}
+
+
+///////////////////
+// frame counter //
+///////////////////
+
+static void quarter_frame(struct apu_t* apu)
+{
+  struct triangle_t* t = &apu->triangle;
+
+  envelope_clock(&apu->pulse[0].env);
+  envelope_clock(&apu->pulse[1].env);
+  envelope_clock(&apu->noise.env);
+
+  if (t->linear_reload)
+    t->linear = t->linear_period;
+  else if (t->linear > 0)
+    t->linear--;
+  if (!t->control)
+    t->linear_reload = false;
+}
+
+static void half_frame(struct apu_t* apu)
+{
+  for (int ch=0; ch<2; ch++)
+  {
+    struct pulse_t* p = &apu->pulse[ch];
+
+    if (!p->env.loop && (p->length > 0))
+      p->length--;
+
+    if ((p->sweep_divider == 0) && p->sweep_enabled && (p->sweep_shift > 0) && !pulse_muted(p, ch))
+      p->timer = sweep_target(p, ch);
+    if ((p->sweep_divider == 0) || p->sweep_reload)
+    {
+      p->sweep_divider = p->sweep_period;
+      p->sweep_reload = false;
+    }
+    else
+    {
+      p->sweep_divider--;
+    }
+  }
+
+  if (!apu->triangle.control && (apu->triangle.length > 0))
+    apu->triangle.length--;
+  if (!apu->noise.env.loop && (apu->noise.length > 0))
+    apu->noise.length--;
+}
+
+// levels that depend on envelopes, lengths and registers rather than on
+// the channel timers
+static void update_levels(struct apu_t* apu, uint64_t cycle)
+{
+  set_level(apu, PULSE1, pulse_level(apu, PULSE1), cycle);
+  set_level(apu, PULSE2, pulse_level(apu, PULSE2), cycle);
+  set_level(apu, NOISE, noise_level(apu), cycle);
+  set_level(apu, DMC, apu->dmc.level, cycle);
+}
+
+static void frame_clock(struct apu_t* apu)
+{
+  int mode = apu->five_step;
+
+  quarter_frame(apu);
+  if (apu->frame_step & 1)
+    half_frame(apu);
+
+  if (apu->frame_step == 3)
+  {
+    if (!apu->five_step && !apu->irq_inhibit)
+      apu->frame_irq = true;
+    apu->frame_base += frame_length[mode];
+    apu->frame_step = 0;
+  }
+  else
+  {
+    apu->frame_step++;
+  }
+  update_levels(apu, apu->frame_next);
+  apu->frame_next = apu->frame_base + frame_steps[mode][apu->frame_step];
+}
+
+
+static void update_irq(struct apu_t* apu)
+{
+  if (apu->set_irq)
+    apu->set_irq(apu->irq_ctx, apu->frame_irq || apu->dmc_irq);
+}
+
+
+//////////////
+// catch up //
+//////////////
+
+static void run(struct apu_t* apu, uint64_t cycle)
+{
+  while (1)
+  {
+    uint64_t until = (apu->frame_next <= cycle) ? apu->frame_next : cycle;
+
+    run_pulse(apu, PULSE1, until);
+    run_pulse(apu, PULSE2, until);
+    run_triangle(apu, until);
+    run_noise(apu, until);
+    run_dmc(apu, until);
+
+    if (apu->frame_next > cycle)
+      break;
+    frame_clock(apu);
+  }
+  apu->time = cycle;
+}
+
+void apu_catch_up(struct apu_t* apu, uint64_t cycle)
+{
+  if (cycle <= apu->time)
+    return;
+
+  // keep the delta buffer from overflowing when frames are long
+  while (cycle - apu->frame_start > APU_FLUSH_CYCLES)
+  {
+    uint64_t mid = apu->frame_start + APU_FLUSH_CYCLES;
+    run(apu, mid);
+    flush(apu, mid);
+  }
+  run(apu, cycle);
+  update_irq(apu);
+}
+
+void apu_end_frame(struct apu_t* apu, uint64_t cycle)
+{
+  apu_catch_up(apu, cycle);
+  flush(apu, apu->time);
+}
+
+
+///////////////
+// registers //
+///////////////
+
+void apu_write(struct apu_t* apu, uint16_t addr, uint8_t value)
+{
+  apu_catch_up(apu, *apu->clock);
+
+  struct pulse_t* p = &apu->pulse[(addr >> 2) & 1];
+  struct triangle_t* t = &apu->triangle;
+  struct noise_t* n = &apu->noise;
+  struct dmc_t* d = &apu->dmc;
+
+  switch (addr)
+  {
+  case 0x4000:
+  case 0x4004:
+    p->duty = value >> 6;
+    p->env.loop = (value & 0x20) ? 1 : 0;
+    p->env.constant = (value & 0x10) ? 1 : 0;
+    p->env.volume = value & 0x0F;
+    break;
+  case 0x4001:
+  case 0x4005:
+    p->sweep_enabled = (value & 0x80) ? 1 : 0;
+    p->sweep_period = (value >> 4) & 7;
+    p->sweep_negate = (value & 0x08) ? 1 : 0;
+    p->sweep_shift = value & 7;
+    p->sweep_reload = true;
+    break;
+  case 0x4002:
+  case 0x4006:
+    p->timer = (p->timer & 0x700) | value;
+    break;
+  case 0x4003:
+  case 0x4007:
+    p->timer = (p->timer & 0xFF) | ((value & 7) << 8);
+    if (apu->enabled & (1 << ((addr >> 2) & 1)))
+      p->length = length_table[value >> 3];
+    p->step = 0;
+    p->env.start = true;
+    break;
+
+  case 0x4008:
+    t->control = (value & 0x80) ? 1 : 0;
+    t->linear_period = value & 0x7F;
+    break;
+  case 0x400A:
+    t->timer = (t->timer & 0x700) | value;
+    break;
+  case 0x400B:
+    t->timer = (t->timer & 0xFF) | ((value & 7) << 8);
+    if (apu->enabled & 0x04)
+      t->length = length_table[value >> 3];
+    t->linear_reload = true;
+    break;
+
+  case 0x400C:
+    n->env.loop = (value & 0x20) ? 1 : 0;
+    n->env.constant = (value & 0x10) ? 1 : 0;
+    n->env.volume = value & 0x0F;
+    break;
+  case 0x400E:
+    n->mode = (value & 0x80) ? 1 : 0;
+    n->period = noise_table[value & 0x0F];
+    break;
+  case 0x400F:
+    if (apu->enabled & 0x08)
+      n->length = length_table[value >> 3];
+    n->env.start = true;
+    break;
+
+  case 0x4010:
+    d->irq_enabled = (value & 0x80) ? 1 : 0;
+    d->loop = (value & 0x40) ? 1 : 0;
+    d->period = dmc_table[value & 0x0F];
+    if (!d->irq_enabled)
+      apu->dmc_irq = false;
+    break;
+  case 0x4011:
+    d->level = value & 0x7F;
+    break;
+  case 0x4012:
+    d->start = 0xC000 + (value << 6);
+    break;
+  case 0x4013:
+    d->length = (value << 4) + 1;
+    break;
+
+  case 0x4015:
+    apu->enabled = value & 0x1F;
+    if (!(value & 0x01)) apu->pulse[0].length = 0;
+    if (!(value & 0x02)) apu->pulse[1].length = 0;
+    if (!(value & 0x04)) t->length = 0;
+    if (!(value & 0x08)) n->length = 0;
+    if (!(value & 0x10))
+    {
+      d->remaining = 0;
+    }
+    else if (d->remaining == 0)
+    {
+      d->addr = d->start;
+      d->remaining = d->length;
+      dmc_fetch(apu);
+    }
+    apu->dmc_irq = false;
+    break;
+
+  case 0x4017:
+    apu->five_step = (value & 0x80) ? 1 : 0;
+    apu->irq_inhibit = (value & 0x40) ? 1 : 0;
+    if (apu->irq_inhibit)
+      apu->frame_irq = false;
+    apu->frame_base = apu->time;
+    apu->frame_step = 0;
+    apu->frame_next = apu->frame_base + frame_steps[apu->five_step][0];
+    // the 5-step mode clocks everything right away
+    if (apu->five_step)
+    {
+      quarter_frame(apu);
+      half_frame(apu);
+    }
+    break;
+  }
+
+  update_levels(apu, apu->time);
+  update_irq(apu);
+}
+
+void apu_reset(struct apu_t* apu)
+{
+  apu_catch_up(apu, *apu->clock);
+  apu->triangle.step = 0;
+  apu->dmc.level &= 1;
+  apu_write(apu, 0x4015, 0);
+  apu_write(apu, 0x4017, (apu->five_step << 7) | (apu->irq_inhibit << 6));
+}
+
+uint64_t apu_next_irq(const struct apu_t* apu)
+{
+  const struct dmc_t* d = &apu->dmc;
+  uint64_t next = UINT64_MAX;
+
+  // at the last step of the 4-step sequence
+  if (!apu->five_step && !apu->irq_inhibit && !apu->frame_irq)
+    next = apu->frame_base + frame_steps[0][3];
+
+  // when the last byte is fetched, a byte is fetched each time the output
+  // unit starts on the one before
+  if (d->irq_enabled && !d->loop && (d->remaining > 0) && !apu->dmc_irq)
+  {
+    uint64_t dmc = d->next + (uint64_t)(d->bits - 1 + (d->remaining - 1) * 8) * d->period;
+    if (dmc < next)
+      next = dmc;
+  }
+  return next;
+}
+
+
+uint8_t apu_read_status(struct apu_t* apu)
+{
+  apu_catch_up(apu, *apu->clock);
+
+  uint8_t status = ((apu->pulse[0].length > 0) ? 0x01 : 0) |
+                   ((apu->pulse[1].length > 0) ? 0x02 : 0) |
+                   ((apu->triangle.length > 0) ? 0x04 : 0) |
+                   ((apu->noise.length > 0)    ? 0x08 : 0) |
+                   ((apu->dmc.remaining > 0)   ? 0x10 : 0) |
+                   (apu->frame_irq ? 0x40 : 0) |
+                   (apu->dmc_irq   ? 0x80 : 0);
+  apu->frame_irq = false;
+  update_irq(apu);
+  return status;
+}
+
+
+///////////
+// setup //
+///////////
+
+void apu_init(struct apu_t* apu, struct bus_t* bus, const uint64_t* clock)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, build_kernel);
+
+  memset(apu, 0, sizeof(*apu));
+  ring_init(&apu->ring);
+  apu->bus = bus;
+  apu->clock = clock;
+  apu->time = *clock;
+  apu->frame_start = *clock;
+
+  apu->noise.lfsr = 1;
+  apu->noise.period = noise_table[0];
+  apu->dmc.period = dmc_table[0];
+  apu->dmc.bits = 8;
+  apu->dmc.silent = true;
+  apu->pulse[0].next = apu->pulse[1].next = *clock;
+  apu->triangle.next = apu->noise.next = apu->dmc.next = *clock;
+
+  apu->frame_base = *clock;
+  apu->frame_next = *clock + frame_steps[0][0];
+}
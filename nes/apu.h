@@ -0,0 +1,171 @@
+#include <stdint.h> //uint8_t
+#include "cpu-6502.h" //bool
+#include "bus.h"
+#include "ring.h"
+
+#pragma once
+
+/**
+ * 2A03 audio: two pulse channels, triangle, noise, DMC and the frame counter.
+ *
+ * Like the PPU, the APU is caught up to the cpu cycle counter lazily, on
+ * register accesses and once per frame, instead of being clocked every
+ * cycle. Catching up walks from one timer or frame counter event to the
+ * next, and every change of a channel's output is added to a delta buffer
+ * as a band-limited step (a windowed sinc), so the output has no aliasing
+ * however high the channel frequencies. At the end of a frame the deltas are
+ * integrated into 16 bit samples and pushed to a lock-free ring for an audio
+ * callback or the WAV writer.
+ */
+
+#define APU_SAMPLE_RATE 44100
+#define APU_CLOCK_RATE  1789773 // NTSC cpu clock
+
+// band-limited step synthesis
+#define BLIP_PHASES 32   // sub-sample positions
+#define BLIP_TAPS   16   // kernel width in samples
+#define BLIP_SIZE   2048 // delta buffer, samples
+#define APU_FLUSH_CYCLES 65536 // samples are flushed at least this often
+
+struct envelope_t
+{
+  bool     start;
+  bool     loop; // also halts the length counter
+  bool     constant;
+  uint8_t  volume;
+  uint8_t  divider;
+  uint8_t  decay;
+};
+
+struct pulse_t
+{
+  struct envelope_t env;
+  uint8_t  duty;
+  uint8_t  step;
+  uint16_t timer;
+  uint8_t  length;
+  bool     sweep_enabled;
+  bool     sweep_negate;
+  bool     sweep_reload;
+  uint8_t  sweep_period;
+  uint8_t  sweep_shift;
+  uint8_t  sweep_divider;
+  uint64_t next; // cpu cycle of the next sequencer step
+};
+
+struct triangle_t
+{
+  uint16_t timer;
+  uint8_t  step;
+  uint8_t  length;
+  bool     control; // also halts the length counter
+  bool     linear_reload;
+  uint8_t  linear_period;
+  uint8_t  linear;
+  uint64_t next;
+};
+
+struct noise_t
+{
+  struct envelope_t env;
+  bool     mode;
+  uint16_t period;
+  uint16_t lfsr;
+  uint8_t  length;
+  uint64_t next;
+};
+
+struct dmc_t
+{
+  bool     irq_enabled;
+  bool     loop;
+  uint16_t period;
+  uint8_t  level;
+  uint16_t start;
+  uint16_t length;
+  uint16_t addr;
+  uint16_t remaining;
+  uint8_t  shift;
+  uint8_t  bits;
+  bool     silent;
+  uint8_t  buffer;
+  bool     buffer_full;
+  uint64_t next;
+};
+
+struct apu_t
+{
+  struct bus_t*     bus; // DMC sample fetches
+  const uint64_t*   clock;
+  uint64_t          time; // caught up to this cpu cycle
+
+  struct pulse_t    pulse[2];
+  struct triangle_t triangle;
+  struct noise_t    noise;
+  struct dmc_t      dmc;
+  uint8_t           enabled; // $4015
+
+  // frame counter
+  bool              five_step;
+  bool              irq_inhibit;
+  uint8_t           frame_step;
+  uint64_t          frame_base; // cpu cycle the sequence started
+  uint64_t          frame_next; // cpu cycle of the next step
+
+  // interrupt lines to the cpu, set_irq is told whether either is up after
+  // every catch up and register access
+  bool              frame_irq;
+  bool              dmc_irq;
+  void            (*set_irq)(void* ctx, bool level);
+  void*             irq_ctx;
+
+  // synthesis: current channel levels, the delta buffer and its time base
+  uint8_t           level[5];
+  float             deltas[BLIP_SIZE + BLIP_TAPS];
+  uint64_t          frame_start; // cpu cycle of deltas[0]
+  uint64_t          frame_frac;  // sub-sample offset of frame_start, 32.32
+  float             integrator;
+  float             highpass;
+
+  struct sample_ring_t ring;
+  uint32_t          dropped; // samples the ring had no room for
+};
+
+/**
+ * Powers up the APU. clock is the cpu cycle counter it catches up to.
+ */
+void apu_init(struct apu_t* apu, struct bus_t* bus, const uint64_t* clock);
+
+/**
+ * The reset button: silences every channel as a $4015 write of 0 does,
+ * restarts the triangle and the frame counter in its current mode, and
+ * leaves only the low bit of the DMC level.
+ */
+void apu_reset(struct apu_t* apu);
+
+/**
+ * $4000-$4013, $4015 and $4017
+ */
+void apu_write(struct apu_t* apu, uint16_t addr, uint8_t value);
+
+/**
+ * $4015: length counter, DMC and interrupt status. Acknowledges the frame
+ * interrupt.
+ */
+uint8_t apu_read_status(struct apu_t* apu);
+
+/**
+ * Runs the APU up to cpu cycle 'cycle'.
+ */
+void apu_catch_up(struct apu_t* apu, uint64_t cycle);
+
+/**
+ * Catches up to 'cycle' and pushes all complete samples to the ring.
+ */
+void apu_end_frame(struct apu_t* apu, uint64_t cycle);
+
+/**
+ * returns: the cpu cycle by which the APU, caught up to it, may have raised
+ * an interrupt it hasn't yet, UINT64_MAX if it can't
+ */
+uint64_t apu_next_irq(const struct apu_t* apu);
@@ -0,0 +1,291 @@
+/**
+ * Headless compatibility sweep.
+ *
+ * Runs every cart given on the command line for a fixed number of frames, on
+ * a pool of threads, and writes one CSV row per cart:
+ *
+ *   rom,status,frames,cycles,seconds,cycles_per_sec,frame_hash,run_hash,detail
+ *
+ * status is one of
+ *   ok       ran all frames
+ *   illegal  the cpu hit an opcode it can't execute (detail has it and the pc)
+ *   hang     the cpu is parked on a JMP to itself with NMI off and IRQs
+ *            masked or none armed, nothing can ever wake it up
+ *   error    the cart didn't load (detail says why)
+ *   crash    the emulator died on it (detail has the signal)
+ *
+ * each cart runs in a child process of its own, so one that brings the
+ * emulator down is reported as crash and the rest of the sweep goes on.
+ *
+ * frame_hash is a hash of the last frame's picture, run_hash chains the hash
+ * of every frame, so two runs that diverge anywhere differ in it.
+ *
+ * -e picks the cpu engine: interp (default), predecode, jit, or check, which
+ * runs the dynarec and compares every block against the interpreter; a cart
+ * with mismatches is reported as error.
+ *
+ *   usage: batch [-j THREADS] [-f FRAMES] [-e ENGINE] [-o CSV] ROM...
+ */
+#include "nes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DEFAULT_FRAMES 600
+
+enum { RUN_OK, RUN_ILLEGAL, RUN_HANG, RUN_ERROR, RUN_CRASH, RUN_COUNT };
+static const char* const status_name[] = { "ok", "illegal", "hang", "error", "crash" };
+
+struct job_t
+{
+  const char* path;
+
+  int         status;
+  uint32_t    frames;
+  uint64_t    cycles;
+  double      seconds;
+  uint64_t    frame_hash;
+  uint64_t    run_hash;
+  char        detail[64];
+};
+
+static struct job_t* jobs;
+static int           njobs;
+static atomic_int    next_job;
+static uint32_t      nframes = DEFAULT_FRAMES;
+static int           engine = NES_ENGINE_INTERP;
+
+
+// an IRQ that is up, or one the APU or the mapper is counting down to
+static bool irq_armed(const struct nes_t* nes)
+{
+  return nes->cpu.irq_lines ||
+         (apu_next_irq(&nes->apu) != UINT64_MAX) ||
+         (mapper_irq_countdown(&nes->mapper) > 0);
+}
+
+static bool hung(struct nes_t* nes)
+{
+  uint16_t pc = nes->cpu.regs.pc;
+
+  return !(nes->ppu.ctrl & 0x80) &&
+         (nes->cpu.regs.status.interrupt || !irq_armed(nes)) &&
+         (bus_read(&nes->bus, pc) == 0x4C) && // jmp abs
+         (bus_read(&nes->bus, pc+1) == (pc & 0xFF)) &&
+         (bus_read(&nes->bus, pc+2) == (pc >> 8));
+}
+
+
+static void run(struct job_t* job)
+{
+  // a console is a few hundred KB, too much for a thread stack
+  struct nes_t* nes = malloc(sizeof(*nes));
+  if (nes == NULL)
+  {
+    job->status = RUN_ERROR;
+    snprintf(job->detail, sizeof(job->detail), "out of memory");
+    return;
+  }
+
+  int rtn = nes_open(nes, job->path);
+
+  if (rtn != NES_CART_OK)
+  {
+    job->status = RUN_ERROR;
+    snprintf(job->detail, sizeof(job->detail), "%s",
+             (rtn == NES_BAD_MAPPER) ? "unsupported mapper" : nes_cart_error(rtn));
+    free(nes);
+    return;
+  }
+  if (!nes_set_engine(nes, engine))
+  {
+    job->status = RUN_ERROR;
+    snprintf(job->detail, sizeof(job->detail), "engine not available");
+    nes_close(nes);
+    free(nes);
+    return;
+  }
+
+  double start = nes_now();
+  job->status = RUN_OK;
+  job->run_hash = NES_HASH_SEED;
+  for (job->frames=0; job->frames<nframes; )
+  {
+    bool ok = nes_run_frame(nes);
+    if (!ok)
+    {
+      job->status = RUN_ILLEGAL;
+      snprintf(job->detail, sizeof(job->detail), "opcode $%02X at $%04X",
+               nes->cpu.regs.ir, (uint16_t)(nes->cpu.regs.pc - 1));
+      break;
+    }
+    job->frames++;
+    job->run_hash = nes_hash_frame(nes->ppu.framebuffer, job->run_hash);
+    if (hung(nes))
+    {
+      job->status = RUN_HANG;
+      snprintf(job->detail, sizeof(job->detail), "jmp $%04X", nes->cpu.regs.pc);
+      break;
+    }
+  }
+  job->seconds = nes_now() - start;
+  job->cycles = nes->cpu.regs.cycles;
+  job->frame_hash = nes_hash_frame(nes->ppu.framebuffer, NES_HASH_SEED);
+  if (nes->jit && jit_stats(nes->jit)->mismatches && (job->status == RUN_OK))
+  {
+    job->status = RUN_ERROR;
+    snprintf(job->detail, sizeof(job->detail), "%llu jit mismatches",
+             (unsigned long long) jit_stats(nes->jit)->mismatches);
+  }
+
+  nes_close(nes);
+  free(nes);
+}
+
+/**
+ * runs a job in a child process. jobs is shared with the children, so the
+ * child fills in its own row; if it dies on a signal instead the row is
+ * overwritten with a crash.
+ */
+static void run_isolated(struct job_t* job)
+{
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    run(job);
+    _exit(0);
+  }
+  if (pid < 0)
+  {
+    job->status = RUN_ERROR;
+    snprintf(job->detail, sizeof(job->detail), "fork failed");
+    return;
+  }
+
+  int wstatus;
+  while (waitpid(pid, &wstatus, 0) < 0)
+    ;
+  if (WIFSIGNALED(wstatus))
+  {
+    job->status = RUN_CRASH;
+    snprintf(job->detail, sizeof(job->detail), "signal %d (%s)",
+             WTERMSIG(wstatus), strsignal(WTERMSIG(wstatus)));
+  }
+  else if (WEXITSTATUS(wstatus) != 0)
+  {
+    job->status = RUN_CRASH;
+    snprintf(job->detail, sizeof(job->detail), "exit %d", WEXITSTATUS(wstatus));
+  }
+}
+
+static void* worker(void* arg)
+{
+  int i;
+  while ((i = atomic_fetch_add(&next_job, 1)) < njobs)
+    run_isolated(&jobs[i]);
+  return NULL;
+}
+
+
+static void write_csv(FILE* f)
+{
+  fprintf(f, "rom,status,frames,cycles,seconds,cycles_per_sec,frame_hash,run_hash,detail\n");
+  for (int i=0; i<njobs; i++)
+  {
+    struct job_t* j = &jobs[i];
+    fprintf(f, "\"%s\",%s,%u,%llu,%.3f,%.0f,%016llx,%016llx,\"%s\"\n",
+            j->path, status_name[j->status], j->frames,
+            (unsigned long long)j->cycles, j->seconds,
+            (j->seconds > 0) ? j->cycles / j->seconds : 0,
+            (unsigned long long)j->frame_hash,
+            (unsigned long long)j->run_hash, j->detail);
+  }
+}
+
+
+int main(int argc, char* argv[])
+{
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* csv = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:f:e:o:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'j': nthreads = atoi(optarg); break;
+    case 'f': nframes = atoi(optarg); break;
+    case 'e':
+      if ((engine = nes_engine_by_name(optarg)) < 0)
+      {
+        printf("unknown engine %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'o': csv = optarg; break;
+    default:
+      printf("usage: %s [-j THREADS] [-f FRAMES] [-e ENGINE] [-o CSV] ROM...\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc)
+  {
+    printf("usage: %s [-j THREADS] [-f FRAMES] [-e ENGINE] [-o CSV] ROM...\n", argv[0]);
+    return 1;
+  }
+
+  njobs = argc - optind;
+  // shared with the children, see run_isolated()
+  jobs = mmap(NULL, njobs * sizeof(*jobs), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (jobs == MAP_FAILED)
+  {
+    printf("out of memory\n");
+    return 1;
+  }
+  for (int i=0; i<njobs; i++)
+    jobs[i].path = argv[optind + i];
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nthreads > njobs)
+    nthreads = njobs;
+
+  double start = nes_now();
+  pthread_t threads[nthreads];
+  for (int i=0; i<nthreads; i++)
+    pthread_create(&threads[i], NULL, worker, NULL);
+  for (int i=0; i<nthreads; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = nes_now() - start;
+
+  FILE* f = stdout;
+  if (csv && ((f = fopen(csv, "w")) == NULL))
+  {
+    printf("cannot create %s\n", csv);
+    return 1;
+  }
+  write_csv(f);
+  if (f != stdout)
+    fclose(f);
+
+  int counts[RUN_COUNT] = { 0 };
+  uint64_t cycles = 0;
+  for (int i=0; i<njobs; i++)
+  {
+    counts[jobs[i].status]++;
+    cycles += jobs[i].cycles;
+  }
+  fprintf(stderr, "%d roms on %d threads in %.2fs, %.0f cycles/sec: %d ok, %d illegal, %d hang, %d error, %d crash\n",
+          njobs, nthreads, elapsed, cycles / elapsed,
+          counts[RUN_OK], counts[RUN_ILLEGAL], counts[RUN_HANG], counts[RUN_ERROR],
+          counts[RUN_CRASH]);
+
+  munmap(jobs, njobs * sizeof(*jobs));
+  return counts[RUN_OK] == njobs ? 0 : 2;
+}
@@ -0,0 +1,65 @@
+#include "bus.h"
+#include <string.h>
+
+
+// nothing drives the data bus, so the last byte on it is read back. For an
+// absolute access that is the high byte of the address.
+static uint8_t open_bus_read(void* ctx, uint16_t addr)
+{
+  return addr >> 8;
+}
+
+static void ignore_write(void* ctx, uint16_t addr, uint8_t value)
+{
+}
+
+
+void bus_init(struct bus_t* bus)
+{
+  memset(bus->ram, 0, sizeof(bus->ram));
+  bus_map_io(bus, 0x00, BUS_PAGES, NULL, NULL, NULL);
+  bus_map_ram(bus, 0x00, 0x20, bus->ram, BUS_RAM);
+}
+
+
+void bus_init_flat(struct bus_t* bus, uint8_t* mem)
+{
+  bus_map_io(bus, 0x00, BUS_PAGES, NULL, NULL, NULL);
+  bus_map_ram(bus, 0x00, BUS_PAGES, mem, 0x10000);
+}
+
+
+void bus_map_read(struct bus_t* bus, uint8_t page, unsigned npages, const uint8_t* mem, size_t size)
+{
+  for (unsigned i=0; i<npages && page+i<BUS_PAGES; i++)
+    bus->read_page[page+i] = &mem[(i << 8) % size];
+}
+
+
+void bus_map_write(struct bus_t* bus, uint8_t page, unsigned npages, uint8_t* mem, size_t size)
+{
+  for (unsigned i=0; i<npages && page+i<BUS_PAGES; i++)
+    bus->write_page[page+i] = &mem[(i << 8) % size];
+}
+
+
+void bus_map_ram(struct bus_t* bus, uint8_t page, unsigned npages, uint8_t* mem, size_t size)
+{
+  bus_map_read(bus, page, npages, mem, size);
+  bus_map_write(bus, page, npages, mem, size);
+}
+
+
+void bus_map_io(struct bus_t* bus, uint8_t page, unsigned npages,
+                bus_read_fn read, bus_write_fn write, void* ctx)
+{
+  for (unsigned i=page; i<page+npages && i<BUS_PAGES; i++)
+  {
+    bus->read_page[i] = NULL;
+    bus->write_page[i] = NULL;
+    bus->read_fn[i] = read ? read : open_bus_read;
+    bus->write_fn[i] = write ? write : ignore_write;
+    bus->read_ctx[i] = ctx;
+    bus->write_ctx[i] = ctx;
+  }
+}
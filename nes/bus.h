@@ -0,0 +1,83 @@
+#include <stdint.h> //uint8_t
+#include <stddef.h> //size_t
+
+#pragma once
+
+/**
+ * CPU address space, split into 256 pages of 256 bytes.
+ *
+ * A page is either backed by memory, in which case the page table holds a
+ * direct pointer and an access is a single indexed load or store, or it is
+ * handled by a callback for side-effecting registers (PPU, APU, controllers,
+ * mapper registers). Reads and writes are mapped separately so ROM can be
+ * read through a pointer while its writes go to a mapper. A pointer always
+ * takes precedence over the handler of the same page.
+ *
+ * Handlers get the full address and do their own mirroring, e.g. the PPU
+ * registers repeat every 8 bytes through $3FFF.
+ */
+
+#define BUS_PAGES   256
+#define BUS_RAM     0x800 // 2KB of internal RAM, mirrored through $1FFF
+
+typedef uint8_t (*bus_read_fn)(void* ctx, uint16_t addr);
+typedef void    (*bus_write_fn)(void* ctx, uint16_t addr, uint8_t value);
+
+struct bus_t
+{
+  // page table, NULL when the handler below is used
+  const uint8_t* read_page[BUS_PAGES];
+  uint8_t*       write_page[BUS_PAGES];
+
+  bus_read_fn    read_fn[BUS_PAGES];
+  bus_write_fn   write_fn[BUS_PAGES];
+  void*          read_ctx[BUS_PAGES];
+  void*          write_ctx[BUS_PAGES];
+
+  uint8_t        ram[BUS_RAM];
+};
+
+
+static inline uint8_t bus_read(struct bus_t* bus, uint16_t addr)
+{
+  const uint8_t* page = bus->read_page[addr >> 8];
+  if (page)
+    return page[addr & 0xFF];
+  return bus->read_fn[addr >> 8](bus->read_ctx[addr >> 8], addr);
+}
+
+static inline void bus_write(struct bus_t* bus, uint16_t addr, uint8_t value)
+{
+  uint8_t* page = bus->write_page[addr >> 8];
+  if (page)
+    page[addr & 0xFF] = value;
+  else
+    bus->write_fn[addr >> 8](bus->write_ctx[addr >> 8], addr, value);
+}
+
+
+/**
+ * NES memory map: internal RAM mirrored over $0000-$1FFF, everything else
+ * open bus until the PPU, APU and cartridge map themselves in.
+ */
+void bus_init(struct bus_t* bus);
+
+/**
+ * A flat 64KB of RAM, for running the bare CPU.
+ */
+void bus_init_flat(struct bus_t* bus, uint8_t* mem);
+
+/**
+ * Maps npages pages starting at page to mem. mem repeats every size bytes,
+ * which must be a multiple of 256, so mirrors need no extra handling.
+ */
+void bus_map_read(struct bus_t* bus, uint8_t page, unsigned npages, const uint8_t* mem, size_t size);
+void bus_map_write(struct bus_t* bus, uint8_t page, unsigned npages, uint8_t* mem, size_t size);
+void bus_map_ram(struct bus_t* bus, uint8_t page, unsigned npages, uint8_t* mem, size_t size);
+
+/**
+ * Routes npages pages starting at page to handlers and drops their memory
+ * pointers. A NULL read returns open bus, a NULL write is ignored.
+ */
+void bus_map_io(struct bus_t* bus, uint8_t page, unsigned npages,
+                bus_read_fn read, bus_write_fn write, void* ctx);
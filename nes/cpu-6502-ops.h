@@ -0,0 +1,286 @@
+/**
+ * The 151 official 6502 opcodes, followed by the stable unofficial ones that
+ * games and nestest.nes rely on.
+ *
+ *   OP(opcode, name, addressing mode, length, cycles, operation)
+ *
+ * This file is included with OP() defined by the includer; it builds the
+ * opcode tables and the dispatcher from the same list, so the addressing mode
+ * and the operation of each opcode are fused into a single handler.
+ */
+
+OP(0x69, "adc", IMM, 2, 2, ADC)
+OP(0x65, "adc", ZP,  2, 3, ADC)
+OP(0x75, "adc", ZPX, 2, 4, ADC)
+OP(0x6d, "adc", ABS, 3, 4, ADC)
+OP(0x7d, "adc", ABX, 3, 4, ADC)
+OP(0x79, "adc", ABY, 3, 4, ADC)
+OP(0x61, "adc", IZX, 2, 6, ADC)
+OP(0x71, "adc", IZY, 2, 5, ADC)
+
+OP(0x29, "and", IMM, 2, 2, AND)
+OP(0x25, "and", ZP,  2, 3, AND)
+OP(0x35, "and", ZPX, 2, 4, AND)
+OP(0x2d, "and", ABS, 3, 4, AND)
+OP(0x3d, "and", ABX, 3, 4, AND)
+OP(0x39, "and", ABY, 3, 4, AND)
+OP(0x21, "and", IZX, 2, 6, AND)
+OP(0x31, "and", IZY, 2, 5, AND)
+
+OP(0x0a, "asl", IMP, 1, 2, ASL_A)
+OP(0x06, "asl", ZP,  2, 5, ASL)
+OP(0x16, "asl", ZPX, 2, 6, ASL)
+OP(0x0e, "asl", ABS, 3, 6, ASL)
+OP(0x1e, "asl", ABX, 3, 7, ASL)
+
+OP(0x90, "bcc", REL, 2, 2, BCC)
+OP(0xb0, "bcs", REL, 2, 2, BCS)
+OP(0xf0, "beq", REL, 2, 2, BEQ)
+OP(0x30, "bmi", REL, 2, 2, BMI)
+OP(0xd0, "bne", REL, 2, 2, BNE)
+OP(0x10, "bpl", REL, 2, 2, BPL)
+OP(0x50, "bvc", REL, 2, 2, BVC)
+OP(0x70, "bvs", REL, 2, 2, BVS)
+
+OP(0x24, "bit", ZP,  2, 3, BIT)
+OP(0x2c, "bit", ABS, 3, 4, BIT)
+
+OP(0x00, "brk", IMP, 1, 7, BRK)
+
+OP(0x18, "clc", IMP, 1, 2, CLC)
+OP(0xd8, "cld", IMP, 1, 2, CLD)
+OP(0x58, "cli", IMP, 1, 2, CLI)
+OP(0xb8, "clv", IMP, 1, 2, CLV)
+
+OP(0xc9, "cmp", IMM, 2, 2, CMP)
+OP(0xc5, "cmp", ZP,  2, 3, CMP)
+OP(0xd5, "cmp", ZPX, 2, 4, CMP)
+OP(0xcd, "cmp", ABS, 3, 4, CMP)
+OP(0xdd, "cmp", ABX, 3, 4, CMP)
+OP(0xd9, "cmp", ABY, 3, 4, CMP)
+OP(0xc1, "cmp", IZX, 2, 6, CMP)
+OP(0xd1, "cmp", IZY, 2, 5, CMP)
+
+OP(0xe0, "cpx", IMM, 2, 2, CPX)
+OP(0xe4, "cpx", ZP,  2, 3, CPX)
+OP(0xec, "cpx", ABS, 3, 4, CPX)
+
+OP(0xc0, "cpy", IMM, 2, 2, CPY)
+OP(0xc4, "cpy", ZP,  2, 3, CPY)
+OP(0xcc, "cpy", ABS, 3, 4, CPY)
+
+OP(0xc6, "dec", ZP,  2, 5, DEC)
+OP(0xd6, "dec", ZPX, 2, 6, DEC)
+OP(0xce, "dec", ABS, 3, 6, DEC)
+OP(0xde, "dec", ABX, 3, 7, DEC)
+
+OP(0xca, "dex", IMP, 1, 2, DEX)
+OP(0x88, "dey", IMP, 1, 2, DEY)
+
+OP(0x49, "eor", IMM, 2, 2, EOR)
+OP(0x45, "eor", ZP,  2, 3, EOR)
+OP(0x55, "eor", ZPX, 2, 4, EOR)
+OP(0x4d, "eor", ABS, 3, 4, EOR)
+OP(0x5d, "eor", ABX, 3, 4, EOR)
+OP(0x59, "eor", ABY, 3, 4, EOR)
+OP(0x41, "eor", IZX, 2, 6, EOR)
+OP(0x51, "eor", IZY, 2, 5, EOR)
+
+OP(0xe6, "inc", ZP,  2, 5, INC)
+OP(0xf6, "inc", ZPX, 2, 6, INC)
+OP(0xee, "inc", ABS, 3, 6, INC)
+OP(0xfe, "inc", ABX, 3, 7, INC)
+
+OP(0xe8, "inx", IMP, 1, 2, INX)
+OP(0xc8, "iny", IMP, 1, 2, INY)
+
+OP(0x4c, "jmp", ABS, 3, 3, JMP)
+OP(0x6c, "jmp", IND, 3, 5, JMP)
+
+OP(0x20, "jsr", ABS, 3, 6, JSR)
+
+OP(0xa9, "lda", IMM, 2, 2, LDA)
+OP(0xa5, "lda", ZP,  2, 3, LDA)
+OP(0xb5, "lda", ZPX, 2, 4, LDA)
+OP(0xad, "lda", ABS, 3, 4, LDA)
+OP(0xbd, "lda", ABX, 3, 4, LDA)
+OP(0xb9, "lda", ABY, 3, 4, LDA)
+OP(0xa1, "lda", IZX, 2, 6, LDA)
+OP(0xb1, "lda", IZY, 2, 5, LDA)
+
+OP(0xa2, "ldx", IMM, 2, 2, LDX)
+OP(0xa6, "ldx", ZP,  2, 3, LDX)
+OP(0xb6, "ldx", ZPY, 2, 4, LDX)
+OP(0xae, "ldx", ABS, 3, 4, LDX)
+OP(0xbe, "ldx", ABY, 3, 4, LDX)
+
+OP(0xa0, "ldy", IMM, 2, 2, LDY)
+OP(0xa4, "ldy", ZP,  2, 3, LDY)
+OP(0xb4, "ldy", ZPX, 2, 4, LDY)
+OP(0xac, "ldy", ABS, 3, 4, LDY)
+OP(0xbc, "ldy", ABX, 3, 4, LDY)
+
+OP(0x4a, "lsr", IMP, 1, 2, LSR_A)
+OP(0x46, "lsr", ZP,  2, 5, LSR)
+OP(0x56, "lsr", ZPX, 2, 6, LSR)
+OP(0x4e, "lsr", ABS, 3, 6, LSR)
+OP(0x5e, "lsr", ABX, 3, 7, LSR)
+
+OP(0xea, "nop", IMP, 1, 2, NOP)
+
+OP(0x09, "ora", IMM, 2, 2, ORA)
+OP(0x05, "ora", ZP,  2, 3, ORA)
+OP(0x15, "ora", ZPX, 2, 4, ORA)
+OP(0x0d, "ora", ABS, 3, 4, ORA)
+OP(0x1d, "ora", ABX, 3, 4, ORA)
+OP(0x19, "ora", ABY, 3, 4, ORA)
+OP(0x01, "ora", IZX, 2, 6, ORA)
+OP(0x11, "ora", IZY, 2, 5, ORA)
+
+OP(0x48, "pha", IMP, 1, 3, PHA)
+OP(0x08, "php", IMP, 1, 3, PHP)
+OP(0x68, "pla", IMP, 1, 4, PLA)
+OP(0x28, "plp", IMP, 1, 4, PLP)
+
+OP(0x2a, "rol", IMP, 1, 2, ROL_A)
+OP(0x26, "rol", ZP,  2, 5, ROL)
+OP(0x36, "rol", ZPX, 2, 6, ROL)
+OP(0x2e, "rol", ABS, 3, 6, ROL)
+OP(0x3e, "rol", ABX, 3, 7, ROL)
+
+OP(0x6a, "ror", IMP, 1, 2, ROR_A)
+OP(0x66, "ror", ZP,  2, 5, ROR)
+OP(0x76, "ror", ZPX, 2, 6, ROR)
+OP(0x6e, "ror", ABS, 3, 6, ROR)
+OP(0x7e, "ror", ABX, 3, 7, ROR)
+
+OP(0x40, "rti", IMP, 1, 6, RTI)
+OP(0x60, "rts", IMP, 1, 6, RTS)
+
+OP(0xe9, "sbc", IMM, 2, 2, SBC)
+OP(0xe5, "sbc", ZP,  2, 3, SBC)
+OP(0xf5, "sbc", ZPX, 2, 4, SBC)
+OP(0xed, "sbc", ABS, 3, 4, SBC)
+OP(0xfd, "sbc", ABX, 3, 4, SBC)
+OP(0xf9, "sbc", ABY, 3, 4, SBC)
+OP(0xe1, "sbc", IZX, 2, 6, SBC)
+OP(0xf1, "sbc", IZY, 2, 5, SBC)
+
+OP(0x38, "sec", IMP, 1, 2, SEC)
+OP(0xf8, "sed", IMP, 1, 2, SED)
+OP(0x78, "sei", IMP, 1, 2, SEI)
+
+OP(0x85, "sta", ZP,  2, 3, STA)
+OP(0x95, "sta", ZPX, 2, 4, STA)
+OP(0x8d, "sta", ABS, 3, 4, STA)
+OP(0x9d, "sta", ABX, 3, 5, STA)
+OP(0x99, "sta", ABY, 3, 5, STA)
+OP(0x81, "sta", IZX, 2, 6, STA)
+OP(0x91, "sta", IZY, 2, 6, STA)
+
+OP(0x86, "stx", ZP,  2, 3, STX)
+OP(0x96, "stx", ZPY, 2, 4, STX)
+OP(0x8e, "stx", ABS, 3, 4, STX)
+
+OP(0x84, "sty", ZP,  2, 3, STY)
+OP(0x94, "sty", ZPX, 2, 4, STY)
+OP(0x8c, "sty", ABS, 3, 4, STY)
+
+OP(0xaa, "tax", IMP, 1, 2, TAX)
+OP(0xa8, "tay", IMP, 1, 2, TAY)
+OP(0xba, "tsx", IMP, 1, 2, TSX)
+OP(0x8a, "txa", IMP, 1, 2, TXA)
+OP(0x9a, "txs", IMP, 1, 2, TXS)
+OP(0x98, "tya", IMP, 1, 2, TYA)
+
+// unofficial opcodes
+
+OP(0x1a, "*nop", IMP, 1, 2, NOP)
+OP(0x3a, "*nop", IMP, 1, 2, NOP)
+OP(0x5a, "*nop", IMP, 1, 2, NOP)
+OP(0x7a, "*nop", IMP, 1, 2, NOP)
+OP(0xda, "*nop", IMP, 1, 2, NOP)
+OP(0xfa, "*nop", IMP, 1, 2, NOP)
+OP(0x80, "*nop", IMM, 2, 2, NOP_R)
+OP(0x82, "*nop", IMM, 2, 2, NOP_R)
+OP(0x89, "*nop", IMM, 2, 2, NOP_R)
+OP(0xc2, "*nop", IMM, 2, 2, NOP_R)
+OP(0xe2, "*nop", IMM, 2, 2, NOP_R)
+OP(0x04, "*nop", ZP,  2, 3, NOP_R)
+OP(0x44, "*nop", ZP,  2, 3, NOP_R)
+OP(0x64, "*nop", ZP,  2, 3, NOP_R)
+OP(0x14, "*nop", ZPX, 2, 4, NOP_R)
+OP(0x34, "*nop", ZPX, 2, 4, NOP_R)
+OP(0x54, "*nop", ZPX, 2, 4, NOP_R)
+OP(0x74, "*nop", ZPX, 2, 4, NOP_R)
+OP(0xd4, "*nop", ZPX, 2, 4, NOP_R)
+OP(0xf4, "*nop", ZPX, 2, 4, NOP_R)
+OP(0x0c, "*nop", ABS, 3, 4, NOP_R)
+OP(0x1c, "*nop", ABX, 3, 4, NOP_R)
+OP(0x3c, "*nop", ABX, 3, 4, NOP_R)
+OP(0x5c, "*nop", ABX, 3, 4, NOP_R)
+OP(0x7c, "*nop", ABX, 3, 4, NOP_R)
+OP(0xdc, "*nop", ABX, 3, 4, NOP_R)
+OP(0xfc, "*nop", ABX, 3, 4, NOP_R)
+
+OP(0xa7, "*lax", ZP,  2, 3, LAX)
+OP(0xb7, "*lax", ZPY, 2, 4, LAX)
+OP(0xaf, "*lax", ABS, 3, 4, LAX)
+OP(0xbf, "*lax", ABY, 3, 4, LAX)
+OP(0xa3, "*lax", IZX, 2, 6, LAX)
+OP(0xb3, "*lax", IZY, 2, 5, LAX)
+
+OP(0x87, "*sax", ZP,  2, 3, SAX)
+OP(0x97, "*sax", ZPY, 2, 4, SAX)
+OP(0x8f, "*sax", ABS, 3, 4, SAX)
+OP(0x83, "*sax", IZX, 2, 6, SAX)
+
+OP(0xeb, "*sbc", IMM, 2, 2, SBC)
+
+OP(0xc7, "*dcp", ZP,  2, 5, DCP)
+OP(0xd7, "*dcp", ZPX, 2, 6, DCP)
+OP(0xcf, "*dcp", ABS, 3, 6, DCP)
+OP(0xdf, "*dcp", ABX, 3, 7, DCP)
+OP(0xdb, "*dcp", ABY, 3, 7, DCP)
+OP(0xc3, "*dcp", IZX, 2, 8, DCP)
+OP(0xd3, "*dcp", IZY, 2, 8, DCP)
+
+OP(0xe7, "*isb", ZP,  2, 5, ISB)
+OP(0xf7, "*isb", ZPX, 2, 6, ISB)
+OP(0xef, "*isb", ABS, 3, 6, ISB)
+OP(0xff, "*isb", ABX, 3, 7, ISB)
+OP(0xfb, "*isb", ABY, 3, 7, ISB)
+OP(0xe3, "*isb", IZX, 2, 8, ISB)
+OP(0xf3, "*isb", IZY, 2, 8, ISB)
+
+OP(0x07, "*slo", ZP,  2, 5, SLO)
+OP(0x17, "*slo", ZPX, 2, 6, SLO)
+OP(0x0f, "*slo", ABS, 3, 6, SLO)
+OP(0x1f, "*slo", ABX, 3, 7, SLO)
+OP(0x1b, "*slo", ABY, 3, 7, SLO)
+OP(0x03, "*slo", IZX, 2, 8, SLO)
+OP(0x13, "*slo", IZY, 2, 8, SLO)
+
+OP(0x27, "*rla", ZP,  2, 5, RLA)
+OP(0x37, "*rla", ZPX, 2, 6, RLA)
+OP(0x2f, "*rla", ABS, 3, 6, RLA)
+OP(0x3f, "*rla", ABX, 3, 7, RLA)
+OP(0x3b, "*rla", ABY, 3, 7, RLA)
+OP(0x23, "*rla", IZX, 2, 8, RLA)
+OP(0x33, "*rla", IZY, 2, 8, RLA)
+
+OP(0x47, "*sre", ZP,  2, 5, SRE)
+OP(0x57, "*sre", ZPX, 2, 6, SRE)
+OP(0x4f, "*sre", ABS, 3, 6, SRE)
+OP(0x5f, "*sre", ABX, 3, 7, SRE)
+OP(0x5b, "*sre", ABY, 3, 7, SRE)
+OP(0x43, "*sre", IZX, 2, 8, SRE)
+OP(0x53, "*sre", IZY, 2, 8, SRE)
+
+OP(0x67, "*rra", ZP,  2, 5, RRA)
+OP(0x77, "*rra", ZPX, 2, 6, RRA)
+OP(0x6f, "*rra", ABS, 3, 6, RRA)
+OP(0x7f, "*rra", ABX, 3, 7, RRA)
+OP(0x7b, "*rra", ABY, 3, 7, RRA)
+OP(0x63, "*rra", IZX, 2, 8, RRA)
+OP(0x73, "*rra", IZY, 2, 8, RRA)
@@ -1,192 +1,194 @@
 #include "cpu-6502.h"
+#include "bus.h"
+#include "log.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h> //malloc
 #include <string.h>
+#include <stddef.h> //offsetof()
 
 #define MEM_16KB (16*1024)
 
-//
-char* opcode_name[256];
-uint8_t opcode_cycles[256];
-uint8_t opcode_len[256];
-void (*decode_handler[256]) ();
-void (*exec_handler[256]) ();
+// opcode tables, built from cpu-6502-ops.h. opcode_len is 0 for the opcodes
+// that are not implemented
+#define OP(op, name, mode, len, cycles, exec) [op] = name,
+const char* const opcode_name[256] = {
+#include "cpu-6502-ops.h"
+};
+#undef OP
 
+#define OP(op, name, mode, len, cycles, exec) [op] = len,
+const uint8_t opcode_len[256] = {
+#include "cpu-6502-ops.h"
+};
+#undef OP
 
-uint8_t get_proc_status()
+#define OP(op, name, mode, len, cycles, exec) [op] = cycles,
+const uint8_t opcode_cycles[256] = {
+#include "cpu-6502-ops.h"
+};
+#undef OP
+
+#define OP(op, name, mode, len, cycles, exec) [op] = MODE_##mode,
+const uint8_t opcode_mode[256] = {
+#include "cpu-6502-ops.h"
+};
+#undef OP
+
+
+// INT_IRQ follows the IRQ line and I, so taking it is part of the one check
+// of 'pending' between instructions; redone whenever either changes
+static inline void update_irq(struct cpu_t* cpu)
 {
-  return (regs.status.negative << 7) | 
-         (regs.status.overflow << 6) | 
-         (regs.status.break_cmd << 4) | 
-         (regs.status.decimal << 3) | 
-         (regs.status.interrupt << 2) | 
-         (regs.status.zero << 1) | 
-          regs.status.carry;
+  cpu->pending &= ~INT_IRQ;
+  if (cpu->irq_lines && !cpu->regs.status.interrupt)
+    cpu->pending |= INT_IRQ;
 }
 
-void set_proc_status(uint8_t status)
+
+uint8_t get_proc_status(const struct cpu_t* cpu)
 {
   // MSB           LSB
   // [7 6 5 4 3 2 1 0]
   // [N V - B D I Z C]
-  regs.status.carry     =  status       & 0x01;
-  regs.status.zero      = (status >> 1) & 0x01;
-  regs.status.interrupt = (status >> 2) & 0x01;
-  regs.status.decimal   = (status >> 3) & 0x01;
-  regs.status.break_cmd = (status >> 4) & 0x01;
-  regs.status.overflow  = (status >> 6) & 0x01;
-  regs.status.negative  = (status >> 7) & 0x01;
+  return (cpu->regs.status.neg_res & FLAG_N) |
+         (cpu->regs.status.overflow << 6) |
+         (cpu->regs.status.break_cmd << 4) |
+         (cpu->regs.status.decimal << 3) |
+         (cpu->regs.status.interrupt << 2) |
+         ((cpu->regs.status.zero_res == 0) << 1) |
+          cpu->regs.status.carry;
+}
+
+void set_proc_status(struct cpu_t* cpu, uint8_t status)
+{
+  cpu->regs.status.carry     =  status       & 0x01;
+  cpu->regs.status.zero_res  = ~status       & FLAG_Z; // non zero when Z is clear
+  cpu->regs.status.interrupt = (status >> 2) & 0x01;
+  cpu->regs.status.decimal   = (status >> 3) & 0x01;
+  cpu->regs.status.break_cmd = (status >> 4) & 0x01;
+  cpu->regs.status.overflow  = (status >> 6) & 0x01;
+  update_irq(cpu);
+  cpu->regs.status.neg_res   =  status;
 }
 
 
 /**
  for debug/test purposes
  */
-void set_memory(uint16_t addr, uint8_t value)
+void set_memory(struct cpu_t* cpu, uint16_t addr, uint8_t value)
 {
-  mem_map[addr] = value;
+  bus_write(cpu->bus, addr, value);
 }
 
 
-void set_memory_range(uint16_t addr, uint8_t *buffer, uint8_t size)
+void set_memory_range(struct cpu_t* cpu, uint16_t addr, uint8_t *buffer, uint8_t size)
 {
   for (int i=0; i<size; i++)
-    mem_map[addr+i] = buffer[i];
+    bus_write(cpu->bus, addr+i, buffer[i]);
 }
 
 
-uint8_t get_memory(uint16_t addr)
+uint8_t get_memory(struct cpu_t* cpu, uint16_t addr)
 {
-  return mem_map[addr];
+  return bus_read(cpu->bus, addr);
 }
 
 
 /**
  */
-void print_regs()
+static void print_regs(const struct cpu_t* cpu)
 {
   // a     x     y
   // pc    sp    status[N V - B D I Z C]
-  printf("acc:0x%x\tx:0x%x\ty:0x%x\n", regs.acc, regs.x, regs.y);
-  printf("pc:0x%x\tsp:0x%x\t[%s %s - %s %s %s %s %s]\n", regs.pc, regs.sp, (regs.status.negative)?"1":"0", (regs.status.overflow)?"1":"0", (regs.status.break_cmd)?"1":"0", (regs.status.decimal)?"1":"0", (regs.status.interrupt)?"1":"0", (regs.status.zero)?"1":"0", (regs.status.carry)?"1":"0");
+  printf("acc:0x%x\tx:0x%x\ty:0x%x\n", cpu->regs.acc, cpu->regs.x, cpu->regs.y);
+  printf("pc:0x%x\tsp:0x%x\t[%s %s - %s %s %s %s %s]\n", cpu->regs.pc, cpu->regs.sp, (status_negative(cpu))?"1":"0", (cpu->regs.status.overflow)?"1":"0", (cpu->regs.status.break_cmd)?"1":"0", (cpu->regs.status.decimal)?"1":"0", (cpu->regs.status.interrupt)?"1":"0", (status_zero(cpu))?"1":"0", (cpu->regs.status.carry)?"1":"0");
   printf("\t\t\t[N O - B D I Z C]\n\n");
 }
 
-void cpu_step()
-{
-  // fetch - next opcode from memory
-    regs.ir = mem_map[regs.pc];
-    print_regs();
-    regs.pc++;
 
-    if (opcode_len[regs.ir] == 0)
-    {
-      printf("unknown opcode 0x%x\n", regs.ir);
-      return;
-    }
+////////////
+// memory //
+////////////
 
-    // decode - see what else the opcode needs
-    if (decode_handler[regs.ir])
-    {
-      decode_handler[regs.ir]();
-    }
 
-    // execute
-    if (exec_handler[regs.ir])
-    {
-      exec_handler[regs.ir]();
-    }
-}
+#define RD(a)    bus_read(cpu->bus, (a))
+#define WR(a, v) bus_write(cpu->bus, (a), (v))
 
-void cpu_run()
-{
-  while (1)
-  {
-    cpu_step();
+// the stack lives in page 1, sp points at the next free byte
+#define PUSH(v)  WR(0x100 | cpu->regs.sp--, v)
+#define PULL()   RD(0x100 | ++cpu->regs.sp)
 
-    // if break command is set then stop
-    if (regs.status.break_cmd)
-      return;
-
-    // store
-  }
+// reset goes through the motions of an interrupt with the writes held off:
+// S drops by three, I is set and pc comes from $FFFC. A pending NMI is lost
+static void reset_sequence(struct cpu_t* cpu)
+{
+  cpu->pending &= ~(INT_RESET | INT_NMI | INT_IRQ);
+  cpu->regs.sp -= 3;
+  cpu->regs.status.interrupt = 1;
+  cpu->regs.pc = RD(0xFFFC) | (RD(0xFFFD) << 8);
+  cpu->regs.cycles += 7;
 }
 
 
 //////////////////////
-// address handlers //
+// addressing modes //
 //////////////////////
 
+// Every mode leaves the effective address in the local 'addr' and advances
+// pc past the operand. On entry pc points at the byte after the opcode. The
+// indexed modes also set 'cross' when indexing moved addr to another page,
+// which costs reads one extra cycle.
+
 
 /**
- These instructions have their data defined as the next byte after the opcode. ORA #$B2 will perform a logical 
- (also called bitwise) of the value B2 with the accumulator. Remember that in assembly when you see a # sign, 
+ Implied and accumulator modes have no operand.
+ */
+#define IMP
+
+
+/**
+ These instructions have their data defined as the next byte after the opcode. ORA #$B2 will perform a logical
+ (also called bitwise) of the value B2 with the accumulator. Remember that in assembly when you see a # sign,
  it indicates an immediate value. If $B2 was written without a #, it would indicate an address or offset.
+
+ The effective address is simply the address of the operand byte.
  */
-void addrmode_immediate()
-{
-  printf("%s: 0x%x\n", __func__, regs.pc);
-  regs.tl = mem_map[regs.pc++];
-  regs.th = 0;
-}
+#define IMM addr = cpu->regs.pc++;
 
 
 /**
- Zero-Page is an addressing mode that is only capable of addressing the first 256 bytes of the CPU's memory map. 
- You can think of it as absolute addressing for the first 256 bytes. The instruction LDA $35 will put the value 
- stored in memory location $35 into A. The advantage of zero-page are two - the instruction takes one less byte 
- to specify, and it executes in less CPU cycles. Most programs are written to store the most frequently used 
+ Zero-Page is an addressing mode that is only capable of addressing the first 256 bytes of the CPU's memory map.
+ You can think of it as absolute addressing for the first 256 bytes. The instruction LDA $35 will put the value
+ stored in memory location $35 into A. The advantage of zero-page are two - the instruction takes one less byte
+ to specify, and it executes in less CPU cycles. Most programs are written to store the most frequently used
  variables in the first 256 memory locations so they can take advantage of zero page addressing.
  */
-void addrmode_zero_page()
-{
-  printf("%s: pc:0x%x\n", __func__, regs.pc);
-  regs.tl = mem_map[regs.pc++];
-  regs.th = 0;
-}
+#define ZP addr = RD(cpu->regs.pc++);
 
 
 /**
  This works just like absolute indexed, but the target address is limited to the first 0xFF bytes.
 
- The target address will wrap around and will always be in the zero page. If the instruction is LDA $C0,X, 
- and X is $60, then the target address will be $20. $C0+$60 = $120, but the carry is discarded in the 
+ The target address will wrap around and will always be in the zero page. If the instruction is LDA $C0,X,
+ and X is $60, then the target address will be $20. $C0+$60 = $120, but the carry is discarded in the
  calculation of the target address.
  */
-void addrmode_zero_page_x()
-{
-  printf("%s: pc:0x%x\n", __func__, regs.pc);
-  regs.tl = (mem_map[regs.pc] + regs.x) & 0xFF;
-  regs.th = 0;
-  regs.pc++;
-}
-
-
-void addrmode_zero_page_y()
-{
-  printf("%s: pc:0x%x\n", __func__, regs.pc);
-  regs.tl = (mem_map[regs.pc] + regs.y) & 0xFF;
-  regs.th = 0;
-  regs.pc++;
-}
+#define ZPX addr = (RD(cpu->regs.pc++) + cpu->regs.x) & 0xFF;
+#define ZPY addr = (RD(cpu->regs.pc++) + cpu->regs.y) & 0xFF;
 
 
 /**
- Absolute addressing specifies the memory location explicitly in the two bytes following the opcode. 
- So JMP $4032 will set the PC to $4032. The hex for this is 4C 32 40. The 6502 is a little endian machine, 
+ Absolute addressing specifies the memory location explicitly in the two bytes following the opcode.
+ So JMP $4032 will set the PC to $4032. The hex for this is 4C 32 40. The 6502 is a little endian machine,
  so any 16 bit (2 byte) value is stored with the LSB first. All instructions that use absolute addressing are 3 bytes.
  */
-void addrmode_abs()
-{
-  printf("%s: 0x%x\n", __func__, regs.pc);
-  // get the next two bytes after opcode. this is the address to read
-  regs.tl = mem_map[regs.pc++];
-  regs.th = mem_map[regs.pc++];
-}
+#define ABS addr = RD(cpu->regs.pc) | (RD(cpu->regs.pc+1) << 8); \
+            cpu->regs.pc += 2;
 
 
 /**
- This addressing mode makes the target address by adding the contents of the X or Y register to an absolute address. 
+ This addressing mode makes the target address by adding the contents of the X or Y register to an absolute address.
  For example, this 6502 code can be used to fill 10 bytes with $FF starting at address $1009, counting down to address $1000.
    LDA #$FF
    LDY #$09
@@ -195,32 +197,18 @@ void addrmode_abs()
    DEY
    BPL loop
  */
-void addrmode_abs_x()
-{
-  printf("%s: 0x%x\n", __func__, regs.pc);
-  uint16_t tmp = mem_map[regs.pc++];
-           tmp |= (mem_map[regs.pc++] << 8);
-           tmp += regs.x;
-
-  regs.tl = tmp & 0xFF;
-  regs.th = (tmp >> 8) & 0xFF;
-}
-
-
-void addrmode_abs_y()
-{
-  printf("%s: 0x%x\n", __func__, regs.pc);
-  uint16_t tmp = mem_map[regs.pc++];
-           tmp |= (mem_map[regs.pc++] << 8);
-           tmp += regs.y;
-
-  regs.tl = tmp & 0xFF;
-  regs.th = (tmp >> 8) & 0xFF;
-}
+#define ABX tmp = RD(cpu->regs.pc) | (RD(cpu->regs.pc+1) << 8); \
+            cpu->regs.pc += 2; \
+            addr = tmp + cpu->regs.x; \
+            cross = ((tmp ^ addr) >> 8) & 0x1;
+#define ABY tmp = RD(cpu->regs.pc) | (RD(cpu->regs.pc+1) << 8); \
+            cpu->regs.pc += 2; \
+            addr = tmp + cpu->regs.y; \
+            cross = ((tmp ^ addr) >> 8) & 0x1;
 
 
 /**
- The JMP instruction is the only instruction that uses this addressing mode. It is a 3 byte instruction - the 2nd 
+ The JMP instruction is the only instruction that uses this addressing mode. It is a 3 byte instruction - the 2nd
  and 3rd bytes are an absolute address. The set the PC to the address stored at that address. So maybe this would be clearer.
 
    Memory:
@@ -230,818 +218,661 @@ void addrmode_abs_y()
    JMP  ($1000)
 
    When this instruction is executed, the PC will be set to $3a52, which is the address stored at address $1000.
- */
-void addrmode_indirect()
-{
-  printf("%s: 0x%x\n", __func__, regs.pc);
-  uint16_t tmp = mem_map[regs.pc++];
-           tmp |= mem_map[regs.pc++] << 8;
 
-  regs.tl = mem_map[tmp];
-  regs.th = mem_map[tmp+1];
-}
+ The 6502 never carries into the high byte when fetching the pointer, so JMP ($10FF) reads $10FF and $1000.
+ */
+#define IND tmp = RD(cpu->regs.pc) | (RD(cpu->regs.pc+1) << 8); \
+            cpu->regs.pc += 2; \
+            addr = RD(tmp) | (RD((tmp & 0xFF00) | ((tmp+1) & 0x00FF)) << 8);
 
 
 /**
-  This mode is only used with the X register. Consider a situation where the instruction is LDA ($20,X), 
-  X contains $04, and memory at $24 contains 0024: 74 20, First, X is added to $20 to get $24. The target 
-  address will be fetched from $24 resulting in a target address of $2074. Register A will be loaded with 
+  This mode is only used with the X register. Consider a situation where the instruction is LDA ($20,X),
+  X contains $04, and memory at $24 contains 0024: 74 20, First, X is added to $20 to get $24. The target
+  address will be fetched from $24 resulting in a target address of $2074. Register A will be loaded with
   the contents of memory at $2074.
 
-  If X + the immediate byte will wrap around to a zero-page address. So you could code that like 
+  If X + the immediate byte will wrap around to a zero-page address. So you could code that like
   targetAddress = (X + opcode[1]) & 0xFF .
 
-  Indexed Indirect instructions are 2 bytes - the second byte is the zero-page address - $20 in the example. 
+  Indexed Indirect instructions are 2 bytes - the second byte is the zero-page address - $20 in the example.
   Obviously the fetched address has to be stored in the zero page.
  */
-void addrmode_indexed_indirect_x()
-{
-  uint8_t zpage = (mem_map[regs.pc++] + regs.x) & 0xFF;
-  printf("%s: 0x%x\n", __func__, zpage);
-
-  regs.tl = mem_map[zpage];
-  regs.th = mem_map[zpage+1];
-}
+#define IZX tmp = (RD(cpu->regs.pc++) + cpu->regs.x) & 0xFF; \
+            addr = RD(tmp) | (RD((tmp+1) & 0xFF) << 8);
 
 
 /**
- This mode is only used with the Y register. It differs in the order that Y is applied to the indirectly 
- fetched address. An example instruction that uses indirect index addressing is LDA ($86),Y . To calculate 
- the target address, the CPU will first fetch the address stored at zero page location $86. That address 
- will be added to register Y to get the final target address. For LDA ($86),Y, if the address stored 
- at $86 is $4028 (memory is 0086: 28 40, remember little endian) and register Y contains $10, then the final 
+ This mode is only used with the Y register. It differs in the order that Y is applied to the indirectly
+ fetched address. An example instruction that uses indirect index addressing is LDA ($86),Y . To calculate
+ the target address, the CPU will first fetch the address stored at zero page location $86. That address
+ will be added to register Y to get the final target address. For LDA ($86),Y, if the address stored
+ at $86 is $4028 (memory is 0086: 28 40, remember little endian) and register Y contains $10, then the final
  target address would be $4038. Register A will be loaded with the contents of memory at $4038.
 
- Indirect Indexed instructions are 2 bytes - the second byte is the zero-page address - $20 in the example. 
+ Indirect Indexed instructions are 2 bytes - the second byte is the zero-page address - $20 in the example.
  (So the fetched address has to be stored in the zero page.)
 
- While indexed indirect addressing will only generate a zero-page address, this mode's target address is 
+ While indexed indirect addressing will only generate a zero-page address, this mode's target address is
  not wrapped - it can be anywhere in the 16-bit address space.
  */
-void addrmode_indirect_indexed_y()
-{
-  uint8_t zpage = mem_map[regs.pc++];
-  uint16_t tmp = (mem_map[zpage] | (mem_map[zpage+1] << 8)) + regs.y;
-  printf("%s: 0x%x\n", __func__, tmp);
+#define IZY tmp = RD(cpu->regs.pc++); \
+            tmp = RD(tmp) | (RD((tmp+1) & 0xFF) << 8); \
+            addr = tmp + cpu->regs.y; \
+            cross = ((tmp ^ addr) >> 8) & 0x1;
 
-  regs.tl = tmp & 0xFF;
-  regs.th = (tmp >> 8) & 0xFF;
-}
 
-
-/////////////
-// opcodes //
-/////////////
+/**
+ Branches use a signed 8 bit offset relative to the address of the next instruction.
+ */
+#define REL tmp = RD(cpu->regs.pc++); \
+            addr = cpu->regs.pc + (int8_t)tmp;
+
+
+////////////////
+// operations //
+////////////////
+
+
+// N and Z are just the result, see struct proc_status_t
+#define SET_ZN(v) cpu->regs.status.zero_res = cpu->regs.status.neg_res = (v);
+
+// All of the flag arithmetic is straight-line: carry is bit 8 of a 16 bit
+// sum, overflow is the sign of the two operands against the result's.
+// The 2A03 has no decimal mode, so ADC/SBC are always binary.
+#define ADD(m) tmp = cpu->regs.acc + (m) + cpu->regs.status.carry; \
+               cpu->regs.status.overflow = ((~(cpu->regs.acc ^ (m)) & (cpu->regs.acc ^ tmp)) >> 7) & 0x1; \
+               cpu->regs.status.carry = tmp >> 8; \
+               cpu->regs.acc = tmp & 0xFF; \
+               SET_ZN(cpu->regs.acc)
+
+// r - m as r + ~m + 1, carry is set when there was no borrow
+#define SUB_FLAGS(r, m) tmp = (r) + ((m) ^ 0xFF) + 1; \
+                        cpu->regs.status.carry = tmp >> 8; \
+                        SET_ZN(tmp & 0xFF)
+
+#define COMPARE(r) val = RD(addr); PENALTY SUB_FLAGS(r, val)
+
+// a taken branch costs one cycle, two if it lands in another page
+#define BRANCH(cond) if (cond) \
+                     { \
+                       cpu->regs.cycles += 1 + (((cpu->regs.pc ^ addr) >> 8) & 0x1); \
+                       cpu->regs.pc = addr; \
+                     }
+
+// reads through abs,X / abs,Y / (zp),Y pay for a page crossing
+#define PENALTY cpu->regs.cycles += cross;
+
+#define ADC val = RD(addr); PENALTY ADD(val)
+#define SBC val = RD(addr) ^ 0xFF; PENALTY ADD(val)
+#define AND cpu->regs.acc &= RD(addr); PENALTY SET_ZN(cpu->regs.acc)
+#define ORA cpu->regs.acc |= RD(addr); PENALTY SET_ZN(cpu->regs.acc)
+#define EOR cpu->regs.acc ^= RD(addr); PENALTY SET_ZN(cpu->regs.acc)
+#define CMP COMPARE(cpu->regs.acc)
+#define CPX COMPARE(cpu->regs.x)
+#define CPY COMPARE(cpu->regs.y)
+
+// the one place N and Z come from different values
+#define BIT val = RD(addr); \
+            cpu->regs.status.zero_res = cpu->regs.acc & val; \
+            cpu->regs.status.overflow = (val >> 6) & 0x1; \
+            cpu->regs.status.neg_res = val;
+
+#define LDA cpu->regs.acc = RD(addr); PENALTY SET_ZN(cpu->regs.acc)
+#define LDX cpu->regs.x = RD(addr); PENALTY SET_ZN(cpu->regs.x)
+#define LDY cpu->regs.y = RD(addr); PENALTY SET_ZN(cpu->regs.y)
+#define STA WR(addr, cpu->regs.acc);
+#define STX WR(addr, cpu->regs.x);
+#define STY WR(addr, cpu->regs.y);
+
+// read-modify-write on memory
+#define INC val = RD(addr) + 1; WR(addr, val); SET_ZN(val)
+#define DEC val = RD(addr) - 1; WR(addr, val); SET_ZN(val)
+
+#define ASL val = RD(addr); \
+            cpu->regs.status.carry = val >> 7; \
+            val <<= 1; \
+            WR(addr, val); SET_ZN(val)
+#define LSR val = RD(addr); \
+            cpu->regs.status.carry = val & 0x1; \
+            val >>= 1; \
+            WR(addr, val); SET_ZN(val)
+#define ROL val = RD(addr); \
+            tmp = (val << 1) | cpu->regs.status.carry; \
+            cpu->regs.status.carry = val >> 7; \
+            val = tmp & 0xFF; \
+            WR(addr, val); SET_ZN(val)
+#define ROR val = RD(addr); \
+            tmp = (val >> 1) | (cpu->regs.status.carry << 7); \
+            cpu->regs.status.carry = val & 0x1; \
+            val = tmp & 0xFF; \
+            WR(addr, val); SET_ZN(val)
+
+// same on the accumulator
+#define ASL_A cpu->regs.status.carry = cpu->regs.acc >> 7; \
+              cpu->regs.acc <<= 1; SET_ZN(cpu->regs.acc)
+#define LSR_A cpu->regs.status.carry = cpu->regs.acc & 0x1; \
+              cpu->regs.acc >>= 1; SET_ZN(cpu->regs.acc)
+#define ROL_A tmp = (cpu->regs.acc << 1) | cpu->regs.status.carry; \
+              cpu->regs.status.carry = cpu->regs.acc >> 7; \
+              cpu->regs.acc = tmp & 0xFF; SET_ZN(cpu->regs.acc)
+#define ROR_A tmp = (cpu->regs.acc >> 1) | (cpu->regs.status.carry << 7); \
+              cpu->regs.status.carry = cpu->regs.acc & 0x1; \
+              cpu->regs.acc = tmp & 0xFF; SET_ZN(cpu->regs.acc)
+
+#define INX cpu->regs.x++; SET_ZN(cpu->regs.x)
+#define INY cpu->regs.y++; SET_ZN(cpu->regs.y)
+#define DEX cpu->regs.x--; SET_ZN(cpu->regs.x)
+#define DEY cpu->regs.y--; SET_ZN(cpu->regs.y)
+
+#define TAX cpu->regs.x = cpu->regs.acc; SET_ZN(cpu->regs.x)
+#define TAY cpu->regs.y = cpu->regs.acc; SET_ZN(cpu->regs.y)
+#define TSX cpu->regs.x = cpu->regs.sp; SET_ZN(cpu->regs.x)
+#define TXA cpu->regs.acc = cpu->regs.x; SET_ZN(cpu->regs.acc)
+#define TYA cpu->regs.acc = cpu->regs.y; SET_ZN(cpu->regs.acc)
+#define TXS cpu->regs.sp = cpu->regs.x;
+
+#define BCC BRANCH(!cpu->regs.status.carry)
+#define BCS BRANCH(cpu->regs.status.carry)
+#define BNE BRANCH(cpu->regs.status.zero_res)
+#define BEQ BRANCH(!cpu->regs.status.zero_res)
+#define BPL BRANCH(!(cpu->regs.status.neg_res & FLAG_N))
+#define BMI BRANCH(cpu->regs.status.neg_res & FLAG_N)
+#define BVC BRANCH(!cpu->regs.status.overflow)
+#define BVS BRANCH(cpu->regs.status.overflow)
+
+#define CLC cpu->regs.status.carry = 0;
+#define CLD cpu->regs.status.decimal = 0;
+#define CLI cpu->regs.status.interrupt = 0; update_irq(cpu);
+#define CLV cpu->regs.status.overflow = 0;
+#define SEC cpu->regs.status.carry = 1;
+#define SED cpu->regs.status.decimal = 1;
+#define SEI cpu->regs.status.interrupt = 1; cpu->pending &= ~INT_IRQ;
+
+#define NOP
+
+// unofficial opcodes, mostly a read-modify-write fused with an ALU op
+#define NOP_R val = RD(addr); PENALTY
+#define LAX cpu->regs.acc = cpu->regs.x = RD(addr); PENALTY SET_ZN(cpu->regs.x)
+#define SAX WR(addr, cpu->regs.acc & cpu->regs.x);
+#define DCP val = RD(addr) - 1; WR(addr, val); \
+            SUB_FLAGS(cpu->regs.acc, val)
+#define ISB val = RD(addr) + 1; WR(addr, val); \
+            val ^= 0xFF; ADD(val)
+#define SLO ASL cpu->regs.acc |= val; SET_ZN(cpu->regs.acc)
+#define RLA ROL cpu->regs.acc &= val; SET_ZN(cpu->regs.acc)
+#define SRE LSR cpu->regs.acc ^= val; SET_ZN(cpu->regs.acc)
+#define RRA ROR ADD(val)
+
+// bits 4 (B) and 5 only exist on the stack: pushed as 1 by PHP/BRK and
+// ignored when pulled
+#define PHA PUSH(cpu->regs.acc);
+#define PHP PUSH(get_proc_status(cpu) | 0x30);
+#define PLA cpu->regs.acc = PULL(); SET_ZN(cpu->regs.acc)
+#define PLP set_proc_status(cpu, PULL() & ~0x10);
+
+#define JMP cpu->regs.pc = addr;
+
+// JSR pushes the address of its own last byte, RTS adds the one back
+#define JSR tmp = cpu->regs.pc - 1; \
+            PUSH(tmp >> 8); \
+            PUSH(tmp & 0xFF); \
+            cpu->regs.pc = addr;
+#define RTS tmp = PULL(); \
+            tmp |= PULL() << 8; \
+            cpu->regs.pc = tmp + 1;
+
+// pushes pc and status, with B as given, and jumps through vector. I is set
+// so the IRQ line is ignored until the handler is done with it
+#define INTERRUPT(vector, b) PUSH(cpu->regs.pc >> 8); \
+                             PUSH(cpu->regs.pc & 0xFF); \
+                             PUSH((get_proc_status(cpu) & ~0x10) | 0x20 | (b)); \
+                             cpu->regs.status.interrupt = 1; \
+                             cpu->pending &= ~INT_IRQ; \
+                             cpu->regs.pc = RD(vector) | (RD((vector) + 1) << 8);
+
+// taken between instructions instead of the next one, highest priority first
+#define TAKE_INTERRUPT if (cpu->pending & INT_RESET) \
+                         reset_sequence(cpu); \
+                       else \
+                       { \
+                         if (cpu->pending & INT_NMI) \
+                         { \
+                           cpu->pending &= ~INT_NMI; \
+                           INTERRUPT(0xFFFA, 0) \
+                         } \
+                         else \
+                         { \
+                           INTERRUPT(0xFFFE, 0) \
+                         } \
+                         cpu->regs.cycles += 7; \
+                       }
+
+// BRK skips a padding byte and takes the IRQ vector with B set on the stack
+#define BRK cpu->regs.pc++; \
+            INTERRUPT(0xFFFE, FLAG_B)
+#define RTI set_proc_status(cpu, PULL() & ~0x10); \
+            tmp = PULL(); \
+            tmp |= PULL() << 8; \
+            cpu->regs.pc = tmp;
+
+
+////////////////
+// dispatcher //
+////////////////
 
 
-void opcode_adc()
+/**
+ * Executes one instruction. The addressing mode and operation of each opcode
+ * are expanded inline into one handler, so an instruction costs a single
+ * indirect jump, and operands only ever live in locals.
+ *
+ * returns: false if the opcode is not implemented
+ */
+bool cpu_step(struct cpu_t* cpu)
 {
-  // adjust the ACC register and set carry flag
-  if ((regs.acc + regs.status.carry + regs.tl) > 0xff)
+  uint16_t addr; // effective address
+  uint16_t tmp;
+  uint8_t  val;
+  uint8_t  cross = 0; // page crossed by indexing
+
+  // an interrupt raised during the last instruction is taken before the next
+  if (cpu->pending)
   {
-    regs.acc += regs.status.carry + regs.tl;
-    regs.status.carry = 1;
+    TAKE_INTERRUPT
+    return true;
   }
-  else
+
+  // fetch - next opcode from memory
+  cpu->regs.ir = RD(cpu->regs.pc);
+  if (LOG_LEVEL >= LOG_TRACE)
+    print_regs(cpu);
+  TRACE_INSN(cpu->regs.pc, cpu->regs.ir, cpu->regs.acc, cpu->regs.x, cpu->regs.y, cpu->regs.sp, get_proc_status(cpu));
+  cpu->regs.pc++;
+
+#ifdef __GNUC__
+  // computed goto: one table of label addresses, no bounds check
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+#define OP(op, name, mode, len, cycles, exec) [op] = &&op_##op,
+  static const void* const dispatch[256] = {
+    [0 ... 255] = &&op_unknown,
+#include "cpu-6502-ops.h"
+  };
+#undef OP
+#pragma GCC diagnostic pop
+
+  goto *dispatch[cpu->regs.ir];
+
+#define OP(op, name, mode, len, cyc, exec) op_##op: { mode exec } cpu->regs.cycles += cyc; return true;
+#include "cpu-6502-ops.h"
+#undef OP
+
+op_unknown:
+#else
+  switch (cpu->regs.ir)
   {
-    regs.acc += regs.status.carry + regs.tl;
-    regs.status.carry = 0;
+#define OP(op, name, mode, len, cyc, exec) case op: { mode exec } cpu->regs.cycles += cyc; return true;
+#include "cpu-6502-ops.h"
+#undef OP
   }
+#endif
 
-  // TODO : finish
-
-  // set zero flag
-  regs.status.zero = (regs.acc==0) ? 1 : 0;
-
-  // set overflow
-
-  // set negative
-  regs.status.negative = (regs.acc & 0x80) ? 1 : 0;
-}
-
-
-void opcode_and()
-{
-  regs.acc &= regs.tl;
-
-  // set flags
-  regs.status.zero = (regs.acc==0) ? 1 : 0;
-  regs.status.negative = (regs.acc & 0x80) ? 1 : 0;
-}
-
-
-void opcode_asl()
-{// TODO : finish
-}
-
-
-void opcode_bcc()
-{// TODO : finish
-}
-
-
-void opcode_bcs()
-{// TODO : finish
-}
-
-
-void opcode_beq()
-{// TODO : finish
-}
-
-
-void opcode_bit()
-{
-  uint8_t test = mem_map[regs.tl | (regs.th << 8)] & regs.acc;
-
-  // set flags
-  regs.status.zero = (test==0) ? 1 : 0;
-  regs.status.overflow = (test & 0x40) ? 1 : 0;
-  regs.status.negative = (test & 0x80) ? 1 : 0;
-}
-
-
-void opcode_bmi()
-{// TODO : finish
-}
-
-
-void opcode_bne()
-{// TODO : finish
-}
-
-
-void opcode_bpl()
-{// TODO : finish
-}
-
-
-void opcode_brk()
-{// TODO : finish
-  regs.status.break_cmd = 1;
-}
-
-
-void opcode_bvc()
-{// TODO : finish
-}
-
-
-void opcode_bvs()
-{// TODO : finish
-}
-
-
-void opcode_clc()
-{
-  regs.status.carry = 0;
-}
-
-
-void opcode_cld()
-{
-  regs.status.decimal = 0;
-}
-
-
-void opcode_cli()
-{
-  regs.status.interrupt = 0;
-}
-
-
-void opcode_clv()
-{
-  regs.status.overflow = 0;
-}
-
-
-void opcode_cmp()
-{
-  // assumes the value from memory to compare is loaded into regs.tl
-  int8_t result;
-  if (regs.ir == 0xc9)
-    result = regs.acc - regs.tl;
-  else
-    result = regs.acc - mem_map[regs.tl | (regs.th << 8)];
-
-  // set flags
-  regs.status.carry = (result >= 0) ? 1 : 0;
-  regs.status.zero = (result == 0) ? 1 : 0;
-  regs.status.negative = (result & 0x80) ? 1 : 0;
-}
-
-
-void opcode_cpx()
-{
-  int8_t result;
-  if (regs.ir == 0xe0)
-    result = regs.x - regs.tl;
-  else
-    result = regs.x - mem_map[regs.tl | (regs.th << 8)];
-
-  // set flags
-  regs.status.carry = (result >= 0) ? 1 : 0;
-  regs.status.zero = (result == 0) ? 1 : 0;
-  regs.status.negative = (result & 0x80) ? 1 : 0;
-}
-
-
-void opcode_cpy()
-{
-  int8_t result;
-  if (regs.ir == 0xc0)
-    result = regs.y - regs.tl;
-  else
-    result = regs.y - mem_map[regs.tl | (regs.th << 8)];
-
-  // set flags
-  regs.status.carry = (result >= 0) ? 1 : 0;
-  regs.status.zero = (result == 0) ? 1 : 0;
-  regs.status.negative = (result & 0x80) ? 1 : 0;
+  log_error("unknown opcode 0x%x\n", cpu->regs.ir);
+  (void)addr; (void)tmp; (void)val; (void)cross;
+  return false;
 }
 
 
-void opcode_dec()
-{
-  uint8_t result = mem_map[regs.tl | (regs.th << 8)] - 1;
-  mem_map[regs.tl | (regs.th << 8)] = result;
+/////////////////////
+// predecode cache //
+/////////////////////
 
-  // set flags
-  regs.status.zero = (result==0) ? 1 : 0;
-  regs.status.negative = (result & 0x80) ? 1 : 0;
-}
+#define DECODE_TABLE 4096 // decoded pages, a 512KB PRG ROM fills half
 
+_Static_assert(offsetof(struct bus_t, write_page) == offsetof(struct bus_t, read_page) + BUS_PAGES * sizeof(void*),
+               "remap() compares both page tables at once");
 
-void opcode_dex()
+struct decoded_t
 {
-  regs.x--;
+  const void* handler; // label in cpu_step_cached(), NULL until decoded
+  uint16_t    operand;
+  uint8_t     op;
+  uint8_t     len;
+};
 
-  // set flags
-  regs.status.zero = (regs.x==0) ? 1 : 0;
-  regs.status.negative = (regs.x & 0x80) ? 1 : 0;
-}
-
-
-void opcode_dey()
+struct decoded_page_t
 {
-  regs.y--;
-
-  // set flags
-  regs.status.zero = (regs.y==0) ? 1 : 0;
-  regs.status.negative = (regs.y & 0x80) ? 1 : 0;
-}
-
+  const uint8_t*   host; // the memory it was decoded from
+  struct decoded_t insn[256];
+};
 
-void opcode_eor()
+struct decode_cache_t
 {
-  // if immediate value use it; otherwise read memory???? TODO THIS MAY BE BAD TO DO
-  if (regs.ir == 0x49)
-    regs.acc ^= regs.tl;
-  else
-    regs.acc ^= mem_map[regs.tl | (regs.th << 8)];
+  // decoded page of the memory mapped at each cpu page, as of map
+  struct decoded_page_t* bound[BUS_PAGES];
+  // decoded page of the memory each cpu page writes to, if any
+  struct decoded_page_t* watch[BUS_PAGES];
+  const uint8_t*         map[2*BUS_PAGES]; // read and write page tables
 
-  // set flags
-  regs.status.zero = (regs.acc==0) ? 1 : 0;
-  regs.status.negative = (regs.acc & 0x80) ? 1 : 0;
-}
+  struct decoded_page_t* table[DECODE_TABLE]; // by host address
+  unsigned               count;
+};
 
 
-void opcode_inc()
+struct decode_cache_t* decode_cache_create()
 {
-  uint8_t result = mem_map[regs.tl | (regs.th << 8)] + 1;
-  mem_map[regs.tl | (regs.th << 8)] = result;
-
-  // set flags
-  regs.status.zero = (result==0) ? 1 : 0;
-  regs.status.negative = (result & 0x80) ? 1 : 0;
+  return calloc(1, sizeof(struct decode_cache_t));
 }
 
-
-void opcode_inx()
+void decode_cache_flush(struct decode_cache_t* cache)
 {
-  regs.x++;
-
-  // set flags
-  regs.status.zero = (regs.x==0) ? 1 : 0;
-  regs.status.negative = (regs.x & 0x80) ? 1 : 0;
+  for (int i=0; i<DECODE_TABLE; i++)
+    free(cache->table[i]);
+  memset(cache, 0, sizeof(*cache));
 }
 
-
-void opcode_iny()
+void decode_cache_destroy(struct decode_cache_t* cache)
 {
-  regs.y++;
-
-  // set flags
-  regs.status.zero = (regs.y==0) ? 1 : 0;
-  regs.status.negative = (regs.y & 0x80) ? 1 : 0;
+  if (cache == NULL)
+    return;
+  decode_cache_flush(cache);
+  free(cache);
 }
 
-
-void opcode_jmp()
+static struct decoded_page_t** find_page(struct decode_cache_t* cache, const uint8_t* host)
 {
-  // TODO : finish
-  regs.pc = (regs.th << 8) | regs.tl;
-}
-
-
-void opcode_jsr()
-{// TODO : finish
-
-  // push address onto stack
-  //
+  uint32_t h = (uint32_t)(((uintptr_t)host >> 8) * 0x9E3779B1u) % DECODE_TABLE;
 
-  // set program counter
-  //
+  while (cache->table[h] && (cache->table[h]->host != host))
+    h = (h + 1) % DECODE_TABLE;
+  return &cache->table[h];
 }
 
-
-void opcode_lda()
-{
-  if (regs.ir == 0xa9)
-    regs.acc = regs.tl;
-  else
-    regs.acc = mem_map[regs.tl | (regs.th << 8)];
-
-  // set flags
-  regs.status.zero = (regs.acc==0) ? 1 : 0;
-  regs.status.negative = (regs.acc & 0x80) ? 1 : 0;
-}
-
-
-void opcode_ldx()
+/**
+ * The memory map changed (bank switch): pages mapped elsewhere now are
+ * rebound the next time they run.
+ */
+static void remap(struct decode_cache_t* cache, const struct bus_t* bus)
 {
-  if (regs.ir == 0xa2)
-    regs.x = regs.tl;
-  else
-    regs.x = mem_map[regs.tl | (regs.th << 8)];
+  if (!memcmp(cache->map, bus->read_page, sizeof(cache->map)))
+    return;
 
-  // set flags
-  regs.status.zero = (regs.x==0) ? 1 : 0;
-  regs.status.negative = (regs.x & 0x80) ? 1 : 0;
+  for (int p=0; p<BUS_PAGES; p++)
+  {
+    if (cache->map[p] != bus->read_page[p])
+      cache->bound[p] = NULL;
+    cache->watch[p] = bus->write_page[p] ? *find_page(cache, bus->write_page[p]) : NULL;
+  }
+  memcpy(cache->map, bus->read_page, sizeof(cache->map));
 }
 
-
-void opcode_ldy()
+/**
+ * returns: the decoded page for the memory at cpu page p, NULL for I/O
+ */
+static struct decoded_page_t* bind(struct decode_cache_t* cache, const struct bus_t* bus, int p)
 {
-  if (regs.ir == 0xa0)
-    regs.y = regs.tl;
-  else
-    regs.y = mem_map[regs.tl | (regs.th << 8)];
+  const uint8_t* host = bus->read_page[p];
+  if (host == NULL)
+    return NULL;
 
-  // set flags
-  regs.status.zero = (regs.y==0) ? 1 : 0;
-  regs.status.negative = (regs.y & 0x80) ? 1 : 0;
+  struct decoded_page_t** slot = find_page(cache, host);
+  if (*slot == NULL)
+  {
+    if (cache->count >= DECODE_TABLE * 3 / 4)
+    {
+      decode_cache_flush(cache);
+      remap(cache, bus);
+      slot = find_page(cache, host);
+    }
+    *slot = calloc(1, sizeof(struct decoded_page_t));
+    (*slot)->host = host;
+    cache->count++;
+    // RAM: writes to it have to drop what was decoded
+    for (int q=0; q<BUS_PAGES; q++)
+      if (bus->write_page[q] == host)
+        cache->watch[q] = *slot;
+  }
+  cache->bound[p] = *slot;
+  return *slot;
 }
 
-
-void opcode_lsr()
+/**
+ * Every write goes through here. One to decoded memory drops the
+ * instructions that could contain the byte, one to I/O may have been a bank
+ * switch.
+ */
+static inline void cached_write(struct cpu_t* cpu, struct decode_cache_t* cache, uint16_t addr, uint8_t value)
 {
-  if (regs.ir == 0x4a)
+  uint8_t* page = cpu->bus->write_page[addr >> 8];
+  if (page)
   {
-    regs.status.carry = regs.acc & 0x1;
-    regs.acc = ((regs.acc >> 1) & 0x7f);
-
-    // set flags
-    regs.status.zero = (regs.acc == 0) ? 1 : 0;
-    regs.status.negative = (regs.acc & 0x80) ? 1 : 0;
+    struct decoded_page_t* decoded = cache->watch[addr >> 8];
+    page[addr & 0xFF] = value;
+    if (decoded)
+    {
+      for (int lo = (addr & 0xFF) - 2; lo <= (addr & 0xFF); lo++)
+        if (lo >= 0)
+          decoded->insn[lo].handler = NULL;
+    }
   }
   else
   {
-    uint16_t addr = regs.tl | (regs.th << 8);
-    regs.status.carry = mem_map[addr] & 0x1;
-    mem_map[addr] = (mem_map[addr] >> 1) & 0x7f;
-
-    // set flags
-    regs.status.zero = (mem_map[addr] == 0) ? 1 : 0;
-    regs.status.negative = (mem_map[addr] & 0x80) ? 1 : 0;
+    cpu->bus->write_fn[addr >> 8](cpu->bus->write_ctx[addr >> 8], addr, value);
+    remap(cache, cpu->bus);
   }
 }
 
+// The addressing modes once more, for operands that were fetched when the
+// instruction was decoded: pc is already past the instruction and the
+// operand is in 'opnd'.
+#define D_IMP
+#define D_IMM addr = cpu->regs.pc - 1;
+#define D_ZP  addr = opnd;
+#define D_ZPX addr = (opnd + cpu->regs.x) & 0xFF;
+#define D_ZPY addr = (opnd + cpu->regs.y) & 0xFF;
+#define D_ABS addr = opnd;
+#define D_ABX tmp = opnd; \
+              addr = tmp + cpu->regs.x; \
+              cross = ((tmp ^ addr) >> 8) & 0x1;
+#define D_ABY tmp = opnd; \
+              addr = tmp + cpu->regs.y; \
+              cross = ((tmp ^ addr) >> 8) & 0x1;
+#define D_IND addr = RD(opnd) | (RD((opnd & 0xFF00) | ((opnd+1) & 0x00FF)) << 8);
+#define D_IZX tmp = (opnd + cpu->regs.x) & 0xFF; \
+              addr = RD(tmp) | (RD((tmp+1) & 0xFF) << 8);
+#define D_IZY tmp = RD(opnd) | (RD((opnd+1) & 0xFF) << 8); \
+              addr = tmp + cpu->regs.y; \
+              cross = ((tmp ^ addr) >> 8) & 0x1;
+#define D_REL addr = cpu->regs.pc + (int8_t)opnd;
+
+#undef WR
+#define WR(a, v) cached_write(cpu, cache, (a), (v))
 
-void opcode_nop()
-{
-}
-
-
-void opcode_ora()
-{
-  if (regs.ir == 0x09)
-    regs.acc |= regs.tl;
-  else
-    regs.acc |= mem_map[regs.tl | (regs.th << 8)];
-
-  // set flags
-  regs.status.zero = (regs.acc==0) ? 1 : 0;
-  regs.status.negative = (regs.acc & 0x80) ? 1 : 0;
-}
-
-
-void opcode_pha()
-{
-  // push onto stack; decrement
-  mem_map[regs.sp] = regs.acc;
-  regs.sp--;
-}
-
-
-void opcode_php()
-{
-  // push onto stack; decrement
-  mem_map[regs.sp] = get_proc_status();
-  regs.sp--;
-}
-
-
-void opcode_pla()
-{
-  // increment sp; then grab value
-  regs.sp++;
-  regs.acc = mem_map[regs.sp];
-
-  // set flags
-  regs.status.zero = (regs.acc==0) ? 1 : 0;
-  regs.status.negative = (regs.acc & 0x80) ? 1 : 0;
-}
-
-
-void opcode_plp()
-{
-  // increment sp; then grab value
-  regs.sp++;
-  set_proc_status(mem_map[regs.sp]);
-}
-
-
-// void opcode_rol(uint8_t op, uint8_t v1, uint8_t v2)
-// {// TODO : finish
-// }
-
-
-// void opcode_ror(uint8_t op, uint8_t v1, uint8_t v2)
-// {// TODO : finish
-// }
-
-
-// void opcode_rti(uint8_t op, uint8_t v1, uint8_t v2)
-// {// TODO : finish
-// }
-
-
-// void opcode_rts(uint8_t op, uint8_t v1, uint8_t v2)
-// {// TODO : finish
-// }
-
-
-void opcode_sbc()
-{// TODO finish
-  uint8_t m = mem_map[(regs.th << 8) | regs.tl];
-  int16_t result = regs.acc - m - (1-regs.status.carry);
-
-  // set flags
-  regs.status.carry = (result & 0x100) ? 1 : 0; // set flag if the value > 0xff
-  regs.status.zero = (regs.x==0) ? 1 : 0;
-  regs.status.overflow = 0;
-  regs.status.negative = (regs.x & 0x80) ? 1 : 0;
-}
-
-
-void opcode_sec()
-{
-  regs.status.carry = 1;
-}
-
-
-void opcode_sed()
-{
-  regs.status.decimal = 1;
-}
+/**
+ * cpu_step() through the predecode cache: the handler and operand come from
+ * the decoded page, so the common case reads no code from the bus. An
+ * instruction that straddles two pages, or runs from I/O space, is fetched
+ * from the bus each time but still runs through here so its writes are
+ * seen.
+ *
+ * returns: false if the opcode is not implemented
+ */
+bool cpu_step_cached(struct cpu_t* cpu, struct decode_cache_t* cache)
+{
+#ifndef __GNUC__
+  // the handlers are label addresses, without them the cache goes unused
+  return cpu_step(cpu);
+#else
+  uint16_t addr; // effective address
+  uint16_t tmp;
+  uint8_t  val;
+  uint8_t  cross = 0; // page crossed by indexing
+  uint16_t opnd;
+  uint8_t  len;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+#define OP(op, name, mode, len, cycles, exec) [op] = &&dop_##op,
+  static const void* const dispatch[256] = {
+    [0 ... 255] = &&unknown,
+#include "cpu-6502-ops.h"
+  };
+#undef OP
+#pragma GCC diagnostic pop
+
+  if (cpu->pending)
+  {
+    TAKE_INTERRUPT
+    return true;
+  }
 
+  uint16_t pc = cpu->regs.pc;
+  struct decoded_page_t* page = cache->bound[pc >> 8];
+  if (page == NULL)
+    page = bind(cache, cpu->bus, pc >> 8);
+  if (page == NULL)
+    goto fetch;
 
-void opcode_sei()
-{
-  regs.status.interrupt = 1;
-}
+  struct decoded_t* d = &page->insn[pc & 0xFF];
+  if (d->handler == NULL)
+  {
+    uint8_t lo = pc & 0xFF;
+    d->op = page->host[lo];
+    d->len = opcode_len[d->op];
+    d->operand = 0;
+    if ((d->len > 1) && (lo + d->len <= 256))
+      d->operand = page->host[lo+1] | ((d->len > 2) ? page->host[lo+2] << 8 : 0);
+    // the operand of a straddling instruction is in another page
+    if ((d->len == 0) || (lo + d->len > 256))
+    {
+      d->handler = &&fetch;
+      d->len = 0;
+    }
+    else
+      d->handler = dispatch[d->op];
+  }
 
+  opnd = d->operand;
+  len = d->len;
+  cpu->regs.ir = d->op;
+  if (len) // straddling ones are traced in fetch
+  {
+    if (LOG_LEVEL >= LOG_TRACE)
+      print_regs(cpu);
+    TRACE_INSN(pc, cpu->regs.ir, cpu->regs.acc, cpu->regs.x, cpu->regs.y, cpu->regs.sp, get_proc_status(cpu));
+  }
+  cpu->regs.pc += len;
+  goto *d->handler;
 
-void opcode_sta()
-{
-  mem_map[(regs.th << 8) | regs.tl] = regs.acc;
-}
+fetch:
+  cpu->regs.ir = RD(pc);
+  len = opcode_len[cpu->regs.ir];
+  if (len == 0)
+    goto unknown;
+  opnd = (len > 1) ? RD(pc+1) | ((len > 2) ? RD(pc+2) << 8 : 0) : 0;
+  if (LOG_LEVEL >= LOG_TRACE)
+    print_regs(cpu);
+  TRACE_INSN(pc, cpu->regs.ir, cpu->regs.acc, cpu->regs.x, cpu->regs.y, cpu->regs.sp, get_proc_status(cpu));
+  cpu->regs.pc += len;
+  goto *dispatch[cpu->regs.ir];
 
+#define OP(op, name, mode, len, cyc, exec) dop_##op: { D_##mode exec } cpu->regs.cycles += cyc; return true;
+#include "cpu-6502-ops.h"
+#undef OP
 
-void opcode_stx()
-{
-  mem_map[(regs.th << 8) | regs.tl] = regs.x;
+unknown:
+  log_error("unknown opcode 0x%x\n", cpu->regs.ir);
+  cpu->regs.pc++;
+  (void)addr; (void)tmp; (void)val; (void)cross;
+  return false;
+#endif
 }
 
+#undef WR
+#define WR(a, v) bus_write(cpu->bus, (a), (v))
 
-void opcode_sty()
-{
-  mem_map[(regs.th << 8) | regs.tl] = regs.y;
-}
 
-
-void opcode_tax()
+void cpu_nmi(struct cpu_t* cpu)
 {
-  regs.x = regs.acc;
-
-  // set flags
-  regs.status.zero = (regs.x==0) ? 1 : 0;
-  regs.status.negative = (regs.x & 0x80) ? 1 : 0;
+  cpu->pending |= INT_NMI;
 }
 
 
-void opcode_txa()
+void cpu_irq(struct cpu_t* cpu, uint8_t source, bool level)
 {
-  regs.acc = regs.x;
-
-  // set flags
-  regs.status.zero = (regs.acc==0) ? 1 : 0;
-  regs.status.negative = (regs.acc & 0x80) ? 1 : 0;
+  if (level)
+    cpu->irq_lines |= source;
+  else
+    cpu->irq_lines &= ~source;
+  update_irq(cpu);
 }
 
 
-void opcode_tay()
+void cpu_soft_reset(struct cpu_t* cpu)
 {
-  regs.y = regs.acc;
-
-  // set flags
-  regs.status.zero = (regs.y==0) ? 1 : 0;
-  regs.status.negative = (regs.y & 0x80) ? 1 : 0;
+  cpu->pending |= INT_RESET;
 }
 
 
-void opcode_tya()
+/**
+ * runs until the cpu hits an opcode it can't execute
+ */
+void cpu_run(struct cpu_t* cpu)
 {
-  regs.acc = regs.y;
-
-  // set flags
-  regs.status.zero = (regs.acc==0) ? 1 : 0;
-  regs.status.negative = (regs.acc & 0x80) ? 1 : 0;
+  while (cpu_step(cpu))
+  {
+  }
 }
 
 
-void opcode_tsx()
+/**
+ * Runs whole instructions until at least ncycles cycles have passed, so the
+ * caller can then catch the PPU/APU up to regs.cycles in one go. Overshoots by
+ * at most one instruction; stops early on an opcode it can't execute.
+ *
+ * returns: the number of cycles actually executed
+ */
+uint32_t cpu_run_cycles(struct cpu_t* cpu, uint32_t ncycles)
 {
-  regs.x = regs.sp;
-
-  // set flags
-  regs.status.zero = (regs.x==0) ? 1 : 0;
-  regs.status.negative = (regs.x & 0x80) ? 1 : 0;
-}
+  uint64_t start = cpu->regs.cycles;
+  uint64_t end = start + ncycles;
 
+  while (cpu->regs.cycles < end)
+  {
+    if (!cpu_step(cpu))
+      break;
+  }
 
-void opcode_txs()
-{ // S = X
-  regs.sp = regs.x;
+  return cpu->regs.cycles - start;
 }
 
 
-#define OPCODE(op, name, len, cycles, exec, decode) opcode_name[op] = name; \
-                                                    opcode_len[op] = len; \
-                                                    opcode_cycles[op] = cycles; \
-                                                    exec_handler[op] = exec; \
-                                                    decode_handler[op] = decode;
-
-void cpu_init()
+void cpu_init(struct cpu_t* cpu, struct bus_t* bus)
 {
-  // zero out stuff
-  memset(opcode_name, 0, 256);
-  memset(opcode_cycles, 0, 256);
-  memset(opcode_len, 0, 256);
-  memset(decode_handler, 0, sizeof(void*) * 256);
-  memset(exec_handler, 0, sizeof(void*) * 256);
-
-  OPCODE(0x69, "adc", 2, 2, opcode_adc, addrmode_immediate)
-  OPCODE(0x65, "adc", 2, 3, opcode_adc, addrmode_zero_page)
-  OPCODE(0x75, "adc", 2, 4, opcode_adc, addrmode_zero_page_x)
-  OPCODE(0x6D, "adc", 3, 4, opcode_adc, addrmode_abs)
-  OPCODE(0x7D, "adc", 3, 4, opcode_adc, addrmode_abs_x)
-  OPCODE(0x79, "adc", 3, 4, opcode_adc, addrmode_abs_y)
-  OPCODE(0x61, "adc", 2, 6, opcode_adc, addrmode_indexed_indirect_x)
-  OPCODE(0x71, "adc", 2, 5, opcode_adc, addrmode_indirect_indexed_y)
-
-  OPCODE(0x29, "and", 2, 2, opcode_and, addrmode_immediate)
-  OPCODE(0x25, "and", 2, 3, opcode_and, addrmode_zero_page)
-  OPCODE(0x35, "and", 2, 4, opcode_and, addrmode_zero_page_x)
-  OPCODE(0x2d, "and", 3, 4, opcode_and, addrmode_abs)
-  OPCODE(0x3d, "and", 3, 4, opcode_and, addrmode_abs_x)
-  OPCODE(0x39, "and", 3, 4, opcode_and, addrmode_abs_y)
-  OPCODE(0x21, "and", 2, 6, opcode_and, addrmode_indexed_indirect_x)
-  OPCODE(0x31, "and", 2, 5, opcode_and, addrmode_indirect_indexed_y)
-
-  // OPCODE(0x0a, "asl", 1, 2, opcode_asl)
-  // OPCODE(0x06, "asl", 2, 5, opcode_asl)
-  // OPCODE(0x16, "asl", 2, 6, opcode_asl)
-  // OPCODE(0x0e, "asl", 3, 6, opcode_asl)
-  // OPCODE(0x1e, "asl", 3, 7, opcode_asl)
-
-  // OPCODE(0x90, "bcc", 2, 2, opcode_bcc)
-
-  // OPCODE(0xb0, "bcs", 2, 2, opcode_bcs)
-
-  // OPCODE(0xf0, "beq", 2, 2, opcode_beq)
-
-  OPCODE(0x24, "bit", 2, 3, opcode_bit, addrmode_zero_page)
-  OPCODE(0x2c, "bit", 3, 4, opcode_bit, addrmode_abs)
-
-  // OPCODE(0x30, "bmi", 2, 2, opcode_bmi)
-
-  // OPCODE(0xd0, "bne", 2, 2, opcode_bne)
-
-  // OPCODE(0x10, "bpl", 2, 2, opcode_bpl)
-
-  OPCODE(0x00, "brk", 1, 7, opcode_brk, NULL)
-
-  // OPCODE(0x50, "bvc", 2, 2, opcode_bvc)
-
-  // OPCODE(0x70, "bvs", 2, 2, opcode_bvs)
-
-  OPCODE(0x18, "clc", 1, 2, opcode_clc, NULL)
-
-  OPCODE(0xd8, "cld", 1, 2, opcode_cld, NULL)
-
-  OPCODE(0x58, "cli", 1, 2, opcode_cli, NULL)
-
-  OPCODE(0xb8, "clv", 1, 2, opcode_clv, NULL)
-
-  OPCODE(0xc9, "cmp", 2, 2, opcode_cmp, addrmode_immediate)
-  OPCODE(0xc5, "cmp", 2, 3, opcode_cmp, addrmode_zero_page)
-  OPCODE(0xd5, "cmp", 2, 4, opcode_cmp, addrmode_zero_page_x)
-  OPCODE(0xcd, "cmp", 3, 4, opcode_cmp, addrmode_abs)
-  OPCODE(0xdd, "cmp", 3, 4, opcode_cmp, addrmode_abs_x)
-  OPCODE(0xd9, "cmp", 3, 4, opcode_cmp, addrmode_abs_y)
-  OPCODE(0xc1, "cmp", 2, 6, opcode_cmp, addrmode_indexed_indirect_x)
-  OPCODE(0xd1, "cmp", 2, 5, opcode_cmp, addrmode_indirect_indexed_y)
-
-  OPCODE(0xe0, "cpx", 2, 2, opcode_cpx, addrmode_immediate)
-  OPCODE(0xe4, "cpx", 2, 3, opcode_cpx, addrmode_zero_page)
-  OPCODE(0xec, "cpx", 3, 4, opcode_cpx, addrmode_abs)
-
-  OPCODE(0xc0, "cpy", 2, 2, opcode_cpy, addrmode_immediate)
-  OPCODE(0xc4, "cpy", 2, 3, opcode_cpy, addrmode_zero_page)
-  OPCODE(0xcc, "cpy", 3, 4, opcode_cpy, addrmode_abs)
-  
-  OPCODE(0xc6, "dec", 2, 5, opcode_dec, addrmode_zero_page)
-  OPCODE(0xd6, "dec", 2, 6, opcode_dec, addrmode_zero_page_x)
-  OPCODE(0xce, "dec", 3, 6, opcode_dec, addrmode_abs)
-  OPCODE(0xde, "dec", 3, 7, opcode_dec, addrmode_abs_x)
-
-  OPCODE(0xca, "dex", 1, 2, opcode_dex, NULL)
-  
-  OPCODE(0x88, "dey", 1, 2, opcode_dey, NULL)
-
-  OPCODE(0x49, "eor", 2, 2, opcode_eor, addrmode_immediate)
-  OPCODE(0x45, "eor", 2, 3, opcode_eor, addrmode_zero_page)
-  OPCODE(0x55, "eor", 2, 4, opcode_eor, addrmode_zero_page_x)
-  OPCODE(0x4d, "eor", 3, 4, opcode_eor, addrmode_abs)
-  OPCODE(0x5d, "eor", 3, 4, opcode_eor, addrmode_abs_x)
-  OPCODE(0x59, "eor", 3, 4, opcode_eor, addrmode_abs_y)
-  OPCODE(0x41, "eor", 2, 6, opcode_eor, addrmode_indexed_indirect_x)
-  OPCODE(0x51, "eor", 2, 5, opcode_eor, addrmode_indirect_indexed_y)
-
-  OPCODE(0xe6, "inc", 2, 5, opcode_inc, addrmode_zero_page)
-  OPCODE(0xf6, "inc", 2, 6, opcode_inc, addrmode_zero_page_x)
-  OPCODE(0xee, "inc", 3, 6, opcode_inc, addrmode_abs)
-  OPCODE(0xfe, "inc", 3, 7, opcode_inc, addrmode_abs_x)
-
-  OPCODE(0xe8, "inx", 1, 2, opcode_inx, NULL)
-  OPCODE(0xc8, "iny", 1, 2, opcode_iny, NULL)
-
-  OPCODE(0x4c, "jmp", 3, 3, opcode_jmp, addrmode_abs)
-  OPCODE(0x6c, "jmp", 3, 5, opcode_jmp, addrmode_indirect)
-
-  // OPCODE(0x20, "jsr", 3, 6, opcode_jsr)
-
-  OPCODE(0xa9, "lda", 2, 2, opcode_lda, addrmode_immediate)
-  OPCODE(0xa5, "lda", 2, 3, opcode_lda, addrmode_zero_page)
-  OPCODE(0xb5, "lda", 2, 4, opcode_lda, addrmode_zero_page_x)
-  OPCODE(0xad, "lda", 3, 4, opcode_lda, addrmode_abs)
-  OPCODE(0xbd, "lda", 3, 4, opcode_lda, addrmode_abs_x)
-  OPCODE(0xb9, "lda", 3, 4, opcode_lda, addrmode_abs_y)
-  OPCODE(0xa1, "lda", 2, 6, opcode_lda, addrmode_indexed_indirect_x)
-  OPCODE(0xb1, "lda", 2, 5, opcode_lda, addrmode_indirect_indexed_y)
-
-  OPCODE(0xa2, "ldx", 2, 2, opcode_ldx, addrmode_immediate)
-  OPCODE(0xa6, "ldx", 2, 3, opcode_ldx, addrmode_zero_page)
-  OPCODE(0xb6, "ldx", 2, 4, opcode_ldx, addrmode_zero_page_y)
-  OPCODE(0xae, "ldx", 3, 4, opcode_ldx, addrmode_abs)
-  OPCODE(0xbe, "ldx", 3, 4, opcode_ldx, addrmode_abs_y)
-
-  OPCODE(0xa0, "ldy", 2, 2, opcode_ldy, addrmode_immediate)
-  OPCODE(0xa4, "ldy", 2, 3, opcode_ldy, addrmode_zero_page)
-  OPCODE(0xb4, "ldy", 2, 4, opcode_ldy, addrmode_zero_page_x)
-  OPCODE(0xac, "ldy", 3, 4, opcode_ldy, addrmode_abs)
-  OPCODE(0xbc, "ldy", 3, 4, opcode_ldy, addrmode_abs_x)
-
-  OPCODE(0x4a, "lsr", 1, 2, opcode_lsr, NULL)
-  OPCODE(0x46, "lsr", 2, 5, opcode_lsr, addrmode_zero_page)
-  OPCODE(0x56, "lsr", 2, 6, opcode_lsr, addrmode_zero_page_x)
-  OPCODE(0x4e, "lsr", 3, 6, opcode_lsr, addrmode_abs)
-  OPCODE(0x5e, "lsr", 3, 7, opcode_lsr, addrmode_abs_x)
-
-  OPCODE(0xea, "nop", 1, 2, opcode_nop, NULL)
-
-  OPCODE(0x09, "ora", 2, 2, opcode_ora, addrmode_immediate)
-  OPCODE(0x05, "ora", 2, 3, opcode_ora, addrmode_zero_page)
-  OPCODE(0x15, "ora", 2, 4, opcode_ora, addrmode_zero_page_x)
-  OPCODE(0x0d, "ora", 3, 4, opcode_ora, addrmode_abs)
-  OPCODE(0x1d, "ora", 3, 4, opcode_ora, addrmode_abs_x)
-  OPCODE(0x19, "ora", 3, 4, opcode_ora, addrmode_abs_y)
-  OPCODE(0x01, "ora", 2, 6, opcode_ora, addrmode_indexed_indirect_x)
-  OPCODE(0x11, "ora", 2, 5, opcode_ora, addrmode_indirect_indexed_y)
-
-  OPCODE(0x48, "pha", 1, 3, opcode_pha, NULL)
-  OPCODE(0x08, "php", 1, 3, opcode_php, NULL)
-  OPCODE(0x68, "pla", 1, 4, opcode_pla, NULL)
-  OPCODE(0x28, "plp", 1, 4, opcode_plp, NULL)
-
-  // OPCODE(0x2a, "rol", 1, 2, opcode_rol)
-  // OPCODE(0x26, "rol", 2, 5, opcode_rol)
-  // OPCODE(0x36, "rol", 2, 6, opcode_rol)
-  // OPCODE(0x2e, "rol", 3, 6, opcode_rol)
-  // OPCODE(0x3e, "rol", 3, 7, opcode_rol)
-
-  // OPCODE(0x6a, "ror", 1, 2, opcode_ror)
-  // OPCODE(0x66, "ror", 2, 5, opcode_ror)
-  // OPCODE(0x76, "ror", 2, 6, opcode_ror)
-  // OPCODE(0x6e, "ror", 3, 6, opcode_ror)
-  // OPCODE(0x7e, "ror", 3, 7, opcode_ror)
-
-  // OPCODE(0x40, "rti", 1, 6, opcode_rti)
-
-  // OPCODE(0x60, "rts", 1, 6, opcode_rts)
-
-  // OPCODE(0xe9, "sbc", 2, 2, opcode_sbc)
-  // OPCODE(0xe5, "sbc", 2, 3, opcode_sbc)
-  // OPCODE(0xf5, "sbc", 2, 4, opcode_sbc)
-  // OPCODE(0xed, "sbc", 3, 4, opcode_sbc)
-  // OPCODE(0xfd, "sbc", 3, 4, opcode_sbc)
-  // OPCODE(0xf9, "sbc", 3, 4, opcode_sbc)
-  // OPCODE(0xe1, "sbc", 2, 6, opcode_sbc)
-  // OPCODE(0xf1, "sbc", 2, 5, opcode_sbc)
-
-  OPCODE(0x38, "sec", 1, 2, opcode_sec, NULL)
-
-  OPCODE(0xf8, "sed", 1, 2, opcode_sed, NULL)
-
-  OPCODE(0x78, "sei", 1, 2, opcode_sei, NULL)
-
-  OPCODE(0x85, "sta", 2, 3, opcode_sta, addrmode_zero_page)
-  OPCODE(0x95, "sta", 2, 4, opcode_sta, addrmode_zero_page_x)
-  OPCODE(0x8d, "sta", 3, 4, opcode_sta, addrmode_abs)
-  OPCODE(0x9d, "sta", 3, 5, opcode_sta, addrmode_abs_x)
-  OPCODE(0x99, "sta", 3, 5, opcode_sta, addrmode_abs_y)
-  OPCODE(0x81, "sta", 2, 6, opcode_sta, addrmode_indexed_indirect_x)
-  OPCODE(0x91, "sta", 2, 6, opcode_sta, addrmode_indirect_indexed_y)
-
-  OPCODE(0x86, "stx", 2, 3, opcode_stx, addrmode_zero_page)
-  OPCODE(0x96, "stx", 2, 4, opcode_stx, addrmode_zero_page_y)
-  OPCODE(0x8e, "stx", 3, 4, opcode_stx, addrmode_abs)
-
-  OPCODE(0x84, "sty", 2, 3, opcode_sty, addrmode_zero_page)
-  OPCODE(0x94, "sty", 2, 4, opcode_sty, addrmode_zero_page_x)
-  OPCODE(0x8c, "sty", 3, 4, opcode_sty, addrmode_abs)
-
-  OPCODE(0xaa, "tax", 1, 2, opcode_tax, NULL)
-  OPCODE(0x8a, "txa", 1, 2, opcode_txa, NULL)
-
-  OPCODE(0xa8, "tay", 1, 2, opcode_tay, NULL)
-  OPCODE(0x98, "tya", 1, 2, opcode_tya, NULL)
-
-  OPCODE(0xba, "tsx", 1, 2, opcode_tsx, NULL)
-  OPCODE(0x9a, "txs", 1, 2, opcode_txs, NULL)
+  // opcode tables are static, just start from a clean register file
+  memset(cpu, 0, sizeof(*cpu));
+  cpu->bus = bus;
 }
 
 
 /**
- * load PRG ROM into memory at 0x8000. if there is only one page, then load 
- * at both 0x8000 and 0xc000; otherwise load two pages worth.
+ * map PRG ROM at 0x8000. if there is only one page, it is mirrored at 0xc000;
+ * otherwise the first two pages are mapped. the ROM is not copied, so prg
+ * must stay valid while it is mapped.
  */
-void cpu_load_prg(const uint8_t* prg, uint8_t numblk)
+void cpu_load_prg(struct cpu_t* cpu, const uint8_t* prg, uint8_t numblk)
 {
-  if (numblk == 1)
-  {
-    printf("memcpy 1 block to 0x8000 and 0xC000\n");
-    memcpy(&(mem_map[0x8000]), prg, MEM_16KB);
-    memcpy(&(mem_map[0xC000]), prg, MEM_16KB);
-  }
-  else
-  {
-    printf("memcpy 2 blocks\n");
-    memcpy(&mem_map[0x8000], prg, 2*MEM_16KB);
-  }
+  size_t size = (numblk == 1) ? MEM_16KB : 2*MEM_16KB;
+
+  log_debug("map %u block(s) at 0x8000\n", numblk);
+  bus_map_io(cpu->bus, 0x80, 0x80, NULL, NULL, NULL);
+  bus_map_read(cpu->bus, 0x80, 0x80, prg, size);
 }
 
 
-/*
- * reset will set pc to 0xfffc and 0xfffd
- */
-void cpu_reset()
+void cpu_reset(struct cpu_t* cpu)
 {
-  regs.pc = (mem_map[0xfffd]<<8) | mem_map[0xfffc];
-  printf("reset pc=0x%x\n\n", regs.pc);
-
-  // TODO
+  reset_sequence(cpu);
+  log_info("reset pc=0x%x\n\n", cpu->regs.pc);
 }
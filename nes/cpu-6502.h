@@ -7,16 +7,19 @@ typedef uint8_t bool;
 #define true 1
 #define false 0
 
-// processor status flags
+// Processor status, kept in the form the ALU produces it so opcodes don't
+// branch on their results. N and Z are not flags but the value they were
+// last set from (almost always the same byte), the full register is only
+// put together by get_proc_status() when it is pushed or inspected.
 struct proc_status_t
 {
-  uint8_t  carry;
-  uint8_t  zero;
+  uint8_t  carry;     // 0 or 1
+  uint8_t  zero_res;  // Z is set when this is 0
+  uint8_t  neg_res;   // N is bit 7 of this
   uint8_t  interrupt;
   uint8_t  decimal;
   uint8_t  break_cmd;
-  uint8_t  overflow;
-  uint8_t  negative;
+  uint8_t  overflow;  // 0 or 1
 };
 
 // program accessable registers
@@ -29,30 +32,126 @@ struct proc_regs_t
   uint8_t  y;
   struct proc_status_t status;
   uint8_t  ir; // instruction register
-  /// registers to temporarily hold addresses. holds address during decode step for all non immediate address mode
-  uint8_t  tl;
-  uint8_t  th;
-  // input data latch register
-  uint8_t idl;
+  uint64_t cycles; // cpu cycles executed since power on
 };
 
-// locals
-struct proc_regs_t  regs;
-uint8_t             mem_map[0x10000];
+struct bus_t;
 
-uint8_t get_proc_status();
+// A 6502 and nothing but its own state, so any number of them can run side
+// by side, on different threads too. The opcode tables below are shared and
+// immutable.
+struct cpu_t
+{
+  struct proc_regs_t regs;
+  struct bus_t*      bus; // every memory access goes through here
+  uint8_t            pending;   // INT_*, checked once before each instruction
+  uint8_t            irq_lines; // IRQ_* sources holding the IRQ line
+};
+
+// pending interrupts, taken in this order
+#define INT_RESET 0x01
+#define INT_NMI   0x02 // edge triggered, latched until taken
+#define INT_IRQ   0x04 // level: some irq_lines are set and I is clear
+
+// sources sharing the IRQ line
+#define IRQ_MAPPER 0x01
+#define IRQ_APU    0x02
+
+// status register bits
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+static inline bool status_zero(const struct cpu_t* cpu)     { return cpu->regs.status.zero_res == 0; }
+static inline bool status_negative(const struct cpu_t* cpu) { return cpu->regs.status.neg_res >> 7; }
+
+uint8_t get_proc_status(const struct cpu_t* cpu);
+
+void set_proc_status(struct cpu_t* cpu, uint8_t status);
+
+void set_memory(struct cpu_t* cpu, uint16_t addr, uint8_t value);
+void set_memory_range(struct cpu_t* cpu, uint16_t addr, uint8_t *buffer, uint8_t size);
+
+uint8_t get_memory(struct cpu_t* cpu, uint16_t addr);
+
+// addressing modes, as found in opcode_mode
+enum
+{
+  MODE_IMP, // implied or accumulator
+  MODE_IMM, // #$nn
+  MODE_ZP,  // $nn
+  MODE_ZPX, // $nn,X
+  MODE_ZPY, // $nn,Y
+  MODE_ABS, // $nnnn
+  MODE_ABX, // $nnnn,X
+  MODE_ABY, // $nnnn,Y
+  MODE_IND, // ($nnnn)
+  MODE_IZX, // ($nn,X)
+  MODE_IZY, // ($nn),Y
+  MODE_REL  // branch target
+};
+
+extern const char* const opcode_name[256];
+extern const uint8_t opcode_len[256];
+extern const uint8_t opcode_cycles[256];
+extern const uint8_t opcode_mode[256];
+
+bool cpu_step(struct cpu_t* cpu);
+
+/**
+ * Predecoded instructions, per 256 byte page of memory and keyed by the
+ * memory itself, so each PRG bank has its own and a bank switch just selects
+ * another. A write to memory that was decoded drops its page. Flush it when
+ * memory or the memory map changed behind the cpu's back.
+ */
+struct decode_cache_t;
+
+struct decode_cache_t* decode_cache_create();
+
+void decode_cache_destroy(struct decode_cache_t* cache);
+
+void decode_cache_flush(struct decode_cache_t* cache);
+
+/**
+ * Same as cpu_step(), through cache.
+ */
+bool cpu_step_cached(struct cpu_t* cpu, struct decode_cache_t* cache);
+
+void cpu_run(struct cpu_t* cpu);
 
-void set_proc_status(uint8_t status);
+/**
+ * Signals a non maskable interrupt, taken before the next instruction.
+ */
+void cpu_nmi(struct cpu_t* cpu);
 
-void set_memory(uint16_t addr, uint8_t value);
-void set_memory_range(uint16_t addr, uint8_t *buffer, uint8_t size);
+/**
+ * Sets or clears the IRQ line of 'source' (IRQ_*). The IRQ is taken before
+ * the next instruction for as long as any source holds the line and I is
+ * clear.
+ */
+void cpu_irq(struct cpu_t* cpu, uint8_t source, bool level);
 
-uint8_t get_memory(uint16_t addr);
+/**
+ * Presses reset: the reset sequence runs before the next instruction.
+ */
+void cpu_soft_reset(struct cpu_t* cpu);
 
-void cpu_step();
+uint32_t cpu_run_cycles(struct cpu_t* cpu, uint32_t ncycles);
 
-void cpu_init();
+/**
+ * Clears the registers and routes all memory accesses through bus. A bare
+ * cpu can run on bus_init_flat() over 64KB of its own.
+ */
+void cpu_init(struct cpu_t* cpu, struct bus_t* bus);
 
-void cpu_load_prg(const uint8_t* prg, uint8_t numblk);
+void cpu_load_prg(struct cpu_t* cpu, const uint8_t* prg, uint8_t numblk);
 
-void cpu_reset();
+/**
+ * Runs the reset sequence right away, as at power on: S goes down by three
+ * without writing, I is set and pc is loaded from $FFFC.
+ */
+void cpu_reset(struct cpu_t* cpu);
@@ -0,0 +1,125 @@
+/**
+ * Headless front end: runs one cart for a number of frames as fast as it
+ * goes, with no picture or sound, through nes_step_frame(), and reports
+ *
+ *   frames, seconds, frames/sec and the speed relative to a real console
+ *   frame_hash  hash of the last frame's picture
+ *   run_hash    chained hash of every frame's picture
+ *   samples     audio samples made
+ *
+ * with the hashes of nes_hash_frame(), the same as batch's, so a run here
+ * can be compared with a sweep. The picture and audio are only looked at
+ * when hashing or counting, a real front end would hand them on.
+ *
+ * -m plays the controller input of an FM2 movie, for as many frames as it
+ * has unless -f says otherwise, so the same gameplay can be replayed
+ * deterministically and compared by hash.
+ *
+ *   usage: headless [-f FRAMES] [-e ENGINE] [-m MOVIE] ROM
+ */
+#include "nes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define DEFAULT_FRAMES 600
+
+
+int main(int argc, char* argv[])
+{
+  uint32_t nframes = 0;
+  int engine = NES_ENGINE_INTERP;
+  const char* movie_path = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:e:m:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'f': nframes = atoi(optarg); break;
+    case 'e':
+      if ((engine = nes_engine_by_name(optarg)) < 0)
+      {
+        printf("unknown engine %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'm': movie_path = optarg; break;
+    default:
+      printf("usage: %s [-f FRAMES] [-e ENGINE] [-m MOVIE] ROM\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1)
+  {
+    printf("usage: %s [-f FRAMES] [-e ENGINE] [-m MOVIE] ROM\n", argv[0]);
+    return 1;
+  }
+
+  static struct movie_t movie;
+  if (movie_path)
+  {
+    int rtn = movie_open(&movie, movie_path);
+    if (rtn != MOVIE_OK)
+    {
+      printf("%s: %s\n", movie_path, movie_error(rtn));
+      return 1;
+    }
+    if (nframes == 0)
+      nframes = movie.nframes;
+  }
+  if (nframes == 0)
+    nframes = DEFAULT_FRAMES;
+
+  static struct nes_t nes;
+  int rtn = nes_open(&nes, argv[optind]);
+  if (rtn != NES_CART_OK)
+  {
+    printf("%s: %s\n", argv[optind], (rtn == NES_BAD_MAPPER) ? "unsupported mapper" : nes_cart_error(rtn));
+    movie_close(&movie);
+    return 1;
+  }
+  if (!nes_set_engine(&nes, engine))
+  {
+    printf("engine not available\n");
+    nes_close(&nes);
+    movie_close(&movie);
+    return 1;
+  }
+
+  struct nes_frame_t frame = { 0 };
+  uint64_t run_hash = NES_HASH_SEED;
+  uint64_t samples = 0;
+  bool ok = true;
+  double start = nes_now();
+  uint32_t n;
+  for (n=0; ok && (n<nframes); n++)
+  {
+    if (movie_path)
+      nes_play_movie(&nes, &movie, n);
+    ok = nes_step_frame(&nes, &frame);
+    run_hash = nes_hash_frame(frame.pixels, run_hash);
+    samples += frame.nsamples;
+  }
+  double seconds = nes_now() - start;
+
+  if (!ok)
+    printf("opcode $%02X at $%04X in frame %llu\n", nes.cpu.regs.ir,
+           (uint16_t)(nes.cpu.regs.pc - 1), (unsigned long long)frame.number);
+  printf("%u frames in %.3fs, %.1f fps (%.1fx real time)\n", n, seconds,
+         (seconds > 0) ? n / seconds : 0,
+         (seconds > 0) ? n / seconds / NES_FRAME_RATE : 0);
+  printf("frame_hash %016llx run_hash %016llx samples %llu\n",
+         (unsigned long long)nes_hash_frame(nes.ppu.framebuffer, NES_HASH_SEED),
+         (unsigned long long)run_hash, (unsigned long long)samples);
+
+  if (nes.jit && jit_stats(nes.jit)->mismatches)
+  {
+    printf("%llu jit mismatches\n", (unsigned long long)jit_stats(nes.jit)->mismatches);
+    ok = false;
+  }
+
+  nes_close(&nes);
+  movie_close(&movie);
+  return ok ? 0 : 2;
+}
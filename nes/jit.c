@@ -0,0 +1,1117 @@
+#include "jit.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h> //offsetof()
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+#include <pthread.h>
+
+#define JIT_CODE_SIZE  (8 << 20) // bytes of translated code
+#define JIT_BLOCK_MAX  4096      // worst case code for one block
+#define JIT_MAX_INSNS  24        // per block
+#define JIT_MAX_BYTES  (JIT_MAX_INSNS * 3)
+#define JIT_TABLE_BITS 14
+#define JIT_TABLE_SIZE (1 << JIT_TABLE_BITS)
+#define JIT_LOG_SIZE   256       // I/O accesses per block in check mode
+
+typedef void (*block_fn)(struct cpu_t* cpu, struct jit_t* jit, struct bus_t* bus, uint64_t until);
+
+struct block_t
+{
+  const uint8_t* host; // code bytes, NULL for a free slot
+  uint16_t       pc;
+  uint8_t        len;  // bytes of 6502 code
+  bool           ram;  // translated from writable memory
+  block_fn       code; // NULL when the first instruction is interpreted
+  uint8_t        src[JIT_MAX_BYTES]; // copy of the code, ram blocks only
+};
+
+struct io_t
+{
+  uint16_t addr;
+  uint8_t  value;
+  bool     write;
+  uint16_t stall; // cycles the handler added, OAM DMA
+};
+
+struct jit_t
+{
+  struct cpu_t*      cpu;
+  struct bus_t*      bus;
+  struct jit_stats_t stats;
+
+  uint8_t*           code;
+  size_t             used;
+  struct block_t*    table;
+  unsigned           nblocks;
+
+  // check mode: the I/O a block did, replayed to the interpreter
+  bool               check;
+  bool               logging;
+  struct io_t        log[JIT_LOG_SIZE];
+  unsigned           nlog;
+  unsigned           replayed;
+  bool               replay_bad;
+  struct bus_t       replay;
+  const uint8_t*     replay_map[2*BUS_PAGES]; // read and write pages it was made from
+  uint8_t*           pages[BUS_PAGES]; // writable memory, mirrors once
+  int                npages;
+  uint8_t          (*before)[256];
+  uint8_t          (*after)[256];
+};
+
+
+//////////////////
+// opcode kinds //
+//////////////////
+
+enum
+{
+  K_NONE, // left to the interpreter
+  K_LD, K_ST, K_ALU, K_ADC, K_SBC, K_CMP, K_BIT,
+  K_RMW, K_RMW_A, K_INCR, K_T, K_FLAG, K_NOP,
+  K_BRANCH, K_JMP, K_JSR, K_RTS, K_PHA, K_PLA
+};
+
+// register and flag offsets in struct cpu_t, all reachable with a disp8
+#define O_PC  offsetof(struct cpu_t, regs.pc)
+#define O_SP  offsetof(struct cpu_t, regs.sp)
+#define O_A   offsetof(struct cpu_t, regs.acc)
+#define O_X   offsetof(struct cpu_t, regs.x)
+#define O_Y   offsetof(struct cpu_t, regs.y)
+#define O_C   offsetof(struct cpu_t, regs.status.carry)
+#define O_Z   offsetof(struct cpu_t, regs.status.zero_res)
+#define O_N   offsetof(struct cpu_t, regs.status.neg_res)
+#define O_D   offsetof(struct cpu_t, regs.status.decimal)
+#define O_V   offsetof(struct cpu_t, regs.status.overflow)
+#define O_CYC offsetof(struct cpu_t, regs.cycles)
+#define O_PEND offsetof(struct cpu_t, pending)
+_Static_assert(offsetof(struct cpu_t, pending) < 128, "cpu_t fields need disp8");
+
+#define O_READ_PAGE  offsetof(struct bus_t, read_page)
+#define O_WRITE_PAGE offsetof(struct bus_t, write_page)
+_Static_assert(O_WRITE_PAGE == O_READ_PAGE + BUS_PAGES * sizeof(void*), "page tables must be adjacent");
+
+// x86 condition codes
+enum { CC_O = 0x0, CC_C = 0x2, CC_NC = 0x3, CC_Z = 0x4, CC_NZ = 0x5 };
+
+// x86 register numbers, for the byte registers too
+enum { AL = 0, CL = 1, DL = 2 };
+
+enum { RMW_INC, RMW_DEC, RMW_ASL, RMW_LSR, RMW_ROL, RMW_ROR };
+
+struct kind_t
+{
+  uint8_t kind;
+  uint8_t a; // register offset, x86 opcode or RMW op
+  uint8_t b; // second register offset, flag value or branch condition
+};
+
+static const char* const opcode_exec[256] = {
+#define OP(op, name, mode, len, cycles, exec) [op] = #exec,
+#include "cpu-6502-ops.h"
+#undef OP
+};
+
+static const struct { const char* exec; struct kind_t k; } kind_names[] = {
+  { "LDA", { K_LD, O_A } }, { "LDX", { K_LD, O_X } }, { "LDY", { K_LD, O_Y } },
+  { "STA", { K_ST, O_A } }, { "STX", { K_ST, O_X } }, { "STY", { K_ST, O_Y } },
+  // x86 'op r/m8, r8'
+  { "AND", { K_ALU, 0x20 } }, { "ORA", { K_ALU, 0x08 } }, { "EOR", { K_ALU, 0x30 } },
+  { "ADC", { K_ADC } }, { "SBC", { K_SBC } },
+  { "CMP", { K_CMP, O_A } }, { "CPX", { K_CMP, O_X } }, { "CPY", { K_CMP, O_Y } },
+  { "BIT", { K_BIT } },
+  { "INC", { K_RMW, RMW_INC } }, { "DEC", { K_RMW, RMW_DEC } },
+  { "ASL", { K_RMW, RMW_ASL } }, { "LSR", { K_RMW, RMW_LSR } },
+  { "ROL", { K_RMW, RMW_ROL } }, { "ROR", { K_RMW, RMW_ROR } },
+  { "ASL_A", { K_RMW_A, RMW_ASL } }, { "LSR_A", { K_RMW_A, RMW_LSR } },
+  { "ROL_A", { K_RMW_A, RMW_ROL } }, { "ROR_A", { K_RMW_A, RMW_ROR } },
+  { "INX", { K_INCR, O_X, RMW_INC } }, { "INY", { K_INCR, O_Y, RMW_INC } },
+  { "DEX", { K_INCR, O_X, RMW_DEC } }, { "DEY", { K_INCR, O_Y, RMW_DEC } },
+  { "TAX", { K_T, O_A, O_X } }, { "TAY", { K_T, O_A, O_Y } }, { "TSX", { K_T, O_SP, O_X } },
+  { "TXA", { K_T, O_X, O_A } }, { "TYA", { K_T, O_Y, O_A } }, { "TXS", { K_T, O_X, O_SP } },
+  { "CLC", { K_FLAG, O_C, 0 } }, { "SEC", { K_FLAG, O_C, 1 } },
+  { "CLD", { K_FLAG, O_D, 0 } }, { "SED", { K_FLAG, O_D, 1 } },
+  { "CLV", { K_FLAG, O_V, 0 } },
+  { "NOP", { K_NOP } },
+  // taken when the flag byte compares (cmp/test) as the condition says
+  { "BCC", { K_BRANCH, O_C, CC_Z } },  { "BCS", { K_BRANCH, O_C, CC_NZ } },
+  { "BNE", { K_BRANCH, O_Z, CC_NZ } }, { "BEQ", { K_BRANCH, O_Z, CC_Z } },
+  { "BPL", { K_BRANCH, O_N, CC_Z } },  { "BMI", { K_BRANCH, O_N, CC_NZ } },
+  { "BVC", { K_BRANCH, O_V, CC_Z } },  { "BVS", { K_BRANCH, O_V, CC_NZ } },
+  { "JMP", { K_JMP } }, { "JSR", { K_JSR } }, { "RTS", { K_RTS } },
+  { "PHA", { K_PHA } }, { "PLA", { K_PLA } },
+};
+
+static struct kind_t kinds[256];
+
+static void build_kinds()
+{
+  for (int op=0; op<256; op++)
+  {
+    if (!opcode_exec[op])
+      continue;
+    for (size_t i=0; i<sizeof(kind_names)/sizeof(kind_names[0]); i++)
+      if (!strcmp(opcode_exec[op], kind_names[i].exec))
+        kinds[op] = kind_names[i].k;
+  }
+  kinds[0x6c].kind = K_NONE; // jmp ($nnnn)
+}
+
+
+/////////////
+// helpers //
+/////////////
+
+// called from translated code for accesses to pages without memory
+
+static uint8_t jit_read(struct jit_t* jit, uint16_t addr)
+{
+  uint64_t cycles = jit->cpu->regs.cycles;
+  uint8_t value = bus_read(jit->bus, addr);
+  if (jit->logging && (jit->nlog < JIT_LOG_SIZE))
+    jit->log[jit->nlog++] = (struct io_t){ addr, value, false, jit->cpu->regs.cycles - cycles };
+  return value;
+}
+
+static void jit_write(struct jit_t* jit, uint16_t addr, uint8_t value)
+{
+  uint64_t cycles = jit->cpu->regs.cycles;
+  bus_write(jit->bus, addr, value);
+  if (jit->logging && (jit->nlog < JIT_LOG_SIZE))
+    jit->log[jit->nlog++] = (struct io_t){ addr, value, true, jit->cpu->regs.cycles - cycles };
+}
+
+
+/////////////
+// emitter //
+/////////////
+
+// Translated code runs with rbx = cpu, r12 = jit, r13 = bus, r15 = the cycle
+// a block that loops on itself must stop at. r14 holds a page crossing
+// penalty or an RMW address across helper calls. Values are in
+// al, store values in dl, effective addresses in esi.
+
+struct emit_t
+{
+  uint8_t* p;
+  bool     io; // the instruction may have read an I/O register
+};
+
+static void e8(struct emit_t* e, uint8_t b)   { *e->p++ = b; }
+static void e32(struct emit_t* e, uint32_t v) { memcpy(e->p, &v, 4); e->p += 4; }
+static void e64(struct emit_t* e, uint64_t v) { memcpy(e->p, &v, 8); e->p += 8; }
+
+static void bytes(struct emit_t* e, int n, const uint8_t* b)
+{
+  memcpy(e->p, b, n);
+  e->p += n;
+}
+#define EMIT(e, ...) bytes(e, sizeof((uint8_t[]){ __VA_ARGS__ }), (uint8_t[]){ __VA_ARGS__ })
+
+// op reg, [rbx+off]
+static void rm(struct emit_t* e, uint8_t opcode, int reg, int off)
+{
+  EMIT(e, opcode, 0x43 | (reg << 3), off);
+}
+
+static void load8(struct emit_t* e, int reg, int off)  { rm(e, 0x8A, reg, off); }
+static void store8(struct emit_t* e, int reg, int off) { rm(e, 0x88, reg, off); }
+static void setcc(struct emit_t* e, int cc, int off)   { EMIT(e, 0x0F, 0x90 | cc, 0x43, off); }
+static void movzx_esi(struct emit_t* e, int off)       { EMIT(e, 0x0F, 0xB6, 0x73, off); }
+static void set_byte(struct emit_t* e, int off, uint8_t v) { EMIT(e, 0xC6, 0x43, off, v); }
+
+static void set_zn(struct emit_t* e)
+{
+  store8(e, AL, O_Z);
+  store8(e, AL, O_N);
+}
+
+static void add_cycles(struct emit_t* e, int n)
+{
+  if (n)
+    EMIT(e, 0x48, 0x83, 0x43, O_CYC, n); // add qword [rbx+cycles], n
+}
+
+static void mov_esi(struct emit_t* e, uint32_t v) { e8(e, 0xBE); e32(e, v); }
+static void and_esi(struct emit_t* e, uint32_t v) { EMIT(e, 0x81, 0xE6); e32(e, v); }
+static void mov_rax(struct emit_t* e, const void* p) { EMIT(e, 0x48, 0xB8); e64(e, (uint64_t)(uintptr_t)p); }
+
+static void call(struct emit_t* e, const void* fn)
+{
+  mov_rax(e, fn);
+  EMIT(e, 0xFF, 0xD0);
+}
+
+static uint8_t* jcc8(struct emit_t* e, int cc)
+{
+  EMIT(e, 0x70 | cc, 0);
+  return e->p - 1;
+}
+
+static uint8_t* jmp8(struct emit_t* e)
+{
+  EMIT(e, 0xEB, 0);
+  return e->p - 1;
+}
+
+static void patch8(struct emit_t* e, uint8_t* at)
+{
+  ptrdiff_t rel = e->p - (at + 1);
+  if ((rel < -128) || (rel > 127))
+    abort();
+  *at = (uint8_t) rel;
+}
+
+static void prologue(struct emit_t* e)
+{
+  EMIT(e, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push rbx, r12-r15
+       0x48, 0x89, 0xFB,  // mov rbx, rdi
+       0x49, 0x89, 0xF4,  // mov r12, rsi
+       0x49, 0x89, 0xD5,  // mov r13, rdx
+       0x49, 0x89, 0xCF); // mov r15, rcx
+}
+
+static void epilogue(struct emit_t* e)
+{
+  EMIT(e, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);
+}
+
+// leave the block at pc after adding the cycles of the last instruction
+static void exit_to(struct emit_t* e, int cycles, uint16_t pc)
+{
+  add_cycles(e, cycles);
+  EMIT(e, 0x66, 0xC7, 0x43, O_PC, pc & 0xFF, pc >> 8);
+  epilogue(e);
+}
+
+// leave the block if an interrupt came up, it is taken before the next
+// instruction
+static void exit_on_interrupt(struct emit_t* e, uint16_t pc)
+{
+  EMIT(e, 0x80, 0x7B, O_PEND, 0x00); // cmp byte [rbx+pending], 0
+  uint8_t* none = jcc8(e, CC_Z);
+  exit_to(e, 0, pc);
+  patch8(e, none);
+}
+
+
+//////////////////////
+// memory accesses  //
+//////////////////////
+
+struct insn_t
+{
+  uint16_t       pc;
+  uint16_t       next;
+  uint8_t        mode;
+  uint8_t        cycles;
+  uint16_t       operand;
+  struct kind_t  k;
+  const uint8_t* page0; // host memory of pages 0 and 1
+  const uint8_t* page1;
+  const uint8_t* host;  // host memory of the block's page
+  uint8_t        block_page;
+  uint16_t       block_pc;
+  uint8_t*       body;  // the block's code after the prologue
+  const struct bus_t* bus;
+};
+
+// rax = bus page table entry of the page in esi, or of 'page' when known
+static void lookup(struct emit_t* e, int page, size_t table)
+{
+  if (page >= 0)
+  {
+    EMIT(e, 0x49, 0x8B, 0x85); // mov rax, [r13+disp32]
+    e32(e, table + 8*page);
+  }
+  else
+  {
+    EMIT(e, 0x89, 0xF0,        // mov eax, esi
+         0xC1, 0xE8, 0x08,     // shr eax, 8
+         0x49, 0x8B, 0x84, 0xC5); // mov rax, [r13+rax*8+disp32]
+    e32(e, table);
+  }
+}
+
+/**
+ * al = byte at esi. Zero page is read straight from RAM, other pages through
+ * the page table, calling the bus handler when there is no memory.
+ */
+static void emit_read(struct emit_t* e, const struct insn_t* in, int page)
+{
+  if (page == 0)
+  {
+    mov_rax(e, in->page0);
+    EMIT(e, 0x0F, 0xB6, 0x04, 0x30); // movzx eax, byte [rax+rsi]
+    return;
+  }
+
+  // a page without memory now is I/O, and so may be one only known later
+  e->io = e->io || (page < 0) || !in->bus->read_page[page];
+  lookup(e, page, O_READ_PAGE);
+  EMIT(e, 0x48, 0x85, 0xC0);       // test rax, rax
+  uint8_t* slow = jcc8(e, CC_Z);
+  EMIT(e, 0x40, 0x0F, 0xB6, 0xCE,  // movzx ecx, sil
+       0x8A, 0x04, 0x08);          // mov al, [rax+rcx]
+  uint8_t* done = jmp8(e);
+  patch8(e, slow);
+  EMIT(e, 0x4C, 0x89, 0xE7);       // mov rdi, r12
+  call(e, jit_read);
+  patch8(e, done);
+}
+
+/**
+ * Stores dl at esi. A handler call may have switched the bank the block runs
+ * from, in which case the block is left after this instruction.
+ */
+static void emit_write(struct emit_t* e, const struct insn_t* in, int page)
+{
+  if (page == 0)
+  {
+    mov_rax(e, in->page0);
+    EMIT(e, 0x88, 0x14, 0x30); // mov [rax+rsi], dl
+    return;
+  }
+
+  lookup(e, page, O_WRITE_PAGE);
+  EMIT(e, 0x48, 0x85, 0xC0);       // test rax, rax
+  uint8_t* slow = jcc8(e, CC_Z);
+  EMIT(e, 0x40, 0x0F, 0xB6, 0xCE,  // movzx ecx, sil
+       0x88, 0x14, 0x08);          // mov [rax+rcx], dl
+  uint8_t* done = jmp8(e);
+  patch8(e, slow);
+  EMIT(e, 0x4C, 0x89, 0xE7,        // mov rdi, r12
+       0x0F, 0xB6, 0xD2);          // movzx edx, dl
+  call(e, jit_write);
+
+  mov_rax(e, in->host);
+  EMIT(e, 0x49, 0x39, 0x85);       // cmp [r13+disp32], rax
+  e32(e, O_READ_PAGE + 8*in->block_page);
+  uint8_t* same = jcc8(e, CC_Z);
+  exit_to(e, in->cycles, in->next);
+  patch8(e, same);
+  patch8(e, done);
+  e->io = true;
+}
+
+// r14d ^= esi, then the page crossing bit of it
+static void cross_penalty(struct emit_t* e)
+{
+  EMIT(e, 0x41, 0x31, 0xF6,        // xor r14d, esi
+       0x41, 0xC1, 0xEE, 0x08,     // shr r14d, 8
+       0x41, 0x83, 0xE6, 0x01);    // and r14d, 1
+}
+
+// esi = (word at zero page esi), pointer wraps within the zero page
+static void zp_pointer(struct emit_t* e, const struct insn_t* in)
+{
+  mov_rax(e, in->page0);
+  EMIT(e, 0x0F, 0xB6, 0x0C, 0x30,  // movzx ecx, byte [rax+rsi]
+       0xFF, 0xC6);                // inc esi
+  and_esi(e, 0xFF);
+  EMIT(e, 0x0F, 0xB6, 0x34, 0x30,  // movzx esi, byte [rax+rsi]
+       0xC1, 0xE6, 0x08,           // shl esi, 8
+       0x09, 0xCE);                // or esi, ecx
+}
+
+/**
+ * esi = effective address of the operand.
+ *
+ * returns: the page of the address when it is known now, -1 otherwise
+ */
+static int emit_address(struct emit_t* e, const struct insn_t* in, bool penalty)
+{
+  uint16_t op = in->operand;
+
+  switch (in->mode)
+  {
+  case MODE_ZP:
+    mov_esi(e, op & 0xFF);
+    return 0;
+  case MODE_ZPX:
+  case MODE_ZPY:
+    movzx_esi(e, (in->mode == MODE_ZPX) ? O_X : O_Y);
+    EMIT(e, 0x81, 0xC6); e32(e, op & 0xFF); // add esi, imm32
+    and_esi(e, 0xFF);
+    return 0;
+  case MODE_ABS:
+    mov_esi(e, op);
+    return op >> 8;
+  case MODE_ABX:
+  case MODE_ABY:
+    movzx_esi(e, (in->mode == MODE_ABX) ? O_X : O_Y);
+    EMIT(e, 0x81, 0xC6); e32(e, op);
+    and_esi(e, 0xFFFF);
+    if (penalty)
+    {
+      EMIT(e, 0x41, 0xBE); e32(e, op); // mov r14d, base
+      cross_penalty(e);
+    }
+    return -1;
+  case MODE_IZX:
+    movzx_esi(e, O_X);
+    EMIT(e, 0x81, 0xC6); e32(e, op & 0xFF);
+    and_esi(e, 0xFF);
+    zp_pointer(e, in);
+    return -1;
+  case MODE_IZY:
+    mov_esi(e, op & 0xFF);
+    zp_pointer(e, in);
+    if (penalty)
+      EMIT(e, 0x41, 0x89, 0xF6);   // mov r14d, esi
+    EMIT(e, 0x0F, 0xB6, 0x43, O_Y, // movzx eax, byte [rbx+y]
+         0x01, 0xC6);              // add esi, eax
+    and_esi(e, 0xFFFF);
+    if (penalty)
+      cross_penalty(e);
+    return -1;
+  }
+  abort();
+}
+
+static bool indexed(int mode)
+{
+  return (mode == MODE_ABX) || (mode == MODE_ABY) || (mode == MODE_IZY);
+}
+
+// al = the operand of a read instruction, with its page crossing penalty
+static void emit_operand(struct emit_t* e, const struct insn_t* in)
+{
+  if (in->mode == MODE_IMM)
+  {
+    EMIT(e, 0xB0, in->operand & 0xFF); // mov al, imm8
+    return;
+  }
+  int page = emit_address(e, in, indexed(in->mode));
+  emit_read(e, in, page);
+  if (indexed(in->mode))
+    EMIT(e, 0x4C, 0x01, 0x73, O_CYC); // add [rbx+cycles], r14
+}
+
+// al op= 1 for an RMW operation, flags to C/Z/N
+static void emit_rmw_op(struct emit_t* e, int op)
+{
+  switch (op)
+  {
+  case RMW_INC: EMIT(e, 0xFE, 0xC0); break;
+  case RMW_DEC: EMIT(e, 0xFE, 0xC8); break;
+  case RMW_ASL: EMIT(e, 0xD0, 0xE0); break;
+  case RMW_LSR: EMIT(e, 0xD0, 0xE8); break;
+  case RMW_ROL: load8(e, DL, O_C); EMIT(e, 0xD0, 0xEA, 0xD0, 0xD0); break; // shr dl,1; rcl al,1
+  case RMW_ROR: load8(e, DL, O_C); EMIT(e, 0xD0, 0xEA, 0xD0, 0xD8); break; // shr dl,1; rcr al,1
+  }
+  if ((op != RMW_INC) && (op != RMW_DEC))
+    setcc(e, CC_C, O_C);
+  set_zn(e);
+}
+
+/**
+ * Continues at target. A jump back to the start of the block runs it again
+ * right here, as long as there is time left and no interrupt, which turns wait
+ * loops into native loops.
+ */
+static void jump_to(struct emit_t* e, const struct insn_t* in, int cycles, uint16_t target)
+{
+  add_cycles(e, cycles);
+  if (target == in->block_pc)
+  {
+    EMIT(e, 0x4C, 0x39, 0x7B, O_CYC);  // cmp [rbx+cycles], r15
+    uint8_t* late = jcc8(e, CC_NC);
+    EMIT(e, 0x80, 0x7B, O_PEND, 0x00); // cmp byte [rbx+pending], 0
+    uint8_t* pend = jcc8(e, CC_NZ);
+    e8(e, 0xE9);                       // jmp body
+    e32(e, (uint32_t)(in->body - (e->p + 4)));
+    patch8(e, late);
+    patch8(e, pend);
+  }
+  exit_to(e, 0, target);
+}
+
+// esi = 0x100 | sp as an offset into page 1
+static void stack_access(struct emit_t* e, const struct insn_t* in, bool write)
+{
+  movzx_esi(e, O_SP);
+  mov_rax(e, in->page1);
+  if (write)
+    EMIT(e, 0x88, 0x14, 0x30);       // mov [rax+rsi], dl
+  else
+    EMIT(e, 0x0F, 0xB6, 0x04, 0x30); // movzx eax, byte [rax+rsi]
+}
+
+
+/////////////////
+// translation //
+/////////////////
+
+/**
+ * Emits one instruction.
+ *
+ * returns: 1 when the instruction ends the block, 0 to go on, -1 if it can't
+ * be translated
+ */
+static int translate(struct jit_t* jit, struct emit_t* e, const struct insn_t* in)
+{
+  const struct kind_t* k = &in->k;
+
+  switch (k->kind)
+  {
+  case K_LD:
+    emit_operand(e, in);
+    store8(e, AL, k->a);
+    set_zn(e);
+    break;
+
+  case K_ST:
+    {
+      int page = emit_address(e, in, false);
+      load8(e, DL, k->a);
+      emit_write(e, in, page);
+    }
+    break;
+
+  case K_ALU:
+    emit_operand(e, in);
+    EMIT(e, 0x88, 0xC1);          // mov cl, al
+    load8(e, AL, O_A);
+    EMIT(e, k->a, 0xC8);          // op al, cl
+    store8(e, AL, O_A);
+    set_zn(e);
+    break;
+
+  case K_ADC:
+  case K_SBC:
+    emit_operand(e, in);
+    EMIT(e, 0x88, 0xC1);          // mov cl, al
+    if (k->kind == K_SBC)
+      EMIT(e, 0xF6, 0xD1);        // not cl
+    load8(e, AL, O_A);
+    load8(e, DL, O_C);
+    EMIT(e, 0xD0, 0xEA,           // shr dl, 1: CF = carry
+         0x10, 0xC8);             // adc al, cl
+    setcc(e, CC_C, O_C);
+    setcc(e, CC_O, O_V);
+    store8(e, AL, O_A);
+    set_zn(e);
+    break;
+
+  case K_CMP:
+    emit_operand(e, in);
+    EMIT(e, 0x88, 0xC1);          // mov cl, al
+    load8(e, AL, k->a);
+    EMIT(e, 0x28, 0xC8);          // sub al, cl
+    setcc(e, CC_NC, O_C);         // no borrow
+    set_zn(e);
+    break;
+
+  case K_BIT:
+    emit_operand(e, in);
+    store8(e, AL, O_N);
+    EMIT(e, 0x88, 0xC2,           // mov dl, al
+         0xC0, 0xEA, 0x06,        // shr dl, 6
+         0x80, 0xE2, 0x01);       // and dl, 1
+    store8(e, DL, O_V);
+    rm(e, 0x22, AL, O_A);         // and al, [rbx+acc]
+    store8(e, AL, O_Z);
+    break;
+
+  case K_RMW:
+    {
+      int page = emit_address(e, in, false);
+      EMIT(e, 0x41, 0x89, 0xF6);  // mov r14d, esi
+      emit_read(e, in, page);
+      emit_rmw_op(e, k->a);
+      EMIT(e, 0x88, 0xC2,         // mov dl, al
+           0x44, 0x89, 0xF6);     // mov esi, r14d
+      emit_write(e, in, page);
+    }
+    break;
+
+  case K_RMW_A:
+    load8(e, AL, O_A);
+    emit_rmw_op(e, k->a);
+    store8(e, AL, O_A);
+    break;
+
+  case K_INCR:
+    load8(e, AL, k->a);
+    emit_rmw_op(e, k->b);
+    store8(e, AL, k->a);
+    break;
+
+  case K_T:
+    load8(e, AL, k->a);
+    store8(e, AL, k->b);
+    if (k->b != O_SP)
+      set_zn(e);
+    break;
+
+  case K_FLAG:
+    set_byte(e, k->a, k->b);
+    break;
+
+  case K_NOP:
+    break;
+
+  case K_BRANCH:
+    {
+      uint16_t target = in->next + (int8_t) in->operand;
+      if (k->a == O_N)
+        EMIT(e, 0xF6, 0x43, O_N, 0x80);  // test byte [rbx+n], 0x80
+      else
+        EMIT(e, 0x80, 0x7B, k->a, 0x00); // cmp byte [rbx+flag], 0
+      uint8_t* not_taken = jcc8(e, k->b ^ 1);
+      jump_to(e, in, in->cycles + 1 + (((in->next ^ target) >> 8) & 1), target);
+      patch8(e, not_taken);
+      exit_to(e, in->cycles, in->next);
+    }
+    return 1;
+
+  case K_JMP:
+    jump_to(e, in, in->cycles, in->operand);
+    return 1;
+
+  case K_JSR:
+    // pushes the address of its own last byte
+    EMIT(e, 0xB2, (in->pc + 2) >> 8);    // mov dl, imm8
+    stack_access(e, in, true);
+    EMIT(e, 0xFE, 0x4B, O_SP,            // dec byte [rbx+sp]
+         0xB2, (in->pc + 2) & 0xFF);
+    stack_access(e, in, true);
+    EMIT(e, 0xFE, 0x4B, O_SP);
+    exit_to(e, in->cycles, in->operand);
+    return 1;
+
+  case K_RTS:
+    EMIT(e, 0xFE, 0x43, O_SP);           // inc byte [rbx+sp]
+    stack_access(e, in, false);
+    EMIT(e, 0x89, 0xC1,                  // mov ecx, eax
+         0xFE, 0x43, O_SP);
+    stack_access(e, in, false);
+    EMIT(e, 0xC1, 0xE0, 0x08,            // shl eax, 8
+         0x09, 0xC8,                     // or eax, ecx
+         0xFF, 0xC0,                     // inc eax
+         0x66, 0x89, 0x43, O_PC);        // mov [rbx+pc], ax
+    add_cycles(e, in->cycles);
+    epilogue(e);
+    return 1;
+
+  case K_PHA:
+    load8(e, DL, O_A);
+    stack_access(e, in, true);
+    EMIT(e, 0xFE, 0x4B, O_SP);
+    break;
+
+  case K_PLA:
+    EMIT(e, 0xFE, 0x43, O_SP);
+    stack_access(e, in, false);
+    store8(e, AL, O_A);
+    set_zn(e);
+    break;
+
+  default:
+    return -1;
+  }
+
+  add_cycles(e, in->cycles);
+  if (e->io)
+    exit_on_interrupt(e, in->next);
+  return 0;
+}
+
+static bool is_store(const struct kind_t* k)
+{
+  return (k->kind == K_ST) || (k->kind == K_RMW) || (k->kind == K_PHA);
+}
+
+/**
+ * Translates the block at pc, whose page is at host memory 'host'.
+ */
+static void compile(struct jit_t* jit, struct block_t* b, const uint8_t* host)
+{
+  struct bus_t* bus = jit->bus;
+  struct emit_t e = { jit->code + jit->used };
+  uint8_t* start = e.p;
+  uint16_t pc = b->pc;
+  int n = 0;
+  bool closed = false; // the code ends in an exit already
+
+  struct insn_t in = {
+    .page0 = bus->read_page[0], .page1 = bus->read_page[1],
+    .host = host, .block_page = pc >> 8, .block_pc = pc, .bus = bus,
+  };
+
+  prologue(&e);
+  in.body = e.p;
+  unsigned lo = pc & 0xFF;
+  while ((n < JIT_MAX_INSNS) && (lo < 256))
+  {
+    uint8_t op = host[lo];
+    uint8_t len = opcode_len[op];
+
+    if ((len == 0) || (lo + len > 256))
+      break;
+
+    in.pc = pc;
+    in.next = pc + len;
+    in.mode = opcode_mode[op];
+    in.cycles = opcode_cycles[op];
+    in.operand = (len > 1) ? host[lo+1] | ((len > 2) ? host[lo+2] << 8 : 0) : 0;
+    in.k = kinds[op];
+
+    uint8_t* mark = e.p;
+    e.io = false;
+    int r = translate(jit, &e, &in);
+    if (r < 0)
+    {
+      e.p = mark;
+      break;
+    }
+    n++;
+    pc = in.next;
+    lo += len;
+    if (r > 0)
+    {
+      closed = true;
+      break;
+    }
+    // a store could have changed the code that follows
+    if (b->ram && is_store(&in.k))
+      break;
+  }
+
+  b->len = pc - b->pc;
+  if (b->ram)
+    memcpy(b->src, &host[b->pc & 0xFF], b->len);
+
+  if (n == 0)
+  {
+    b->code = NULL;
+    return;
+  }
+
+  if (!closed)
+    exit_to(&e, 0, pc);
+
+  b->code = (block_fn)(void*) start;
+  jit->used += e.p - start;
+  jit->stats.blocks++;
+}
+
+
+///////////
+// cache //
+///////////
+
+static void flush(struct jit_t* jit)
+{
+  memset(jit->table, 0, JIT_TABLE_SIZE * sizeof(struct block_t));
+  jit->nblocks = 0;
+  jit->used = 0;
+  jit->stats.flushes++;
+}
+
+static struct block_t* lookup_block(struct jit_t* jit, uint16_t pc, const uint8_t* host)
+{
+  const uint8_t* key = &host[pc & 0xFF];
+  uint32_t h = (uint32_t)((((uintptr_t)key ^ pc) * 0x9E3779B97F4A7C15ULL) >> (64 - JIT_TABLE_BITS));
+
+  while (1)
+  {
+    struct block_t* b = &jit->table[h];
+    if (b->host == NULL)
+      break;
+    if ((b->host == key) && (b->pc == pc))
+    {
+      // code in RAM is checked against what it was translated from
+      if (!b->ram || !memcmp(b->src, key, b->len))
+        return b;
+      // a retranslation takes fresh space too, code patched in a loop
+      // would otherwise run past the end
+      if (jit->used + JIT_BLOCK_MAX > JIT_CODE_SIZE)
+      {
+        flush(jit);
+        return lookup_block(jit, pc, host);
+      }
+      compile(jit, b, host);
+      return b;
+    }
+    h = (h + 1) & (JIT_TABLE_SIZE - 1);
+  }
+
+  if ((jit->nblocks >= JIT_TABLE_SIZE * 3 / 4) || (jit->used + JIT_BLOCK_MAX > JIT_CODE_SIZE))
+  {
+    flush(jit);
+    return lookup_block(jit, pc, host);
+  }
+
+  struct block_t* b = &jit->table[h];
+  b->host = key;
+  b->pc = pc;
+  b->ram = (jit->bus->write_page[pc >> 8] != NULL);
+  jit->nblocks++;
+  compile(jit, b, host);
+  return b;
+}
+
+
+////////////////
+// check mode //
+////////////////
+
+static uint8_t replay_read(void* ctx, uint16_t addr)
+{
+  struct jit_t* jit = (struct jit_t*) ctx;
+  struct io_t* io = &jit->log[jit->replayed];
+
+  if ((jit->replayed >= jit->nlog) || io->write || (io->addr != addr))
+  {
+    jit->replay_bad = true;
+    return 0;
+  }
+  jit->replayed++;
+  jit->cpu->regs.cycles += io->stall;
+  return io->value;
+}
+
+static void replay_write(void* ctx, uint16_t addr, uint8_t value)
+{
+  struct jit_t* jit = (struct jit_t*) ctx;
+  struct io_t* io = &jit->log[jit->replayed];
+
+  if ((jit->replayed >= jit->nlog) || !io->write || (io->addr != addr) || (io->value != value))
+  {
+    jit->replay_bad = true;
+    return;
+  }
+  jit->replayed++;
+  jit->cpu->regs.cycles += io->stall;
+}
+
+static void find_pages(struct jit_t* jit)
+{
+  jit->npages = 0;
+  for (int p=0; p<BUS_PAGES; p++)
+  {
+    uint8_t* page = jit->bus->write_page[p];
+    int i = 0;
+    while ((i < jit->npages) && (jit->pages[i] != page))
+      i++;
+    if (page && (i == jit->npages))
+      jit->pages[jit->npages++] = page;
+  }
+}
+
+static void save_pages(struct jit_t* jit, uint8_t (*to)[256])
+{
+  for (int i=0; i<jit->npages; i++)
+    memcpy(to[i], jit->pages[i], 256);
+}
+
+static void load_pages(struct jit_t* jit, uint8_t (*from)[256])
+{
+  for (int i=0; i<jit->npages; i++)
+    memcpy(jit->pages[i], from[i], 256);
+}
+
+/**
+ * Runs a block natively, then reruns it through the interpreter from the
+ * same state, feeding it the I/O the block did, and compares. The native
+ * result is kept either way.
+ */
+static void run_checked(struct jit_t* jit, struct block_t* b)
+{
+  struct cpu_t* cpu = jit->cpu;
+  struct bus_t* bus = jit->bus;
+
+  // the interpreter sees the memory map the block started with, rebuilt
+  // only when the mapping changed
+  if (memcmp(jit->replay_map, bus->read_page, sizeof(jit->replay_map)))
+  {
+    memcpy(jit->replay_map, bus->read_page, sizeof(jit->replay_map));
+    jit->replay = *bus;
+    for (int p=0; p<BUS_PAGES; p++)
+    {
+      if (!bus->read_page[p])
+      {
+        jit->replay.read_fn[p] = replay_read;
+        jit->replay.read_ctx[p] = jit;
+      }
+      if (!bus->write_page[p])
+      {
+        jit->replay.write_fn[p] = replay_write;
+        jit->replay.write_ctx[p] = jit;
+      }
+    }
+    find_pages(jit);
+  }
+
+  struct cpu_t start = *cpu;
+  save_pages(jit, jit->before);
+  jit->nlog = 0;
+  jit->logging = true;
+  b->code(cpu, jit, bus, 0); // one pass through a loop
+  jit->logging = false;
+  struct cpu_t native = *cpu;
+  save_pages(jit, jit->after);
+
+  load_pages(jit, jit->before);
+  *cpu = start;
+  cpu->bus = &jit->replay;
+  jit->replayed = 0;
+  jit->replay_bad = false;
+  for (int i=0; (i <= JIT_MAX_INSNS) && (cpu->regs.cycles < native.regs.cycles); i++)
+    if (!cpu_step(cpu))
+      break;
+
+  bool same = !jit->replay_bad && (jit->replayed == jit->nlog) &&
+              (cpu->regs.pc == native.regs.pc) && (cpu->regs.sp == native.regs.sp) &&
+              (cpu->regs.acc == native.regs.acc) && (cpu->regs.x == native.regs.x) &&
+              (cpu->regs.y == native.regs.y) && (cpu->regs.cycles == native.regs.cycles) &&
+              (get_proc_status(cpu) == get_proc_status(&native));
+  for (int i=0; same && (i<jit->npages); i++)
+    same = !memcmp(jit->pages[i], jit->after[i], 256);
+
+  if (!same)
+  {
+    jit->stats.mismatches++;
+    log_error("jit: block $%04X differs: pc %04X/%04X a %02X/%02X x %02X/%02X y %02X/%02X "
+              "sp %02X/%02X p %02X/%02X cycles %llu/%llu io %u/%u\n",
+              start.regs.pc, native.regs.pc, cpu->regs.pc, native.regs.acc, cpu->regs.acc,
+              native.regs.x, cpu->regs.x, native.regs.y, cpu->regs.y,
+              native.regs.sp, cpu->regs.sp, get_proc_status(&native), get_proc_status(cpu),
+              (unsigned long long)native.regs.cycles, (unsigned long long)cpu->regs.cycles,
+              jit->nlog, jit->replayed);
+  }
+
+  load_pages(jit, jit->after);
+  *cpu = native;
+}
+
+
+/////////
+// api //
+/////////
+
+struct jit_t* jit_create(struct cpu_t* cpu, struct bus_t* bus, bool check)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, build_kinds);
+
+  // zero page and stack are accessed directly
+  for (int p=0; p<2; p++)
+  {
+    if (!bus->read_page[p] || (bus->read_page[p] != bus->write_page[p]))
+    {
+      log_error("jit: pages 0 and 1 must be RAM\n");
+      return NULL;
+    }
+  }
+
+  struct jit_t* jit = calloc(1, sizeof(*jit));
+  jit->cpu = cpu;
+  jit->bus = bus;
+  jit->check = check;
+  jit->table = calloc(JIT_TABLE_SIZE, sizeof(struct block_t));
+  jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED)
+  {
+    log_error("jit: no executable memory\n");
+    free(jit->table);
+    free(jit);
+    return NULL;
+  }
+  if (check)
+  {
+    jit->before = malloc(BUS_PAGES * 256);
+    jit->after = malloc(BUS_PAGES * 256);
+  }
+  return jit;
+}
+
+
+void jit_destroy(struct jit_t* jit)
+{
+  if (jit == NULL)
+    return;
+  munmap(jit->code, JIT_CODE_SIZE);
+  free(jit->table);
+  free(jit->before);
+  free(jit->after);
+  free(jit);
+}
+
+
+bool jit_run(struct jit_t* jit, uint64_t until)
+{
+  struct cpu_t* cpu = jit->cpu;
+
+  while (cpu->regs.cycles < until)
+  {
+    uint16_t pc = cpu->regs.pc;
+    const uint8_t* host = jit->bus->read_page[pc >> 8];
+
+    if (!cpu->pending && host)
+    {
+      struct block_t* b = lookup_block(jit, pc, host);
+      if (b->code)
+      {
+        jit->stats.runs++;
+        if (jit->check)
+          run_checked(jit, b);
+        else
+          b->code(cpu, jit, jit->bus, until);
+        continue;
+      }
+    }
+
+    jit->stats.interpreted++;
+    if (!cpu_step(cpu))
+      return false;
+  }
+  return true;
+}
+
+
+void jit_flush(struct jit_t* jit)
+{
+  flush(jit);
+}
+
+
+const struct jit_stats_t* jit_stats(const struct jit_t* jit)
+{
+  return &jit->stats;
+}
+
+#else
+
+struct jit_t* jit_create(struct cpu_t* cpu, struct bus_t* bus, bool check)
+{
+  log_error("jit: only available on x86-64\n");
+  return NULL;
+}
+
+void jit_destroy(struct jit_t* jit)
+{
+}
+
+bool jit_run(struct jit_t* jit, uint64_t until)
+{
+  return false;
+}
+
+void jit_flush(struct jit_t* jit)
+{
+}
+
+const struct jit_stats_t* jit_stats(const struct jit_t* jit)
+{
+  return NULL;
+}
+
+#endif
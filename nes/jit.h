@@ -0,0 +1,71 @@
+#include <stdint.h> //uint8_t
+#include "cpu-6502.h" //bool
+#include "bus.h"
+
+#pragma once
+
+/**
+ * Optional x86-64 dynarec for the 6502.
+ *
+ * Straight-line runs of instructions (basic blocks, ended by a branch, jump,
+ * call or return, or by an instruction the translator leaves alone) are
+ * translated to native code that works on the cpu_t registers in place, and
+ * kept in an executable code cache keyed by the host address of the code
+ * and its cpu address. A bank switch maps other host memory under the same
+ * cpu address, so it simply selects other blocks, and a write that remaps the
+ * page the running block came from leaves the block at the next instruction.
+ * Blocks never cross a 256 byte page. Blocks from RAM keep a copy of their
+ * bytes and are retranslated when the code changed, and end after every
+ * store so they can't run over code they just wrote.
+ *
+ * A block that branches or jumps back to its own start loops natively until
+ * the cycle budget runs out, so wait loops don't go back to the dispatcher.
+ *
+ * Memory accesses go through the bus page table inline and call out to the
+ * bus handlers only for I/O; an interrupt raised by one ends the block after
+ * the instruction, where the interpreter would take it. The instructions that
+ * touch I (CLI, SEI, PLP, RTI, BRK), PHP, JMP indirect and the unofficial
+ * opcodes are left to cpu_step(), as is taking the interrupt itself. Pages 0
+ * and 1 must be plain RAM.
+ *
+ * In check mode every block is run twice, translated and then interpreted
+ * from the same state with the I/O it did replayed, and the two results must
+ * agree; mismatches are logged and counted.
+ *
+ * Only available on x86-64, jit_create() returns NULL elsewhere.
+ */
+
+struct jit_t;
+
+struct jit_stats_t
+{
+  uint64_t blocks;      // translated
+  uint64_t runs;        // native block executions
+  uint64_t interpreted; // instructions left to cpu_step()
+  uint64_t flushes;     // times the code cache was dropped
+  uint64_t mismatches;  // check mode
+};
+
+/**
+ * returns: NULL when the host can't run translated code
+ */
+struct jit_t* jit_create(struct cpu_t* cpu, struct bus_t* bus, bool check);
+
+void jit_destroy(struct jit_t* jit);
+
+/**
+ * Runs blocks, and interpreted instructions in between, until the cpu has
+ * reached cycle 'until'. Like cpu_run_cycles() it overshoots by at most a
+ * block.
+ *
+ * returns: false if the cpu hit an opcode it can't execute
+ */
+bool jit_run(struct jit_t* jit, uint64_t until);
+
+/**
+ * Drops every translated block, for when memory or the memory map changed
+ * behind the cpu's back.
+ */
+void jit_flush(struct jit_t* jit);
+
+const struct jit_stats_t* jit_stats(const struct jit_t* jit);
@@ -0,0 +1,55 @@
+#include <stdint.h> //uint8_t
+#include "cpu-6502.h" //bool
+
+#pragma once
+
+/**
+ * Standard controller on $4016/$4017. Writing 1 to bit 0 of $4016 holds the
+ * strobe, which keeps loading the buttons into the shift register; once it
+ * drops, each read shifts one button out on bit 0, A first, and 1s after
+ * the eighth. Whoever owns the buttons (a front end, a movie) sets 'buttons'
+ * between frames.
+ */
+
+// in shift order
+#define JOY_A      0x01
+#define JOY_B      0x02
+#define JOY_SELECT 0x04
+#define JOY_START  0x08
+#define JOY_UP     0x10
+#define JOY_DOWN   0x20
+#define JOY_LEFT   0x40
+#define JOY_RIGHT  0x80
+
+struct joypad_t
+{
+  uint8_t buttons; // JOY_*, held down now
+  uint8_t shift;   // latched, next bit out is bit 0
+  uint8_t shifted; // bits read since the latch, the rest read as 1
+  bool    strobe;
+};
+
+static inline void joypad_strobe(struct joypad_t* pad, uint8_t value)
+{
+  pad->strobe = value & 1;
+  if (pad->strobe)
+  {
+    pad->shift = pad->buttons;
+    pad->shifted = 0;
+  }
+}
+
+/**
+ * returns: the next button in bit 0
+ */
+static inline uint8_t joypad_read(struct joypad_t* pad)
+{
+  if (pad->strobe)
+    return pad->buttons & 1;
+  if (pad->shifted >= 8)
+    return 1;
+  uint8_t bit = pad->shift & 1;
+  pad->shift >>= 1;
+  pad->shifted++;
+  return bit;
+}
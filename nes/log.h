@@ -0,0 +1,25 @@
+#include <stdio.h>
+
+#pragma once
+
+/**
+ * Compile time log levels. Anything above LOG_LEVEL compiles to nothing, so
+ * the default build does no formatting work in the cpu loop. Build with
+ * -DLOG_LEVEL=LOG_TRACE to get the per instruction register dumps back.
+ */
+#define LOG_NONE  0
+#define LOG_ERROR 1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+#define LOG(level, ...) do { if (LOG_LEVEL >= (level)) printf(__VA_ARGS__); } while (0)
+
+#define log_error(...) LOG(LOG_ERROR, __VA_ARGS__)
+#define log_info(...)  LOG(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) LOG(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) LOG(LOG_TRACE, __VA_ARGS__)
@@ -1,16 +1,25 @@
-#include "cpu-6502.h"
-#include "nes_cart.h"
+#include "nes.h"
+#include "trace.h"
+#include "wav.h"
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h> //atoi()
+#include <unistd.h>
+
+#define DEFAULT_FRAMES 3600 // a minute of a real console
 
 
 void printHelp(char* app)
 {
-   printf("Usage: %s [-?hde] FILE\n", app);
+   printf("Usage: %s [-?hdetwjp] FILE [FRAMES]\n", app);
    printf(" ?\tDisplay this help menu\n");
    printf(" h\tPerform hex dump\n");
    printf(" d\tPerform disassembly\n");
-   printf(" e\tPerform emulation\n");
+   printf(" e\tPerform emulation, FRAMES frames (default %i)\n", DEFAULT_FRAMES);
+   printf(" t\tEmulate and write binary instruction trace to nes.trace (CPU_TRACE builds)\n");
+   printf(" w\tEmulate and write audio to nes.wav\n");
+   printf(" j\tRun the cpu on the x86-64 dynarec\n");
+   printf(" p\tRun the cpu through the predecode cache\n");
    printf("\n");
 }
 
@@ -48,6 +57,11 @@ int main(int argc, char* argv[])
    bool dump=false;
    bool diss=false;
    bool emulate=false;
+   bool trace=false;
+   bool wave=false;
+   bool jit=false;
+   bool predecode=false;
+   int frames=DEFAULT_FRAMES;
    
    if(argc<3)
    {
@@ -72,6 +86,22 @@ int main(int argc, char* argv[])
       
       if( strstr(argv[1], "e") != NULL )
          emulate=true;
+      
+      if( strstr(argv[1], "t") != NULL )
+         trace=true;
+
+      if( strstr(argv[1], "w") != NULL )
+         wave=true;
+
+      if( strstr(argv[1], "j") != NULL )
+         jit=true;
+
+      if( strstr(argv[1], "p") != NULL )
+         predecode=true;
+
+      // tracing and audio come from running it
+      if( trace || wave )
+         emulate=true;
    }
    else
    {
@@ -79,6 +109,8 @@ int main(int argc, char* argv[])
       printHelp(argv[0]);
       return -1;
    }
+   if(argc > 3)
+      frames = atoi(argv[3]);
    
    // FILE* f = (FILE*) fopen(argv[2], "r");
    // if(f != NULL) // if pointer is valid
@@ -94,18 +126,23 @@ int main(int argc, char* argv[])
       // fclose(f); // close file
 
 
-      // read in the nes file
-      uint8_t rtn = nes_read(argv[2]);
-      if (rtn)
-        printf("nes_read failed with error %u\n", rtn);
-      const uint8_t *binary = nes_prg_rom();
-      uint8_t prg_blksz = nes_prg_blksz();
-      int fsize = prg_blksz*(16*1024);
+      // map the nes file and power on
+      static struct nes_t nes;
+      int rtn = nes_open(&nes, argv[2]);
+      if (rtn == NES_BAD_MAPPER)
+        return -1;
+      if (rtn != NES_CART_OK)
+      {
+        printf("%s: %s\n", argv[2], nes_cart_error(rtn));
+        return -1;
+      }
+      const uint8_t *binary = nes.cart.prg;
+      int fsize = nes.cart.prg_size;
       
-      cpu_init();
-      cpu_load_prg(binary, prg_blksz);
-      cpu_reset();
-      cpu_run();
+      if (jit && !nes_set_engine(&nes, NES_ENGINE_JIT))
+        printf("dynarec not available, interpreting\n");
+      else if (predecode)
+        nes_set_engine(&nes, NES_ENGINE_PREDECODE);
 
       // hexdump
       if(dump)
@@ -135,11 +172,32 @@ int main(int argc, char* argv[])
       // emulate
       if(emulate)
       {
-         //mach.execute(binary, fsize);
+         static struct wav_sink_t wav;
+         if (wave && (wav_open(&wav, &nes.apu.ring, APU_SAMPLE_RATE, "nes.wav") != 0))
+           wave = false;
+
+         if (trace)
+           trace_open("nes.trace");
+         for (int i=0; i<frames; i++)
+         {
+           if (!nes_run_frame(&nes))
+           {
+             printf("illegal opcode $%02X at $%04X in frame %i\n", nes.cpu.regs.ir,
+                    (uint16_t)(nes.cpu.regs.pc - 1), i);
+             break;
+           }
+           // the emulation runs far faster than real time, let the writer
+           // drain a frame's worth of samples rather than dropping them
+           while (wave && (ring_size(&nes.apu.ring) > RING_SIZE - 2048))
+             usleep(1000);
+         }
+         trace_close();
+         if (wave)
+           wav_close(&wav);
       }
       
       // cleanup memory
-      // free(binary);
+      nes_close(&nes);
    // }
    
    return 0;
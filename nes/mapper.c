@@ -0,0 +1,427 @@
+#include "mapper.h"
+#include "log.h"
+#include <string.h>
+
+#define PRG_8KB  0x2000
+#define PRG_16KB 0x4000
+#define CHR_1KB  0x400
+
+
+///////////////
+// banking   //
+///////////////
+
+// Bank numbers wrap at the number of banks on the cart, and negative
+// numbers count from the end (-1 is the last bank).
+
+static size_t wrap_bank(int bank, size_t nbanks)
+{
+  if (nbanks == 0)
+    return 0;
+  bank %= (int) nbanks;
+  return (bank < 0) ? bank + nbanks : bank;
+}
+
+
+/**
+ * maps an 8KB PRG bank into one of the four $2000 slots at $8000
+ */
+static void map_prg_8k(struct mapper_t* m, int slot, int bank)
+{
+  size_t b = wrap_bank(bank, m->prg_size / PRG_8KB);
+  bus_map_read(m->bus, 0x80 + slot*0x20, 0x20, &m->prg[b*PRG_8KB], PRG_8KB);
+}
+
+
+/**
+ * maps a 16KB PRG bank at $8000 (slot 0) or $C000 (slot 1)
+ */
+static void map_prg_16k(struct mapper_t* m, int slot, int bank)
+{
+  size_t b = wrap_bank(bank, m->prg_size / PRG_16KB);
+  bus_map_read(m->bus, 0x80 + slot*0x40, 0x40, &m->prg[b*PRG_16KB], PRG_16KB);
+}
+
+
+/**
+ * maps npages consecutive 1KB CHR banks starting at PPU page slot
+ */
+static void map_chr(struct mapper_t* m, int slot, int bank, int npages)
+{
+  for (int i=0; i<npages; i++)
+  {
+    size_t b = wrap_bank(bank + i, m->chr_size / CHR_1KB);
+    m->chr_page[slot+i] = &m->chr[b*CHR_1KB];
+    m->chr_write[slot+i] = m->chr_is_ram ? &m->chr_ram[b*CHR_1KB] : NULL;
+  }
+}
+
+
+static void mapper_bus_write(void* ctx, uint16_t addr, uint8_t value)
+{
+  struct mapper_t* m = (struct mapper_t*) ctx;
+  if (m->write)
+    m->write(m, addr, value);
+}
+
+
+static void set_irq(struct mapper_t* m, bool level)
+{
+  if (m->irq == level)
+    return;
+  m->irq = level;
+  if (m->set_irq)
+    m->set_irq(m->irq_ctx, level);
+}
+
+
+//////////
+// NROM //
+//////////
+
+static void nrom_update(struct mapper_t* m)
+{
+  // NROM-128 mirrors its single bank at $C000
+  map_prg_16k(m, 0, 0);
+  map_prg_16k(m, 1, 1);
+  map_chr(m, 0, 0, 8);
+}
+
+static void nrom_reset(struct mapper_t* m)
+{
+  nrom_update(m);
+}
+
+
+//////////
+// MMC1 //
+//////////
+
+static void mmc1_update(struct mapper_t* m)
+{
+  static const uint8_t mirroring[4] = {
+    MIRROR_SINGLE_LOW, MIRROR_SINGLE_HIGH, MIRROR_VERTICAL, MIRROR_HORIZONTAL
+  };
+  uint8_t control = m->mmc1.control;
+  uint8_t prg = m->mmc1.prg & 0x0F;
+
+  m->mirroring = mirroring[control & 3];
+
+  switch ((control >> 2) & 3)
+  {
+  case 0:
+  case 1: // 32KB, low bit ignored
+    map_prg_16k(m, 0, prg & ~1);
+    map_prg_16k(m, 1, prg | 1);
+    break;
+  case 2: // first bank fixed at $8000
+    map_prg_16k(m, 0, 0);
+    map_prg_16k(m, 1, prg);
+    break;
+  case 3: // last bank fixed at $C000
+    map_prg_16k(m, 0, prg);
+    map_prg_16k(m, 1, -1);
+    break;
+  }
+
+  if (control & 0x10)
+  {
+    // two 4KB banks
+    map_chr(m, 0, m->mmc1.chr0*4, 4);
+    map_chr(m, 4, m->mmc1.chr1*4, 4);
+  }
+  else
+  {
+    // one 8KB bank, low bit ignored
+    map_chr(m, 0, (m->mmc1.chr0 & ~1)*4, 8);
+  }
+}
+
+static void mmc1_reset(struct mapper_t* m)
+{
+  m->mmc1.shift = 0;
+  m->mmc1.count = 0;
+  m->mmc1.control = 0x0C;
+  m->mmc1.chr0 = 0;
+  m->mmc1.chr1 = 0;
+  m->mmc1.prg = 0;
+  mmc1_update(m);
+}
+
+// registers are loaded one bit at a time, lsb first, the fifth write
+// commits to the register picked by address bits 13-14
+static void mmc1_write(struct mapper_t* m, uint16_t addr, uint8_t value)
+{
+  if (value & 0x80)
+  {
+    m->mmc1.shift = 0;
+    m->mmc1.count = 0;
+    m->mmc1.control |= 0x0C;
+    mmc1_update(m);
+    return;
+  }
+
+  m->mmc1.shift |= (value & 1) << m->mmc1.count;
+  if (++m->mmc1.count < 5)
+    return;
+
+  switch ((addr >> 13) & 3)
+  {
+  case 0: m->mmc1.control = m->mmc1.shift; break;
+  case 1: m->mmc1.chr0 = m->mmc1.shift; break;
+  case 2: m->mmc1.chr1 = m->mmc1.shift; break;
+  case 3: m->mmc1.prg = m->mmc1.shift; break;
+  }
+  m->mmc1.shift = 0;
+  m->mmc1.count = 0;
+  mmc1_update(m);
+}
+
+
+///////////
+// UxROM //
+///////////
+
+static void uxrom_update(struct mapper_t* m)
+{
+  map_prg_16k(m, 0, m->latch.bank);
+  map_prg_16k(m, 1, -1);
+  map_chr(m, 0, 0, 8);
+}
+
+static void uxrom_reset(struct mapper_t* m)
+{
+  m->latch.bank = 0;
+  uxrom_update(m);
+}
+
+static void uxrom_write(struct mapper_t* m, uint16_t addr, uint8_t value)
+{
+  m->latch.bank = value;
+  map_prg_16k(m, 0, value);
+}
+
+
+///////////
+// CNROM //
+///////////
+
+static void cnrom_update(struct mapper_t* m)
+{
+  map_prg_16k(m, 0, 0);
+  map_prg_16k(m, 1, 1);
+  map_chr(m, 0, m->latch.bank*8, 8);
+}
+
+static void cnrom_reset(struct mapper_t* m)
+{
+  m->latch.bank = 0;
+  cnrom_update(m);
+}
+
+static void cnrom_write(struct mapper_t* m, uint16_t addr, uint8_t value)
+{
+  m->latch.bank = value;
+  map_chr(m, 0, value*8, 8);
+}
+
+
+//////////
+// MMC3 //
+//////////
+
+static void mmc3_update(struct mapper_t* m)
+{
+  const uint8_t* r = m->mmc3.r;
+
+  // bit 6 swaps the switchable $8000 bank with the fixed second to last
+  if (m->mmc3.select & 0x40)
+  {
+    map_prg_8k(m, 0, -2);
+    map_prg_8k(m, 2, r[6]);
+  }
+  else
+  {
+    map_prg_8k(m, 0, r[6]);
+    map_prg_8k(m, 2, -2);
+  }
+  map_prg_8k(m, 1, r[7]);
+  map_prg_8k(m, 3, -1);
+
+  // bit 7 swaps the 2KB and 1KB halves of the pattern tables
+  int inv = (m->mmc3.select & 0x80) ? 4 : 0;
+  map_chr(m, 0 ^ inv, r[0] & ~1, 2);
+  map_chr(m, 2 ^ inv, r[1] & ~1, 2);
+  map_chr(m, 4 ^ inv, r[2], 1);
+  map_chr(m, 5 ^ inv, r[3], 1);
+  map_chr(m, 6 ^ inv, r[4], 1);
+  map_chr(m, 7 ^ inv, r[5], 1);
+}
+
+static void mmc3_reset(struct mapper_t* m)
+{
+  static const uint8_t power_on[8] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+
+  memcpy(m->mmc3.r, power_on, sizeof(power_on));
+  m->mmc3.select = 0;
+  m->mmc3.irq_latch = 0;
+  m->mmc3.irq_counter = 0;
+  m->mmc3.irq_reload = false;
+  m->mmc3.irq_enabled = false;
+  set_irq(m, false);
+  mmc3_update(m);
+}
+
+// even/odd register pairs at $8000, $A000, $C000 and $E000
+static void mmc3_write(struct mapper_t* m, uint16_t addr, uint8_t value)
+{
+  switch (addr & 0xE001)
+  {
+  case 0x8000:
+    m->mmc3.select = value;
+    mmc3_update(m);
+    break;
+  case 0x8001:
+    m->mmc3.r[m->mmc3.select & 7] = value;
+    mmc3_update(m);
+    break;
+  case 0xA000:
+    if (m->mirroring != MIRROR_FOUR)
+      m->mirroring = (value & 1) ? MIRROR_HORIZONTAL : MIRROR_VERTICAL;
+    break;
+  case 0xA001:
+    // PRG RAM protect, not emulated
+    break;
+  case 0xC000:
+    m->mmc3.irq_latch = value;
+    break;
+  case 0xC001:
+    m->mmc3.irq_counter = 0;
+    m->mmc3.irq_reload = true;
+    break;
+  case 0xE000:
+    m->mmc3.irq_enabled = false;
+    set_irq(m, false);
+    break;
+  case 0xE001:
+    m->mmc3.irq_enabled = true;
+    break;
+  }
+}
+
+static void mmc3_scanline(struct mapper_t* m)
+{
+  if ((m->mmc3.irq_counter == 0) || m->mmc3.irq_reload)
+  {
+    m->mmc3.irq_counter = m->mmc3.irq_latch;
+    m->mmc3.irq_reload = false;
+  }
+  else
+  {
+    m->mmc3.irq_counter--;
+  }
+
+  if ((m->mmc3.irq_counter == 0) && m->mmc3.irq_enabled)
+    set_irq(m, true);
+}
+
+static int mmc3_countdown(const struct mapper_t* m)
+{
+  if (!m->mmc3.irq_enabled || m->irq)
+    return 0;
+  // a reload takes one count, a latch of 0 fires on every one
+  if ((m->mmc3.irq_counter == 0) || m->mmc3.irq_reload)
+    return m->mmc3.irq_latch + 1;
+  return m->mmc3.irq_counter;
+}
+
+
+///////////
+// setup //
+///////////
+
+bool mapper_init(struct mapper_t* m, uint16_t number,
+                 const uint8_t* prg, size_t prg_size,
+                 const uint8_t* chr, size_t chr_size, uint8_t mirroring)
+{
+  memset(m, 0, sizeof(*m));
+  m->number = number;
+  m->prg = prg;
+  m->prg_size = prg_size;
+  m->mirroring = mirroring;
+
+  if (chr_size == 0)
+  {
+    m->chr = m->chr_ram;
+    m->chr_size = CHR_RAM_SIZE;
+    m->chr_is_ram = true;
+  }
+  else
+  {
+    m->chr = chr;
+    m->chr_size = chr_size;
+  }
+
+  switch (number)
+  {
+  case 0:
+    m->name = "NROM";
+    m->reset = nrom_reset;
+    m->update = nrom_update;
+    break;
+  case 1:
+    m->name = "MMC1";
+    m->reset = mmc1_reset;
+    m->update = mmc1_update;
+    m->write = mmc1_write;
+    break;
+  case 2:
+    m->name = "UxROM";
+    m->reset = uxrom_reset;
+    m->update = uxrom_update;
+    m->write = uxrom_write;
+    break;
+  case 3:
+    m->name = "CNROM";
+    m->reset = cnrom_reset;
+    m->update = cnrom_update;
+    m->write = cnrom_write;
+    break;
+  case 4:
+    m->name = "MMC3";
+    m->reset = mmc3_reset;
+    m->update = mmc3_update;
+    m->write = mmc3_write;
+    m->scanline = mmc3_scanline;
+    m->countdown = mmc3_countdown;
+    break;
+  default:
+    log_error("mapper %u is not supported\n", number);
+    return false;
+  }
+
+  log_info("mapper %u (%s) PRG %zuKB CHR %zuKB%s\n", number, m->name,
+           prg_size/1024, m->chr_size/1024, m->chr_is_ram ? " RAM" : "");
+  return true;
+}
+
+
+void mapper_attach(struct mapper_t* m, struct bus_t* bus)
+{
+  m->bus = bus;
+  bus_map_ram(bus, 0x60, 0x20, m->prg_ram, PRG_RAM_SIZE);
+  bus_map_io(bus, 0x80, 0x80, NULL, mapper_bus_write, m);
+  m->reset(m);
+}
+
+
+void mapper_reset(struct mapper_t* m)
+{
+  m->reset(m);
+}
+
+
+void mapper_restore(struct mapper_t* m)
+{
+  m->update(m);
+}
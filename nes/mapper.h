@@ -0,0 +1,135 @@
+#include <stdint.h> //uint8_t
+#include <stddef.h> //size_t
+#include "bus.h"
+#include "cpu-6502.h" //bool
+
+#pragma once
+
+/**
+ * Cartridge boards. A mapper owns the PRG/CHR banking of one cart: it maps
+ * PRG into the cpu bus page table and CHR into eight 1KB pattern table pages
+ * for the PPU. A bank switch only swaps page pointers, ROM is never copied.
+ *
+ * Supported: 0 NROM, 1 MMC1, 2 UxROM, 3 CNROM, 4 MMC3.
+ */
+
+// nametable arrangement, the first two match the iNES header bit
+enum
+{
+  MIRROR_HORIZONTAL,
+  MIRROR_VERTICAL,
+  MIRROR_SINGLE_LOW,
+  MIRROR_SINGLE_HIGH,
+  MIRROR_FOUR
+};
+
+#define PRG_RAM_SIZE 0x2000
+#define CHR_RAM_SIZE 0x2000
+
+struct mapper_t
+{
+  uint16_t       number;
+  const char*    name;
+  struct bus_t*  bus;
+
+  const uint8_t* prg;
+  size_t         prg_size;
+  const uint8_t* chr;
+  size_t         chr_size;
+  bool           chr_is_ram;
+
+  // PPU $0000-$1FFF in 1KB pages, chr_write is NULL for CHR ROM
+  const uint8_t* chr_page[8];
+  uint8_t*       chr_write[8];
+  uint8_t        mirroring;
+
+  // interrupt line to the cpu (MMC3), set_irq is told every change
+  bool           irq;
+  void         (*set_irq)(void* ctx, bool level);
+  void*          irq_ctx;
+
+  void (*reset)(struct mapper_t* m);
+  void (*update)(struct mapper_t* m); // maps what the registers select
+  void (*write)(struct mapper_t* m, uint16_t addr, uint8_t value);
+  void (*scanline)(struct mapper_t* m);
+  int  (*countdown)(const struct mapper_t* m);
+
+  // registers, everything a save state needs besides the RAM
+  union
+  {
+    struct
+    {
+      uint8_t bank;
+    } latch; // UxROM, CNROM
+
+    struct
+    {
+      uint8_t shift;
+      uint8_t count;
+      uint8_t control;
+      uint8_t chr0;
+      uint8_t chr1;
+      uint8_t prg;
+    } mmc1;
+
+    struct
+    {
+      uint8_t select;
+      uint8_t r[8];
+      uint8_t irq_latch;
+      uint8_t irq_counter;
+      bool    irq_reload;
+      bool    irq_enabled;
+    } mmc3;
+  };
+
+  uint8_t        prg_ram[PRG_RAM_SIZE];
+  uint8_t        chr_ram[CHR_RAM_SIZE];
+};
+
+
+/**
+ * Sets up mapper 'number' over the cart's PRG and CHR, which must stay valid
+ * while the mapper is in use. A chr_size of 0 gives the board 8KB of CHR RAM.
+ *
+ * returns: false if the mapper is not supported
+ */
+bool mapper_init(struct mapper_t* m, uint16_t number,
+                 const uint8_t* prg, size_t prg_size,
+                 const uint8_t* chr, size_t chr_size, uint8_t mirroring);
+
+/**
+ * Maps PRG RAM at $6000, PRG ROM at $8000 and the mapper registers into bus,
+ * in their power on state.
+ */
+void mapper_attach(struct mapper_t* m, struct bus_t* bus);
+
+/**
+ * The reset button: puts the registers back in their power on state and
+ * drops the IRQ. PRG and CHR RAM are kept.
+ */
+void mapper_reset(struct mapper_t* m);
+
+/**
+ * Maps the banks the registers select, after they were loaded from a save
+ * state.
+ */
+void mapper_restore(struct mapper_t* m);
+
+/**
+ * Called by the PPU once per rendered scanline, clocks the MMC3 IRQ counter.
+ */
+static inline void mapper_scanline(struct mapper_t* m)
+{
+  if (m->scanline)
+    m->scanline(m);
+}
+
+/**
+ * returns: the number of scanlines mapper_scanline() has to count before
+ * the mapper raises its IRQ, 0 if it won't
+ */
+static inline int mapper_irq_countdown(const struct mapper_t* m)
+{
+  return m->countdown ? m->countdown(m) : 0;
+}
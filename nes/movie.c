@@ -0,0 +1,104 @@
+#include "movie.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// eight buttons, written right to left from bit 7
+static uint8_t parse_pad(const char* field, size_t len)
+{
+  uint8_t buttons = 0;
+
+  for (size_t i=0; (i < len) && (i < 8); i++)
+    if ((field[i] != '.') && (field[i] != ' '))
+      buttons |= 0x80 >> i;
+  return buttons;
+}
+
+static bool parse_frame(const char* line, struct movie_frame_t* frame)
+{
+  // "|commands|port0|port1|port2|"
+  const char* field[5];
+  size_t len[5];
+  const char* p = line + 1;
+
+  for (int i=0; i<4; i++)
+  {
+    const char* end = strchr(p, '|');
+    if (end == NULL)
+      return false;
+    field[i] = p;
+    len[i] = end - p;
+    p = end + 1;
+  }
+
+  frame->commands = atoi(field[0]);
+  frame->pad[0] = parse_pad(field[1], len[1]);
+  frame->pad[1] = parse_pad(field[2], len[2]);
+  return true;
+}
+
+
+int movie_open(struct movie_t* movie, const char* filepath)
+{
+  char line[256];
+  uint32_t size = 0;
+
+  memset(movie, 0, sizeof(*movie));
+  FILE* f = fopen(filepath, "r");
+  if (f == NULL)
+    return MOVIE_OPEN_FAILED;
+
+  while (fgets(line, sizeof(line), f))
+  {
+    if (line[0] != '|')
+    {
+      if (!strncmp(line, "binary 1", 8))
+      {
+        fclose(f);
+        movie_close(movie);
+        return MOVIE_BINARY;
+      }
+      continue;
+    }
+
+    if (movie->nframes == size)
+    {
+      size = size ? size*2 : 4096;
+      movie->frames = realloc(movie->frames, size * sizeof(*movie->frames));
+    }
+    if (!parse_frame(line, &movie->frames[movie->nframes]))
+    {
+      log_error("movie line %u: %s", movie->nframes, line);
+      fclose(f);
+      movie_close(movie);
+      return MOVIE_BAD_LINE;
+    }
+    movie->nframes++;
+  }
+
+  fclose(f);
+  log_info("movie %s: %u frames\n", filepath, movie->nframes);
+  return MOVIE_OK;
+}
+
+
+void movie_close(struct movie_t* movie)
+{
+  free(movie->frames);
+  memset(movie, 0, sizeof(*movie));
+}
+
+
+const char* movie_error(int error)
+{
+  switch (error)
+  {
+  case MOVIE_OK:          return "ok";
+  case MOVIE_OPEN_FAILED: return "cannot open file";
+  case MOVIE_BINARY:      return "binary movies are not supported";
+  case MOVIE_BAD_LINE:    return "bad input line";
+  }
+  return "unknown error";
+}
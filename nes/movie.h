@@ -0,0 +1,50 @@
+#include <stdint.h> //uint8_t
+#include "cpu-6502.h" //bool
+
+#pragma once
+
+/**
+ * Input movies in the FCEUX FM2 text format: "key value" header lines, then
+ * one line of input per frame from power on,
+ *
+ *   |commands|RLDUTSBA|RLDUTSBA||
+ *
+ * a field per controller port (empty when nothing is plugged in), where
+ * any character but ' ' and '.' holds the button down. Of the commands
+ * only soft reset (1) is carried out. Binary FM2 and the Four Score are
+ * not supported.
+ */
+
+#define MOVIE_RESET 0x01 // commands
+
+struct movie_frame_t
+{
+  uint8_t commands;
+  uint8_t pad[2]; // JOY_* for $4016 and $4017
+};
+
+struct movie_t
+{
+  struct movie_frame_t* frames;
+  uint32_t              nframes;
+};
+
+// movie_open() results
+enum
+{
+  MOVIE_OK,
+  MOVIE_OPEN_FAILED,
+  MOVIE_BINARY,
+  MOVIE_BAD_LINE
+};
+
+/**
+ * Reads the whole input log into memory.
+ *
+ * returns: MOVIE_OK, or an error for movie_error()
+ */
+int movie_open(struct movie_t* movie, const char* filepath);
+
+void movie_close(struct movie_t* movie);
+
+const char* movie_error(int error);
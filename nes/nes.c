@@ -0,0 +1,282 @@
+#include "nes.h"
+#include "log.h"
+#include <string.h>
+#include <time.h>
+
+
+// $4000-$40FF: APU, OAM DMA, controllers, the rest of the page is unused
+// cartridge space
+static uint8_t io_read(void* ctx, uint16_t addr)
+{
+  struct nes_t* nes = (struct nes_t*) ctx;
+
+  switch (addr)
+  {
+  case 0x4015:
+    return apu_read_status(&nes->apu);
+  // the other bits are open bus, the high byte of the address
+  case 0x4016:
+    return (addr >> 8) | joypad_read(&nes->pad[0]);
+  case 0x4017:
+    return (addr >> 8) | joypad_read(&nes->pad[1]);
+  }
+  return addr >> 8;
+}
+
+static void io_write(void* ctx, uint16_t addr, uint8_t value)
+{
+  struct nes_t* nes = (struct nes_t*) ctx;
+
+  if ((addr <= 0x4013) || (addr == 0x4015) || (addr == 0x4017))
+  {
+    apu_write(&nes->apu, addr, value);
+    return;
+  }
+
+  switch (addr)
+  {
+  case 0x4014: // OAM DMA, the cpu is halted for 513 cycles, 514 on odd ones
+    {
+      uint8_t page[256];
+      for (int i=0; i<256; i++)
+        page[i] = bus_read(&nes->bus, (value << 8) | i);
+      ppu_oam_dma(&nes->ppu, page);
+      nes->cpu.regs.cycles += 513 + (nes->cpu.regs.cycles & 1);
+    }
+    break;
+  case 0x4016: // one strobe line to both ports
+    joypad_strobe(&nes->pad[0], value);
+    joypad_strobe(&nes->pad[1], value);
+    break;
+  }
+}
+
+
+static void nmi(void* ctx)
+{
+  struct nes_t* nes = (struct nes_t*) ctx;
+  cpu_nmi(&nes->cpu);
+}
+
+static void mapper_irq(void* ctx, bool level)
+{
+  struct nes_t* nes = (struct nes_t*) ctx;
+  cpu_irq(&nes->cpu, IRQ_MAPPER, level);
+}
+
+static void apu_irq(void* ctx, bool level)
+{
+  struct nes_t* nes = (struct nes_t*) ctx;
+  cpu_irq(&nes->cpu, IRQ_APU, level);
+}
+
+
+int nes_open(struct nes_t* nes, const char* filepath)
+{
+  int rtn = nes_cart_open(&nes->cart, filepath);
+  if (rtn != NES_CART_OK)
+    return rtn;
+
+  struct nes_cart_t* cart = &nes->cart;
+  if (!mapper_init(&nes->mapper, cart->mapper, cart->prg, cart->prg_size,
+                   cart->chr, cart->chr_size, cart->mirroring))
+  {
+    nes_cart_close(cart);
+    return NES_BAD_MAPPER;
+  }
+
+  bus_init(&nes->bus);
+  mapper_attach(&nes->mapper, &nes->bus);
+  if (cart->trainer)
+    memcpy(&nes->mapper.prg_ram[0x1000], cart->trainer, 512);
+
+  cpu_init(&nes->cpu, &nes->bus);
+  nes->mapper.set_irq = mapper_irq;
+  nes->mapper.irq_ctx = nes;
+
+  ppu_init(&nes->ppu, &nes->mapper, &nes->cpu.regs.cycles);
+  nes->ppu.nmi = nmi;
+  nes->ppu.nmi_ctx = nes;
+  ppu_attach(&nes->ppu, &nes->bus);
+
+  apu_init(&nes->apu, &nes->bus, &nes->cpu.regs.cycles);
+  nes->apu.set_irq = apu_irq;
+  nes->apu.irq_ctx = nes;
+
+  bus_map_io(&nes->bus, 0x40, 1, io_read, io_write, nes);
+
+  nes->engine = NES_ENGINE_INTERP;
+  nes->jit = NULL;
+  nes->decode = NULL;
+  nes->frames = 0;
+  memset(nes->pad, 0, sizeof(nes->pad));
+
+  cpu_reset(&nes->cpu);
+  return NES_CART_OK;
+}
+
+
+void nes_close(struct nes_t* nes)
+{
+  jit_destroy(nes->jit);
+  nes->jit = NULL;
+  decode_cache_destroy(nes->decode);
+  nes->decode = NULL;
+  nes_cart_close(&nes->cart);
+}
+
+
+void nes_reset(struct nes_t* nes)
+{
+  ppu_reset(&nes->ppu);
+  apu_reset(&nes->apu);
+  mapper_reset(&nes->mapper);
+  cpu_soft_reset(&nes->cpu);
+}
+
+
+int nes_engine_by_name(const char* name)
+{
+  static const char* const names[] = {
+    [NES_ENGINE_INTERP] = "interp",
+    [NES_ENGINE_JIT] = "jit",
+    [NES_ENGINE_JIT_CHECK] = "check",
+    [NES_ENGINE_PREDECODE] = "predecode",
+  };
+
+  for (int i=0; i<(int)(sizeof(names)/sizeof(names[0])); i++)
+    if (!strcmp(name, names[i]))
+      return i;
+  return -1;
+}
+
+
+bool nes_set_engine(struct nes_t* nes, int engine)
+{
+  struct jit_t* jit = NULL;
+
+  if ((engine == NES_ENGINE_JIT) || (engine == NES_ENGINE_JIT_CHECK))
+  {
+    jit = jit_create(&nes->cpu, &nes->bus, engine == NES_ENGINE_JIT_CHECK);
+    if (jit == NULL)
+      return false;
+  }
+  jit_destroy(nes->jit);
+  nes->jit = jit;
+  decode_cache_destroy(nes->decode);
+  nes->decode = (engine == NES_ENGINE_PREDECODE) ? decode_cache_create() : NULL;
+  nes->engine = engine;
+  return true;
+}
+
+
+// The PPU and APU only run when the cpu touches them, so they are caught up
+// to wherever one of them could raise its IRQ next for it to come in time.
+static uint64_t next_irq(struct nes_t* nes, uint64_t until)
+{
+  int lines = mapper_irq_countdown(&nes->mapper);
+  if (lines > 0)
+  {
+    uint64_t cycle = ppu_next_mapper_scanline(&nes->ppu, lines);
+    if (cycle < until)
+      until = cycle;
+  }
+  uint64_t cycle = apu_next_irq(&nes->apu);
+  if (cycle < until)
+    until = cycle;
+  // at least one instruction, the estimates may be a bit early
+  if (until <= nes->cpu.regs.cycles)
+    until = nes->cpu.regs.cycles + 1;
+  return until;
+}
+
+static bool run_cpu(struct nes_t* nes, uint64_t until)
+{
+  bool ok = true;
+
+  if (nes->jit)
+    ok = jit_run(nes->jit, until);
+  else if (nes->decode)
+  {
+    while (ok && (nes->cpu.regs.cycles < until))
+      ok = cpu_step_cached(&nes->cpu, nes->decode);
+  }
+  while (ok && (nes->cpu.regs.cycles < until))
+    ok = cpu_step(&nes->cpu);
+  return ok;
+}
+
+
+bool nes_run_frame(struct nes_t* nes)
+{
+  uint64_t vblank = ppu_next_vblank(&nes->ppu);
+  bool ok = true;
+
+  // in between the PPU only has to catch up when the cpu touches it, which
+  // the register handlers do themselves
+  while (ok && (nes->cpu.regs.cycles < vblank))
+  {
+    uint64_t until = next_irq(nes, vblank);
+    ok = run_cpu(nes, until);
+    if (until < vblank)
+    {
+      ppu_catch_up(&nes->ppu, nes->cpu.regs.cycles);
+      apu_catch_up(&nes->apu, nes->cpu.regs.cycles);
+    }
+  }
+
+  ppu_catch_up(&nes->ppu, nes->cpu.regs.cycles);
+  apu_end_frame(&nes->apu, nes->cpu.regs.cycles);
+  nes->frames++;
+  return ok;
+}
+
+
+bool nes_step_frame(struct nes_t* nes, struct nes_frame_t* frame)
+{
+  frame->number = nes->frames;
+  bool ok = nes_run_frame(nes);
+
+  frame->pixels = nes->ppu.framebuffer;
+  frame->samples = nes->audio;
+  frame->nsamples = ring_pop(&nes->apu.ring, nes->audio, NES_FRAME_SAMPLES);
+  return ok;
+}
+
+
+bool nes_play_movie(struct nes_t* nes, const struct movie_t* movie, uint32_t n)
+{
+  if (n >= movie->nframes)
+  {
+    nes->pad[0].buttons = nes->pad[1].buttons = 0;
+    return false;
+  }
+
+  const struct movie_frame_t* f = &movie->frames[n];
+  nes->pad[0].buttons = f->pad[0];
+  nes->pad[1].buttons = f->pad[1];
+  if (f->commands & MOVIE_RESET)
+    nes_reset(nes);
+  return true;
+}
+
+
+// the framebuffer is a multiple of 8 bytes, not necessarily aligned to 8
+uint64_t nes_hash_frame(const uint8_t* pixels, uint64_t h)
+{
+  for (size_t i=0; i<PPU_WIDTH*PPU_HEIGHT; i+=8)
+  {
+    uint64_t word;
+    memcpy(&word, &pixels[i], 8);
+    h ^= word;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+double nes_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
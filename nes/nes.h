@@ -0,0 +1,175 @@
+#include <stdint.h> //uint8_t
+#include "cpu-6502.h"
+#include "bus.h"
+#include "mapper.h"
+#include "nes_cart.h"
+#include "ppu.h"
+#include "apu.h"
+#include "jit.h"
+#include "joypad.h"
+#include "movie.h"
+
+#pragma once
+
+#define NES_FRAME_SAMPLES 2048 // room for a frame's audio, ~735 samples
+#define NES_FRAME_RATE    60.0988 // NTSC
+
+/**
+ * The console: a cart plugged into the cpu bus, the PPU, the APU, two
+ * controllers and the $4000 I/O page, run a frame at a time.
+ */
+struct nes_t
+{
+  struct nes_cart_t cart;
+  struct cpu_t      cpu;
+  struct bus_t      bus;
+  struct mapper_t   mapper;
+  struct ppu_t      ppu;
+  struct apu_t      apu;
+  struct joypad_t   pad[2]; // $4016, $4017
+
+  int               engine; // NES_ENGINE_*
+  struct jit_t*     jit;    // NULL unless running translated code
+  struct decode_cache_t* decode; // NULL unless predecoding
+
+  uint64_t          frames; // completed since power on
+  int16_t           audio[NES_FRAME_SAMPLES]; // nes_step_frame() output
+};
+
+// What nes_step_frame() produced, valid until the next call
+struct nes_frame_t
+{
+  uint64_t       number;   // frames completed before this one
+  const uint8_t* pixels;   // PPU_WIDTH x PPU_HEIGHT master palette indices
+  const int16_t* samples;  // mono, APU_SAMPLE_RATE
+  size_t         nsamples;
+};
+
+// how the cpu is run
+enum
+{
+  NES_ENGINE_INTERP,    // cpu_step()
+  NES_ENGINE_JIT,       // translated blocks, see jit.h
+  NES_ENGINE_JIT_CHECK, // translated blocks checked against the interpreter
+  NES_ENGINE_PREDECODE  // cpu_step_cached()
+};
+
+/**
+ * returns: NES_ENGINE_* for "interp", "predecode", "jit" or "check", -1 if
+ * name is none of them
+ */
+int nes_engine_by_name(const char* name);
+
+/**
+ * Opens the cart at filepath and powers the console on.
+ *
+ * returns: NES_CART_OK, a nes_cart_open() error, or NES_BAD_MAPPER
+ */
+int nes_open(struct nes_t* nes, const char* filepath);
+
+#define NES_BAD_MAPPER 100
+
+void nes_close(struct nes_t* nes);
+
+/**
+ * Presses reset: the PPU, APU and mapper go back to their reset state now,
+ * the cpu runs its reset sequence before the next instruction. Memory is
+ * kept.
+ */
+void nes_reset(struct nes_t* nes);
+
+/**
+ * Switches the cpu engine, the interpreter is the default.
+ *
+ * returns: false if the engine isn't available, the old one is kept then
+ */
+bool nes_set_engine(struct nes_t* nes, int engine);
+
+/**
+ * Runs the cpu until the PPU enters vblank, at which point framebuffer holds
+ * a complete picture and the frame's audio samples are in apu.ring.
+ *
+ * returns: false if the cpu hit an opcode it can't execute
+ */
+bool nes_run_frame(struct nes_t* nes);
+
+/**
+ * nes_run_frame() for callers that want the frame handed to them: frame gets
+ * the picture and the audio samples the frame made, which are taken out of
+ * apu.ring. Nothing else may be reading the ring then.
+ *
+ * returns: false if the cpu hit an opcode it can't execute
+ */
+bool nes_step_frame(struct nes_t* nes, struct nes_frame_t* frame);
+
+/**
+ * Holds the buttons of frame n of movie for the next frame, and presses
+ * reset ahead of it if the movie does.
+ *
+ * returns: false past the end of the movie, all buttons are released then
+ */
+bool nes_play_movie(struct nes_t* nes, const struct movie_t* movie, uint32_t n);
+
+#define NES_HASH_SEED 0xcbf29ce484222325ULL
+
+/**
+ * Hashes a picture onto h, FNV-1a over 64 bit words. A run hash chains every
+ * frame from NES_HASH_SEED, a frame hash is one picture from it. The tools
+ * that report hashes all use this one, so their runs compare.
+ *
+ * returns: the new hash
+ */
+uint64_t nes_hash_frame(const uint8_t* pixels, uint64_t h);
+
+/**
+ * returns: seconds on a monotonic clock, for timing runs
+ */
+double nes_now();
+
+
+/**
+ * Serializes the whole console, cpu, RAM, PPU, APU, mapper registers and
+ * PRG/CHR RAM, controllers, into a versioned blob for the same cart. The
+ * picture isn't kept, the next frame redraws it. Pass a NULL buf to get
+ * the size.
+ *
+ * returns: the size of the state, nothing was written if it is over size
+ */
+size_t nes_save_state(const struct nes_t* nes, uint8_t* buf, size_t size);
+
+/**
+ * Loads a blob from nes_save_state() of the same cart and version, and
+ * drops whatever the cpu engine had cached about memory.
+ *
+ * returns: false if the blob doesn't fit this console, which is unchanged
+ */
+bool nes_load_state(struct nes_t* nes, const uint8_t* buf, size_t size);
+
+/**
+ * A frozen copy of a console that any number of forks start from. Each
+ * fork is a private mapping of the copy, so they share all the memory none
+ * of them wrote to, and only the pages a fork touches get copied. The
+ * console it came from must stay open while forks run, they share its cart.
+ */
+struct nes_snapshot_t
+{
+  int    fd;
+  size_t size;
+};
+
+/**
+ * returns: false if the snapshot can't be made
+ */
+bool nes_snapshot(const struct nes_t* nes, struct nes_snapshot_t* snap);
+
+void nes_snapshot_close(struct nes_snapshot_t* snap);
+
+/**
+ * A console that continues from snap, on the same engine. Close it with
+ * nes_fork_close(), not nes_close().
+ *
+ * returns: NULL if it can't be mapped
+ */
+struct nes_t* nes_fork(const struct nes_snapshot_t* snap);
+
+void nes_fork_close(struct nes_t* nes);
@@ -1,7 +1,12 @@
-
-#include <stdint.h>
+#include "nes_cart.h"
+#include "mapper.h" //MIRROR_*
+#include "log.h"
 #include <stdio.h>
-#include <stdlib.h> //malloc
+#include <string.h>
+#include <fcntl.h> //open()
+#include <unistd.h> //close()
+#include <sys/mman.h> //mmap()
+#include <sys/stat.h> //fstat()
 
 /**
  * Sample RAM map for games
@@ -37,108 +42,181 @@ The format of the header is as follows:
 9: Flags 9
 10: Flags 10 (unofficial)
 11-15: Zero filled
+
+NES 2.0 is flagged by bits 2-3 of flags 7 being 2 and uses bytes 8-15:
+
+8: Mapper bits 8-11 (low nibble), submapper (high nibble)
+9: PRG ROM size MSB (low nibble), CHR ROM size MSB (high nibble). An MSB of
+   $F turns the LSB into exponent-multiplier form: 2^E * (MM*2+1) bytes with
+   E in bits 2-7 and MM in bits 0-1
+10: PRG RAM shift count (low nibble), PRG NVRAM shift count (high nibble)
+11: CHR RAM shift count (low nibble), CHR NVRAM shift count (high nibble)
+   a shift count n means 64<<n bytes, 0 means none
+12-15: Timing, console type, misc ROMs, default expansion device
  */
 
 
-uint8_t header[16];
-uint8_t trainer[512];
-uint8_t *prg_rom = NULL;
-uint8_t *chr_rom = NULL;
-uint8_t *inst_rom = NULL;
-uint8_t *prom = NULL;
-uint8_t *title = NULL;
 
-//
-uint8_t prg_rom_blksz = 0;
-uint8_t chr_rom_blksz = 0;
-uint8_t prg_ram_blksz = 0;
+#define HEADER_SIZE  16
+#define TRAINER_SIZE 512
+#define PRG_UNIT     (16*1024)
+#define CHR_UNIT     (8*1024)
 
-// flags
-uint8_t mirror_flag = 0;
-uint8_t prg_ram_flag = 0;
-uint8_t trainer_flag = 0;
 
+// NES 2.0 ROM size, lsb from bytes 4/5 and msb nibble from byte 9
+static uint64_t nes2_rom_size(uint8_t lsb, uint8_t msb, size_t unit)
+{
+	if (msb == 0x0F)
+	{
+		uint8_t exponent = lsb >> 2;
+		if (exponent > 40)
+			return UINT64_MAX; // can't be in the file anyway
+		return ((uint64_t)1 << exponent) * ((lsb & 3)*2 + 1);
+	}
+	return (uint64_t)((msb << 8) | lsb) * unit;
+}
 
-/**
- * returns: 0 on success
- */
-uint8_t nes_read(const char *filepath)
+// NES 2.0 RAM size from a shift count nibble
+static size_t nes2_ram_size(uint8_t shift)
+{
+	return shift ? (size_t)64 << shift : 0;
+}
+
+
+static int parse_header(struct nes_cart_t* cart)
 {
-	//uint8_t rtn = 0;
-	printf("%s: filepath=%s\n", __func__, filepath);
+	const uint8_t* header = cart->data;
+	uint64_t prg_size, chr_size;
+
+	// is this the right file format
+	if (cart->size < HEADER_SIZE ||
+		header[0] != 0x4e ||
+		header[1] != 0x45 ||
+		header[2] != 0x53 ||
+		header[3] != 0x1a)
+		return NES_CART_BAD_HEADER;
+
+	cart->nes2 = (header[7] & 0x0C) == 0x08;
+	cart->battery = (header[6] & 0x02) ? 1 : 0;
+	if (header[6] & 0x08)
+		cart->mirroring = MIRROR_FOUR;
+	else
+		cart->mirroring = (header[6] & 0x01) ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+
+	if (cart->nes2)
+	{
+		cart->mapper = (header[6] >> 4) | (header[7] & 0xF0) | ((header[8] & 0x0F) << 8);
+		cart->submapper = header[8] >> 4;
+		prg_size = nes2_rom_size(header[4], header[9] & 0x0F, PRG_UNIT);
+		chr_size = nes2_rom_size(header[5], header[9] >> 4, CHR_UNIT);
+		cart->prg_ram_size = nes2_ram_size(header[10] & 0x0F) + nes2_ram_size(header[10] >> 4);
+		cart->chr_ram_size = nes2_ram_size(header[11] & 0x0F) + nes2_ram_size(header[11] >> 4);
+	}
+	else
+	{
+		// old dumps carry junk such as "DiskDude!" in bytes 7-15, the high
+		// mapper nibble is only trusted when the tail is zero filled
+		bool clean = !header[12] && !header[13] && !header[14] && !header[15];
+		cart->mapper = (header[6] >> 4) | (clean ? (header[7] & 0xF0) : 0);
+		cart->submapper = 0;
+		prg_size = (uint64_t)header[4] * PRG_UNIT;
+		chr_size = (uint64_t)header[5] * CHR_UNIT;
+		cart->prg_ram_size = (header[8] ? header[8] : 1) * (8*1024);
+		cart->chr_ram_size = chr_size ? 0 : CHR_UNIT;
+	}
 
-	FILE* f = (FILE*) fopen(filepath, "r");
-	if(f != NULL) // if pointer is valid
+	// the mappers switch PRG in windows of up to 16KB and CHR in 1KB pages,
+	// smaller NES 2.0 exponent sizes would map past the end
+	if ((prg_size < PRG_UNIT) || (chr_size % 1024))
 	{
-		// read the header
-		printf("%s: read header\n", __func__);
-		if (fread(header, sizeof(uint8_t), 16, f) != 16)
-		{
-			fclose(f);
-			return 1;
-		}
-
-		// is this the right file format
-		if (header[0] != 0x4e || 
-			header[1] != 0x45 ||
-			header[2] != 0x53 ||
-			header[3] != 0x1a)
-		{
-			fclose(f);
-			return 2;
-		}
-
-		prg_rom_blksz = header[4];
-		chr_rom_blksz = header[5];
-
-		// read flags from header
-		mirror_flag  = (header[6] & 0x01) ? 1 : 0;
-		prg_ram_flag = (header[6] & 0x02) ? 1 : 0;
-		trainer_flag = (header[6] & 0x04) ? 1 : 0;
-		printf("mirror:%u prg_ram:%u trainer:%u\n", mirror_flag, prg_ram_flag, trainer_flag);
-
-		prg_ram_blksz = header[7];
-		
-		// check flag 6 to see if trainer is available
-		if (trainer_flag)
-		{
-			printf("%s: read trainer 512 bytes\n", __func__);
-			fread(trainer, sizeof(uint8_t), 512, f);
-		}
-
-		// 
-		if (prg_rom_blksz > 0)
-		{
-			printf("%s: PRG ROM: %u blocks\n", __func__, prg_rom_blksz);
-			prg_rom = (uint8_t*) malloc(prg_rom_blksz*(16*1024));
-			fread(prg_rom, sizeof(uint8_t), prg_rom_blksz*(16*1024), f);
-		}
-
-		if (chr_rom_blksz > 0)
-		{
-			printf("%s: CHR ROM: %u blocks\n", __func__, chr_rom_blksz);
-			chr_rom = (uint8_t*) malloc(chr_rom_blksz*(8*1024));
-			fread(chr_rom, sizeof(uint8_t), chr_rom_blksz*(8*1024), f);
-		}
-
-		printf("%s: close file\n", __func__);
-		fclose(f);
+		log_error("%s: %llu bytes of PRG or %llu of CHR can't be mapped\n", __func__,
+		          (unsigned long long)prg_size, (unsigned long long)chr_size);
+		return NES_CART_BAD_SIZE;
 	}
 
-	return 0;
+	// the sections must fit in the file, anything after them is ignored
+	uint64_t offset = HEADER_SIZE;
+	if (header[6] & 0x04)
+	{
+		cart->trainer = &cart->data[offset];
+		offset += TRAINER_SIZE;
+	}
+	// one at a time, a sum of huge NES 2.0 sizes can wrap around
+	if ((offset > cart->size) ||
+		(prg_size > cart->size - offset) ||
+		(chr_size > cart->size - offset - prg_size))
+	{
+		log_error("%s: %llu bytes of PRG and %llu of CHR in a %zu byte file\n", __func__,
+		          (unsigned long long)prg_size, (unsigned long long)chr_size, cart->size);
+		return NES_CART_BAD_SIZE;
+	}
+
+	cart->prg = &cart->data[offset];
+	cart->prg_size = prg_size;
+	cart->chr = chr_size ? &cart->data[offset + prg_size] : NULL;
+	cart->chr_size = chr_size;
+	return NES_CART_OK;
 }
 
-uint8_t nes_prg_blksz()
+
+int nes_cart_open(struct nes_cart_t* cart, const char* filepath)
 {
-	return prg_rom_blksz;
+	struct stat st;
+	int rtn;
+
+	log_info("%s: filepath=%s\n", __func__, filepath);
+	memset(cart, 0, sizeof(*cart));
+
+	int fd = open(filepath, O_RDONLY);
+	if (fd < 0)
+		return NES_CART_OPEN_FAILED;
+
+	if (fstat(fd, &st) != 0 || st.st_size < HEADER_SIZE)
+	{
+		close(fd);
+		return NES_CART_BAD_HEADER;
+	}
+
+	// read only and private, every cart of the same file shares the page cache
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping keeps the file open
+	if (data == MAP_FAILED)
+		return NES_CART_OPEN_FAILED;
+
+	cart->data = (const uint8_t*) data;
+	cart->size = st.st_size;
+
+	rtn = parse_header(cart);
+	if (rtn != NES_CART_OK)
+	{
+		nes_cart_close(cart);
+		return rtn;
+	}
+
+	log_info("%s: %s mapper %u.%u PRG %zuKB CHR %zuKB mirror:%u battery:%u trainer:%u\n",
+	         __func__, cart->nes2 ? "NES 2.0" : "iNES", cart->mapper, cart->submapper,
+	         cart->prg_size/1024, cart->chr_size/1024, cart->mirroring, cart->battery,
+	         cart->trainer != NULL);
+	return NES_CART_OK;
 }
 
-const uint8_t* nes_prg_rom()
+
+void nes_cart_close(struct nes_cart_t* cart)
 {
-	return prg_rom;
+	if (cart->data != NULL)
+		munmap((void*) cart->data, cart->size);
+	memset(cart, 0, sizeof(*cart));
 }
 
-const uint8_t* nes_chr_rom()
+
+const char* nes_cart_error(int error)
 {
-	return chr_rom;
-}
\ No newline at end of file
+	switch (error)
+	{
+	case NES_CART_OK:          return "ok";
+	case NES_CART_OPEN_FAILED: return "cannot open file";
+	case NES_CART_BAD_HEADER:  return "not an iNES file";
+	case NES_CART_BAD_SIZE:    return "ROM sizes do not match the file";
+	}
+	return "unknown error";
+}
@@ -1,9 +1,50 @@
+#include <stdint.h> //uint8_t
+#include <stddef.h> //size_t
+#include "cpu-6502.h" //bool
 
+#pragma once
 
-uint8_t nes_read(const char *filepath);
+/**
+ * An iNES or NES 2.0 cartridge image, mapped read only from its file. PRG,
+ * CHR and the trainer point into the mapping, so opening a cart copies
+ * nothing and any number of carts can be open at once.
+ */
+struct nes_cart_t
+{
+  const uint8_t* data; // the whole file
+  size_t         size;
 
-uint8_t nes_prg_blksz();
+  const uint8_t* prg;
+  size_t         prg_size;
+  const uint8_t* chr; // NULL when the board has CHR RAM
+  size_t         chr_size;
+  const uint8_t* trainer; // 512 bytes for $7000, or NULL
 
-const uint8_t* nes_prg_rom();
+  uint16_t       mapper;
+  uint8_t        submapper;
+  uint8_t        mirroring; // MIRROR_HORIZONTAL, MIRROR_VERTICAL or MIRROR_FOUR
+  bool           battery;
+  bool           nes2;
+  size_t         prg_ram_size;
+  size_t         chr_ram_size;
+};
 
-const uint8_t* nes_chr_rom();
+// nes_cart_open() results
+enum
+{
+  NES_CART_OK,
+  NES_CART_OPEN_FAILED,
+  NES_CART_BAD_HEADER,
+  NES_CART_BAD_SIZE
+};
+
+/**
+ * Maps the file and checks that the sections the header describes fit in it.
+ *
+ * returns: NES_CART_OK, or an error for nes_cart_error()
+ */
+int nes_cart_open(struct nes_cart_t* cart, const char* filepath);
+
+void nes_cart_close(struct nes_cart_t* cart);
+
+const char* nes_cart_error(int error);
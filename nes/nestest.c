@@ -0,0 +1,224 @@
+/**
+ * nestest.nes log comparison.
+ *
+ * Runs nestest.nes in automation mode (PC=$C000, no PPU) and writes a
+ * nestest-format line for every instruction into a buffer:
+ *
+ *   C000  4C F5 C5  JMP $C5F5    ...    A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+ *
+ * The buffer is then compared line by line against a reference log, stopping
+ * at the first mismatch. PC, the instruction bytes, the registers, and the
+ * PPU/CYC columns (when the reference has them) must match; the disassembly
+ * is not compared since loggers annotate it differently. The PPU position is
+ * derived from the CPU cycle count, three dots per cycle.
+ *
+ * The result codes the ROM leaves in $02/$03 are always checked. A missing
+ * reference log is a failure, an empty LOG argument skips the comparison on
+ * purpose.
+ *
+ *   usage: nestest [ROM [LOG]]  (defaults: nestest.nes nestest.log)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "cpu-6502.h"
+#include "bus.h"
+#include "nes_cart.h"
+
+#define NESTEST_START 0xC000
+#define NESTEST_END   0xC66E // final RTS of the automated run
+#define MAX_LINES     10000  // the reference log has 8991
+#define LINE_LEN      128
+#define REGS_COL      48     // "A:" in a nestest line
+#define REGS_LEN      25     // "A:00 X:00 Y:00 P:24 SP:FD"
+
+static char (*lines)[LINE_LEN];
+static int  nlines;
+
+// nestest needs nothing but RAM around the ROM
+static uint8_t      mem[0x10000];
+static struct bus_t bus;
+static struct cpu_t cpu;
+
+
+static void disassemble(char* out, size_t size, uint16_t pc)
+{
+	uint8_t op = get_memory(&cpu, pc);
+	uint8_t lo = get_memory(&cpu, pc+1);
+	uint8_t hi = get_memory(&cpu, pc+2);
+	char name[4];
+
+	// skip the '*' of unofficial opcodes, it has its own column
+	const char* src = opcode_name[op] + (opcode_name[op][0] == '*');
+	for(int i=0; i<4; i++)
+		name[i] = toupper(src[i]);
+
+	switch(opcode_mode[op])
+	{
+	case MODE_IMM: snprintf(out, size, "%s #$%02X", name, lo); break;
+	case MODE_ZP:  snprintf(out, size, "%s $%02X", name, lo); break;
+	case MODE_ZPX: snprintf(out, size, "%s $%02X,X", name, lo); break;
+	case MODE_ZPY: snprintf(out, size, "%s $%02X,Y", name, lo); break;
+	case MODE_ABS: snprintf(out, size, "%s $%02X%02X", name, hi, lo); break;
+	case MODE_ABX: snprintf(out, size, "%s $%02X%02X,X", name, hi, lo); break;
+	case MODE_ABY: snprintf(out, size, "%s $%02X%02X,Y", name, hi, lo); break;
+	case MODE_IND: snprintf(out, size, "%s ($%02X%02X)", name, hi, lo); break;
+	case MODE_IZX: snprintf(out, size, "%s ($%02X,X)", name, lo); break;
+	case MODE_IZY: snprintf(out, size, "%s ($%02X),Y", name, lo); break;
+	case MODE_REL: snprintf(out, size, "%s $%04X", name, (uint16_t)(pc + 2 + (int8_t)lo)); break;
+	default:
+		// the accumulator forms of the shifts print their operand
+		if((op & 0x9f) == 0x0a)
+			snprintf(out, size, "%s A", name);
+		else
+			snprintf(out, size, "%s", name);
+	}
+}
+
+
+static void log_line(char* out)
+{
+	uint8_t op = get_memory(&cpu, cpu.regs.pc);
+	char bytes[10] = "";
+	char dis[40];
+
+	for(int i=0; i<opcode_len[op]; i++)
+		sprintf(&bytes[i ? i*3-1 : 0], i ? " %02X" : "%02X", get_memory(&cpu, cpu.regs.pc+i));
+	disassemble(dis, sizeof(dis), cpu.regs.pc);
+
+	uint64_t dot = cpu.regs.cycles * 3;
+	snprintf(out, LINE_LEN, "%04X  %-8s %c%-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3u,%3u CYC:%llu",
+	         cpu.regs.pc, bytes, opcode_name[op][0] == '*' ? '*' : ' ', dis,
+	         cpu.regs.acc, cpu.regs.x, cpu.regs.y, get_proc_status(&cpu) | 0x20, cpu.regs.sp,
+	         (unsigned)(dot / 341 % 262), (unsigned)(dot % 341),
+	         (unsigned long long)cpu.regs.cycles);
+}
+
+
+static void run(const struct nes_cart_t* cart)
+{
+	bus_init_flat(&bus, mem);
+	cpu_init(&cpu, &bus);
+	cpu_load_prg(&cpu, cart->prg, cart->prg_size / (16*1024));
+	cpu.regs.pc = NESTEST_START;
+	cpu.regs.sp = 0xFD;
+	set_proc_status(&cpu, 0x24);
+	cpu.regs.cycles = 7; // the power-up reset
+
+	for(nlines=0; nlines<MAX_LINES; )
+	{
+		uint16_t pc = cpu.regs.pc;
+		log_line(lines[nlines++]);
+		if((pc == NESTEST_END) || !cpu_step(&cpu))
+			break;
+	}
+}
+
+
+// true if the reference line agrees with ours on every compared column
+static bool same_line(const char* ref, const char* got)
+{
+	size_t len = strcspn(ref, "\r\n");
+
+	// PC and instruction bytes
+	if(len < REGS_COL + REGS_LEN)
+		return false;
+	for(int i=0; i<14; i++)
+		if(ref[i] != got[i])
+			return false;
+
+	// A X Y P SP
+	const char* regs_ref = strstr(ref, "A:");
+	if((regs_ref == NULL) || (strncmp(regs_ref, &got[REGS_COL], REGS_LEN) != 0))
+		return false;
+
+	// PPU and CYC, only present in the newer logs
+	const char* ppu = strstr(regs_ref, "PPU:");
+	if(ppu != NULL)
+	{
+		const char* ours = strstr(got, "PPU:");
+		size_t n = len - (ppu - ref);
+		if((strlen(ours) != n) || (strncmp(ppu, ours, n) != 0))
+			return false;
+	}
+	return true;
+}
+
+
+static bool compare(const char* path)
+{
+	if(path[0] == 0)
+	{
+		printf("no reference log given, comparison skipped\n");
+		return true;
+	}
+
+	FILE* f = fopen(path, "r");
+	if(f == NULL)
+	{
+		printf("cannot open reference log %s\n", path);
+		return false;
+	}
+
+	char ref[256];
+	int n = 0;
+	bool ok = true;
+	while(fgets(ref, sizeof(ref), f) != NULL)
+	{
+		if(n == nlines)
+		{
+			printf("line %d: trace ended early\n  expected: %s", n+1, ref);
+			ok = false;
+			break;
+		}
+		if(!same_line(ref, lines[n]))
+		{
+			if(n > 0)
+				printf("line %d: %s\n", n, lines[n-1]);
+			printf("line %d mismatch\n  expected: %s  got:      %s\n", n+1, ref, lines[n]);
+			ok = false;
+			break;
+		}
+		n++;
+	}
+	fclose(f);
+
+	if(ok)
+		printf("%d lines match %s\n", n, path);
+	return ok;
+}
+
+
+int main(int argc, char* argv[])
+{
+	const char* rom = (argc > 1) ? argv[1] : "nestest.nes";
+	const char* log = (argc > 2) ? argv[2] : "nestest.log";
+
+	struct nes_cart_t cart;
+	int rtn = nes_cart_open(&cart, rom);
+	if(rtn != NES_CART_OK)
+	{
+		printf("%s: %s\n", rom, nes_cart_error(rtn));
+		return 1;
+	}
+
+	lines = malloc(MAX_LINES * sizeof(*lines));
+	run(&cart);
+
+	bool ok = compare(log);
+
+	// nestest leaves the number of the first failed test in $02 (official)
+	// and $03 (unofficial opcodes)
+	uint8_t official = get_memory(&cpu, 0x02);
+	uint8_t unofficial = get_memory(&cpu, 0x03);
+	printf("%d instructions, %llu cycles, $02=%02X $03=%02X\n",
+	       nlines, (unsigned long long)cpu.regs.cycles, official, unofficial);
+	if(official || unofficial)
+		ok = false;
+
+	free(lines);
+	nes_cart_close(&cart);
+	printf("nestest result: %s\n", ok ? "success" : "failed");
+	return ok ? 0 : 1;
+}
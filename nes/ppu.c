@@ -0,0 +1,671 @@
+#include "ppu.h"
+#include "log.h"
+#include <string.h>
+#include <pthread.h>
+
+const uint32_t ppu_rgb[64] = {
+  0x7C7C7C, 0x0000FC, 0x0000BC, 0x4428BC, 0x940084, 0xA80020, 0xA81000, 0x881400,
+  0x503000, 0x007800, 0x006800, 0x005800, 0x004058, 0x000000, 0x000000, 0x000000,
+  0xBCBCBC, 0x0078F8, 0x0058F8, 0x6844FC, 0xD800CC, 0xE40058, 0xF83800, 0xE45C10,
+  0xAC7C00, 0x00B800, 0x00A800, 0x00A844, 0x008888, 0x000000, 0x000000, 0x000000,
+  0xF8F8F8, 0x3CBCFC, 0x6888FC, 0x9878F8, 0xF878F8, 0xF85898, 0xF87858, 0xFCA044,
+  0xF8B800, 0xB8F818, 0x58D854, 0x58F898, 0x00E8D8, 0x787878, 0x000000, 0x000000,
+  0xFCFCFC, 0xA4E4FC, 0xB8B8F8, 0xD8B8F8, 0xF8B8F8, 0xF8A4C0, 0xF0D0B0, 0xFCE0A8,
+  0xF8D878, 0xD8F878, 0xB8F8B8, 0xB8F8D8, 0x00FCFC, 0xF8D8F8, 0x000000, 0x000000
+};
+
+// PPUCTRL
+#define CTRL_INCREMENT  0x04
+#define CTRL_SPRITE_PT  0x08
+#define CTRL_BG_PT      0x10
+#define CTRL_TALL       0x20
+#define CTRL_NMI        0x80
+
+// PPUMASK
+#define MASK_GRAY       0x01
+#define MASK_BG_LEFT    0x02
+#define MASK_SPRITE_LEFT 0x04
+#define MASK_BG         0x08
+#define MASK_SPRITES    0x10
+
+// PPUSTATUS
+#define STATUS_OVERFLOW 0x20
+#define STATUS_HIT      0x40
+#define STATUS_VBLANK   0x80
+
+#define RENDERING(p) ((p)->mask & (MASK_BG | MASK_SPRITES))
+
+// one pixel per byte, lowest address first
+#define BYTES(b) (0x0101010101010101ULL * (b))
+
+
+///////////////////////
+// expansion tables  //
+///////////////////////
+
+// A pattern table byte holds one bit plane of an 8 pixel sliver, leftmost
+// pixel in bit 7. expand[] spreads those bits over the bytes of a uint64_t
+// so both planes combine into 8 two-bit pixels with one shift and or,
+// expand_flip[] does the same mirrored for horizontally flipped sprites.
+static uint64_t expand[256];
+static uint64_t expand_flip[256];
+
+static void build_expand_tables()
+{
+  for (int i=0; i<256; i++)
+  {
+    expand[i] = 0;
+    expand_flip[i] = 0;
+    for (int b=0; b<8; b++)
+    {
+      if (i & (0x80 >> b))
+      {
+        expand[i] |= 1ULL << (8*b);
+        expand_flip[i] |= 1ULL << (8*(7-b));
+      }
+    }
+  }
+}
+
+static inline uint64_t sliver(uint8_t lo, uint8_t hi, const uint64_t* table)
+{
+  return table[lo] | (table[hi] << 1);
+}
+
+// or attribute bits into the opaque pixels of a sliver
+static inline uint64_t colorize(uint64_t px, uint8_t attr)
+{
+  uint64_t opaque = (px | (px >> 1)) & BYTES(1);
+  return px | (opaque * attr);
+}
+
+
+////////////////
+// tile cache //
+////////////////
+
+static void decode_tile(struct ppu_tile_page_t* t, int tile)
+{
+  const uint8_t* planes = t->chr + tile*16;
+
+  for (int y=0; y<8; y++)
+  {
+    t->row[tile*8 + y] = sliver(planes[y], planes[y+8], expand);
+    t->flip[tile*8 + y] = sliver(planes[y], planes[y+8], expand_flip);
+  }
+  t->valid |= 1ULL << tile;
+}
+
+// the decoded page for CHR memory chr, taking over the next page in turn
+// if none has it yet
+static struct ppu_tile_page_t* find_page(struct ppu_t* p, const uint8_t* chr)
+{
+  for (int i=0; i<PPU_TILE_PAGES; i++)
+    if (p->tiles[i].chr == chr)
+      return &p->tiles[i];
+
+  struct ppu_tile_page_t* t = &p->tiles[p->victim];
+  p->victim = (p->victim + 1) % PPU_TILE_PAGES;
+  for (int i=0; i<8; i++)
+    if (p->bound[i] == t)
+      p->bound_chr[i] = NULL;
+  t->chr = chr;
+  t->valid = 0;
+  return t;
+}
+
+// the decoded row of the sliver at pattern address pat, the mapper page
+// compared on every fetch catches bank switches
+static inline uint64_t tile_row(struct ppu_t* p, uint16_t pat, bool flip)
+{
+  int n = (pat >> 10) & 7;
+  const uint8_t* chr = p->mapper->chr_page[n];
+
+  if (p->bound_chr[n] != chr)
+  {
+    p->bound[n] = find_page(p, chr);
+    p->bound_chr[n] = chr;
+  }
+
+  struct ppu_tile_page_t* t = p->bound[n];
+  int tile = (pat >> 4) & 63;
+  if (!(t->valid & (1ULL << tile)))
+    decode_tile(t, tile);
+  return (flip ? t->flip : t->row)[tile*8 + (pat & 7)];
+}
+
+// a CHR RAM page may be mapped more than once, every copy goes
+static void invalidate_tile(struct ppu_t* p, const uint8_t* chr, int tile)
+{
+  for (int i=0; i<PPU_TILE_PAGES; i++)
+    if (p->tiles[i].chr == chr)
+      p->tiles[i].valid &= ~(1ULL << tile);
+}
+
+// leaves the decoded rows, a fork shouldn't copy them just to drop them
+void ppu_flush_tiles(struct ppu_t* p)
+{
+  for (int i=0; i<PPU_TILE_PAGES; i++)
+  {
+    p->tiles[i].chr = NULL;
+    p->tiles[i].valid = 0;
+  }
+  memset(p->bound, 0, sizeof(p->bound));
+  memset(p->bound_chr, 0, sizeof(p->bound_chr));
+  p->victim = 0;
+}
+
+
+////////////
+// memory //
+////////////
+
+static uint16_t nametable_index(const struct ppu_t* p, uint16_t addr)
+{
+  uint16_t table = (addr >> 10) & 3;
+
+  switch (p->mapper->mirroring)
+  {
+  case MIRROR_HORIZONTAL:  table >>= 1; break;
+  case MIRROR_VERTICAL:    table &= 1; break;
+  case MIRROR_SINGLE_LOW:  table = 0; break;
+  case MIRROR_SINGLE_HIGH: table = 1; break;
+  }
+  return (table << 10) | (addr & 0x3FF);
+}
+
+// $3F10/$3F14/$3F18/$3F1C mirror the backdrop entries below them
+static uint8_t palette_index(uint16_t addr)
+{
+  addr &= 0x1F;
+  return ((addr & 0x13) == 0x10) ? addr & ~0x10 : addr;
+}
+
+static inline uint8_t chr_read(const struct ppu_t* p, uint16_t addr)
+{
+  return p->mapper->chr_page[(addr >> 10) & 7][addr & 0x3FF];
+}
+
+static uint8_t ppu_read(struct ppu_t* p, uint16_t addr)
+{
+  addr &= 0x3FFF;
+  if (addr < 0x2000)
+    return chr_read(p, addr);
+  if (addr < 0x3F00)
+    return p->vram[nametable_index(p, addr)];
+  return p->palette[palette_index(addr)];
+}
+
+static void ppu_write(struct ppu_t* p, uint16_t addr, uint8_t value)
+{
+  addr &= 0x3FFF;
+  if (addr < 0x2000)
+  {
+    uint8_t* page = p->mapper->chr_write[addr >> 10];
+    if (page && (page[addr & 0x3FF] != value))
+    {
+      page[addr & 0x3FF] = value;
+      invalidate_tile(p, page, (addr >> 4) & 63);
+    }
+  }
+  else if (addr < 0x3F00)
+  {
+    p->vram[nametable_index(p, addr)] = value;
+  }
+  else
+  {
+    p->palette[palette_index(addr)] = value & 0x3F;
+  }
+}
+
+
+///////////////
+// rendering //
+///////////////
+
+// background of one scanline as palette indices 0-15 (0 transparent),
+// starting at fine x
+static void render_background(struct ppu_t* p, uint8_t* line)
+{
+  uint8_t buf[PPU_WIDTH + 16];
+  uint16_t v = p->v;
+  uint16_t table = (p->ctrl & CTRL_BG_PT) ? 0x1000 : 0;
+  uint16_t fine_y = (v >> 12) & 7;
+
+  // 33 tiles cover the line for any fine x
+  for (int tile=0; tile<33; tile++)
+  {
+    uint8_t index = p->vram[nametable_index(p, 0x2000 | (v & 0x0FFF))];
+    uint8_t attr = p->vram[nametable_index(p, 0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07))];
+    attr = (attr >> (((v >> 4) & 4) | (v & 2))) & 3;
+
+    uint16_t pat = table | (index << 4) | fine_y;
+    uint64_t px = colorize(tile_row(p, pat, false), attr << 2);
+    memcpy(&buf[tile*8], &px, 8);
+
+    // coarse x, wrapping into the next nametable
+    if ((v & 0x1F) == 31)
+      v = (v & ~0x1F) ^ 0x0400;
+    else
+      v++;
+  }
+
+  memcpy(line, &buf[p->x], PPU_WIDTH);
+  if (!(p->mask & MASK_BG_LEFT))
+    memset(line, 0, 8);
+}
+
+// sprites of one scanline as palette indices 16-31 (0 transparent), with
+// the priority bit in bit 7 and sprite 0 marked in zero[]
+static void render_sprites(struct ppu_t* p, uint8_t* line, uint8_t* zero)
+{
+  int height = (p->ctrl & CTRL_TALL) ? 16 : 8;
+  int count = 0;
+
+  memset(line, 0, PPU_WIDTH);
+  memset(zero, 0, PPU_WIDTH);
+
+  for (int i=0; i<64; i++)
+  {
+    const uint8_t* s = &p->oam[i*4];
+    int row = p->scanline - (s[0] + 1);
+    if ((row < 0) || (row >= height))
+      continue;
+
+    if (++count > 8)
+    {
+      p->status |= STATUS_OVERFLOW;
+      break;
+    }
+
+    uint8_t tile = s[1];
+    uint8_t attr = s[2];
+    uint16_t table;
+
+    if (attr & 0x80)
+      row = height - 1 - row;
+    if (height == 16)
+    {
+      table = (tile & 1) ? 0x1000 : 0;
+      tile &= 0xFE;
+      if (row > 7)
+      {
+        tile++;
+        row -= 8;
+      }
+    }
+    else
+    {
+      table = (p->ctrl & CTRL_SPRITE_PT) ? 0x1000 : 0;
+    }
+
+    uint16_t pat = table | (tile << 4) | row;
+    uint64_t bits = tile_row(p, pat, attr & 0x40);
+    uint8_t px[8];
+    memcpy(px, &bits, 8);
+
+    // earlier sprites win, so only fill pixels that are still empty
+    uint8_t color = 0x10 | ((attr & 3) << 2) | ((attr & 0x20) << 2);
+    for (int j=0; j<8; j++)
+    {
+      int x = s[3] + j;
+      if ((x < PPU_WIDTH) && px[j] && !line[x])
+      {
+        line[x] = color | px[j];
+        zero[x] = (i == 0);
+      }
+    }
+  }
+
+  if (!(p->mask & MASK_SPRITE_LEFT))
+  {
+    memset(line, 0, 8);
+    memset(zero, 0, 8);
+  }
+}
+
+static void render_scanline(struct ppu_t* p)
+{
+  uint8_t* out = &p->framebuffer[p->scanline * PPU_WIDTH];
+  uint8_t bg[PPU_WIDTH];
+  uint8_t sp[PPU_WIDTH];
+  uint8_t zero[PPU_WIDTH];
+  uint8_t gray = (p->mask & MASK_GRAY) ? 0x30 : 0x3F;
+
+  if (!RENDERING(p))
+  {
+    memset(out, p->palette[0] & gray, PPU_WIDTH);
+    return;
+  }
+
+  if (p->mask & MASK_BG)
+    render_background(p, bg);
+  else
+    memset(bg, 0, sizeof(bg));
+
+  if (p->mask & MASK_SPRITES)
+  {
+    render_sprites(p, sp, zero);
+  }
+  else
+  {
+    memset(sp, 0, sizeof(sp));
+    memset(zero, 0, sizeof(zero));
+  }
+
+  for (int x=0; x<PPU_WIDTH; x++)
+  {
+    uint8_t b = bg[x];
+    uint8_t s = sp[x];
+
+    if (zero[x] && b && (x != 255))
+      p->status |= STATUS_HIT;
+
+    uint8_t index = (s && (!(s & 0x80) || !b)) ? (s & 0x1F) : b;
+    out[x] = p->palette[palette_index(index)] & gray;
+  }
+}
+
+// loopy's scroll updates at the end of a rendered line
+static void increment_y(struct ppu_t* p)
+{
+  uint16_t v = p->v;
+
+  if ((v & 0x7000) != 0x7000)
+  {
+    v += 0x1000;
+  }
+  else
+  {
+    v &= ~0x7000;
+    uint16_t y = (v & 0x03E0) >> 5;
+    if (y == 29)
+    {
+      y = 0;
+      v ^= 0x0800;
+    }
+    else if (y == 31)
+    {
+      y = 0;
+    }
+    else
+    {
+      y++;
+    }
+    v = (v & ~0x03E0) | (y << 5);
+  }
+  p->v = v;
+}
+
+
+////////////
+// timing //
+////////////
+
+static int line_length(const struct ppu_t* p)
+{
+  // the pre-render line of odd frames skips a dot while rendering
+  if ((p->scanline == PPU_PRERENDER) && p->odd_frame && RENDERING(p))
+    return PPU_DOTS - 1;
+  return PPU_DOTS;
+}
+
+// dots within a line where something happens
+static int next_event(int dot)
+{
+  if (dot < 1)
+    return 1;   // vblank set / clear
+  if (dot < 256)
+    return 256; // line rendered, scroll updated
+  if (dot < 260)
+    return 260; // MMC3 counts the line
+  return PPU_DOTS;
+}
+
+static void handle_event(struct ppu_t* p)
+{
+  bool visible = p->scanline < PPU_HEIGHT;
+
+  switch (p->dot)
+  {
+  case 1:
+    if (p->scanline == PPU_VBLANK)
+    {
+      p->status |= STATUS_VBLANK;
+      if ((p->ctrl & CTRL_NMI) && p->nmi)
+        p->nmi(p->nmi_ctx);
+    }
+    else if (p->scanline == PPU_PRERENDER)
+    {
+      p->status &= ~(STATUS_VBLANK | STATUS_HIT | STATUS_OVERFLOW);
+    }
+    break;
+
+  case 256:
+    if (visible)
+      render_scanline(p);
+    if ((visible || (p->scanline == PPU_PRERENDER)) && RENDERING(p))
+    {
+      increment_y(p);
+      p->v = (p->v & ~0x041F) | (p->t & 0x041F);
+      if (p->scanline == PPU_PRERENDER)
+        p->v = (p->v & 0x041F) | (p->t & ~0x041F);
+    }
+    break;
+
+  case 260:
+    if ((visible || (p->scanline == PPU_PRERENDER)) && RENDERING(p))
+      mapper_scanline(p->mapper);
+    break;
+  }
+}
+
+void ppu_catch_up(struct ppu_t* p, uint64_t cycle)
+{
+  uint64_t target = cycle * 3;
+
+  while (p->dots < target)
+  {
+    int len = line_length(p);
+    int next = next_event(p->dot);
+    if (next > len)
+      next = len;
+
+    if ((uint64_t)(next - p->dot) > target - p->dots)
+    {
+      p->dot += target - p->dots;
+      p->dots = target;
+      break;
+    }
+    p->dots += next - p->dot;
+    p->dot = next;
+
+    if (p->dot == len)
+    {
+      p->dot = 0;
+      if (++p->scanline == PPU_LINES)
+      {
+        p->scanline = 0;
+        p->frame++;
+        p->odd_frame = !p->odd_frame;
+      }
+    }
+    else
+    {
+      handle_event(p);
+    }
+  }
+}
+
+uint64_t ppu_next_vblank(const struct ppu_t* p)
+{
+  // lines to go until (241, 1), wrapping through the pre-render line
+  bool wraps = (p->scanline > PPU_VBLANK) || ((p->scanline == PPU_VBLANK) && (p->dot >= 1));
+  int lines = PPU_VBLANK - p->scanline + (wraps ? PPU_LINES : 0);
+  uint64_t dots = (uint64_t)lines * PPU_DOTS + 1 - p->dot;
+
+  if (wraps && p->odd_frame && RENDERING(p))
+    dots--;
+
+  // round up so catching up to the result reaches the dot
+  return (p->dots + dots + 2) / 3;
+}
+
+uint64_t ppu_next_mapper_scanline(const struct ppu_t* p, int n)
+{
+  int line = p->scanline;
+  uint64_t dots = 0;
+
+  // whole lines from the start of this one, then back to where we are
+  if (p->dot >= 260)
+  {
+    dots = PPU_DOTS;
+    line = (line + 1) % PPU_LINES;
+  }
+  while (1)
+  {
+    if (((line < PPU_HEIGHT) || (line == PPU_PRERENDER)) && (--n == 0))
+      break;
+    dots += PPU_DOTS;
+    line = (line + 1) % PPU_LINES;
+  }
+  dots += 260 - p->dot;
+
+  // up to two odd frames may skip a dot on the way, early is fine
+  dots = (dots > 2) ? dots - 2 : 0;
+  return (p->dots + dots) / 3;
+}
+
+
+///////////////
+// registers //
+///////////////
+
+static uint8_t register_read(void* ctx, uint16_t addr)
+{
+  struct ppu_t* p = (struct ppu_t*) ctx;
+  ppu_catch_up(p, *p->clock);
+
+  switch (addr & 7)
+  {
+  case 2: // PPUSTATUS
+    p->open_bus = (p->status & 0xE0) | (p->open_bus & 0x1F);
+    p->status &= ~STATUS_VBLANK;
+    p->w = false;
+    break;
+  case 4: // OAMDATA
+    p->open_bus = p->oam[p->oam_addr];
+    break;
+  case 7: // PPUDATA, buffered except for the palette
+    if ((p->v & 0x3FFF) < 0x3F00)
+    {
+      p->open_bus = p->read_buffer;
+      p->read_buffer = ppu_read(p, p->v);
+    }
+    else
+    {
+      p->open_bus = (p->open_bus & 0xC0) | ppu_read(p, p->v);
+      p->read_buffer = ppu_read(p, p->v - 0x1000);
+    }
+    p->v += (p->ctrl & CTRL_INCREMENT) ? 32 : 1;
+    break;
+  }
+  return p->open_bus;
+}
+
+static void register_write(void* ctx, uint16_t addr, uint8_t value)
+{
+  struct ppu_t* p = (struct ppu_t*) ctx;
+  ppu_catch_up(p, *p->clock);
+  p->open_bus = value;
+
+  switch (addr & 7)
+  {
+  case 0: // PPUCTRL
+    // enabling NMI during vblank fires it right away
+    if (!(p->ctrl & CTRL_NMI) && (value & CTRL_NMI) && (p->status & STATUS_VBLANK) && p->nmi)
+      p->nmi(p->nmi_ctx);
+    p->ctrl = value;
+    p->t = (p->t & ~0x0C00) | ((value & 3) << 10);
+    break;
+  case 1: // PPUMASK
+    p->mask = value;
+    break;
+  case 3: // OAMADDR
+    p->oam_addr = value;
+    break;
+  case 4: // OAMDATA
+    p->oam[p->oam_addr++] = value;
+    break;
+  case 5: // PPUSCROLL
+    if (!p->w)
+    {
+      p->t = (p->t & ~0x001F) | (value >> 3);
+      p->x = value & 7;
+    }
+    else
+    {
+      p->t = (p->t & 0x0C1F) | ((value & 7) << 12) | ((value & 0xF8) << 2);
+    }
+    p->w = !p->w;
+    break;
+  case 6: // PPUADDR
+    if (!p->w)
+    {
+      p->t = (p->t & 0x00FF) | ((value & 0x3F) << 8);
+    }
+    else
+    {
+      p->t = (p->t & 0xFF00) | value;
+      p->v = p->t;
+    }
+    p->w = !p->w;
+    break;
+  case 7: // PPUDATA
+    ppu_write(p, p->v, value);
+    p->v += (p->ctrl & CTRL_INCREMENT) ? 32 : 1;
+    break;
+  }
+}
+
+
+void ppu_oam_dma(struct ppu_t* p, const uint8_t* page)
+{
+  ppu_catch_up(p, *p->clock);
+  for (int i=0; i<256; i++)
+    p->oam[(uint8_t)(p->oam_addr + i)] = page[i];
+}
+
+
+///////////
+// setup //
+///////////
+
+void ppu_init(struct ppu_t* p, struct mapper_t* mapper, const uint64_t* clock)
+{
+  // shared by every PPU, built once whichever thread gets here first
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, build_expand_tables);
+
+  memset(p, 0, sizeof(*p));
+  p->mapper = mapper;
+  p->clock = clock;
+  p->dots = *clock * 3;
+}
+
+
+void ppu_reset(struct ppu_t* p)
+{
+  ppu_catch_up(p, *p->clock);
+  p->ctrl = 0;
+  p->mask = 0;
+  p->t = 0;
+  p->x = 0;
+  p->w = false;
+  p->read_buffer = 0;
+}
+
+void ppu_attach(struct ppu_t* p, struct bus_t* bus)
+{
+  bus_map_io(bus, 0x20, 0x20, register_read, register_write, p);
+}
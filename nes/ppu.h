@@ -0,0 +1,133 @@
+#include <stdint.h> //uint8_t
+#include "cpu-6502.h" //bool
+#include "mapper.h"
+#include "bus.h"
+
+#pragma once
+
+/**
+ * 2C02 picture processor.
+ *
+ * The PPU is not stepped in lockstep with the cpu. It keeps its own dot
+ * counter and is caught up to the cpu cycle counter only when something can
+ * observe it: a register access, or the frame loop waiting for vblank. Each
+ * visible scanline is rendered in one go when the catch-up passes its dot
+ * 256, a tile sliver (8 pixels) per pattern fetch, so register writes take
+ * effect from the next scanline on. The slivers come from a cache of decoded
+ * CHR pages, see ppu_tile_page_t.
+ *
+ * The output is a 256x240 framebuffer of master palette indices (0-63),
+ * ppu_rgb converts them to colors.
+ */
+
+#define PPU_WIDTH  256
+#define PPU_HEIGHT 240
+
+#define PPU_DOTS     341 // per scanline
+#define PPU_LINES    262 // per frame, 240 visible, 1 idle, 20 vblank, 1 pre-render
+#define PPU_VBLANK   241 // first vblank scanline
+#define PPU_PRERENDER 261
+
+#define PPU_TILE_PAGES 16 // decoded 1KB CHR pages kept, 8 mapped plus spares
+
+// The 64 tiles of a 1KB CHR page with both bit planes already combined: a
+// row of 8 two-bit pixels per uint64_t, one byte each, leftmost pixel in the
+// low byte, and the same mirrored for flipped sprites. Pages are keyed by
+// the CHR memory they decode, so a bank switch only picks another page, and
+// tiles are decoded on first use. A CHR RAM write undoes its tile.
+struct ppu_tile_page_t
+{
+  const uint8_t* chr;   // NULL if unused
+  uint64_t       valid; // a bit per decoded tile
+  uint64_t       row[64*8];
+  uint64_t       flip[64*8];
+};
+
+struct ppu_t
+{
+  struct mapper_t* mapper; // CHR pages, nametable mirroring, scanline irq
+
+  // catch up reference, 3 dots per cpu cycle
+  const uint64_t* clock;
+  uint64_t dots; // since power on
+  int      scanline;
+  int      dot;
+  uint64_t frame;
+  bool     odd_frame;
+
+  // registers
+  uint8_t  ctrl;
+  uint8_t  mask;
+  uint8_t  status;
+  uint8_t  oam_addr;
+  uint8_t  read_buffer;
+  uint8_t  open_bus;
+
+  // scroll: current and temporary vram address, fine x, write toggle
+  uint16_t v;
+  uint16_t t;
+  uint8_t  x;
+  bool     w;
+
+  // vblank interrupt to the cpu
+  void   (*nmi)(void* ctx);
+  void*    nmi_ctx;
+
+  uint8_t  vram[0x1000]; // nametables, 4KB for four screen boards
+  uint8_t  palette[32];
+  uint8_t  oam[256];
+
+  uint8_t  framebuffer[PPU_WIDTH*PPU_HEIGHT];
+
+  // decoded CHR, and which page each of the 8 mapper pages was last found in
+  struct ppu_tile_page_t  tiles[PPU_TILE_PAGES];
+  struct ppu_tile_page_t* bound[8];
+  const uint8_t*          bound_chr[8];
+  int                     victim;
+};
+
+// master palette as 0xRRGGBB
+extern const uint32_t ppu_rgb[64];
+
+/**
+ * Powers up the PPU. clock is the cpu cycle counter it catches up to.
+ */
+void ppu_init(struct ppu_t* ppu, struct mapper_t* mapper, const uint64_t* clock);
+
+/**
+ * The reset button: clears PPUCTRL, PPUMASK, the scroll, the write toggle
+ * and the read buffer. Status, OAM and memory are kept.
+ */
+void ppu_reset(struct ppu_t* ppu);
+
+/**
+ * Maps the registers at $2000-$3FFF, mirrored every 8 bytes.
+ */
+void ppu_attach(struct ppu_t* ppu, struct bus_t* bus);
+
+/**
+ * Runs the PPU up to cpu cycle 'cycle'.
+ */
+void ppu_catch_up(struct ppu_t* ppu, uint64_t cycle);
+
+/**
+ * returns: the cpu cycle at which the next vblank starts
+ */
+uint64_t ppu_next_vblank(const struct ppu_t* ppu);
+
+/**
+ * returns: a cpu cycle at or before the one at which mapper_scanline() is
+ * called for the nth time from now, if rendering stays on
+ */
+uint64_t ppu_next_mapper_scanline(const struct ppu_t* ppu, int n);
+
+/**
+ * Drops every decoded tile. For when CHR RAM changed behind the PPU's back,
+ * or the console moved in memory.
+ */
+void ppu_flush_tiles(struct ppu_t* ppu);
+
+/**
+ * $4014: copies a page of cpu memory to OAM, starting at OAMADDR.
+ */
+void ppu_oam_dma(struct ppu_t* ppu, const uint8_t* page);
@@ -0,0 +1,70 @@
+#include <stdint.h> //int16_t
+#include <stddef.h> //size_t
+#include <stdatomic.h>
+
+#pragma once
+
+/**
+ * Lock-free single producer, single consumer ring of audio samples. The
+ * emulation thread pushes, an audio callback or writer thread pops. head and
+ * tail only ever grow and sit on their own cache lines, the release/acquire
+ * pair on them publishes the samples in between.
+ */
+
+#define RING_SIZE 8192 // samples, must be a power of two
+
+struct sample_ring_t
+{
+  _Alignas(64) atomic_size_t head; // next write, owned by the producer
+  _Alignas(64) atomic_size_t tail; // next read, owned by the consumer
+  int16_t data[RING_SIZE];
+};
+
+
+static inline void ring_init(struct sample_ring_t* r)
+{
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+}
+
+/**
+ * returns: the number of samples pushed, less than n if the ring is full
+ */
+static inline size_t ring_push(struct sample_ring_t* r, const int16_t* in, size_t n)
+{
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  size_t space = RING_SIZE - (head - tail);
+
+  if (n > space)
+    n = space;
+  for (size_t i=0; i<n; i++)
+    r->data[(head + i) & (RING_SIZE - 1)] = in[i];
+
+  atomic_store_explicit(&r->head, head + n, memory_order_release);
+  return n;
+}
+
+/**
+ * returns: the number of samples popped, less than n if the ring ran dry
+ */
+static inline size_t ring_pop(struct sample_ring_t* r, int16_t* out, size_t n)
+{
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  size_t avail = head - tail;
+
+  if (n > avail)
+    n = avail;
+  for (size_t i=0; i<n; i++)
+    out[i] = r->data[(tail + i) & (RING_SIZE - 1)];
+
+  atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+  return n;
+}
+
+static inline size_t ring_size(struct sample_ring_t* r)
+{
+  return atomic_load_explicit(&r->head, memory_order_acquire) -
+         atomic_load_explicit(&r->tail, memory_order_acquire);
+}
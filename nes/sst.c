@@ -0,0 +1,431 @@
+/**
+ * Table driven 6502 tests.
+ *
+ * Runs single instruction test vectors in the format of the public
+ * SingleStepTests suites (one JSON file per opcode, use the nes6502 set since
+ * the 2A03 has no decimal mode):
+ *
+ *   [ { "name": "a9 42 00",
+ *       "initial": { "pc": 4096, "s": 253, "a": 0, "x": 0, "y": 0, "p": 36,
+ *                    "ram": [ [4096, 169], [4097, 66] ] },
+ *       "final":   { ... same fields ... },
+ *       "cycles":  [ [4096, 169, "read"], [4097, 66, "read"] ] }, ... ]
+ *
+ * Each case loads the initial registers and RAM into a cpu on a flat 64KB
+ * bus, executes one instruction, and must end with exactly the final
+ * registers and RAM, in as many cycles as the cycles list is long. The bus
+ * activity itself isn't compared, the cpu doesn't do the dummy accesses.
+ * "cycles" may also be a plain count, which is what the vectors in
+ * tests/6502 use. B and bit 5 of p don't exist in the register and are
+ * ignored.
+ *
+ * Prints a pass rate per opcode and exits non zero when any case failed.
+ *
+ *   usage: sst [-v] FILE|DIR...
+ */
+#include "cpu-6502.h"
+#include "bus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+
+#define MAX_RAM 64 // RAM entries per state, the suites use at most a dozen
+
+struct state_t
+{
+  uint16_t pc;
+  uint8_t  s, a, x, y, p;
+  int      nram;
+  uint16_t ram_addr[MAX_RAM];
+  uint8_t  ram_value[MAX_RAM];
+};
+
+struct case_t
+{
+  char           name[64];
+  struct state_t initial;
+  struct state_t final;
+  uint32_t       cycles;
+};
+
+static uint8_t      mem[0x10000];
+static struct bus_t bus;
+static struct cpu_t cpu;
+
+static uint32_t pass[256];
+static uint32_t total[256];
+static bool     verbose;
+
+
+//////////
+// JSON //
+//////////
+
+// Just enough JSON for the test files: a cursor over the whole file and a
+// parse error sets 'bad' and stops every later read.
+struct json_t
+{
+  const char* p;
+  const char* end;
+  bool        bad;
+};
+
+static void ws(struct json_t* j)
+{
+  while ((j->p < j->end) && isspace((unsigned char)*j->p))
+    j->p++;
+}
+
+static bool peek(struct json_t* j, char c)
+{
+  ws(j);
+  return !j->bad && (j->p < j->end) && (*j->p == c);
+}
+
+static bool accept(struct json_t* j, char c)
+{
+  if (!peek(j, c))
+    return false;
+  j->p++;
+  return true;
+}
+
+static void expect(struct json_t* j, char c)
+{
+  if (!accept(j, c))
+    j->bad = true;
+}
+
+static uint32_t number(struct json_t* j)
+{
+  uint32_t n = 0;
+  ws(j);
+  if ((j->p >= j->end) || !isdigit((unsigned char)*j->p))
+  {
+    j->bad = true;
+    return 0;
+  }
+  while ((j->p < j->end) && isdigit((unsigned char)*j->p))
+    n = n*10 + (*j->p++ - '0');
+  return n;
+}
+
+// copies at most size-1 characters, escapes are kept as they are
+static void string(struct json_t* j, char* out, size_t size)
+{
+  size_t n = 0;
+  expect(j, '"');
+  while (!j->bad && (j->p < j->end) && (*j->p != '"'))
+  {
+    if ((*j->p == '\\') && (j->p+1 < j->end))
+      j->p++;
+    if (n+1 < size)
+      out[n++] = *j->p;
+    j->p++;
+  }
+  if (size > 0)
+    out[n] = 0;
+  expect(j, '"');
+}
+
+static void skip(struct json_t* j)
+{
+  char key[16];
+
+  if (peek(j, '"'))
+    string(j, key, 0);
+  else if (accept(j, '['))
+  {
+    if (!accept(j, ']'))
+    {
+      do skip(j); while (accept(j, ','));
+      expect(j, ']');
+    }
+  }
+  else if (accept(j, '{'))
+  {
+    if (!accept(j, '}'))
+    {
+      do { string(j, key, sizeof(key)); expect(j, ':'); skip(j); } while (accept(j, ','));
+      expect(j, '}');
+    }
+  }
+  else
+  {
+    // numbers, true/false/null
+    while ((j->p < j->end) && (isalnum((unsigned char)*j->p) || (*j->p == '-') || (*j->p == '.')))
+      j->p++;
+  }
+}
+
+static void parse_state(struct json_t* j, struct state_t* s)
+{
+  char key[16];
+
+  s->nram = 0;
+  expect(j, '{');
+  do
+  {
+    string(j, key, sizeof(key));
+    expect(j, ':');
+    if (!strcmp(key, "pc"))     s->pc = number(j);
+    else if (!strcmp(key, "s")) s->s = number(j);
+    else if (!strcmp(key, "a")) s->a = number(j);
+    else if (!strcmp(key, "x")) s->x = number(j);
+    else if (!strcmp(key, "y")) s->y = number(j);
+    else if (!strcmp(key, "p")) s->p = number(j);
+    else if (!strcmp(key, "ram"))
+    {
+      expect(j, '[');
+      if (!accept(j, ']'))
+      {
+        do
+        {
+          expect(j, '[');
+          uint16_t addr = number(j);
+          expect(j, ',');
+          uint8_t value = number(j);
+          expect(j, ']');
+          if (s->nram < MAX_RAM)
+          {
+            s->ram_addr[s->nram] = addr;
+            s->ram_value[s->nram++] = value;
+          }
+          else
+            j->bad = true;
+        } while (accept(j, ','));
+        expect(j, ']');
+      }
+    }
+    else
+      skip(j);
+  } while (accept(j, ','));
+  expect(j, '}');
+}
+
+static void parse_case(struct json_t* j, struct case_t* c)
+{
+  char key[16];
+
+  c->name[0] = 0;
+  c->cycles = 0;
+  expect(j, '{');
+  do
+  {
+    string(j, key, sizeof(key));
+    expect(j, ':');
+    if (!strcmp(key, "name"))
+      string(j, c->name, sizeof(c->name));
+    else if (!strcmp(key, "initial"))
+      parse_state(j, &c->initial);
+    else if (!strcmp(key, "final"))
+      parse_state(j, &c->final);
+    else if (!strcmp(key, "cycles"))
+    {
+      if (accept(j, '['))
+      {
+        if (!accept(j, ']'))
+        {
+          do { skip(j); c->cycles++; } while (accept(j, ','));
+          expect(j, ']');
+        }
+      }
+      else
+        c->cycles = number(j);
+    }
+    else
+      skip(j);
+  } while (accept(j, ','));
+  expect(j, '}');
+}
+
+
+/////////
+// run //
+/////////
+
+static bool check(const struct case_t* c, uint32_t cycles)
+{
+  const struct state_t* f = &c->final;
+  bool ok = (cpu.regs.pc == f->pc) && (cpu.regs.sp == f->s) &&
+            (cpu.regs.acc == f->a) && (cpu.regs.x == f->x) && (cpu.regs.y == f->y) &&
+            (((get_proc_status(&cpu) ^ f->p) & ~0x30) == 0) &&
+            (cycles == c->cycles);
+
+  for (int i=0; i<f->nram; i++)
+    ok = ok && (mem[f->ram_addr[i]] == f->ram_value[i]);
+
+  if (!ok && verbose)
+  {
+    printf("%s: pc:%04X/%04X s:%02X/%02X a:%02X/%02X x:%02X/%02X y:%02X/%02X p:%02X/%02X cycles:%u/%u\n",
+           c->name, cpu.regs.pc, f->pc, cpu.regs.sp, f->s, cpu.regs.acc, f->a,
+           cpu.regs.x, f->x, cpu.regs.y, f->y, get_proc_status(&cpu), f->p,
+           cycles, c->cycles);
+    for (int i=0; i<f->nram; i++)
+      if (mem[f->ram_addr[i]] != f->ram_value[i])
+        printf("  $%04X: %02X/%02X\n", f->ram_addr[i], mem[f->ram_addr[i]], f->ram_value[i]);
+  }
+  return ok;
+}
+
+static void run_case(const struct case_t* c)
+{
+  const struct state_t* s = &c->initial;
+
+  for (int i=0; i<s->nram; i++)
+    mem[s->ram_addr[i]] = s->ram_value[i];
+  cpu_init(&cpu, &bus);
+  cpu.regs.pc = s->pc;
+  cpu.regs.sp = s->s;
+  cpu.regs.acc = s->a;
+  cpu.regs.x = s->x;
+  cpu.regs.y = s->y;
+  set_proc_status(&cpu, s->p);
+
+  uint8_t op = mem[s->pc];
+  bool ok = cpu_step(&cpu) && check(c, cpu.regs.cycles);
+  total[op]++;
+  pass[op] += ok;
+
+  // leave the memory clean for the next case
+  for (int i=0; i<s->nram; i++)
+    mem[s->ram_addr[i]] = 0;
+  for (int i=0; i<c->final.nram; i++)
+    mem[c->final.ram_addr[i]] = 0;
+}
+
+/**
+ * returns: the number of cases, -1 if the file can't be read or parsed
+ */
+static long run_file(const char* path)
+{
+  FILE* f = fopen(path, "rb");
+  if (f == NULL)
+    return -1;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* text = malloc(size);
+  size_t got = fread(text, 1, size, f);
+  fclose(f);
+
+  struct json_t j = { text, text + got, false };
+  struct case_t c;
+  long n = 0;
+
+  expect(&j, '[');
+  if (!accept(&j, ']'))
+  {
+    do
+    {
+      parse_case(&j, &c);
+      if (j.bad)
+        break;
+      run_case(&c);
+      n++;
+    } while (accept(&j, ','));
+    expect(&j, ']');
+  }
+  free(text);
+
+  if (j.bad)
+  {
+    printf("%s: parse error after %ld cases\n", path, n);
+    return -1;
+  }
+  return n;
+}
+
+static int by_name(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * returns: the number of cases, -1 if any file failed to load
+ */
+static long run_path(const char* path)
+{
+  DIR* dir = opendir(path);
+  if (dir == NULL)
+    return run_file(path);
+
+  // in name order so the output is stable
+  char** names = NULL;
+  int count = 0;
+  struct dirent* e;
+  while ((e = readdir(dir)) != NULL)
+  {
+    size_t len = strlen(e->d_name);
+    if ((len > 5) && !strcmp(&e->d_name[len-5], ".json"))
+    {
+      names = realloc(names, (count+1) * sizeof(char*));
+      names[count] = malloc(strlen(path) + len + 2);
+      sprintf(names[count++], "%s/%s", path, e->d_name);
+    }
+  }
+  closedir(dir);
+  qsort(names, count, sizeof(char*), by_name);
+
+  long n = 0;
+  for (int i=0; i<count; i++)
+  {
+    long r = run_file(names[i]);
+    n = ((n < 0) || (r < 0)) ? -1 : n + r;
+    free(names[i]);
+  }
+  free(names);
+  return n;
+}
+
+
+int main(int argc, char* argv[])
+{
+  int first = 1;
+  if ((argc > 1) && !strcmp(argv[1], "-v"))
+  {
+    verbose = true;
+    first++;
+  }
+  if (first >= argc)
+  {
+    printf("usage: %s [-v] FILE|DIR...\n", argv[0]);
+    return 1;
+  }
+
+  bus_init_flat(&bus, mem);
+
+  clock_t start = clock();
+  bool loaded = true;
+  long ncases = 0;
+  for (int i=first; i<argc; i++)
+  {
+    long n = run_path(argv[i]);
+    loaded = loaded && (n >= 0);
+    ncases += (n > 0) ? n : 0;
+  }
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  uint32_t npass = 0;
+  for (int op=0; op<256; op++)
+  {
+    if (total[op] == 0)
+      continue;
+    npass += pass[op];
+    printf("%02X %-4s %6u/%-6u %s\n", op, opcode_name[op] ? opcode_name[op] : "???",
+           pass[op], total[op], (pass[op] == total[op]) ? "" : "FAILED");
+  }
+  printf("%u/%ld cases passed, %.0f cases/sec\n", npass, ncases,
+         (seconds > 0) ? ncases / seconds : 0);
+
+  if (loaded && (ncases > 0) && (npass == ncases))
+  {
+    printf("sst result: success\n");
+    return 0;
+  }
+  printf("sst result: failed\n");
+  return 1;
+}
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE // memfd_create()
+#include "nes.h"
+#include "log.h"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define STATE_MAGIC   "NESS"
+#define STATE_VERSION 1 // bump whenever a section below changes
+
+struct state_header_t
+{
+  char     magic[4];
+  uint32_t version;
+  uint32_t size; // of the whole blob
+  uint16_t mapper;
+  uint32_t prg_size;
+  uint32_t chr_size;
+};
+
+// One walk over the fields serves both directions: saving copies them into
+// buf, loading out of it. Saving past size only counts, so a NULL buffer
+// gives the size needed. A dry load only checks the sections.
+struct stream_t
+{
+  uint8_t* buf;
+  size_t   size;
+  size_t   pos;
+  bool     load;
+  bool     dry;
+  bool     bad;
+};
+
+static void field(struct stream_t* s, void* data, size_t len)
+{
+  if (s->pos + len <= s->size)
+  {
+    if (s->load && !s->dry)
+      memcpy(data, s->buf + s->pos, len);
+    else if (!s->load)
+      memcpy(s->buf + s->pos, data, len);
+  }
+  else if (s->load)
+  {
+    s->bad = true;
+  }
+  s->pos += len;
+}
+
+#define FIELD(s, x) field((s), &(x), sizeof(x))
+
+// a section is its tag, its length and the fields, so a blob can be looked
+// through and a stray one is caught
+static size_t begin(struct stream_t* s, const char* tag)
+{
+  char t[4];
+  uint32_t len = 0;
+
+  if (s->load && ((s->pos + 4 > s->size) || memcmp(s->buf + s->pos, tag, 4)))
+    s->bad = true;
+  memcpy(t, tag, 4);
+  field(s, t, 4);
+  size_t at = s->pos;
+  field(s, &len, 4);
+  return at;
+}
+
+static void end(struct stream_t* s, size_t at)
+{
+  uint32_t len = s->pos - at - 4;
+  uint32_t recorded;
+
+  if (at + 4 > s->size)
+    return;
+  if (!s->load)
+    memcpy(s->buf + at, &len, 4);
+  else
+  {
+    memcpy(&recorded, s->buf + at, 4);
+    if (recorded != len)
+      s->bad = true;
+  }
+}
+
+
+// Everything but the pointers, the framebuffer (the next frame redraws it),
+// the decoded tiles and the sample ring. The page tables follow from the mapper registers.
+static void walk(struct stream_t* s, struct nes_t* nes)
+{
+  struct cpu_t* cpu = &nes->cpu;
+  struct ppu_t* ppu = &nes->ppu;
+  struct apu_t* apu = &nes->apu;
+  struct mapper_t* m = &nes->mapper;
+  size_t at;
+
+  at = begin(s, "CPU ");
+  FIELD(s, cpu->regs);
+  FIELD(s, cpu->pending);
+  FIELD(s, cpu->irq_lines);
+  end(s, at);
+
+  at = begin(s, "RAM ");
+  FIELD(s, nes->bus.ram);
+  end(s, at);
+
+  at = begin(s, "PPU ");
+  FIELD(s, ppu->dots);
+  FIELD(s, ppu->scanline);
+  FIELD(s, ppu->dot);
+  FIELD(s, ppu->frame);
+  FIELD(s, ppu->odd_frame);
+  FIELD(s, ppu->ctrl);
+  FIELD(s, ppu->mask);
+  FIELD(s, ppu->status);
+  FIELD(s, ppu->oam_addr);
+  FIELD(s, ppu->read_buffer);
+  FIELD(s, ppu->open_bus);
+  FIELD(s, ppu->v);
+  FIELD(s, ppu->t);
+  FIELD(s, ppu->x);
+  FIELD(s, ppu->w);
+  FIELD(s, ppu->vram);
+  FIELD(s, ppu->palette);
+  FIELD(s, ppu->oam);
+  end(s, at);
+
+  // the delta buffer too, so a loaded state sounds exactly like the original
+  at = begin(s, "APU ");
+  FIELD(s, apu->time);
+  FIELD(s, apu->pulse);
+  FIELD(s, apu->triangle);
+  FIELD(s, apu->noise);
+  FIELD(s, apu->dmc);
+  FIELD(s, apu->enabled);
+  FIELD(s, apu->five_step);
+  FIELD(s, apu->irq_inhibit);
+  FIELD(s, apu->frame_step);
+  FIELD(s, apu->frame_base);
+  FIELD(s, apu->frame_next);
+  FIELD(s, apu->frame_irq);
+  FIELD(s, apu->dmc_irq);
+  FIELD(s, apu->level);
+  FIELD(s, apu->deltas);
+  FIELD(s, apu->frame_start);
+  FIELD(s, apu->frame_frac);
+  FIELD(s, apu->integrator);
+  FIELD(s, apu->highpass);
+  end(s, at);
+
+  // the register union, whichever board it is
+  at = begin(s, "MAP ");
+  FIELD(s, m->mirroring);
+  FIELD(s, m->irq);
+  field(s, &m->mmc1, offsetof(struct mapper_t, prg_ram) - offsetof(struct mapper_t, mmc1));
+  FIELD(s, m->prg_ram);
+  if (m->chr_is_ram)
+    FIELD(s, m->chr_ram);
+  end(s, at);
+
+  at = begin(s, "PAD ");
+  FIELD(s, nes->pad);
+  FIELD(s, nes->frames);
+  end(s, at);
+}
+
+static void header(const struct nes_t* nes, struct state_header_t* h, size_t size)
+{
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, STATE_MAGIC, 4);
+  h->version = STATE_VERSION;
+  h->size = size;
+  h->mapper = nes->mapper.number;
+  h->prg_size = nes->cart.prg_size;
+  h->chr_size = nes->cart.chr_size;
+}
+
+
+size_t nes_save_state(const struct nes_t* nes, uint8_t* buf, size_t size)
+{
+  struct state_header_t h;
+  struct stream_t s = { buf, size, sizeof(h), false, false, false };
+
+  // the walk only reads when saving
+  walk(&s, (struct nes_t*) nes);
+  if (s.pos <= size)
+  {
+    header(nes, &h, s.pos);
+    memcpy(buf, &h, sizeof(h));
+  }
+  return s.pos;
+}
+
+
+bool nes_load_state(struct nes_t* nes, const uint8_t* buf, size_t size)
+{
+  struct state_header_t h, expect;
+
+  // the same cart and build always make the same size, so a blob that
+  // matches is loaded in full or not at all
+  header(nes, &expect, nes_save_state(nes, NULL, 0));
+  if (size < sizeof(h))
+    return false;
+  memcpy(&h, buf, sizeof(h));
+  if (memcmp(&h, &expect, sizeof(h)) || (size != h.size))
+  {
+    log_error("state: not from this cart or version\n");
+    return false;
+  }
+
+  // every tag and length is checked before anything is loaded
+  struct stream_t s = { (uint8_t*) buf, size, sizeof(h), true, true, false };
+  walk(&s, nes);
+  if (s.bad)
+  {
+    log_error("state: damaged\n");
+    return false;
+  }
+  s.pos = sizeof(h);
+  s.dry = false;
+  walk(&s, nes);
+
+  // the memory under the cpu changed without it writing
+  mapper_restore(&nes->mapper);
+  ppu_flush_tiles(&nes->ppu);
+  if (nes->decode)
+    decode_cache_flush(nes->decode);
+  if (nes->jit)
+    jit_flush(nes->jit);
+  return true;
+}
+
+
+//////////////
+// snapshot //
+//////////////
+
+bool nes_snapshot(const struct nes_t* nes, struct nes_snapshot_t* snap)
+{
+  snap->size = sizeof(*nes);
+  snap->fd = memfd_create("nes-snapshot", 0);
+  if (snap->fd < 0)
+    return false;
+  if (write(snap->fd, nes, sizeof(*nes)) != sizeof(*nes))
+  {
+    close(snap->fd);
+    snap->fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void nes_snapshot_close(struct nes_snapshot_t* snap)
+{
+  if (snap->fd >= 0)
+    close(snap->fd);
+  snap->fd = -1;
+}
+
+
+// a pointer into the console at old moves along to the same place in nes
+static void* rebase(void* p, const void* old, struct nes_t* nes)
+{
+  uintptr_t u = (uintptr_t) p;
+  if ((u >= (uintptr_t) old) && (u < (uintptr_t) old + sizeof(*nes)))
+    return (uint8_t*) nes + (u - (uintptr_t) old);
+  return p;
+}
+
+#define REBASE(p) (p) = rebase((void*)(p), old, nes)
+
+static void relocate(struct nes_t* nes)
+{
+  // the bus pointer always points at the console's own bus
+  const void* old = (const uint8_t*) nes->cpu.bus - offsetof(struct nes_t, bus);
+
+  REBASE(nes->cpu.bus);
+  for (int p=0; p<BUS_PAGES; p++)
+  {
+    REBASE(nes->bus.read_page[p]);
+    REBASE(nes->bus.write_page[p]);
+    REBASE(nes->bus.read_ctx[p]);
+    REBASE(nes->bus.write_ctx[p]);
+  }
+  REBASE(nes->mapper.bus);
+  REBASE(nes->mapper.chr);
+  for (int i=0; i<8; i++)
+  {
+    REBASE(nes->mapper.chr_page[i]);
+    REBASE(nes->mapper.chr_write[i]);
+  }
+  REBASE(nes->mapper.irq_ctx);
+  REBASE(nes->ppu.mapper);
+  REBASE(nes->ppu.clock);
+  REBASE(nes->ppu.nmi_ctx);
+  REBASE(nes->apu.bus);
+  REBASE(nes->apu.clock);
+  REBASE(nes->apu.irq_ctx);
+}
+
+
+struct nes_t* nes_fork(const struct nes_snapshot_t* snap)
+{
+  struct nes_t* nes = mmap(NULL, snap->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, snap->fd, 0);
+  if (nes == MAP_FAILED)
+    return NULL;
+
+  relocate(nes);
+  // the decoded tiles are keyed by the original's CHR RAM
+  ppu_flush_tiles(&nes->ppu);
+
+  // engines are per console, their caches point into the original
+  int engine = nes->engine;
+  nes->engine = NES_ENGINE_INTERP;
+  nes->jit = NULL;
+  nes->decode = NULL;
+  nes_set_engine(nes, engine);
+  return nes;
+}
+
+void nes_fork_close(struct nes_t* nes)
+{
+  if (nes == NULL)
+    return;
+  jit_destroy(nes->jit);
+  decode_cache_destroy(nes->decode);
+  munmap(nes, sizeof(*nes));
+}
@@ -1,5 +1,16 @@
+#define _GNU_SOURCE // memmem()
 #include <stdio.h>
+#include <string.h>
 #include "cpu-6502.h"
+#include "bus.h"
+#include "mapper.h"
+#include "nes_cart.h"
+#include "ppu.h"
+#include "apu.h"
+#include "jit.h"
+#include "nes.h"
+#include <stdlib.h> //mkstemp()
+#include <unistd.h> //write()
 
 #define ASSERT(cond, action) if(!(cond)) {\
                                  printf("%s:%d ASSERT Failed (%s)\n", __func__, __LINE__, #cond); \
@@ -7,1402 +18,921 @@
                              }
 
 
-// bool test_addrmode_immediate()
-// {
-// 	// testing immediate: this value should load the immediate value (1 byte) from 
-// 	// memory into temporary reg.TL, clear out regs.TH and increment PC.
-
-// 	// 1) set memory
-// 	set_memory(0x6000, 0xDE);
-// 	// 2) set PC
-// 	regs.pc = 0x6000;
-// 	// invoke handler
-// 	addrmode_immediate();
-// 	// 4) verify PC incremented
-// 	ASSERT(regs.pc == 0x6001, return false);
-// 	// 3) verifing the regs.TL  (temp. lower) and regs.TH (temp. high) registers have the correct value
-// 	ASSERT(regs.tl == 0xDE, return false);
-// 	ASSERT(regs.th == 0x0, return false);
-
-// 	return true;
-// }
-
-// bool test_addrmode_zero_page()
-// {
-// 	// this mode is only capable of addressing the first 256 bytes, so it will only read 1 byte
-
-// 	// 1) set memory
-// 	set_memory(0x6000, 0xBB);
-// 	// 2) set PC
-// 	regs.pc = 0x6000;
-// 	// invoke handler
-// 	addrmode_zero_page();
-// 	// 4) verify PC incremented
-// 	ASSERT(regs.pc == 0x6001, return false);
-// 	// 3) verifing the regs.TL  (temp. lower) and regs.TH (temp. high) registers have the correct value
-// 	ASSERT(regs.tl == 0xBB, return false);
-// 	ASSERT(regs.th == 0x0, return false);
-
-// 	return true;
-// }
-
-// bool test_addrmode_zero_page_x()
-// {
-// 	// this mode is only capable of addressing the first 256 bytes, so it will only read 1 byte
-// 	// and will add the X register to it
-
-// 	// 1) set memory
-// 	set_memory(0x6000, 0xCC);
-// 	// 2) set PC
-// 	regs.pc = 0x6000;
-// 	// 3) set X register
-// 	regs.x = 0x44;
-// 	// invoke handler
-// 	addrmode_zero_page_x();
-// 	// 4) verify PC incremented
-// 	ASSERT(regs.pc == 0x6001, return false);
-// 	// 5) verifing the regs.TL  (temp. lower) and regs.TH (temp. high) registers have the correct value
-// 	ASSERT(regs.tl == 0x10, return false);
-// 	ASSERT(regs.th == 0x0, return false);
-
-// 	return true;
-// }
-
-// bool test_addrmode_zero_page_y()
-// {
-// 	// this mode is only capable of addressing the first 256 bytes, so it will only read 1 byte
-// 	// and will add the Y register to it
-
-// 	// 1) set memory
-// 	set_memory(0x6000, 0xDD);
-// 	// 2) set PC
-// 	regs.pc = 0x6000;
-// 	// 3) set X register
-// 	regs.y = 0x44;
-// 	// invoke handler
-// 	addrmode_zero_page_y();
-// 	// 4) verify PC incremented
-// 	ASSERT(regs.pc == 0x6001, return false);
-// 	// 5) verifing the regs.TL  (temp. lower) and regs.TH (temp. high) registers have the correct value
-// 	ASSERT(regs.tl == 0x21, return false);
-// 	ASSERT(regs.th == 0x0, return false);
-
-// 	return true;
-// }
-
-// bool test_addrmode_abs()
-// {
-// 	// this mode is only capable of addressing all memory, so it will read 2 bytes.
-
-// 	// 1) set memory
-// 	set_memory(0x6000, 0xAD);
-// 	set_memory(0x6001, 0xDE);
-// 	// 2) set PC
-// 	regs.pc = 0x6000;
-// 	// invoke handler
-// 	addrmode_abs();
-// 	// 4) verify PC incremented
-// 	ASSERT(regs.pc == 0x6002, return false);
-// 	// 5) verifing the regs.TL  (temp. lower) and regs.TH (temp. high) registers have the correct value
-// 	ASSERT(regs.tl == 0xAD, return false);
-// 	ASSERT(regs.th == 0xDE, return false);
-
-// 	return true;
-// }
-
-// bool test_addrmode_abs_x()
-// {
-// 	// this mode is only capable of addressing all memory, so it will read 2 bytes, then add register X to it.
-
-// 	// 1) set memory
-// 	set_memory(0x6000, 0xEF);
-// 	set_memory(0x6001, 0xBE);
-// 	// 2) set PC
-// 	regs.pc = 0x6000;
-// 	// 3) set X register
-// 	regs.x = 0x55;
-// 	// invoke handler
-// 	addrmode_abs_x();
-// 	// 4) verify PC incremented
-// 	ASSERT(regs.pc == 0x6002, return false);
-// 	// 5) verifing the regs.TL  (temp. lower) and regs.TH (temp. high) registers have the correct value
-// 	ASSERT(regs.tl == 0x44, return false);
-// 	ASSERT(regs.th == 0xBF, return false);
-
-// 	return true;
-// }
-
-// bool test_addrmode_abs_y()
-// {
-// 	// this mode is only capable of addressing all memory, so it will read 2 bytes, then add register Y to it.
-
-// 	// 1) set memory
-// 	set_memory(0x6000, 0xEF);
-// 	set_memory(0x6001, 0xBE);
-// 	// 2) set PC
-// 	regs.pc = 0x6000;
-// 	// 3) set X register
-// 	regs.y = 0x44;
-// 	// invoke handler
-// 	addrmode_abs_y();
-// 	// 4) verify PC incremented
-// 	ASSERT(regs.pc == 0x6002, return false);
-// 	// 5) verifing the regs.TL  (temp. lower) and regs.TH (temp. high) registers have the correct value
-// 	ASSERT(regs.tl == 0x33, return false);
-// 	ASSERT(regs.th == 0xBF, return false);
-
-// 	return true;
-// }
-
-// bool test_addrmode_indirect()
-// {
-// 	// 1) set memory
-// 	set_memory(0x6000, 0xFE);
-// 	set_memory(0x6001, 0xCA);
-// 	set_memory(0xCAFE, 0xAB);
-// 	set_memory(0xCAFF, 0xCD);
-// 	// 2) set PC
-// 	regs.pc = 0x6000;
-// 	// invoke handler
-// 	addrmode_indirect();
-// 	// 4) verify PC incremented
-// 	ASSERT(regs.pc == 0x6002, return false);
-// 	// 5) verifing the regs.TL  (temp. lower) and regs.TH (temp. high) registers have the correct value
-// 	ASSERT(regs.tl == 0xAB, return false);
-// 	ASSERT(regs.th == 0xCD, return false);
-
-// 	return true;
-// }
-
-// bool test_addrmode_indexed_indirect_x()
-// {
-// 	// 1) set memory
-// 	set_memory(0x6000, 0x55);
-// 	set_memory(0x78, 0x22);
-// 	set_memory(0x79, 0x33);
-// 	// 2) set PC
-// 	regs.pc = 0x6000;
-// 	//
-// 	regs.x = 0x23;
-// 	// invoke handler
-// 	addrmode_indexed_indirect_x();
-// 	// 4) verify PC incremented
-// 	ASSERT(regs.pc == 0x6001, return false);
-// 	// 5) verifing the regs.TL  (temp. lower) and regs.TH (temp. high) registers have the correct value
-// 	ASSERT(regs.tl == 0x22, return false);
-// 	ASSERT(regs.th == 0x33, return false);
-
-// 	return true;
-// }
-
-
-// bool test_addrmode_indirect_indexed_y()
-// {
-// 	// 1) set memory
-// 	set_memory(0x6000, 0x66);
-// 	set_memory(0x66, 0x55);
-// 	set_memory(0x67, 0x66);
-// 	// 2) set PC
-// 	regs.pc = 0x6000;
-// 	//
-// 	regs.y = 0x32;
-// 	// invoke handler
-// 	addrmode_indirect_indexed_y();
-// 	// 4) verify PC incremented
-// 	ASSERT(regs.pc == 0x6001, return false);
-// 	// 5) verifing the regs.TL  (temp. lower) and regs.TH (temp. high) registers have the correct value
-// 	ASSERT(regs.tl == 0x87, return false);
-// 	ASSERT(regs.th == 0x66, return false);
-
-// 	return true;
-// }
-
-
-// bool test_a_opcodes()
-// {
-// 	uint8_t ops[] = {
-// 	};
-// 	// load opcodes into memory
-// 	set_memory_range(0x1000, ops, sizeof(ops));
-// 	regs.pc = 0x1000;
-
-// 	return true;
-// }
-
-
-// bool test_b_opcodes()
-// {
-// 	uint8_t ops[] = {
-// 	};
-// 	// load opcodes into memory
-// 	set_memory_range(0x1000, ops, sizeof(ops));
-// 	regs.pc = 0x1000;
-
-// 	return true;
-// }
-
-
-bool test_c_opcodes()
+// Per opcode cpu tests are data, see sst.c and tests/6502. These cover the
+// rest of the console.
+
+static uint8_t io_regs[8];
+
+static uint8_t io_read(void* ctx, uint16_t addr)
 {
-	uint8_t ops[] = {
-		0x18, // clc
-		0xd8, // cld
-		0x58, // cli
-		0xb8, // clv
-
-		0xc9, 0x01, // cmp #$ff
-		0xc5, 0x10, // cmp $10
-		0xd5, 0x10, // cmp $10, x
-		0xcd, 0x00, 0x20, // cmp $2000
-		0xdd, 0x00, 0x20, // cmp $2000, x
-		0xd9, 0x00, 0x20, // cmp $2000, y
-		0xc1, 0x10, // cmp ($12, x)
-		0xd1, 0x12, // cmp ($xx), y
-
-		0xe0, 0x01,
-		0xe4, 0x10,
-		0xec, 0x40, 0x20, // cpx $2040
-
-		0xc0, 0x01,
-		0xc4, 0x10,
-		0xcc, 0x41, 0x20, // cpy $2041
-	};
-	// load opcodes into memory
-	set_memory_range(0x1000, ops, sizeof(ops));
-	set_memory(0x10, 0x02);
-	set_memory(0x11, 0x03);
-	set_memory(0x12, 0x10);
-	set_memory(0x13, 0x20);
-	set_memory(0x2000, 0x50);
-	set_memory(0x2001, 0x51);
-	set_memory(0x2002, 0x52);
-	set_memory(0x2010, 0x60);
-	set_memory(0x2030, 0x70);
-	set_memory(0x2040, 0x80);
-	set_memory(0x2041, 0x90);
-	regs.pc = 0x1000;
-
-	// clear carry
-	regs.status.carry = 0x1;
-	cpu_step();
-	ASSERT(regs.status.carry == 0x0, return false);
-
-	// clear decimal mode
-	regs.status.decimal = 0x1;
-	cpu_step();
-	ASSERT(regs.status.decimal == 0x0, return false);
-
-	// clear interrupt
-	regs.status.interrupt = 0x1;
-	cpu_step();
-	ASSERT(regs.status.interrupt == 0x0, return false);
-
-	// clear overflow
-	regs.status.overflow = 0x1;
-	cpu_step();
-	ASSERT(regs.status.overflow == 0x0, return false);
-
-	/// cmp
-	// setup to test <
-	regs.acc = 0x00;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x0, return false);
-	ASSERT(regs.status.zero == 0x0, return false);
-	ASSERT(regs.status.negative == 0x1, return false);
-
-	// setup to test ==
-	regs.acc = 0x02;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x1, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
-
-	// setup to test >
-	regs.acc = 0x04;
-	regs.x = 0x1;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x0, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
-
-	// setup to test ==
-	regs.acc = 0x50;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x1, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
-
-	// setup to test ==
-	regs.acc = 0x51;
-	regs.x = 0x1;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x1, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
-
-	// setup to test ==
-	regs.acc = 0x52;
-	regs.y = 0x2;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x1, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
-
-	// setup to test ==
-	regs.acc = 0x60;
-	regs.x = 0x2;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x1, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
-
-	// setup to test ==
-	regs.acc = 0x70;
-	regs.y = 0x20;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x1, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
-
-	/// cpx
-	// setup to test <
-	regs.x = 0x00;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x0, return false);
-	ASSERT(regs.status.zero == 0x0, return false);
-	ASSERT(regs.status.negative == 0x1, return false);
-
-	// setup to test ==
-	regs.x = 0x02;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x1, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
-
-	// setup to test >
-	regs.x = 0x81;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x0, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
-
-	/// cpy
-	// setup to test <
-	regs.y = 0x00;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x0, return false);
-	ASSERT(regs.status.zero == 0x0, return false);
-	ASSERT(regs.status.negative == 0x1, return false);
-
-	// setup to test ==
-	regs.y = 0x02;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x1, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
-
-	// setup to test >
-	regs.y = 0x91;
-	cpu_step();
-	// verify
-	ASSERT(regs.status.carry == 0x1, return false);
-	ASSERT(regs.status.zero == 0x0, return false);
-	ASSERT(regs.status.negative == 0x0, return false);
+	return io_regs[addr & 7];
+}
+
+static void io_write(void* ctx, uint16_t addr, uint8_t value)
+{
+	io_regs[addr & 7] = value;
+}
+
+bool test_bus()
+{
+	static const uint8_t rom[0x4000] = { [0] = 0xa9, [0x3fff] = 0xc0 };
+	struct bus_t bus;
+	bus_init(&bus);
+
+	// internal ram repeats every 2KB through 0x1fff
+	bus_write(&bus, 0x0001, 0x42);
+	ASSERT(bus_read(&bus, 0x0801) == 0x42, return false);
+	ASSERT(bus_read(&bus, 0x1801) == 0x42, return false);
+	bus_write(&bus, 0x1fff, 0x24);
+	ASSERT(bus.ram[0x7ff] == 0x24, return false);
+
+	// handlers see the full address and mirror it themselves
+	bus_map_io(&bus, 0x20, 0x20, io_read, io_write, NULL);
+	bus_write(&bus, 0x3ffe, 0x99);
+	ASSERT(io_regs[6] == 0x99, return false);
+	ASSERT(bus_read(&bus, 0x2006) == 0x99, return false);
+
+	// unmapped pages read open bus and ignore writes
+	bus_write(&bus, 0x5000, 0x11);
+	ASSERT(bus_read(&bus, 0x5000) == 0x50, return false);
+
+	// rom is read through the page table, writes go to the handler
+	bus_map_io(&bus, 0x80, 0x80, NULL, io_write, NULL);
+	bus_map_read(&bus, 0x80, 0x80, rom, sizeof(rom));
+	ASSERT(bus_read(&bus, 0x8000) == 0xa9, return false);
+	ASSERT(bus_read(&bus, 0xc000) == 0xa9, return false);
+	ASSERT(bus_read(&bus, 0xffff) == 0xc0, return false);
+	bus_write(&bus, 0x8001, 0x0f);
+	ASSERT(io_regs[1] == 0x0f, return false);
+	ASSERT(bus_read(&bus, 0x8001) == 0x00, return false);
 
 	return true;
 }
 
 
-bool test_d_opcodes()
+// serial load of an MMC1 register
+static void mmc1_load(struct bus_t* bus, uint16_t addr, uint8_t value)
 {
-	uint8_t ops[] = {
-		0xc6, 0x10, // dec $10
-		0xd6, 0x10, // dec $10, x
-		0xce, 0x00, 0x20, // dec $2000
-		0xde, 0x00, 0x20, // dec $2000,x
-		0xca, // dex
-		0xca, // dex
-		0x88, // dey
-		0x88, // dey
-	};
-	// load opcodes into memory
-	set_memory_range(0x1000, ops, sizeof(ops));
-	set_memory(0x10, 0x01);
-	set_memory(0x11, 0x00);
-	set_memory(0x2000, 0x55);
-	set_memory(0x2001, 0x5d);
-	regs.pc = 0x1000;
-
-	// setup
-	cpu_step();
-	// verify
-	ASSERT(get_memory(0x10) == 0x00, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup
-	regs.x = 1;
-	cpu_step();
-	// verify
-	ASSERT(get_memory(0x11) == 0xff, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	// setup
-	cpu_step();
-	// verify
-	ASSERT(get_memory(0x2000) == 0x54, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup
-	regs.x = 1;
-	cpu_step();
-	// verify
-	ASSERT(get_memory(0x2001) == 0x5c, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup
-	regs.x = 0x00;
-	cpu_step();
-	// verify
-	ASSERT(regs.x == 0xff, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	// setup
-	regs.x = 0x01;
-	cpu_step();
-	// verify
-	ASSERT(regs.x == 0x00, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup
-	regs.y = 0x00;
-	cpu_step();
-	// verify
-	ASSERT(regs.y == 0xff, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	// setup
-	regs.y = 0x01;
-	cpu_step();
-	// verify
-	ASSERT(regs.y == 0x0, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
+	for (int i=0; i<5; i++)
+		bus_write(bus, addr, (value >> i) & 1);
+}
+
+bool test_mapper()
+{
+	// eight 16KB PRG banks, each starting with its own number, followed by
+	// the number of the 8KB bank
+	static uint8_t prg[8*0x4000];
+	static uint8_t chr[8*0x2000];
+	static struct mapper_t m;
+	struct bus_t bus;
+
+	for (int i=0; i<8; i++)
+		prg[i*0x4000] = i;
+	for (int i=0; i<16; i++)
+		prg[i*0x2000+1] = i;
+	for (int i=0; i<64; i++)
+		chr[i*0x400] = i;
+
+	// UxROM switches $8000 and keeps the last bank at $C000
+	bus_init(&bus);
+	ASSERT(mapper_init(&m, 2, prg, sizeof(prg), NULL, 0, MIRROR_VERTICAL), return false);
+	mapper_attach(&m, &bus);
+	ASSERT(bus_read(&bus, 0x8000) == 0, return false);
+	ASSERT(bus_read(&bus, 0xc000) == 7, return false);
+	bus_write(&bus, 0x8000, 3);
+	ASSERT(bus_read(&bus, 0x8000) == 3, return false);
+	ASSERT(bus_read(&bus, 0xc000) == 7, return false);
+	ASSERT(m.chr_write[0] != NULL, return false);
+
+	// MMC1 powers up with the last bank fixed, 4KB CHR mode switches halves
+	bus_init(&bus);
+	ASSERT(mapper_init(&m, 1, prg, sizeof(prg), chr, sizeof(chr), MIRROR_VERTICAL), return false);
+	mapper_attach(&m, &bus);
+	ASSERT(bus_read(&bus, 0xc000) == 7, return false);
+	mmc1_load(&bus, 0xe000, 5);
+	ASSERT(bus_read(&bus, 0x8000) == 5, return false);
+	mmc1_load(&bus, 0x8000, 0x11); // 4KB CHR, 32KB PRG, single screen high
+	ASSERT(m.mirroring == MIRROR_SINGLE_HIGH, return false);
+	ASSERT(bus_read(&bus, 0x8000) == 4, return false);
+	ASSERT(bus_read(&bus, 0xc000) == 5, return false);
+	mmc1_load(&bus, 0xc000, 3);
+	ASSERT(m.chr_page[4][0] == 12, return false);
+	ASSERT(m.chr_write[4] == NULL, return false);
+	bus_write(&bus, 0x8000, 0x80);
+	ASSERT(bus_read(&bus, 0xc000) == 7, return false);
+	bus_write(&bus, 0x6000, 0x5a);
+	ASSERT(m.prg_ram[0] == 0x5a, return false);
+
+	// MMC3 A12 inversion moves the 2KB banks to $1000
+	bus_init(&bus);
+	ASSERT(mapper_init(&m, 4, prg, sizeof(prg), chr, sizeof(chr), MIRROR_VERTICAL), return false);
+	mapper_attach(&m, &bus);
+	bus_write(&bus, 0x8000, 0x80);
+	bus_write(&bus, 0x8001, 10);
+	ASSERT(m.chr_page[4][0] == 10, return false);
+	ASSERT(m.chr_page[5][0] == 11, return false);
+	bus_write(&bus, 0x8000, 0x06);
+	bus_write(&bus, 0x8001, 3);
+	ASSERT(bus_read(&bus, 0x8001) == 3, return false);
+	ASSERT(bus_read(&bus, 0xc001) == 14, return false);
+	ASSERT(bus_read(&bus, 0xe001) == 15, return false);
+	bus_write(&bus, 0x8000, 0x46);
+	ASSERT(bus_read(&bus, 0x8001) == 14, return false);
+	ASSERT(bus_read(&bus, 0xc001) == 3, return false);
+
+	// MMC3 irq fires when the counter reaches zero
+	bus_write(&bus, 0xc000, 2);
+	bus_write(&bus, 0xc001, 0);
+	bus_write(&bus, 0xe001, 0);
+	ASSERT(mapper_irq_countdown(&m) == 3, return false);
+	mapper_scanline(&m);
+	mapper_scanline(&m);
+	ASSERT(m.irq == false, return false);
+	ASSERT(mapper_irq_countdown(&m) == 1, return false);
+	mapper_scanline(&m);
+	ASSERT(m.irq == true, return false);
+	ASSERT(mapper_irq_countdown(&m) == 0, return false);
+	bus_write(&bus, 0xe000, 0);
+	ASSERT(m.irq == false, return false);
+
+	ASSERT(mapper_init(&m, 99, prg, sizeof(prg), chr, sizeof(chr), 0) == false, return false);
 
 	return true;
 }
 
-bool test_e_opcodes()
+
+// writes header plus size bytes of zeros to a temporary file
+static bool write_rom(char* path, const uint8_t* header, size_t size)
 {
-	uint8_t ops[] = {
-		0x49, 0x55, // eor #$55
-		0x45, 0x10, // eor $10
-		0x55, 0x10, // eor $10, x
-		0x4d, 0x00, 0x20, // eor $2000
-		0x5d, 0x00, 0x20, // eor $2000,x
-		0x59, 0x00, 0x20, // eor $2000,y
-		0x41, 0x10, // eor ($10,x)
-		0x51, 0x12  // eor ($12),y
-	};
-	// load opcodes into memory
-	set_memory_range(0x1000, ops, sizeof(ops));
-	set_memory(0x10, 0x66);
-	set_memory(0x11, 0x77);
-	set_memory(0x12, 0x04);
-	set_memory(0x13, 0x20);
-	set_memory(0x2000, 0x22);
-	set_memory(0x2001, 0x23);
-	set_memory(0x2002, 0x24);
-	set_memory(0x2004, 0x25);
-	set_memory(0x2005, 0x26);
-	regs.pc = 0x1000;
-
-	// setup for immediate
-	regs.acc = 0x55;
-	cpu_step();
-	// verify
-	ASSERT(regs.acc == 0x0, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup for zero page
-	regs.acc = 0x10;
-	cpu_step();
-	// verify
-	ASSERT(regs.acc == 0x76, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup for zero page, x
-	regs.acc = 0x10;
-	regs.x = 0x1;
-	cpu_step();
-	// verify
-	ASSERT(regs.acc == 0x67, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup for abs
-	regs.acc = 0x10;
-	cpu_step();
-	// verify
-	ASSERT(regs.acc == 0x32, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-	
-	// setup for abs,x
-	regs.acc = 0x10;
-	regs.x = 1;
-	cpu_step();
-	// verify
-	ASSERT(regs.acc == 0x33, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-	
-	// setup for abs,y
-	regs.acc = 0x10;
-	regs.y = 2;
-	cpu_step();
-	// verify
-	ASSERT(regs.acc == 0x34, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup for (ind,x)
-	regs.acc = 0x10;
-	regs.x = 2;
-	cpu_step();
-	// verify
-	ASSERT(regs.acc == 0x35, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup for (ind),y
-	regs.acc = 0x10;
-	regs.y = 1;
-	cpu_step();
-	// // verify
-	ASSERT(regs.acc == 0x36, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
+	static const uint8_t zero[1024];
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return false;
+	bool ok = write(fd, header, 16) == 16;
+	for (size_t n=0; ok && n<size; n+=sizeof(zero))
+		ok = write(fd, zero, sizeof(zero)) == sizeof(zero);
+	close(fd);
+	return ok;
+}
+
+bool test_cart()
+{
+	struct nes_cart_t cart;
+	char path[] = "/tmp/nes-test-XXXXXX";
+
+	// NES 2.0, mapper 0x104 submapper 2, 32KB PRG, CHR in exponent form
+	// (2^13 * 1 = 8KB), 8KB PRG NVRAM, vertical mirroring, trainer
+	const uint8_t nes2[16] = { 'N', 'E', 'S', 0x1a, 2, 0x34, 0x45, 0x08, 0x21, 0xf0, 0x70 };
+	ASSERT(write_rom(path, nes2, 512 + 0x8000 + 0x2000), return false);
+	ASSERT(nes_cart_open(&cart, path) == NES_CART_OK, return false);
+	ASSERT(cart.nes2, return false);
+	ASSERT(cart.mapper == 0x104, return false);
+	ASSERT(cart.submapper == 2, return false);
+	ASSERT(cart.prg_size == 0x8000, return false);
+	ASSERT(cart.chr_size == 0x2000, return false);
+	ASSERT(cart.prg_ram_size == 0x2000, return false);
+	ASSERT(cart.mirroring == MIRROR_VERTICAL, return false);
+	ASSERT(cart.trainer == cart.data + 16, return false);
+	ASSERT(cart.prg == cart.data + 16 + 512, return false);
+	ASSERT(cart.chr == cart.prg + 0x8000, return false);
+	nes_cart_close(&cart);
+	unlink(path);
+
+	// iNES with a junk tail ignores the high mapper nibble, and a file
+	// shorter than its header claims is refused
+	const uint8_t ines[16] = { 'N', 'E', 'S', 0x1a, 2, 1, 0x10, 0x40, 0, 0, 0, 0, 'D', 'u', 'd', 'e' };
+	strcpy(path, "/tmp/nes-test-XXXXXX");
+	ASSERT(write_rom(path, ines, 0x8000 + 0x1000), return false);
+	ASSERT(nes_cart_open(&cart, path) == NES_CART_BAD_SIZE, return false);
+	ASSERT(cart.data == NULL, return false);
+	unlink(path);
+
+	strcpy(path, "/tmp/nes-test-XXXXXX");
+	ASSERT(write_rom(path, ines, 0x8000 + 0x2000), return false);
+	ASSERT(nes_cart_open(&cart, path) == NES_CART_OK, return false);
+	ASSERT(cart.mapper == 1, return false);
+	ASSERT(cart.prg_ram_size == 0x2000, return false);
+	nes_cart_close(&cart);
+	unlink(path);
+
+	// NES 2.0 exponent sizes too big to add up don't wrap around
+	const uint8_t huge[16] = { 'N', 'E', 'S', 0x1a, 0xff, 0xff, 0, 0x08, 0, 0xff };
+	strcpy(path, "/tmp/nes-test-XXXXXX");
+	ASSERT(write_rom(path, huge, 64), return false);
+	ASSERT(nes_cart_open(&cart, path) == NES_CART_BAD_SIZE, return false);
+	unlink(path);
+
+	// nor do ones smaller than a PRG window or a CHR page: 8KB of PRG, then
+	// 16KB of PRG with 512 bytes of CHR
+	const uint8_t small_prg[16] = { 'N', 'E', 'S', 0x1a, 0x34, 0, 0, 0x08, 0, 0x0f };
+	const uint8_t small_chr[16] = { 'N', 'E', 'S', 0x1a, 1, 0x24, 0, 0x08, 0, 0xf0 };
+	strcpy(path, "/tmp/nes-test-XXXXXX");
+	ASSERT(write_rom(path, small_prg, 0x4000), return false);
+	ASSERT(nes_cart_open(&cart, path) == NES_CART_BAD_SIZE, return false);
+	unlink(path);
+	strcpy(path, "/tmp/nes-test-XXXXXX");
+	ASSERT(write_rom(path, small_chr, 0x8000), return false);
+	ASSERT(nes_cart_open(&cart, path) == NES_CART_BAD_SIZE, return false);
+	unlink(path);
 
 	return true;
 }
 
 
-bool test_i_opcodes()
+static int nmi_count;
+
+static void count_nmi(void* ctx)
 {
-	uint8_t ops[] = {
-		0xe6, 0x10, // inc $10
-		0xf6, 0x10, // inc $10, x
-		0xee, 0x00, 0x20, // inc $2000
-		0xfe, 0x00, 0x20, // inc $2000,x
-		0xe8, // inx
-		0xe8, // inx
-		0xc8, // iny
-		0xc8, // iny
-	};
-	// load opcodes into memory
-	set_memory_range(0x1000, ops, sizeof(ops));
-	set_memory(0x10, 0xff);
-	set_memory(0x11, 0x7f);
-	set_memory(0x2000, 0x55);
-	set_memory(0x2001, 0x5d);
-	regs.pc = 0x1000;
-
-	// setup
-	cpu_step();
-	// verify
-	ASSERT(get_memory(0x10) == 0x00, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup
-	regs.x = 1;
-	cpu_step();
-	// verify
-	ASSERT(get_memory(0x11) == 0x80, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	// setup
-	cpu_step();
-	// verify
-	ASSERT(get_memory(0x2000) == 0x56, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup
-	regs.x = 1;
-	cpu_step();
-	// verify
-	ASSERT(get_memory(0x2001) == 0x5e, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup
-	regs.x = 0x7f;
-	cpu_step();
-	// verify
-	ASSERT(regs.x == 0x80, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	// setup
-	regs.x = 0xff;
-	cpu_step();
-	// verify
-	ASSERT(regs.x == 0x0, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// setup
-	regs.y = 0x7f;
-	cpu_step();
-	// verify
-	ASSERT(regs.y == 0x80, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	// setup
-	regs.y = 0xff;
-	cpu_step();
-	// verify
-	ASSERT(regs.y == 0x0, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
+	nmi_count++;
+}
+
+bool test_ppu()
+{
+	static const uint8_t prg[0x4000];
+	static struct mapper_t m;
+	static struct ppu_t ppu;
+	struct bus_t bus;
+	uint64_t clock = 0;
+
+	bus_init(&bus);
+	ASSERT(mapper_init(&m, 0, prg, sizeof(prg), NULL, 0, MIRROR_VERTICAL), return false);
+	mapper_attach(&m, &bus);
+	ppu_init(&ppu, &m, &clock);
+	ppu.nmi = count_nmi;
+	ppu_attach(&ppu, &bus);
+
+	// tile 1: left half color 1, right half color 3
+	bus_write(&bus, 0x2006, 0x00);
+	bus_write(&bus, 0x2006, 0x10);
+	for (int i=0; i<16; i++)
+		bus_write(&bus, 0x2007, (i < 8) ? 0xff : 0x0f);
+	ASSERT(m.chr_ram[0x10] == 0xff && m.chr_ram[0x18] == 0x0f, return false);
+
+	// tile 1 at the top left with attribute palette 2, mirrored in $2800
+	bus_write(&bus, 0x2006, 0x28);
+	bus_write(&bus, 0x2006, 0x00);
+	bus_write(&bus, 0x2007, 0x01);
+	ASSERT(ppu.vram[0] == 0x01, return false);
+	bus_write(&bus, 0x2006, 0x23);
+	bus_write(&bus, 0x2006, 0xc0);
+	bus_write(&bus, 0x2007, 0x02);
+
+	// palette, $3F10 mirrors the backdrop
+	bus_write(&bus, 0x3ffe, 0x3f); // through a register mirror
+	bus_write(&bus, 0x2006, 0x10);
+	bus_write(&bus, 0x2007, 0x0f);
+	bus_write(&bus, 0x2006, 0x3f);
+	bus_write(&bus, 0x2006, 0x09);
+	bus_write(&bus, 0x2007, 0x21);
+	bus_write(&bus, 0x2007, 0x22);
+	bus_write(&bus, 0x2007, 0x23);
+	ASSERT(ppu.palette[0] == 0x0f, return false);
+
+	// buffered PPUDATA reads return the previous fetch
+	bus_write(&bus, 0x2006, 0x20);
+	bus_write(&bus, 0x2006, 0x00);
+	bus_read(&bus, 0x2007);
+	ASSERT(bus_read(&bus, 0x2007) == 0x01, return false);
+
+	// background on, no scroll, NMI on
+	bus_write(&bus, 0x2005, 0);
+	bus_write(&bus, 0x2005, 0);
+	bus_write(&bus, 0x2000, 0x80);
+	bus_write(&bus, 0x2001, 0x0a);
+	ASSERT(nmi_count == 0, return false);
+
+	// the pre-render line copies t to v, so render the next frame
+	clock = ppu_next_vblank(&ppu);
+	ppu_catch_up(&ppu, clock);
+	ASSERT(nmi_count == 1, return false);
+	clock = ppu_next_vblank(&ppu);
+	ppu_catch_up(&ppu, clock);
+	ASSERT(nmi_count == 2, return false);
+	ASSERT(ppu.scanline == PPU_VBLANK && ppu.dot < 4, return false);
+
+	ASSERT(ppu.framebuffer[0] == 0x21, return false);
+	ASSERT(ppu.framebuffer[3] == 0x21, return false);
+	ASSERT(ppu.framebuffer[4] == 0x23, return false);
+	ASSERT(ppu.framebuffer[7*PPU_WIDTH + 7] == 0x23, return false);
+	ASSERT(ppu.framebuffer[8] == 0x0f, return false);
+	ASSERT(ppu.framebuffer[8*PPU_WIDTH] == 0x0f, return false);
+
+	// PPUSTATUS reports vblank once
+	ASSERT(bus_read(&bus, 0x2002) & 0x80, return false);
+	ASSERT(!(bus_read(&bus, 0x2002) & 0x80), return false);
+
+	// rewriting the top row of tile 1 shows up in the next frame
+	bus_write(&bus, 0x2006, 0x00);
+	bus_write(&bus, 0x2006, 0x10);
+	bus_write(&bus, 0x2007, 0x00);
+	bus_write(&bus, 0x2000, 0x80);
+	bus_write(&bus, 0x2005, 0);
+	bus_write(&bus, 0x2005, 0);
+	clock = ppu_next_vblank(&ppu);
+	ppu_catch_up(&ppu, clock);
+	ASSERT(ppu.framebuffer[0] == 0x0f, return false);
+	ASSERT(ppu.framebuffer[4] == 0x22, return false);
+	ASSERT(ppu.framebuffer[PPU_WIDTH] == 0x21, return false);
 
 	return true;
 }
 
 
-// bool test_j_opcodes()
-// {
-// 	uint8_t ops[] = {
-// 	};
-// 	// load opcodes into memory
-// 	set_memory_range(0x1000, ops, sizeof(ops));
-// 	regs.pc = 0x1000;
+static void render_frame(struct ppu_t* ppu, uint64_t* clock)
+{
+	*clock = ppu_next_vblank(ppu);
+	ppu_catch_up(ppu, *clock);
+}
 
-// 	return true;
-// }
+bool test_tile_cache()
+{
+	static const uint8_t prg[0x4000];
+	static uint8_t chr[0x8000];
+	static struct mapper_t m;
+	static struct ppu_t ppu;
+	struct bus_t bus;
+	uint64_t clock = 0;
+
+	// CNROM, tile 1 of every 1KB page k of bank b solid in color
+	// (b + k) % 3 + 1, and tile 2 of each bank left half
+	for (int b=0; b<4; b++)
+	{
+		for (int k=0; k<8; k++)
+		{
+			int color = (b + k) % 3 + 1;
+			memset(&chr[b*0x2000 + k*0x400 + 0x10], (color & 1) ? 0xff : 0, 8);
+			memset(&chr[b*0x2000 + k*0x400 + 0x18], (color & 2) ? 0xff : 0, 8);
+		}
+		memset(&chr[b*0x2000 + 0x20], 0xf0, 8);
+	}
+	bus_init(&bus);
+	ASSERT(mapper_init(&m, 3, prg, sizeof(prg), chr, sizeof(chr), MIRROR_VERTICAL), return false);
+	mapper_attach(&m, &bus);
+	ppu_init(&ppu, &m, &clock);
+	ppu_attach(&ppu, &bus);
+
+	// tile 1 of each page of the background pattern table side by side
+	for (int i=0; i<4; i++)
+		ppu.vram[i] = i*0x40 + 1;
+	ppu.palette[0] = 0x0f;
+	for (int i=1; i<4; i++)
+		ppu.palette[i] = 0x10 + i;
+	ppu.palette[0x11] = 0x16;
+	memset(ppu.oam, 0xff, sizeof(ppu.oam));
+	bus_write(&bus, 0x2001, 0x1e);
+	render_frame(&ppu, &clock);
+
+	// 4 pages from one side of bank 0, then the other side of every bank
+	// takes 16 more, which pushes the first 4 out while their pattern table
+	// is still mapped where it was. Drawing from it again must decode them
+	// anew, not find their slots holding other pages.
+	static const uint8_t steps[][2] = {
+		{ 0, 0 }, { 1, 1 }, { 2, 1 }, { 3, 1 }, { 0, 1 }, { 0, 0 }, { 3, 0 }, { 1, 1 },
+	};
+	for (int n=0; n<8; n++)
+	{
+		int b = steps[n][0];
+		bus_write(&bus, 0x8000, b);
+		bus_write(&bus, 0x2000, steps[n][1] ? 0x10 : 0); // background table
+		render_frame(&ppu, &clock);
+		for (int i=0; i<4; i++)
+		{
+			int k = steps[n][1]*4 + i;
+			ASSERT(ppu.framebuffer[i*8] == 0x10 + (b + k) % 3 + 1, return false);
+			ASSERT(ppu.framebuffer[7*PPU_WIDTH + i*8 + 7] == 0x10 + (b + k) % 3 + 1, return false);
+		}
+	}
+
+	// a flipped sprite draws its right half, the other its left
+	const uint8_t sprites[8] = { 39, 2, 0x40, 64,  39, 2, 0x00, 128 };
+	memcpy(ppu.oam, sprites, sizeof(sprites));
+	render_frame(&ppu, &clock);
+	ASSERT(ppu.framebuffer[40*PPU_WIDTH + 64] == 0x0f, return false);
+	ASSERT(ppu.framebuffer[40*PPU_WIDTH + 68] == 0x16, return false);
+	ASSERT(ppu.framebuffer[40*PPU_WIDTH + 128] == 0x16, return false);
+	ASSERT(ppu.framebuffer[40*PPU_WIDTH + 132] == 0x0f, return false);
 
+	return true;
+}
 
-bool test_l_opcodes()
+
+bool test_apu()
 {
-	uint8_t ops[] = {
-		0xa9, 0x00, // lda #$20
-		0xa5, 0x20, // lda $20
-		0xb5, 0x20, // lda $20, x
-		0xad, 0x00, 0x20, // lda 0x2000
-		0xbd, 0x00, 0x20, // lda 0x2000, x
-		0xb9, 0x00, 0x20, // lda 0x2000, y
-		0xa1, 0x21, // lda ($21, x)
-		0xb1, 0x22, // lda ($22), y
-
-		0xa2, 0x30, // ldx #$30
-		0xa6, 0x30, // ldx $30
-		0xb6, 0x30, // ldx $30, y
-		0xae, 0x00, 0x30, // ldx $3000
-		0xbe, 0x00, 0x30, // ldx $3000, y
-
-		0xa0, 0x40, // ldy #$40
-		0xa4, 0x40, // ldy $40
-		0xb4, 0x40, // ldy $40, x
-		0xac, 0x00, 0x40, // ldy $4000
-		0xbc, 0x00, 0x40, // ldy $4000, x
-
-		0x4a, // lsr acc
-		0x46, 0x50, // lsr $50
-		0x56, 0x50, // lsr %50, x
-		0x4e, 0x00, 0x50, // lsr $5000
-		0x5e, 0x00, 0x50, // lsr $5000, x
-	};
-	// load opcodes into memory
-	set_memory_range(0x1000, ops, sizeof(ops));
-	set_memory(0x20, 0x21);
-	set_memory(0x21, 0xff);
-	set_memory(0x22, 0x10);
-	set_memory(0x23, 0x20);
-	set_memory(0x2000, 0x01);
-	set_memory(0x2001, 0x02);
-	set_memory(0x2002, 0x03);
-	set_memory(0x2010, 0x31);
-	set_memory(0x2011, 0x32);
-	// ldx
-	set_memory(0x30, 0x31);
-	set_memory(0x31, 0x32);
-	set_memory(0x3000, 0x33);
-	set_memory(0x3001, 0x34);
-	// ldy
-	set_memory(0x40, 0x41);
-	set_memory(0x41, 0x42);
-	set_memory(0x4000, 0x43);
-	set_memory(0x4001, 0x44);
-	// lsr
-	set_memory(0x50, 0x51);
-	set_memory(0x51, 0x52);
-	set_memory(0x5000, 0x55);
-	set_memory(0x5001, 0x56);
-
-	regs.pc = 0x1000;
-
-	// lda
-	cpu_step();
-	ASSERT(regs.acc == 0x00, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	cpu_step();
-	ASSERT(regs.acc == 0x21, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.x = 0x1;
-	cpu_step();
-	ASSERT(regs.acc == 0xff, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	cpu_step();
-	ASSERT(regs.acc == 0x01, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.x = 0x1;
-	cpu_step();
-	ASSERT(regs.acc == 0x02, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.y = 0x2;
-	cpu_step();
-	ASSERT(regs.acc == 0x03, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.x = 0x1;
-	cpu_step();
-	ASSERT(regs.acc == 0x31, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.y = 0x1;
-	cpu_step();
-	ASSERT(regs.acc == 0x32, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// ldx
-	cpu_step();
-	ASSERT(regs.x == 0x30, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	cpu_step();
-	ASSERT(regs.x == 0x31, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.y = 0x1;
-	cpu_step();
-	ASSERT(regs.x == 0x32, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	cpu_step();
-	ASSERT(regs.x == 0x33, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	cpu_step();
-	ASSERT(regs.x == 0x34, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// ldy
-	cpu_step();
-	ASSERT(regs.y == 0x40, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	cpu_step();
-	ASSERT(regs.y == 0x41, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.x = 0x1;
-	cpu_step();
-	ASSERT(regs.y == 0x42, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	cpu_step();
-	ASSERT(regs.y == 0x43, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	cpu_step();
-	ASSERT(regs.y == 0x44, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// lsr acc
-	regs.acc = 0x3;
-	cpu_step();
-	ASSERT(regs.acc == 0x1, return false);
-	ASSERT(regs.status.carry == 1, return false);
-
-	cpu_step();
-	ASSERT(get_memory(0x50) == 0x28, return false);
-	ASSERT(regs.status.carry == 1, return false);
-
-	regs.x = 0x1;
-	cpu_step();
-	ASSERT(get_memory(0x51) == 0x29, return false);
-	ASSERT(regs.status.carry == 0, return false);
-
-	cpu_step();
-	ASSERT(get_memory(0x5000) == 0x2a, return false);
-	ASSERT(regs.status.carry == 1, return false);
-
-	regs.x = 0x1;
-	cpu_step();
-	ASSERT(get_memory(0x5001) == 0x2b, return false);
-	ASSERT(regs.status.carry == 0, return false);
+	static struct apu_t apu;
+	struct bus_t bus;
+	uint64_t clock = 0;
+	int16_t samples[1024];
+
+	bus_init(&bus);
+	apu_init(&apu, &bus, &clock);
+
+	// length counters only load while enabled
+	apu_write(&apu, 0x4003, 0x08);
+	ASSERT(apu_read_status(&apu) == 0x00, return false);
+	apu_write(&apu, 0x4015, 0x0f);
+	apu_write(&apu, 0x4003, 0x08); // length 254
+	apu_write(&apu, 0x400F, 0x18); // length 2
+	ASSERT(apu_read_status(&apu) == 0x09, return false);
+
+	// two half frames run the noise length out, the pulse one is left
+	clock = 14913;
+	apu_catch_up(&apu, clock);
+	ASSERT(apu_read_status(&apu) == 0x09, return false);
+	clock = 29829;
+	apu_catch_up(&apu, clock);
+	ASSERT(apu_read_status(&apu) == 0x41, return false); // with the frame irq
+	ASSERT(apu_read_status(&apu) == 0x01, return false); // acknowledged
+
+	// disabling a channel clears its length
+	apu_write(&apu, 0x4015, 0x00);
+	ASSERT(apu_read_status(&apu) == 0x00, return false);
+
+	// no frame irq in 5-step mode
+	apu_write(&apu, 0x4017, 0x80);
+	clock += 40000;
+	ASSERT(!(apu_read_status(&apu) & 0x40), return false);
+	apu_end_frame(&apu, clock);
+	while (ring_pop(&apu.ring, samples, 1024) > 0)
+		;
+
+	// a 440Hz square at full volume: a frame's worth of samples, not silent
+	apu_write(&apu, 0x4015, 0x01);
+	apu_write(&apu, 0x4000, 0xbf);
+	apu_write(&apu, 0x4002, 0xfd);
+	apu_write(&apu, 0x4003, 0x08);
+	clock += 29780;
+	apu_end_frame(&apu, clock);
+	size_t n = ring_pop(&apu.ring, samples, 1024);
+	ASSERT(n >= 733 && n <= 735, return false);
+	int16_t lo = 0, hi = 0;
+	for (size_t i=0; i<n; i++)
+	{
+		lo = (samples[i] < lo) ? samples[i] : lo;
+		hi = (samples[i] > hi) ? samples[i] : hi;
+	}
+	ASSERT(hi > 1000 && lo < -1000, return false);
+	ASSERT(apu.dropped == 0, return false);
 
 	return true;
 }
 
 
-bool test_no_opcodes()
+bool test_cpu_instances()
 {
-	uint8_t ops[] = {
-		0xea, // nop
-		0x09, 0x70, // ora #$70
-		0x05, 0x50, // ora $50
-		0x15, 0x50, // ora $50, x
-		0x0d, 0x00, 0x20, // ora $2000
-		0x1d, 0x00, 0x20, // ora $2000, x
-		0x19, 0x00, 0x20, // ora $2000, y
-		0x01, 0x60, // ora ($60, x)
-		0x11, 0x61, // ora ($61), y
-	};
-	// load opcodes into memory
-	set_memory_range(0x1000, ops, sizeof(ops));
-	set_memory(0x50, 0x0);
-	set_memory(0x51, 0xaa);
-	set_memory(0x61, 0x00);
-	set_memory(0x62, 0x30);
-	set_memory(0x2000, 0xb0);
-	set_memory(0x2001, 0xc0);
-	set_memory(0x2002, 0xd0);
-	set_memory(0x3000, 0x30);
-	set_memory(0x3030, 0x40);
-	regs.pc = 0x1000;
-
-	cpu_step(); // nothing for nop
-
-	// ora
-	regs.acc = 0x5;
-	cpu_step();
-	ASSERT(regs.acc == 0x75, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.acc = 0x0;
-	cpu_step();
-	ASSERT(regs.acc == 0x00, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.acc = 0x55;
-	regs.x = 0x1;
-	cpu_step();
-	ASSERT(regs.acc == 0xff, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	regs.acc = 0xb;
-	cpu_step();
-	ASSERT(regs.acc == 0xbb, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	regs.acc = 0xc;
-	regs.x = 0x1;
-	cpu_step();
-	ASSERT(regs.acc == 0xcc, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	regs.acc = 0xd;
-	regs.y = 0x2;
-	cpu_step();
-	ASSERT(regs.acc == 0xdd, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	regs.acc = 0x03;
-	regs.x = 0x1;
-	cpu_step();
-	ASSERT(regs.acc == 0x33, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.acc = 0x04;
-	regs.y = 0x30;
-	cpu_step();
-	ASSERT(regs.acc == 0x44, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
+	// two cpus on their own buses share nothing but the opcode tables
+	static uint8_t mem_a[0x10000], mem_b[0x10000];
+	struct bus_t bus_a, bus_b;
+	struct cpu_t a, b;
+	uint8_t ops[] = { 0xa9, 0x42, 0x85, 0x10 }; // lda #$42, sta $10
+
+	bus_init_flat(&bus_a, mem_a);
+	bus_init_flat(&bus_b, mem_b);
+	cpu_init(&a, &bus_a);
+	cpu_init(&b, &bus_b);
+	set_memory_range(&a, 0x200, ops, sizeof(ops));
+	a.regs.pc = 0x200;
+	b.regs.pc = 0x200; // brk, nothing was loaded
+
+	ASSERT(cpu_step(&a) && cpu_step(&a), return false);
+	ASSERT(mem_a[0x10] == 0x42 && mem_b[0x10] == 0, return false);
+	ASSERT(a.regs.cycles == 5 && b.regs.cycles == 0, return false);
+	ASSERT(b.regs.acc == 0, return false);
+
+	cpu_nmi(&b);
+	ASSERT(!a.pending && (b.pending == INT_NMI), return false);
+	return true;
+}
 
+
+bool test_interrupts()
+{
+	static uint8_t mem[0x10000];
+	struct bus_t bus;
+	struct cpu_t cpu;
+
+	bus_init_flat(&bus, mem);
+	cpu_init(&cpu, &bus);
+	mem[0xfffa] = 0x00; mem[0xfffb] = 0x04; // nmi $0400
+	mem[0xfffc] = 0x00; mem[0xfffd] = 0x02; // reset $0200
+	mem[0xfffe] = 0x00; mem[0xffff] = 0x03; // irq/brk $0300
+	mem[0x200] = 0x58; // cli
+	mem[0x201] = 0xea; // nop
+	mem[0x300] = 0xea; // nop
+	mem[0x301] = 0x00; // brk
+
+	// reset comes up with I set and the stack pointer three down
+	cpu_reset(&cpu);
+	ASSERT(cpu.regs.pc == 0x200 && cpu.regs.sp == 0xfd && cpu.regs.status.interrupt, return false);
+
+	// the IRQ line is ignored while I is set, taken once CLI clears it
+	cpu_irq(&cpu, IRQ_APU, true);
+	ASSERT(cpu.pending == 0, return false);
+	ASSERT(cpu_step(&cpu) && (cpu.pending == INT_IRQ), return false);
+	uint64_t cycles = cpu.regs.cycles;
+	ASSERT(cpu_step(&cpu) && cpu.regs.pc == 0x300, return false);
+	ASSERT(cpu.regs.cycles == cycles + 7 && cpu.regs.sp == 0xfa, return false);
+	ASSERT(mem[0x1fd] == 0x02 && mem[0x1fc] == 0x01 && (mem[0x1fb] & 0x30) == 0x20, return false);
+
+	// not again inside the handler, BRK pushes B set
+	ASSERT(cpu_step(&cpu) && cpu_step(&cpu) && cpu.regs.pc == 0x300, return false);
+	ASSERT(mem[0x1f9] == 0x03 && (mem[0x1f8] & 0x30) == 0x30, return false);
+
+	// NMI before IRQ, dropping the line leaves nothing pending
+	set_proc_status(&cpu, 0);
+	cpu_nmi(&cpu);
+	ASSERT(cpu.pending == (INT_NMI | INT_IRQ), return false);
+	ASSERT(cpu_step(&cpu) && cpu.regs.pc == 0x400, return false);
+	cpu_irq(&cpu, IRQ_APU, false);
+	set_proc_status(&cpu, 0);
+	ASSERT(cpu.pending == 0, return false);
+
+	// a soft reset waits for the instruction boundary
+	cpu_soft_reset(&cpu);
+	uint8_t sp = cpu.regs.sp;
+	ASSERT(cpu_step(&cpu) && cpu.regs.pc == 0x200 && cpu.regs.sp == (uint8_t)(sp - 3), return false);
+	ASSERT(cpu.pending == 0, return false);
 	return true;
 }
 
 
-bool test_p_opcodes()
+bool test_jit()
 {
-	uint8_t ops[] = {
-		0x48, // pha
-		0x08, // php
-		0x08,
-		0x68, // pla
-		0x68,
-		0x68,
-		0x28, // plp
-		0x28
+	// the same loop interpreted and translated must end in the same state
+	static uint8_t mem_a[0x10000], mem_b[0x10000];
+	struct bus_t bus_a, bus_b;
+	struct cpu_t a, b;
+	uint8_t prog[] = {
+		0xa2, 0x00,       // $0200 ldx #0
+		0x8a,             // $0202 txa
+		0x69, 0x37,       //       adc #$37
+		0x45, 0x10,       //       eor $10
+		0x85, 0x10,       //       sta $10
+		0x2a,             //       rol a
+		0x9d, 0x00, 0x03, //       sta $0300,x
+		0x20, 0x20, 0x02, //       jsr $0220
+		0xe8,             //       inx
+		0xd0, 0xef,       //       bne $0202
+		0x4c, 0x13, 0x02, // $0213 jmp $0213
+	};
+	uint8_t sub[] = {
+		0xc6, 0x11,       // $0220 dec $11
+		0xe5, 0x11,       //       sbc $11
+		0x91, 0x12,       //       sta ($12),y
+		0xc8,             //       iny
+		0x60,             //       rts
 	};
-	// load opcodes into memory
-	set_memory_range(0x1000, ops, sizeof(ops));
-	set_memory(0x40, 0x50);
-	set_memory(0x41, 0x80);
-	set_memory(0x42, 0x00);
-	set_memory(0x50, 0x55);
-	set_memory(0x51, 0x8a);
-	regs.pc = 0x1000;
-
-	// pha
-	regs.acc = 0x11;
-	regs.sp = 0x30;
-	cpu_step();
-	ASSERT(get_memory(0x30) == 0x11, return false);
-	ASSERT(regs.sp == 0x2f, return false);
-
-	// php
-	set_proc_status(0x8a); // 1 0 - 0 1 0 1 0
-	regs.sp = 0x30;
-	cpu_step();
-	ASSERT(get_proc_status() == 0x8a, return false);
-	ASSERT(regs.sp == 0x2f, return false);
-
-	set_proc_status(0x55); // 0 1 - 1 0 1 0 1
-	regs.sp = 0x30;
-	cpu_step();
-	ASSERT(get_proc_status() == 0x55, return false);
-	ASSERT(regs.sp == 0x2f, return false);
-
-	// pla
-	regs.sp = 0x3f;
-	cpu_step();
-	ASSERT(regs.acc == 0x50, return false);
-	ASSERT(regs.sp == 0x40, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	cpu_step();
-	ASSERT(regs.acc == 0x80, return false);
-	ASSERT(regs.sp == 0x41, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	cpu_step();
-	ASSERT(regs.acc == 0x00, return false);
-	ASSERT(regs.sp == 0x42, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// plp
-	regs.sp = 0x4f;
-	cpu_step();
-	ASSERT(regs.sp == 0x50, return false);
-	ASSERT(regs.status.carry == 1, return false);  // 0 1 - 1 0 1 0 1
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.interrupt == 1, return false);
-	ASSERT(regs.status.decimal == 0, return false);
-	ASSERT(regs.status.break_cmd == 1, return false);
-	ASSERT(regs.status.overflow == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	cpu_step();
-	ASSERT(regs.sp == 0x51, return false);
-	ASSERT(regs.status.carry == 0, return false);  // 1 0 - 0 1 0 1 0
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.interrupt == 0, return false);
-	ASSERT(regs.status.decimal == 1, return false);
-	ASSERT(regs.status.break_cmd == 0, return false);
-	ASSERT(regs.status.overflow == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
 
+	bus_init_flat(&bus_a, mem_a);
+	bus_init_flat(&bus_b, mem_b);
+	cpu_init(&a, &bus_a);
+	cpu_init(&b, &bus_b);
+	set_memory_range(&a, 0x200, prog, sizeof(prog));
+	set_memory_range(&a, 0x220, sub, sizeof(sub));
+	set_memory(&a, 0x13, 0x05);
+	a.regs.pc = 0x200;
+	a.regs.sp = 0xff;
+	memcpy(mem_b, mem_a, sizeof(mem_b));
+	b.regs = a.regs;
+
+	while (a.regs.pc != 0x213)
+		ASSERT(cpu_step(&a), return false);
+
+	struct jit_t* jit = jit_create(&b, &bus_b, true);
+	if (jit == NULL)
+		return true; // not on this host
+	ASSERT(jit_run(jit, a.regs.cycles), return false);
+	ASSERT(b.regs.pc == 0x213 && b.regs.cycles == a.regs.cycles, return false);
+	ASSERT(b.regs.acc == a.regs.acc && b.regs.x == a.regs.x && b.regs.y == a.regs.y, return false);
+	ASSERT(get_proc_status(&b) == get_proc_status(&a), return false);
+	ASSERT(memcmp(mem_a, mem_b, 0x600) == 0, return false);
+	ASSERT(jit_stats(jit)->blocks > 0 && jit_stats(jit)->mismatches == 0, return false);
+	jit_destroy(jit);
 	return true;
 }
 
+static const uint8_t bank_b[256] = {
+	0x4c, 0x08, 0x80, // $8000 jmp $8008
+	[0x05] = 0x4c, 0x00, 0x80, // $8005 jmp $8000
+	[0x08] = 0xa9, 0x02, // $8008 lda #2
+	0x85, 0x10,       //       sta $10
+	0x4c, 0x0c, 0x80, // $800c jmp $800c
+};
 
-// bool test_r_opcodes()
-// {
-// 	uint8_t ops[] = {
-// 	};
-// 	// load opcodes into memory
-// 	set_memory_range(0x1000, ops, sizeof(ops));
-// 	regs.pc = 0x1000;
-
-// 	return true;
-// }
+static void switch_bank(void* ctx, uint16_t addr, uint8_t value)
+{
+	bus_map_read((struct bus_t*) ctx, 0x80, 1, bank_b, sizeof(bank_b));
+}
 
+bool test_predecode()
+{
+	static uint8_t mem[0x10000];
+	static const uint8_t bank_a[256] = {
+		0xa9, 0x01,       // $8000 lda #1
+		0x8d, 0x00, 0x40, //       sta $4000, switches to bank_b
+		0x4c, 0x00, 0x80, // $8005 jmp $8000
+	};
+	uint8_t prog[] = {
+		0xa2, 0x02,       // $0200 ldx #2
+		0x8e, 0x07, 0x02, // $0202 stx $0207, the lda operand
+		0xea,             //       nop
+		0xad, 0x00, 0x04, // $0206 lda $0400
+		0x9d, 0x00, 0x03, //       sta $0300,x
+		0xca,             //       dex
+		0xd0, 0xf3,       //       bne $0202
+		0x4c, 0x00, 0x80, //       jmp $8000
+	};
+	struct bus_t bus;
+	struct cpu_t cpu;
+	struct decode_cache_t* cache = decode_cache_create();
+
+	bus_init_flat(&bus, mem);
+	bus_map_read(&bus, 0x80, 1, bank_a, sizeof(bank_a));
+	bus_map_io(&bus, 0x40, 1, NULL, switch_bank, &bus);
+	cpu_init(&cpu, &bus);
+	set_memory_range(&cpu, 0x200, prog, sizeof(prog));
+	mem[0x401] = 0x11;
+	mem[0x402] = 0x22;
+	cpu.regs.pc = 0x200;
+
+	// code patched after it was decoded runs patched
+	while (cpu.regs.pc != 0x8000)
+		ASSERT(cpu_step_cached(&cpu, cache), return false);
+	ASSERT(mem[0x302] == 0x22 && mem[0x301] == 0x11, return false);
+
+	// and code in a bank switched in runs from that bank
+	for (int i=0; i<8; i++)
+		ASSERT(cpu_step_cached(&cpu, cache), return false);
+	ASSERT(mem[0x10] == 0x02 && cpu.regs.pc == 0x800c, return false);
+
+	decode_cache_destroy(cache);
+	return true;
+}
 
-bool test_s_opcodes()
+// blocks run natively, as they do in a frame, not one at a time as in check
+// mode
+bool test_jit_native()
 {
-	uint8_t ops[] = {
-		// TODO finish
-		// 0xe9, 0xxx, // sbc #$xxxx
-		// 0xe5, 0x10, // sbc $10
-		// 0xf5, 0x10, // sbc $10,x
-		// 0xed, 0x00, 0x10, // sbc $1000
-		// 0xfd, 0x00, 0x10, // sbc $1000, x
-		// 0xf9, 0x00, 0x10, // sbc $1000, y
-		// 0xe1, 0xxx,// sbc ($xx,x)
-		// 0xf1, 0xxx,// sbc ($xx),y
-
-		0x38, // sec
-		0xf8, // sed
-		0x78, // sei
-
-		0x85, 0x30, // sta $30
-		0x95, 0x30, // sta $30, x
-		0x8d, 0x00, 0x20, // sta $2000
-		0x9d, 0x00, 0x20, // sta $2000, x
-		0x99, 0x00, 0x20, // sta $2000, y
-		0x81, 0x40, // sta ($40,x)
-		0x91, 0x40, // sta ($40),y
-
-		0x86, 0x50, // stx $50
-		0x96, 0x50, // stx $50, y
-		0x8e, 0x00, 0x30, // stx $3000
-
-		0x84, 0x60, // sty $60
-		0x94, 0x60, // sty $60, x
-		0x8c, 0x00, 0x40, // sty $4000
+	static uint8_t mem[0x10000];
+	static const uint8_t bank_a[256] = {
+		0xa9, 0x01,       // $8000 lda #1
+		0x8d, 0x00, 0x40, //       sta $4000, switches to bank_b
+		0x4c, 0x00, 0x80, // $8005 jmp $8000
+	};
+	uint8_t loop[] = {
+		0xa2, 0x00,       // $0200 ldx #0
+		0xca,             // $0202 dex
+		0xd0, 0xfd,       //       bne $0202
+		0x4c, 0x05, 0x02, // $0205 jmp $0205
 	};
-	// load opcodes into memory
-	set_memory_range(0x1000, ops, sizeof(ops));
-	set_memory(0x40, 0x00);
-	set_memory(0x41, 0x20);
-	set_memory(0x43, 0x03);
-	set_memory(0x44, 0x20);
-	regs.pc = 0x1000;
-
-	// carry
-	regs.status.carry = 0;
-	cpu_step();
-	ASSERT(regs.status.carry == 1, return false);
-
-	// decimal
-	regs.status.decimal = 0;
-	cpu_step();
-	ASSERT(regs.status.decimal == 1, return false);
-
-	// interrupt
-	regs.status.interrupt = 0;
-	cpu_step();
-	ASSERT(regs.status.interrupt == 1, return false);
-
-	// sta zpage
-	regs.acc = 0x55;
-	cpu_step();
-	ASSERT(get_memory(0x30) == 0x55, return false);
-
-	// sta zpage,x
-	regs.x = 0x1;
-	regs.acc = 0x56;
-	cpu_step();
-	ASSERT(get_memory(0x31) == 0x56, return false);
-
-	//
-	regs.acc = 0x57;
-	cpu_step();
-	ASSERT(get_memory(0x2000) == 0x57, return false);
-
-	//
-	regs.x = 0x1;
-	regs.acc = 0x58;
-	cpu_step();
-	ASSERT(get_memory(0x2001) == 0x58, return false);
-
-	//
-	regs.y = 0x2;
-	regs.acc = 0x59;
-	cpu_step();
-	ASSERT(get_memory(0x2002) == 0x59, return false);
-
-	// sta indirect, x
-	regs.x = 0x3;
-	regs.acc = 0x5a;
-	cpu_step();
-	ASSERT(get_memory(0x2003) == 0x5a, return false);
-
-	// sta indirect, y
-	regs.y = 0x4;
-	regs.acc = 0x5b;
-	cpu_step();
-	ASSERT(get_memory(0x2004) == 0x5b, return false);
-
-	// stx zpage
-	regs.x = 0x60;
-	cpu_step();
-	ASSERT(get_memory(0x50) == 0x60, return false);
-
-	// stx zpage,y
-	regs.y = 0x1;
-	regs.x = 0x61;
-	cpu_step();
-	ASSERT(get_memory(0x51) == 0x61, return false);
-
-	// stx absolute
-	regs.x = 0x62;
-	cpu_step();
-	ASSERT(get_memory(0x3000) == 0x62, return false);
-
-	// sty zpage
-	regs.y = 0x70;
-	cpu_step();
-	ASSERT(get_memory(0x60) == 0x70, return false);
-
-	// sty zpage,x
-	regs.x = 0x1;
-	regs.y = 0x71;
-	cpu_step();
-	ASSERT(get_memory(0x61) == 0x71, return false);
-
-	// sty absolute
-	regs.y = 0x72;
-	cpu_step();
-	ASSERT(get_memory(0x4000) == 0x72, return false);
+	uint8_t patch[] = {
+		0xee, 0x01, 0x04, // $0300 inc $0401, the lda operand
+		0x4c, 0x00, 0x04, //       jmp $0400
+	};
+	uint8_t patched[] = {
+		0xa9, 0x00,       // $0400 lda #n
+		0x4c, 0x00, 0x03, //       jmp $0300
+	};
+	struct bus_t bus;
+	struct cpu_t cpu;
+	struct jit_t* jit;
+
+	// a block that branches to itself keeps running without leaving
+	bus_init_flat(&bus, mem);
+	cpu_init(&cpu, &bus);
+	set_memory_range(&cpu, 0x200, loop, sizeof(loop));
+	cpu.regs.pc = 0x200;
+	if ((jit = jit_create(&cpu, &bus, false)) == NULL)
+		return true; // not on this host
+	ASSERT(jit_run(jit, 10000), return false);
+	ASSERT(cpu.regs.pc == 0x205 && cpu.regs.x == 0, return false);
+	ASSERT(cpu.regs.cycles >= 10000 && cpu.regs.cycles < 10010, return false);
+	ASSERT(jit_stats(jit)->runs < 8, return false);
+	jit_destroy(jit);
+
+	// a write that switches the bank the block runs from leaves it
+	memset(mem, 0, sizeof(mem));
+	bus_init_flat(&bus, mem);
+	bus_map_read(&bus, 0x80, 1, bank_a, sizeof(bank_a));
+	bus_map_io(&bus, 0x40, 1, NULL, switch_bank, &bus);
+	cpu_init(&cpu, &bus);
+	cpu.regs.pc = 0x8000;
+	jit = jit_create(&cpu, &bus, false);
+	ASSERT(jit_run(jit, 1000), return false);
+	ASSERT(mem[0x10] == 0x02 && cpu.regs.pc == 0x800c, return false);
+	jit_destroy(jit);
+
+	// code that patches itself runs patched, every retranslation taking
+	// space until the cache is flushed
+	memset(mem, 0, sizeof(mem));
+	bus_init_flat(&bus, mem);
+	cpu_init(&cpu, &bus);
+	set_memory_range(&cpu, 0x300, patch, sizeof(patch));
+	set_memory_range(&cpu, 0x400, patched, sizeof(patched));
+	cpu.regs.pc = 0x300;
+	jit = jit_create(&cpu, &bus, false);
+	ASSERT(jit_run(jit, 4000000), return false);
+	ASSERT(jit_stats(jit)->flushes > 0, return false);
+	// the accumulator is the operand, or one behind it once it was bumped
+	ASSERT(cpu.regs.acc == (uint8_t)(mem[0x401] - (cpu.regs.pc != 0x300)), return false);
+	jit_destroy(jit);
+
+	return true;
+}
+
+bool test_frame_step()
+{
+	// a blank NROM cart, the cpu runs BRKs through the zeroed vectors
+	const uint8_t ines[16] = { 'N', 'E', 'S', 0x1a, 1, 1 };
+	static struct nes_t nes;
+	struct nes_frame_t frame;
+	char path[] = "/tmp/nes-test-XXXXXX";
+
+	ASSERT(write_rom(path, ines, 0x4000 + 0x2000), return false);
+	ASSERT(nes_open(&nes, path) == NES_CART_OK, return false);
+	unlink(path);
+
+	// each frame comes with its picture and its share of the audio; the
+	// first one is short, it starts at power on rather than at vblank
+	for (int i=0; i<3; i++)
+	{
+		ASSERT(nes_step_frame(&nes, &frame), return false);
+		ASSERT(frame.number == i && nes.frames == i+1, return false);
+		ASSERT(frame.pixels == nes.ppu.framebuffer, return false);
+		ASSERT(frame.samples == nes.audio, return false);
+		ASSERT(frame.nsamples > 0 && frame.nsamples <= NES_FRAME_SAMPLES, return false);
+		ASSERT(i == 0 || (frame.nsamples >= 733 && frame.nsamples <= 735), return false);
+	}
+	ASSERT(ring_size(&nes.apu.ring) == 0, return false);
 
+	nes_close(&nes);
 	return true;
 }
 
+bool test_joypad()
+{
+	struct joypad_t pad = { .buttons = JOY_A | JOY_START | JOY_RIGHT };
+
+	// the strobe keeps reloading, A comes out until it drops
+	joypad_strobe(&pad, 1);
+	ASSERT(joypad_read(&pad) == 1 && joypad_read(&pad) == 1, return false);
+	joypad_strobe(&pad, 0);
+	pad.buttons = 0; // latched already
+	uint8_t bits = 0;
+	for (int i=0; i<8; i++)
+		bits |= joypad_read(&pad) << i;
+	ASSERT(bits == (JOY_A | JOY_START | JOY_RIGHT), return false);
+	ASSERT(joypad_read(&pad) == 1, return false);
+
+	// FM2 input lines, buttons written RLDUTSBA
+	static const char fm2[] =
+		"version 3\nport0 1\nport1 1\nport2 0\n"
+		"|0|........|........||\n"
+		"|1|R......A|...U.S..||\n";
+	struct movie_t movie;
+	char path[] = "/tmp/nes-test-XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT(fd >= 0 && write(fd, fm2, sizeof(fm2)-1) == sizeof(fm2)-1, return false);
+	close(fd);
+	ASSERT(movie_open(&movie, path) == MOVIE_OK, return false);
+	unlink(path);
+	ASSERT(movie.nframes == 2, return false);
+	ASSERT(movie.frames[0].pad[0] == 0 && movie.frames[0].commands == 0, return false);
+	ASSERT(movie.frames[1].pad[0] == (JOY_RIGHT | JOY_A), return false);
+	ASSERT(movie.frames[1].pad[1] == (JOY_UP | JOY_SELECT), return false);
+	ASSERT(movie.frames[1].commands == MOVIE_RESET, return false);
+	movie_close(&movie);
 
-bool test_t_opcodes()
+	return true;
+}
+
+static bool run_frames(struct nes_t* nes, int n)
 {
-	uint8_t ops[] = {
-		0xaa, // tax
-		0xaa,
-		0xaa,
-		0xa8, // tay
-		0xa8,
-		0xa8,
-		0x8a, // txa
-		0x8a,
-		0x8a,
-		0x98, // tya
-		0x98,
-		0x98,
-		0xba, // tsx
-		0xba,
-		0xba,
-		0x9a, // txs
-		0x9a,
-		0x9a
-	//tsx: transfer sp to x
-	//txs: transfer x to sp
-	};
-	// load opcodes into memory
-	set_memory_range(0x1000, ops, sizeof(ops));
-	regs.pc = 0x1000;
-
-	// test tax
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.acc = 0x50;
-	cpu_step();
-	ASSERT(regs.x == 0x50, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.acc = 0x80;
-	cpu_step();
-	ASSERT(regs.x == 0x80, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.acc = 0x00;
-	cpu_step();
-	ASSERT(regs.x == 0x00, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// test tay
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.acc = 0x51;
-	cpu_step();
-	ASSERT(regs.y == 0x51, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.acc = 0x85;
-	cpu_step();
-	ASSERT(regs.y == 0x85, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.acc = 0x00;
-	cpu_step();
-	ASSERT(regs.y == 0x00, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// txa
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.x = 0x52;
-	cpu_step();
-	ASSERT(regs.acc == 0x52, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.x = 0x82;
-	cpu_step();
-	ASSERT(regs.acc == 0x82, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.x = 0x00;
-	cpu_step();
-	ASSERT(regs.acc == 0x00, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// tya
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.y = 0x53;
-	cpu_step();
-	ASSERT(regs.acc == 0x53, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.y = 0x83;
-	cpu_step();
-	ASSERT(regs.acc == 0x83, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.y = 0x00;
-	cpu_step();
-	ASSERT(regs.acc == 0x00, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	// tsx
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.sp = 0x54;
-	cpu_step();
-	ASSERT(regs.x == 0x54, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 0, return false);
-
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.sp = 0x84;
-	cpu_step();
-	ASSERT(regs.x == 0x84, return false);
-	ASSERT(regs.status.zero == 0, return false);
-	ASSERT(regs.status.negative == 1, return false);
-
-	regs.status.zero = 0;
-	regs.status.negative = 0;
-	regs.sp = 0x00;
-	cpu_step();
-	ASSERT(regs.x == 0x00, return false);
-	ASSERT(regs.status.zero == 1, return false);
-	ASSERT(regs.status.negative == 0, return false);
+	for (int i=0; i<n; i++)
+		if (!nes_run_frame(nes))
+			return false;
+	return true;
+}
 
+bool test_state()
+{
+	// MMC1 with PRG and CHR RAM: run on from a save, a load and two forks,
+	// all four must draw the same frame at the same cycle
+	static struct nes_t nes;
+	static uint8_t picture[PPU_WIDTH*PPU_HEIGHT];
+	struct nes_snapshot_t snap;
+
+	ASSERT(nes_open(&nes, "the-legend-of-zelda.nes") == NES_CART_OK, return false);
+	ASSERT(run_frames(&nes, 120), return false);
+	size_t size = nes_save_state(&nes, NULL, 0);
+	uint8_t* state = malloc(size);
+	ASSERT(nes_save_state(&nes, state, size) == size, return false);
+	ASSERT(nes_snapshot(&nes, &snap), return false);
+
+	nes.pad[0].buttons = JOY_START;
+	ASSERT(run_frames(&nes, 60), return false);
+	nes.pad[0].buttons = 0;
+	ASSERT(run_frames(&nes, 60), return false);
+	memcpy(picture, nes.ppu.framebuffer, sizeof(picture));
+	uint64_t cycles = nes.cpu.regs.cycles;
+
+	// on another engine, which must forget the code it saw
+	ASSERT(nes_set_engine(&nes, NES_ENGINE_PREDECODE), return false);
+	ASSERT(nes_load_state(&nes, state, size), return false);
+	ASSERT(nes.frames == 120, return false);
+	nes.pad[0].buttons = JOY_START;
+	ASSERT(run_frames(&nes, 60), return false);
+	nes.pad[0].buttons = 0;
+	ASSERT(run_frames(&nes, 60), return false);
+	ASSERT(nes.cpu.regs.cycles == cycles, return false);
+	ASSERT(!memcmp(picture, nes.ppu.framebuffer, sizeof(picture)), return false);
+
+	for (int i=0; i<2; i++)
+	{
+		struct nes_t* fork = nes_fork(&snap);
+		ASSERT(fork != NULL && fork->frames == 120, return false);
+		ASSERT(fork->cpu.bus == &fork->bus && fork->ppu.mapper == &fork->mapper, return false);
+		fork->pad[0].buttons = JOY_START;
+		ASSERT(run_frames(fork, 60), return false);
+		fork->pad[0].buttons = 0;
+		ASSERT(run_frames(fork, 60), return false);
+		ASSERT(fork->cpu.regs.cycles == cycles, return false);
+		ASSERT(!memcmp(picture, fork->ppu.framebuffer, sizeof(picture)), return false);
+		nes_fork_close(fork);
+	}
+	nes_snapshot_close(&snap);
+
+	// a damaged or foreign blob is refused and changes nothing
+	state[4]++; // version
+	ASSERT(!nes_load_state(&nes, state, size), return false);
+	state[4]--;
+	ASSERT(!nes_load_state(&nes, state, size - 1), return false);
+	ASSERT(nes.cpu.regs.cycles == cycles, return false);
+
+	// a bad section further in is caught before the ones ahead of it load
+	uint8_t* tag = memmem(state, size, "PPU ", 4);
+	ASSERT(tag != NULL, return false);
+	tag[0] ^= 0x20;
+	ASSERT(!nes_load_state(&nes, state, size), return false);
+	ASSERT(nes.cpu.regs.cycles == cycles && nes.frames != 120, return false);
+
+	free(state);
+	nes_close(&nes);
 	return true;
 }
 
+bool test_reset()
+{
+	// a movie's reset command presses the button on the whole console
+	static struct nes_t nes;
+	struct movie_frame_t frame = { MOVIE_RESET, { JOY_A, 0 } };
+	struct movie_t movie = { &frame, 1 };
+
+	ASSERT(nes_open(&nes, "the-legend-of-zelda.nes") == NES_CART_OK, return false);
+	ASSERT(run_frames(&nes, 120), return false);
+	ASSERT((nes.ppu.ctrl & 0x80) && nes.ppu.mask && nes.apu.enabled, return false);
+	uint8_t ram = nes.bus.ram[0x10];
+
+	ASSERT(nes_play_movie(&nes, &movie, 0), return false);
+	ASSERT(nes.pad[0].buttons == JOY_A, return false);
+	ASSERT(nes.ppu.ctrl == 0 && nes.ppu.mask == 0 && !nes.ppu.w, return false);
+	ASSERT(nes.apu.enabled == 0 && nes.apu.pulse[0].length == 0, return false);
+	ASSERT(nes.cpu.pending & INT_RESET, return false);
+	ASSERT(nes.bus.ram[0x10] == ram, return false);
+
+	// and the game starts over
+	ASSERT(run_frames(&nes, 60), return false);
+	ASSERT(!(nes.cpu.pending & INT_RESET), return false);
+	ASSERT(nes.ppu.ctrl & 0x80, return false);
+
+	nes_close(&nes);
+	return true;
+}
 
 int main(int argc, char** argv)
 {
-	cpu_init();
-
-	if (/*test_addrmode_immediate()
-	    && test_addrmode_zero_page()
-	    && test_addrmode_zero_page_x()
-	    && test_addrmode_zero_page_y()
-	    && test_addrmode_abs()
-	    && test_addrmode_abs_x()
-	    && test_addrmode_abs_y()
-	    && test_addrmode_indirect()
-	    && test_addrmode_indexed_indirect_x()
-	    && test_addrmode_indirect_indexed_y()
-	    //&& test_a_opcodes()
-	    //&& test_b_opcodes()
-	    &&*/ test_c_opcodes()
-	    && test_d_opcodes()
-	    && test_e_opcodes()
-	    && test_i_opcodes()
-	    //&& test_j_opcodes()
-	    && test_l_opcodes()
-	    && test_no_opcodes()
-	    && test_p_opcodes()
-	    //&& test_r_opcodes()
-	    && test_s_opcodes()
-	    && test_t_opcodes()
+	if (test_bus()
+	    && test_mapper()
+	    && test_cart()
+	    && test_ppu()
+	    && test_tile_cache()
+	    && test_apu()
+	    && test_cpu_instances()
+	    && test_interrupts()
+	    && test_jit()
+	    && test_predecode()
+	    && test_jit_native()
+	    && test_frame_step()
+	    && test_joypad()
+	    && test_state()
+	    && test_reset()
 	    )
 	{
 		printf("test result: success\n");
-		return true;
+		return 0;
 	}
 	else
 	{
 		printf("test result: failed\n");
-		return false;
+		return 1;
 	}
 }
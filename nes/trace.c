@@ -0,0 +1,58 @@
+#include "trace.h"
+#include <stdio.h>
+
+#define TRACE_BUFSZ 4096
+
+static FILE *trace_file = NULL;
+static struct trace_rec_t trace_buf[TRACE_BUFSZ];
+static int trace_cnt = 0;
+
+
+static void trace_flush()
+{
+  if (trace_cnt > 0)
+    fwrite(trace_buf, sizeof(struct trace_rec_t), trace_cnt, trace_file);
+  trace_cnt = 0;
+}
+
+
+uint8_t trace_open(const char *filepath)
+{
+  trace_close();
+
+  trace_file = fopen(filepath, "wb");
+  if (trace_file == NULL)
+    return 1;
+
+  return 0;
+}
+
+
+void trace_close()
+{
+  if (trace_file == NULL)
+    return;
+
+  trace_flush();
+  fclose(trace_file);
+  trace_file = NULL;
+}
+
+
+void trace_insn(uint16_t pc, uint8_t ir, uint8_t acc, uint8_t x, uint8_t y, uint8_t sp, uint8_t status)
+{
+  if (trace_file == NULL)
+    return;
+
+  struct trace_rec_t *rec = &trace_buf[trace_cnt];
+  rec->pc = pc;
+  rec->ir = ir;
+  rec->acc = acc;
+  rec->x = x;
+  rec->y = y;
+  rec->sp = sp;
+  rec->status = status;
+
+  if (++trace_cnt == TRACE_BUFSZ)
+    trace_flush();
+}
@@ -0,0 +1,35 @@
+#include <stdint.h>
+
+#pragma once
+
+/**
+ * Binary instruction trace. Each executed instruction becomes one fixed size
+ * record, buffered and written in large blocks, which is far cheaper than a
+ * printf per instruction. Only compiled into the cpu loop when building with
+ * -DCPU_TRACE; otherwise TRACE_INSN() expands to nothing.
+ */
+struct trace_rec_t
+{
+  uint16_t pc;     // address of the opcode
+  uint8_t  ir;     // opcode
+  uint8_t  acc;
+  uint8_t  x;
+  uint8_t  y;
+  uint8_t  sp;
+  uint8_t  status; // [N V - B D I Z C]
+};
+
+/**
+ * returns: 0 on success
+ */
+uint8_t trace_open(const char *filepath);
+
+void trace_close();
+
+void trace_insn(uint16_t pc, uint8_t ir, uint8_t acc, uint8_t x, uint8_t y, uint8_t sp, uint8_t status);
+
+#ifdef CPU_TRACE
+#define TRACE_INSN(pc, ir, acc, x, y, sp, status) trace_insn(pc, ir, acc, x, y, sp, status)
+#else
+#define TRACE_INSN(pc, ir, acc, x, y, sp, status)
+#endif
@@ -0,0 +1,99 @@
+#include "wav.h"
+#include "log.h"
+#include <string.h>
+#include <unistd.h> //usleep()
+
+#define WAV_BLOCK 1024
+
+
+static void put16(uint8_t* p, uint16_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+  put16(p, v & 0xFFFF);
+  put16(p+2, (v >> 16) & 0xFFFF);
+}
+
+static void write_header(struct wav_sink_t* wav)
+{
+  // canonical 44 byte RIFF/WAVE header, PCM
+  uint8_t h[44];
+  memcpy(&h[0], "RIFF", 4);
+  put32(&h[4], 36 + wav->bytes);
+  memcpy(&h[8], "WAVE", 4);
+  memcpy(&h[12], "fmt ", 4);
+  put32(&h[16], 16);                         // fmt chunk size
+  put16(&h[20], 1);                          // PCM
+  put16(&h[22], 1);                          // channels
+  put32(&h[24], wav->rate);                  // sample rate
+  put32(&h[28], wav->rate*sizeof(int16_t));  // byte rate
+  put16(&h[32], sizeof(int16_t));            // block align
+  put16(&h[34], 16);                         // bits per sample
+  memcpy(&h[36], "data", 4);
+  put32(&h[40], wav->bytes);
+  fwrite(h, 1, sizeof(h), wav->file);
+}
+
+static void* writer(void* arg)
+{
+  struct wav_sink_t* wav = (struct wav_sink_t*) arg;
+  int16_t buf[WAV_BLOCK];
+
+  while (1)
+  {
+    // sample running before draining so the last block is never lost
+    int more = atomic_load(&wav->running);
+    size_t got = ring_pop(wav->ring, buf, WAV_BLOCK);
+    if (got > 0)
+      wav->bytes += fwrite(buf, sizeof(int16_t), got, wav->file)*sizeof(int16_t);
+    else if (!more)
+      break;
+    else
+      usleep(2000);
+  }
+  return NULL;
+}
+
+
+int wav_open(struct wav_sink_t* wav, struct sample_ring_t* ring, uint32_t rate, const char* filepath)
+{
+  wav->file = fopen(filepath, "wb");
+  if (wav->file == NULL)
+  {
+    log_error("cannot create %s\n", filepath);
+    return 1;
+  }
+
+  wav->ring = ring;
+  wav->rate = rate;
+  wav->bytes = 0;
+  write_header(wav);
+
+  atomic_init(&wav->running, 1);
+  if (pthread_create(&wav->thread, NULL, writer, wav) != 0)
+  {
+    fclose(wav->file);
+    wav->file = NULL;
+    return 2;
+  }
+  return 0;
+}
+
+
+void wav_close(struct wav_sink_t* wav)
+{
+  if (wav->file == NULL)
+    return;
+
+  atomic_store(&wav->running, 0);
+  pthread_join(wav->thread, NULL);
+
+  fseek(wav->file, 0, SEEK_SET);
+  write_header(wav);
+  fclose(wav->file);
+  wav->file = NULL;
+}
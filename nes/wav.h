@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+#pragma once
+
+/**
+ * Writes the samples of a ring to a mono 16 bit WAV file on its own thread,
+ * so file I/O never stalls the emulation.
+ */
+struct wav_sink_t
+{
+  struct sample_ring_t* ring;
+  FILE*       file;
+  uint32_t    rate;
+  uint32_t    bytes;
+  pthread_t   thread;
+  atomic_int  running;
+};
+
+/**
+ * returns: 0 on success
+ */
+int wav_open(struct wav_sink_t* wav, struct sample_ring_t* ring, uint32_t rate, const char* filepath);
+
+/**
+ * Drains the ring, finishes the header and closes the file.
+ */
+void wav_close(struct wav_sink_t* wav);
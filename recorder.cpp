@@ -0,0 +1,153 @@
+#include "recorder.h"
+#include <string.h> //memcmp()
+#include <stdlib.h> //malloc()
+#include <unistd.h> //usleep()
+
+Recorder::Recorder() :
+   haveLast(false),
+   out(NULL),
+   pts(NULL),
+   y4m(false),
+   scale(1),
+   row(NULL),
+   written(0),
+   dropped(0),
+   running(false)
+{
+}
+
+Recorder::~Recorder()
+{
+   close();
+}
+
+bool Recorder::open(const char* path, int outScale)
+{
+   size_t len = strlen(path);
+   y4m = (len > 4) && (strcmp(&path[len-4], ".y4m") == 0);
+   scale = (outScale < 1) ? 1 : outScale;
+
+   if(strcmp(path, "-") == 0)
+      out = stdout;
+   else
+      out = fopen(path, "wb");
+   if(out == NULL)
+   {
+      fprintf(stderr, "Cannot create %s\n", path);
+      return false;
+   }
+
+   // stdout only carries the stream, timestamps need a file name
+   if(out != stdout)
+   {
+      char ptsPath[512];
+      snprintf(ptsPath, sizeof(ptsPath), "%s.pts", path);
+      pts = fopen(ptsPath, "w");
+      if(pts != NULL)
+         fprintf(pts, "# timestamp format v2\n");
+   }
+
+   if(y4m)
+      fprintf(out, "YUV4MPEG2 W%i H%i F%i:1 Ip A1:1 Cmono\n",
+              RECORD_WIDTH*scale, RECORD_HEIGHT*scale, RECORD_FPS);
+
+   row = (uint8_t*) malloc(RECORD_WIDTH*scale);
+   haveLast = false;
+   start = std::chrono::steady_clock::now();
+   written = 0;
+   dropped = 0;
+   running = true;
+   writer = std::thread(&Recorder::writerLoop, this);
+   return true;
+}
+
+void Recorder::close()
+{
+   if(out == NULL)
+      return;
+
+   // writer drains the queue before it exits
+   running = false;
+   if(writer.joinable())
+      writer.join();
+
+   if(out != stdout)
+      fclose(out);
+   else
+      fflush(out);
+   out = NULL;
+   if(pts != NULL)
+   {
+      fclose(pts);
+      pts = NULL;
+   }
+   free(row);
+   row = NULL;
+
+   fprintf(stderr, "recorded %u frames, dropped %u\n", written, dropped);
+}
+
+uint32_t Recorder::elapsed() const
+{
+   return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+void Recorder::capture(const uint8_t* pixels)
+{
+   if(out == NULL)
+      return;
+
+   // most frames are identical to the previous one
+   if(haveLast && (memcmp(last.pixels, pixels, sizeof(last.pixels)) == 0))
+      return;
+
+   last.ms = elapsed();
+   memcpy(last.pixels, pixels, sizeof(last.pixels));
+   if(queue.push(&last, 1) == 1)
+   {
+      haveLast = true;
+   }
+   else
+   {
+      // writer is behind, try again with the next changed frame
+      haveLast = false;
+      ++dropped;
+   }
+}
+
+void Recorder::writerLoop()
+{
+   Frame f;
+
+   while(true)
+   {
+      // sample running before draining so the last frame is never lost
+      bool more = running;
+      if(queue.pop(&f, 1) == 1)
+         writeFrame(f);
+      else if(!more)
+         break;
+      else
+         usleep(2000);
+   }
+}
+
+void Recorder::writeFrame(const Frame& f)
+{
+   if(y4m)
+      fprintf(out, "FRAME\n");
+
+   int width = RECORD_WIDTH*scale;
+   for(int y=0; y<RECORD_HEIGHT; y++)
+   {
+      for(int x=0; x<width; x++)
+         row[x] = f.pixels[y*RECORD_WIDTH + x/scale] ? 0xFF : 0x00;
+      for(int i=0; i<scale; i++)
+         fwrite(row, 1, width, out);
+   }
+
+   if(pts != NULL)
+      fprintf(pts, "%u\n", f.ms);
+   ++written;
+}
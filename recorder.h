@@ -0,0 +1,94 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "ringbuffer.h"
+
+// logical screen size, same as the machine
+#define RECORD_WIDTH  64
+#define RECORD_HEIGHT 32
+
+// nominal frame rate in the Y4M header, the real times are in the sidecar
+#define RECORD_FPS    60
+
+// captured frames the writer may fall behind by, must be a power of two
+#define RECORD_QUEUE_SIZE 64
+
+/**
+ * Writes presented frames to a Y4M (mono) or raw 8 bit gray stream.
+ *
+ * capture() only compares the frame against the previous one and queues a
+ * copy if it changed, the scaling and file I/O happen on a writer thread. If
+ * the writer falls RECORD_QUEUE_SIZE frames behind, new frames are dropped
+ * instead of stalling the emulation. Since unchanged frames are skipped, the
+ * wall clock time of every written frame goes to a sidecar "PATH.pts" file in
+ * mkvmerge timestamp v2 format (one millisecond value per line); the
+ * machine's frame counter runs at whatever rate the instructions do. On
+ * stdout there is no sidecar and the stream carries no timing.
+ */
+class Recorder
+{
+public:
+   Recorder();
+   ~Recorder();
+
+   /**
+    * Starts recording. A path ending in ".y4m" writes YUV4MPEG2, anything
+    * else raw frames of width*height bytes. "-" writes to stdout.
+    *
+    * @param[in] path:  The stream to create
+    * @param[in] scale: Output pixels per logical pixel
+    * @return true if the stream was created
+    */
+   bool open(const char* path, int scale);
+
+   /**
+    * Flushes the queue and closes the stream.
+    */
+   void close();
+
+   /**
+    * Queues a frame if it differs from the last one queued.
+    *
+    * @param[in] pixels: RECORD_WIDTH*RECORD_HEIGHT pixels, 0 or 1
+    */
+   void capture(const uint8_t* pixels);
+
+private:
+   struct Frame
+   {
+      uint32_t ms; // since open()
+      uint8_t pixels[RECORD_WIDTH*RECORD_HEIGHT];
+   };
+
+   uint32_t elapsed() const;
+   void writerLoop();
+   void writeFrame(const Frame& f);
+
+   RingBuffer<Frame, RECORD_QUEUE_SIZE> queue;
+
+   // the last queued frame, for deduplication
+   Frame last;
+   bool haveLast;
+
+   // frame times count from open()
+   std::chrono::steady_clock::time_point start;
+
+   FILE* out;
+   FILE* pts;
+   bool y4m;
+   int scale;
+   uint8_t* row; // one scaled output row
+
+   uint32_t written;
+   uint32_t dropped;
+
+   std::thread writer;
+   std::atomic<bool> running;
+};
+
+#endif //RECORDER_H
@@ -0,0 +1,89 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stddef.h>
+#include <atomic>
+
+/**
+ * Lock-free single-producer/single-consumer ring buffer.
+ *
+ * One thread may call push() while another calls pop(); neither side ever
+ * blocks or takes a lock. SIZE must be a power of two. The head and tail
+ * counters run freely and are masked on access, so the full capacity of SIZE
+ * elements is usable.
+ */
+template <typename T, size_t SIZE>
+class RingBuffer
+{
+public:
+   RingBuffer() :
+      head(0),
+      tail(0)
+   {
+      static_assert((SIZE & (SIZE-1)) == 0, "RingBuffer SIZE must be a power of two");
+   }
+
+   /**
+    * Copies up to count elements into the buffer.
+    *
+    * @param[in] src:   The elements to queue
+    * @param[in] count: The number of elements in src
+    * @return the number of elements actually queued
+    */
+   size_t push(const T* src, size_t count)
+   {
+      size_t h = head.load(std::memory_order_relaxed);
+      size_t t = tail.load(std::memory_order_acquire);
+      size_t room = SIZE - (h - t);
+      if(count > room)
+         count = room;
+
+      for(size_t i=0; i<count; i++)
+         data[(h+i) & (SIZE-1)] = src[i];
+
+      head.store(h+count, std::memory_order_release);
+      return count;
+   }
+
+   /**
+    * Copies up to count elements out of the buffer.
+    *
+    * @param[out] dst:   Where to store the elements
+    * @param[in]  count: The number of elements dst can hold
+    * @return the number of elements actually dequeued
+    */
+   size_t pop(T* dst, size_t count)
+   {
+      size_t t = tail.load(std::memory_order_relaxed);
+      size_t h = head.load(std::memory_order_acquire);
+      size_t avail = h - t;
+      if(count > avail)
+         count = avail;
+
+      for(size_t i=0; i<count; i++)
+         dst[i] = data[(t+i) & (SIZE-1)];
+
+      tail.store(t+count, std::memory_order_release);
+      return count;
+   }
+
+   // number of queued elements, exact only when called from producer or consumer
+   size_t size() const
+   {
+      return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+   }
+
+   size_t capacity() const
+   {
+      return SIZE;
+   }
+
+private:
+   T data[SIZE];
+
+   // keep the producer and consumer counters on separate cache lines
+   alignas(64) std::atomic<size_t> head;
+   alignas(64) std::atomic<size_t> tail;
+};
+
+#endif //RINGBUFFER_H
@@ -0,0 +1,82 @@
+#include "screenshm.h"
+#include <stdio.h>
+#include <fcntl.h> //O_CREAT
+#include <unistd.h> //ftruncate()
+#include <sys/mman.h> //shm_open() mmap()
+
+ScreenPublisher::ScreenPublisher() :
+   shared(NULL)
+{
+   name[0] = 0;
+}
+
+ScreenPublisher::~ScreenPublisher()
+{
+   close();
+}
+
+bool ScreenPublisher::open(const char* segment)
+{
+   int fd = shm_open(segment, O_CREAT | O_RDWR, 0644);
+   if(fd < 0)
+   {
+      fprintf(stderr, "Cannot create shared memory %s\n", segment);
+      return false;
+   }
+
+   if(ftruncate(fd, sizeof(SharedScreen)) != 0)
+   {
+      fprintf(stderr, "Cannot size shared memory %s\n", segment);
+      ::close(fd);
+      shm_unlink(segment);
+      return false;
+   }
+
+   void* addr = mmap(NULL, sizeof(SharedScreen), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   ::close(fd); // the mapping keeps the segment alive
+   if(addr == MAP_FAILED)
+   {
+      fprintf(stderr, "Cannot map shared memory %s\n", segment);
+      shm_unlink(segment);
+      return false;
+   }
+
+   shared = (SharedScreen*) addr;
+   shared->seq.store(0, std::memory_order_relaxed);
+   shared->frame = 0;
+   memset(shared->pixels, 0, sizeof(shared->pixels));
+   shared->width = SCREENSHM_WIDTH;
+   shared->height = SCREENSHM_HEIGHT;
+   shared->version = SCREENSHM_VERSION;
+   // readers check magic last, so publish it after everything else
+   std::atomic_thread_fence(std::memory_order_release);
+   shared->magic = SCREENSHM_MAGIC;
+
+   snprintf(name, sizeof(name), "%s", segment);
+   return true;
+}
+
+void ScreenPublisher::close()
+{
+   if(shared == NULL)
+      return;
+
+   munmap(shared, sizeof(SharedScreen));
+   shm_unlink(name);
+   shared = NULL;
+}
+
+void ScreenPublisher::publish(const uint8_t* pixels, uint32_t frame)
+{
+   if(shared == NULL)
+      return;
+
+   uint32_t seq = shared->seq.load(std::memory_order_relaxed);
+   shared->seq.store(seq+1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+
+   memcpy(shared->pixels, pixels, sizeof(shared->pixels));
+   shared->frame = frame;
+
+   shared->seq.store(seq+2, std::memory_order_release);
+}
@@ -0,0 +1,94 @@
+#ifndef SCREENSHM_H
+#define SCREENSHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+/**
+ * Layout of the POSIX shared memory segment a Machine publishes its screen
+ * into. Readers only need this header, they map the segment read only and
+ * call readSharedScreen(), no X11 or SDL involved.
+ *
+ * The writer bumps seq to an odd value, updates the frame, then bumps it to
+ * the next even value (a seqlock). A reader that sees an odd seq, or a seq
+ * that changed while it copied, simply copies again.
+ */
+#define SCREENSHM_MAGIC   0x38504843 // "CHP8"
+#define SCREENSHM_VERSION 1
+
+// screen dimensions, same as the machine
+#define SCREENSHM_WIDTH   64
+#define SCREENSHM_HEIGHT  32
+
+struct SharedScreen
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t width;
+   uint32_t height;
+   std::atomic<uint32_t> seq;
+   // frames presented so far, frame counter of the pixels below
+   uint32_t frame;
+   // one byte per pixel, 0 or 1, row major
+   uint8_t pixels[SCREENSHM_WIDTH*SCREENSHM_HEIGHT];
+};
+
+/**
+ * Copies a consistent frame out of a mapped segment.
+ *
+ * @param[in]  shared: The mapped segment
+ * @param[out] pixels: Where to store width*height pixels
+ * @param[out] frame:  The frame counter of the copied pixels
+ */
+inline void readSharedScreen(const SharedScreen* shared,
+                             uint8_t* pixels,
+                             uint32_t* frame)
+{
+   uint32_t before, after;
+   do
+   {
+      before = shared->seq.load(std::memory_order_acquire);
+      memcpy(pixels, (const void*) shared->pixels, sizeof(shared->pixels));
+      *frame = shared->frame;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = shared->seq.load(std::memory_order_relaxed);
+   } while((before & 1) || (before != after));
+}
+
+/**
+ * Writer side, owns the segment.
+ */
+class ScreenPublisher
+{
+public:
+   ScreenPublisher();
+   ~ScreenPublisher();
+
+   /**
+    * Creates (or reuses) the named segment, e.g. "/chip8-1234".
+    *
+    * @param[in] name: The shm_open() name
+    * @return true if the segment is mapped
+    */
+   bool open(const char* name);
+
+   /**
+    * Unmaps and removes the segment.
+    */
+   void close();
+
+   /**
+    * Publishes a frame. Does nothing if no segment is open.
+    *
+    * @param[in] pixels: width*height pixels
+    * @param[in] frame:  The frame counter
+    */
+   void publish(const uint8_t* pixels, uint32_t frame);
+
+private:
+   SharedScreen* shared;
+   char name[64];
+};
+
+#endif //SCREENSHM_H